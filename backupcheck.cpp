@@ -0,0 +1,202 @@
+#include "backupcheck.hpp"
+#include "memorybudget.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <string.h>
+#include <thread>
+
+// Bytes of a descriptor that are compared: bg_block_bitmap, bg_inode_bitmap
+// and bg_inode_table
+#define DESCRIPTOR_LOCATION_BYTES (3 * sizeof(__u32))
+
+BackupCheck::BackupCheck(ImageReader &reader, const ext2_super_block &primary)
+    : reader(reader), primary(primary), primaryLayout(layoutOf(primary)),
+      blockSize(EXT2_MIN_BLOCK_SIZE << primary.s_log_block_size),
+      groupCount((primary.s_blocks_count - primary.s_first_data_block + primary.s_blocks_per_group - 1) /
+                 primary.s_blocks_per_group) {}
+
+bool BackupCheck::Layout::operator==(const Layout &other) const {
+  return memcmp(this, &other, sizeof(Layout)) == 0;
+}
+
+BackupCheck::Layout BackupCheck::layoutOf(const ext2_super_block &sb) {
+  Layout layout;
+  memset(&layout, 0, sizeof(layout));
+
+  layout.magic = sb.s_magic;
+  layout.revLevel = sb.s_rev_level;
+  layout.inodesCount = sb.s_inodes_count;
+  layout.blocksCount = sb.s_blocks_count;
+  layout.firstDataBlock = sb.s_first_data_block;
+  layout.logBlockSize = sb.s_log_block_size;
+  layout.blocksPerGroup = sb.s_blocks_per_group;
+  layout.inodesPerGroup = sb.s_inodes_per_group;
+
+  // The dynamic revision fields are undefined in revision 0
+  if (sb.s_rev_level > 0) {
+    layout.firstIno = sb.s_first_ino;
+    layout.inodeSize = sb.s_inode_size;
+    layout.featureCompat = sb.s_feature_compat;
+    layout.featureIncompat = sb.s_feature_incompat;
+    layout.featureRoCompat = sb.s_feature_ro_compat;
+  }
+  return layout;
+}
+
+bool BackupCheck::hasSuperBlockCopy(__u32 group, const ext2_super_block &sb) {
+  // Without sparse_super, every group carries a copy. Otherwise only groups 0,
+  // 1 and powers of 3, 5 and 7 do.
+  if (sb.s_rev_level == 0 || !(sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+    return true;
+  if (group <= 1)
+    return true;
+
+  for (__u32 base : {3, 5, 7}) {
+    __u32 n = group;
+    while (n % base == 0)
+      n /= base;
+    if (n == 1)
+      return true;
+  }
+  return false;
+}
+
+// -------------------------------------------------- Checking
+void BackupCheck::run(bool all, const GroupDescTable *descriptors) {
+  TRACE_SCOPE("backups", "section");
+
+  vector<__u32> groups;
+  for (__u32 group = 1; group < groupCount; group++)
+    if (hasSuperBlockCopy(group, primary))
+      groups.push_back(group);
+
+  if (!all && groups.size() > SAMPLE_COPIES)
+    groups = {groups.front(), groups[groups.size() / 2], groups.back()};
+
+  copies.clear();
+  for (__u32 group : groups)
+    copies.push_back({group, false, false, Layout(), 0, NO_MISMATCH});
+  if (copies.empty())
+    return;
+
+  size_t descriptorCount = descriptors ? groupCount : 0;
+  if (!all)
+    descriptorCount = std::min<size_t>(descriptorCount,
+                                       SAMPLE_DESCRIPTOR_BLOCKS * blockSize / sizeof(ext2_group_desc));
+  const size_t BUFFER_SIZE = std::max<size_t>(sizeof(ext2_super_block), descriptorCount * sizeof(ext2_group_desc));
+
+  // A sample is only a few blocks, read on the calling thread. A full check
+  // spreads the copies over as many threads as there are buffers to afford.
+  const size_t WANTED = all ? std::min<size_t>(copies.size(), std::max(1u, std::thread::hardware_concurrency())) : 1;
+  MemoryGrant grant(WANTED * BUFFER_SIZE, BUFFER_SIZE);
+  const unsigned workers = std::max<size_t>(1, grant.size() / BUFFER_SIZE);
+
+  auto work = [&](unsigned w) {
+    TRACE_SCOPE("backups.worker", "worker", w);
+    vector<char> buffer(BUFFER_SIZE);
+    for (size_t i = w; i < copies.size(); i += workers)
+      checkCopy(copies[i], descriptors, descriptorCount, buffer.data());
+  };
+
+  if (workers == 1) {
+    work(0);
+    return;
+  }
+
+  vector<std::thread> threads;
+  for (unsigned w = 0; w < workers; w++)
+    threads.emplace_back(work, w);
+  for (auto &t : threads)
+    t.join();
+}
+
+/*PRIVATE -- thread-safe*/
+void BackupCheck::checkCopy(Copy &copy, const GroupDescTable *descriptors, size_t descriptorCount,
+                            char *buffer) {
+  const size_t start = groupStart(copy.group) * blockSize;
+
+  reader.readBytes(start, sizeof(ext2_super_block), buffer);
+  const ext2_super_block *sb = reinterpret_cast<const ext2_super_block*>(buffer);
+  copy.intact = sb->s_magic == EXT2_SUPER_MAGIC;
+  copy.layout = layoutOf(*sb);
+  copy.matches = copy.layout == primaryLayout;
+
+  if (!copy.intact || descriptorCount == 0)
+    return;
+
+  reader.readBytes(start + blockSize, descriptorCount * sizeof(ext2_group_desc), buffer);
+  const ext2_group_desc *table = reinterpret_cast<const ext2_group_desc*>(buffer);
+  copy.descriptorsChecked = descriptorCount;
+
+  for (size_t i = 0; i < descriptorCount; i++)
+    if (memcmp(&table[i], &(*descriptors)[i], DESCRIPTOR_LOCATION_BYTES) != 0) {
+      copy.firstMismatch = i;
+      break;
+    }
+}
+
+size_t BackupCheck::report(FILE *out) const {
+  size_t findings = 0;
+
+  for (const Copy &copy : copies) {
+    if (!copy.intact) {
+      fprintf(out, "SUPERBLOCK BACKUP IN GROUP %u IS DAMAGED\n", copy.group);
+      findings++;
+      continue;
+    }
+    if (!copy.matches) {
+      fprintf(out, "SUPERBLOCK BACKUP IN GROUP %u DIFFERS FROM PRIMARY\n", copy.group);
+      findings++;
+    }
+    if (copy.firstMismatch != NO_MISMATCH) {
+      fprintf(out, "GROUP DESCRIPTOR %u BACKUP IN GROUP %u DIFFERS FROM PRIMARY\n",
+              copy.firstMismatch, copy.group);
+      findings++;
+    }
+  }
+  return findings;
+}
+
+bool BackupCheck::primaryOutvoted(__u32 &group) const {
+  if (copies.size() < 2)
+    return false;
+
+  for (const Copy &copy : copies)
+    if (!copy.intact || copy.matches || copy.layout != copies[0].layout)
+      return false;
+
+  group = copies[0].group;
+  return true;
+}
+
+bool BackupCheck::readCopy(__u32 group, ext2_super_block &copy) {
+  reader.readBytes(groupStart(group) * blockSize, sizeof(ext2_super_block), reinterpret_cast<char*>(&copy));
+  return copy.s_magic == EXT2_SUPER_MAGIC;
+}
+
+// -------------------------------------------------- Recovery
+__u32 BackupCheck::findBackup(ImageReader &reader, uint64_t imageSize, ext2_super_block &copy,
+                              size_t &descriptorBlock) {
+  static const __u32 GROUPS[] = {1, 3, 5, 7, 9};
+
+  for (__u32 log = 0; ((__u32)EXT2_MIN_BLOCK_SIZE << log) <= MAX_PROBED_BLOCK_SIZE; log++) {
+    const uint64_t BLOCK_SIZE = EXT2_MIN_BLOCK_SIZE << log;
+    const __u32 BLOCKS_PER_GROUP = 8 * BLOCK_SIZE;
+    const __u32 FIRST_DATA_BLOCK = (log == 0) ? 1 : 0;
+
+    for (__u32 group : GROUPS) {
+      const uint64_t start = FIRST_DATA_BLOCK + (uint64_t)group * BLOCKS_PER_GROUP;
+      if ((start + 1) * BLOCK_SIZE > imageSize)
+        break;
+
+      reader.readBytes(start * BLOCK_SIZE, sizeof(ext2_super_block), reinterpret_cast<char*>(&copy));
+      if (copy.s_magic == EXT2_SUPER_MAGIC && copy.s_log_block_size == log &&
+          copy.s_blocks_per_group == BLOCKS_PER_GROUP && copy.s_first_data_block == FIRST_DATA_BLOCK &&
+          (copy.s_rev_level == 0 || copy.s_block_group_nr == group)) {
+        descriptorBlock = start + 1;
+        return group;
+      }
+    }
+  }
+  return 0;
+}
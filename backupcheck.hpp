@@ -0,0 +1,108 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "ext2_fs.h"
+#include "groupdesctable.hpp"
+#include "imagereader.hpp"
+
+using std::vector;
+
+// -------------------------------------------------- Backup Check
+//
+// Cross-checks the backup copies of the Super Block and the Group Descriptor
+// Table against the primary ones. Every group holds a copy, or with
+// sparse_super only groups 0, 1 and powers of 3, 5 and 7. A copy starts at its
+// group's first block, and its descriptors follow in the next block.
+//
+// Only the fields that describe the layout are compared: free counts, mount
+// times, the state and the like are legitimately stale in backups, since the
+// kernel only keeps the primary up to date. The same goes for descriptors,
+// of which only the bitmap and inode table locations are compared.
+//
+// A full check reads every copy on several threads at once (with
+// ImageReader::readBytes()). A sample check reads at most SAMPLE_COPIES of them
+// (the first, middle and last), and at most SAMPLE_DESCRIPTOR_BLOCKS of each
+// table, so its cost does not grow with the image.
+//
+class BackupCheck {
+ public:
+  // The Super Block fields that every copy must agree on
+  struct Layout {
+    __u32 magic;
+    __u32 revLevel;
+    __u32 inodesCount;
+    __u32 blocksCount;
+    __u32 firstDataBlock;
+    __u32 logBlockSize;
+    __u32 blocksPerGroup;
+    __u32 inodesPerGroup;
+    __u32 firstIno;
+    __u32 inodeSize;
+    __u32 featureCompat;
+    __u32 featureIncompat;
+    __u32 featureRoCompat;
+
+    bool operator==(const Layout &other) const;
+    bool operator!=(const Layout &other) const { return !(*this == other); }
+  };
+
+  struct Copy {
+    __u32 group;
+    bool intact;             // has the magic number
+    bool matches;            // same Layout as the primary
+    Layout layout;
+    __u32 descriptorsChecked;
+    __u32 firstMismatch;     // first descriptor that differs, or NO_MISMATCH
+  };
+
+  static const __u32 NO_MISMATCH = ~0u;
+  static const size_t SAMPLE_COPIES = 3;
+  static const size_t SAMPLE_DESCRIPTOR_BLOCKS = 4;
+  static const __u32 MAX_PROBED_BLOCK_SIZE = 8192; // by findBackup()
+
+  BackupCheck(ImageReader &reader, const ext2_super_block &primary);
+
+  /*Reads and compares every copy, or a sample of them. 'descriptors' is the
+    primary table, or null to only compare Super Blocks*/
+  void run(bool all, const GroupDescTable *descriptors);
+
+  const vector<Copy> &getCopies() const { return copies; }
+
+  /*Writes one line per inconsistency found by run(). Returns how many*/
+  size_t report(FILE *out) const;
+
+  /*True if at least two copies were checked, all of them agree with each
+    other, and none agrees with the primary: then it is the primary that is
+    damaged. 'group' is set to the first of those copies*/
+  bool primaryOutvoted(__u32 &group) const;
+
+  /*Reads the Super Block copy held by 'group'*/
+  bool readCopy(__u32 group, ext2_super_block &copy);
+  size_t descriptorBlock(__u32 group) const { return groupStart(group) + 1; }
+
+  static Layout layoutOf(const ext2_super_block &);
+  static bool hasSuperBlockCopy(__u32 group, const ext2_super_block &);
+
+  /*Looks for an intact backup when the primary cannot be read at all, and so
+    nothing is known about the layout: the first few backup groups are tried for
+    every block size, assuming the default of 8 * blockSize blocks per group.
+    Returns the group of the copy found (in 'copy'), or 0*/
+  static __u32 findBackup(ImageReader &reader, uint64_t imageSize, ext2_super_block &copy,
+                          size_t &descriptorBlock);
+
+ private:
+  ImageReader &reader;
+  const ext2_super_block primary;
+  const Layout primaryLayout;
+  const __u32 blockSize;
+  const __u32 groupCount;
+  vector<Copy> copies;
+
+  size_t groupStart(__u32 group) const {
+    return primary.s_first_data_block + (size_t)group * primary.s_blocks_per_group;
+  }
+
+  void checkCopy(Copy &copy, const GroupDescTable *descriptors, size_t descriptorCount, char *buffer);
+};
@@ -0,0 +1,160 @@
+#include "batch.hpp"
+#include "threadpool.hpp"
+#include "memorybudget.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+static vector<string> listImages(const string &source)
+{
+  vector<string> images;
+  struct stat st;
+
+  if (stat(source.c_str(), &st) != 0)
+    throw std::runtime_error("BatchSourceStatError");
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(source.c_str());
+    if (!dir)
+      throw std::runtime_error("BatchDirectoryOpenError");
+
+    while (struct dirent *entry = readdir(dir)) {
+      string path = source + "/" + entry->d_name;
+      if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        images.push_back(path);
+    }
+    closedir(dir);
+    std::sort(images.begin(), images.end());
+  } else {
+    std::ifstream list(source);
+    string line;
+    while (std::getline(list, line))
+      if (!line.empty() && line[0] != '#')
+        images.push_back(line);
+  }
+
+  return images;
+}
+
+static string baseName(const string &path)
+{
+  size_t slash = path.find_last_of('/');
+  return (slash == string::npos) ? path : path.substr(slash + 1);
+}
+
+/*Copies a spilled report to 'dst'*/
+static void copyReport(FILE *src, FILE *dst)
+{
+  char buf[BUFSIZ];
+  size_t n;
+
+  rewind(src);
+  while ((n = fread(buf, 1, sizeof(buf), src)) > 0)
+    fwrite(buf, 1, n, dst);
+}
+
+int runBatch(const string &source, const char *outDir, FILE *report, BatchImageFn validate)
+{
+  const vector<string> images = listImages(source);
+  vector<int> codes(images.size(), 0);
+  std::mutex outputLock;
+
+  // Reports are named after their image, so two images with the same name
+  // (in different directories of a list) would overwrite each other's
+  if (outDir) {
+    std::set<string> names;
+    for (auto &image : images)
+      if (!names.insert(baseName(image)).second)
+        throw std::runtime_error("BatchOutputNameCollision: " + baseName(image));
+  }
+
+  {
+    ThreadPool pool;
+
+    for (size_t i = 0; i < images.size(); i++) {
+      pool.submit([&, i]() {
+        const string &image = images[i];
+        char *outBuf = nullptr, *errBuf = nullptr;
+        size_t outLen = 0, errLen = 0;
+        FILE *out = nullptr;
+        FILE *err = open_memstream(&errBuf, &errLen);
+
+        // Under a memory limit, reports are held in temporary files instead
+        // of memory until they can be written out
+        const bool spill = MemoryBudget::global().getLimit() != 0;
+
+        if (outDir)
+          out = fopen((string(outDir) + "/" + baseName(image) + ".csv").c_str(), "w");
+        else if (spill)
+          out = tmpfile();
+        else
+          out = open_memstream(&outBuf, &outLen);
+
+        if (!out || !err) {
+          codes[i] = 1;
+        } else {
+          try { codes[i] = validate(image.c_str(), out, err); }
+          catch (...) { codes[i] = 2; }
+        }
+
+        if (out && !(spill && !outDir)) {
+          fclose(out);
+          out = nullptr;
+        }
+        if (err) fclose(err);
+
+        // Each image's output is written as one uninterrupted block
+        std::lock_guard<std::mutex> guard(outputLock);
+        if (!outDir) {
+          fprintf(report, "BEGIN,%s\n", image.c_str());
+          if (outBuf)
+            fwrite(outBuf, 1, outLen, report);
+          if (out)
+            copyReport(out, report);
+          fprintf(report, "END,%s,%d\n", image.c_str(), codes[i]);
+        }
+        if (out)
+          fclose(out);
+        // Every line of the image's stderr is tagged with it
+        for (size_t line = 0, next; errBuf && line < errLen; line = next) {
+          const char *newline = (const char*)memchr(errBuf + line, '\n', errLen - line);
+          next = newline ? newline - errBuf + 1 : errLen;
+          fprintf(stderr, "%s: %.*s%s", image.c_str(), (int)(next - line), errBuf + line, newline ? "" : "\n");
+        }
+        free(outBuf);
+        free(errBuf);
+      });
+    }
+
+    pool.wait();
+  }
+  fflush(report);
+
+  // -------------------------------------------------- Summary Matrix
+  std::map<int, size_t> perCode;
+  int summary = 0;
+
+  for (size_t i = 0; i < images.size(); i++) {
+    fprintf(stderr, "BATCH,%s,%d\n", images[i].c_str(), codes[i]);
+    perCode[codes[i]]++;
+    summary |= codes[i];
+  }
+
+  fprintf(stderr, "SUMMARY,%zu", images.size());
+  for (auto &code : perCode)
+    fprintf(stderr, ",%d=%zu", code.first, code.second);
+  fprintf(stderr, "\n");
+
+  return summary;
+}
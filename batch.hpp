@@ -0,0 +1,31 @@
+#pragma once
+#include <functional>
+#include <stdio.h>
+#include <string>
+
+// -------------------------------------------------- Batch Validation
+//
+// Validates many images in a single process. Each image is one task on a
+// work-stealing thread pool, so the per-image setup (stat, Super Block, Group
+// Descriptor Table) of different images overlaps across cores.
+//
+// 'source' is either a directory (every regular file inside it is validated)
+// or a text file listing one image path per line.
+//
+// If 'outDir' is given, the report of each image is written to
+// outDir/<image basename>.csv, and nothing is validated if two images share
+// a basename. Otherwise all reports are written to 'report'
+// (stdout, or a compressed stream) as tagged blocks:
+//
+//   BEGIN,<image>
+//   ...report...
+//   END,<image>,<exit code>
+//
+// What an image writes to stderr is passed on once it is done, each line
+// prefixed with "<image>: ". A summary matrix (one BATCH line per image, then
+// a SUMMARY line with the number of images per exit code) is written to
+// stderr. The return value is the bitwise OR of every image's exit code.
+//
+typedef std::function<int(const char *image, FILE *out, FILE *err)> BatchImageFn;
+
+int runBatch(const std::string &source, const char *outDir, FILE *report, BatchImageFn validate);
@@ -0,0 +1,301 @@
+#include <chrono>
+#include <getopt.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "bufferedimagereader.hpp"
+#include "ext2.hpp"
+#include "imagegenerator.hpp"
+
+#define BENCH_USAGE "Usage: lab3a-bench [--json FILE] [--repeat N] [--quick] [--dir DIR] [IMAGE...]"
+#define EXSUCCESS 0
+#define EXBADARG 1
+#define EXFAIL 2
+#define MiB (1024.0 * 1024.0)
+#define READER_CHUNK_BLOCKS 64
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Benchmarks
+//
+// Times every report section, the audit, and each ImageReader backend's access
+// paths over a set of images (generated with ImageGenerator unless given on
+// the command line). Each benchmark is run once to warm the page cache, then
+// 'repeat' times; the best time is kept. Throughput is given relative to the
+// image's size (MB/s) and to its allocated inodes (inodes/s).
+//
+struct BenchImage {
+  string name;
+  string path;
+  uint64_t bytes;
+  __u32 blockSize;
+  __u32 blockCount;
+  __u32 groups;
+  __u32 inodesUsed;
+};
+
+struct BenchResult {
+  string image;
+  string benchmark;
+  double seconds;
+};
+
+/*Generated when no images are given. Names are used in the JSON output, so
+  keep them stable*/
+static vector<std::pair<string, ImageSpec>> defaultImages(bool quick) {
+  auto spec = [](uint64_t size, __u32 blockSize, size_t files, __u32 fanOut, __u32 depth, double frag) {
+    ImageSpec s;
+    s.size = size;
+    s.blockSize = blockSize;
+    s.files = files;
+    s.fanOut = fanOut;
+    s.indirectDepth = depth;
+    s.fragmentation = frag;
+    return s;
+  };
+
+  if (quick)
+    return {
+      {"quick-1k", spec(16 << 20, 1024, 2000, 32, 2, 0.0)},
+      {"quick-4k-frag", spec(64 << 20, 4096, 2000, 32, 2, 0.3)},
+    };
+
+  return {
+    {"small-1k", spec(64 << 20, 1024, 5000, 32, 2, 0.0)},
+    {"deep-1k-frag", spec(256 << 20, 1024, 20000, 64, 3, 0.3)},
+    {"wide-4k", spec(1ull << 30, 4096, 100000, 512, 2, 0.05)},
+    {"many-groups-2k", spec(1ull << 30, 2048, 50000, 16, 2, 0.1)},
+  };
+}
+
+static double timeBest(unsigned repeat, std::function<void()> fn) {
+  fn(); // warm up
+  double best = 0;
+
+  for (unsigned i = 0; i < repeat; i++) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (i == 0 || seconds < best)
+      best = seconds;
+  }
+  return best;
+}
+
+// -------------------------------------------------- Report Sections
+static void benchSections(const BenchImage &image, unsigned repeat, FILE *sink, vector<BenchResult> &results) {
+  static const struct { const char *name; unsigned mask; } SECTIONS[] = {
+    {"super", SECTION_SUPER},   {"groups", SECTION_GROUPS},
+    {"bfree", SECTION_BFREE},   {"ifree", SECTION_IFREE},
+    {"inodes", SECTION_INODES}, {"dirent", SECTION_DIRENT},
+    {"indirect", SECTION_INDIRECT}, {"frag", SECTION_FRAG},
+    {"hash", SECTION_HASH}, {"path", SECTION_PATH},
+    {"dirent-path", SECTION_DIRENT | SECTION_DIRENT_PATH}, {"xattr", SECTION_XATTR},
+    {"all", SECTION_ALL},
+  };
+
+  for (auto &section : SECTIONS) {
+    double seconds = timeBest(repeat, [&]() {
+      EXT2 ext2(const_cast<char*>(image.path.c_str()));
+      ext2.setOutput(sink);
+      ext2.printReport(section.mask);
+    });
+    results.push_back({image.name, string("section:") + section.name, seconds});
+  }
+
+  double seconds = timeBest(repeat, [&]() {
+    EXT2 ext2(const_cast<char*>(image.path.c_str()));
+    ext2.setOutput(sink);
+    ext2.auditBlocks();
+    ext2.verifyDirectoryGraph();
+  });
+  results.push_back({image.name, "audit", seconds});
+}
+
+// -------------------------------------------------- Image Readers
+// Each backend is read end to end through each of its access paths
+static void benchReaders(const BenchImage &image, unsigned repeat, vector<BenchResult> &results) {
+  struct Backend {
+    const char *name;
+    std::function<ImageReader*(MetaFile*)> make;
+  };
+  static const Backend BACKENDS[] = {
+    {"buffered", [](MetaFile *meta) -> ImageReader* { return new BufferedImageReader(meta); }},
+  };
+
+  MetaFile meta;
+  meta.filename = image.path;
+  stat(image.path.c_str(), &meta.stat);
+  meta.blockSize = image.blockSize;
+  meta.blockCount = image.blockCount;
+
+  for (auto &backend : BACKENDS) {
+    std::unique_ptr<ImageReader> reader(backend.make(&meta));
+    reader->init();
+    const string prefix = string("reader:") + backend.name + ":";
+
+    results.push_back({image.name, prefix + "getBlock", timeBest(repeat, [&]() {
+      for (size_t b = 0; b < image.blockCount; b++)
+        reader->getBlock(b);
+    })});
+
+    results.push_back({image.name, prefix + "getBlocks", timeBest(repeat, [&]() {
+      for (size_t b = 0; b < image.blockCount; b += READER_CHUNK_BLOCKS)
+        reader->getBlocks(b, std::min<size_t>(READER_CHUNK_BLOCKS, image.blockCount - b));
+    })});
+
+    vector<char> buffer((size_t)READER_CHUNK_BLOCKS * image.blockSize);
+    results.push_back({image.name, prefix + "readBlocks", timeBest(repeat, [&]() {
+      for (size_t b = 0; b < image.blockCount; b += READER_CHUNK_BLOCKS)
+        reader->readBlocks(b, std::min<size_t>(READER_CHUNK_BLOCKS, image.blockCount - b), buffer.data());
+    })});
+  }
+}
+
+// -------------------------------------------------- Output
+static void writeJson(FILE *out, const vector<BenchImage> &images, const vector<BenchResult> &results,
+                      unsigned repeat) {
+  fprintf(out, "{\n  \"repeat\": %u,\n  \"images\": [\n", repeat);
+  for (size_t i = 0; i < images.size(); i++) {
+    const BenchImage &im = images[i];
+    fprintf(out, "    {\"name\": \"%s\", \"bytes\": %llu, \"block_size\": %u, \"blocks\": %u, "
+                 "\"groups\": %u, \"inodes_used\": %u}%s\n",
+            im.name.c_str(), (unsigned long long)im.bytes, im.blockSize, im.blockCount,
+            im.groups, im.inodesUsed, (i + 1 < images.size()) ? "," : "");
+  }
+
+  fprintf(out, "  ],\n  \"results\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    const BenchImage *im = nullptr;
+    for (auto &candidate : images)
+      if (candidate.name == r.image)
+        im = &candidate;
+
+    const double seconds = std::max(r.seconds, 1e-9);
+    fprintf(out, "    {\"image\": \"%s\", \"benchmark\": \"%s\", \"seconds\": %.6f, "
+                 "\"mb_per_s\": %.1f, \"inodes_per_s\": %.0f}%s\n",
+            r.image.c_str(), r.benchmark.c_str(), r.seconds,
+            im->bytes / MiB / seconds, im->inodesUsed / seconds, (i + 1 < results.size()) ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+}
+
+static bool describeImage(const string &name, const string &path, BenchImage &image) {
+  try {
+    MetaFile meta;
+    meta.filename = path;
+    if (stat(path.c_str(), &meta.stat) != 0)
+      return false;
+
+    BufferedImageReader reader(&meta);
+    ext2_super_block *sb = reader.getSuperBlock();
+    if (sb->s_magic != EXT2_SUPER_MAGIC || sb->s_blocks_per_group == 0)
+      return false;
+
+    image.name = name;
+    image.path = path;
+    image.bytes = meta.stat.st_size;
+    image.blockSize = KiB << sb->s_log_block_size;
+    image.blockCount = sb->s_blocks_count;
+    image.groups = (sb->s_blocks_count - sb->s_first_data_block + sb->s_blocks_per_group - 1) / sb->s_blocks_per_group;
+    image.inodesUsed = sb->s_inodes_count - sb->s_free_inodes_count;
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *jsonPath = nullptr;
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  unsigned repeat = 3;
+  int quick = 0;
+
+  enum { OPT_JSON = 'j', OPT_REPEAT = 'r', OPT_DIR = 'd' };
+  static struct option longOptions[] = {
+    {"json", required_argument, nullptr, OPT_JSON},
+    {"repeat", required_argument, nullptr, OPT_REPEAT},
+    {"dir", required_argument, nullptr, OPT_DIR},
+    {"quick", no_argument, &quick, 1},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 0:           break;
+      case OPT_JSON:    jsonPath = optarg; break;
+      case OPT_REPEAT:  repeat = std::max(1ul, strtoul(optarg, nullptr, 10)); break;
+      case OPT_DIR:     dir = optarg; break;
+      default:
+        std::cerr << BENCH_USAGE << std::endl;
+        exit(EXBADARG);
+    }
+  }
+
+  // -------------------------------------------------- Images
+  vector<BenchImage> images;
+  vector<string> generated;
+
+  if (optind < argc) {
+    for (int i = optind; i < argc; i++) {
+      BenchImage image;
+      if (!describeImage(argv[i], argv[i], image)) {
+        std::cerr << "lab3a-bench: not an ext2 image: " << argv[i] << std::endl;
+        exit(EXBADARG);
+      }
+      images.push_back(image);
+    }
+  } else {
+    for (auto &entry : defaultImages(quick)) {
+      const string path = string(dir) + "/lab3a-bench-" + entry.first + ".img";
+      try {
+        ImageGenerator(entry.second).write(path);
+      } catch (std::runtime_error &e) {
+        std::cerr << "lab3a-bench: cannot generate " << entry.first << ": " << e.what() << std::endl;
+        exit(EXFAIL);
+      }
+      generated.push_back(path);
+
+      BenchImage image;
+      describeImage(entry.first, path, image);
+      images.push_back(image);
+    }
+  }
+
+  // -------------------------------------------------- Run
+  FILE *sink = fopen("/dev/null", "w");
+  vector<BenchResult> results;
+  int code = EXSUCCESS;
+
+  for (auto &image : images) {
+    fprintf(stderr, "lab3a-bench: %s (%.0f MiB, %u groups, %u inodes)\n",
+            image.name.c_str(), image.bytes / MiB, image.groups, image.inodesUsed);
+    try {
+      benchSections(image, repeat, sink, results);
+      benchReaders(image, repeat, results);
+    } catch (std::exception &e) {
+      std::cerr << "lab3a-bench: " << image.name << ": " << e.what() << std::endl;
+      code = EXFAIL;
+    }
+  }
+  fclose(sink);
+
+  for (auto &path : generated)
+    unlink(path.c_str());
+
+  FILE *out = jsonPath ? fopen(jsonPath, "w") : stdout;
+  if (!out) {
+    std::cerr << "lab3a-bench: cannot write " << jsonPath << std::endl;
+    exit(EXFAIL);
+  }
+  writeJson(out, images, results, repeat);
+  if (out != stdout)
+    fclose(out);
+
+  return code;
+}
@@ -0,0 +1,193 @@
+#include "blockaudit.hpp"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+
+BlockAudit::BlockAudit(__u32 blockCount, __u32 firstDataBlock, __u32 blocksPerGroup,
+                       __u32 firstGroup, __u32 groupCount)
+{
+  this->blockCount = blockCount;
+  this->firstDataBlock = firstDataBlock;
+  this->blocksPerGroup = blocksPerGroup;
+
+  const size_t totalBits = blockCount - firstDataBlock;
+  windowStart = std::min<size_t>(totalBits, (size_t)firstGroup * blocksPerGroup);
+  windowEnd = std::min<size_t>(totalBits, windowStart + (size_t)groupCount * blocksPerGroup);
+
+  const size_t words = (windowEnd - windowStart + WORD_BITS - 1) / WORD_BITS;
+  claimed.assign(words, 0);
+  reserved.assign(words, 0);
+  allocated.assign(words, 0);
+}
+
+bool BlockAudit::test(const vector<uint64_t> &set, size_t bit) const
+{
+  bit -= windowStart;
+  return (set[bit / WORD_BITS] >> (bit % WORD_BITS)) & 1;
+}
+
+void BlockAudit::set(vector<uint64_t> &set, size_t bit)
+{
+  bit -= windowStart;
+  set[bit / WORD_BITS] |= (uint64_t)1 << (bit % WORD_BITS);
+}
+
+void BlockAudit::reserve(__u32 block, __u32 count)
+{
+  const __u32 end = (__u32)std::min<uint64_t>(blockCount, (uint64_t)block + count);
+  if(block >= end)
+    return;
+
+  for(__u32 b = block; b < end; b++)
+    if(b >= firstDataBlock && inWindow(b - firstDataBlock))
+      set(reserved, b - firstDataBlock);
+
+  // The ranges are only consulted for blocks outside the window
+  if(windowStart > 0 || windowEnd < (size_t)blockCount - firstDataBlock) {
+    if(!reservedRanges.empty() && block < reservedRanges.back().first)
+      reservedRangesSorted = false;
+    reservedRanges.emplace_back(block, end);
+  }
+}
+
+bool BlockAudit::isReservedOutsideWindow(__u32 block)
+{
+  if(!reservedRangesSorted) {
+    std::sort(reservedRanges.begin(), reservedRanges.end());
+
+    // Merge overlapping ranges, so that only the nearest one must be checked
+    size_t last = 0;
+    for(size_t i = 1; i < reservedRanges.size(); i++) {
+      if(reservedRanges[i].first <= reservedRanges[last].second)
+        reservedRanges[last].second = std::max(reservedRanges[last].second, reservedRanges[i].second);
+      else
+        reservedRanges[++last] = reservedRanges[i];
+    }
+    if(!reservedRanges.empty())
+      reservedRanges.resize(last + 1);
+    reservedRangesSorted = true;
+  }
+
+  auto next = std::upper_bound(reservedRanges.begin(), reservedRanges.end(),
+                               std::make_pair(block, ~0u));
+  return next != reservedRanges.begin() && block < std::prev(next)->second;
+}
+
+bool BlockAudit::reference(__u32 block, const BlockRef &ref)
+{
+  // Only the first window records invalid and reserved references, so that
+  // each is reported once
+  const bool recordAll = !duplicatePass && windowStart == 0;
+
+  if(block < firstDataBlock || block >= blockCount) {
+    if(recordAll)
+      invalidRefs.emplace_back(block, ref);
+    return false;
+  }
+
+  const size_t bit = block - firstDataBlock;
+  const bool local = inWindow(bit);
+  if(local ? test(reserved, bit) : isReservedOutsideWindow(block)) {
+    if(recordAll)
+      reservedRefs.emplace_back(block, ref);
+    return false;
+  }
+
+  if(!local)
+    return true;
+
+  if(duplicatePass) {
+    auto dup = duplicates.find(block);
+    if(dup != duplicates.end())
+      dup->second.push_back(ref);
+    return true;
+  }
+
+  if(test(claimed, bit))
+    duplicates[block].push_back(ref);
+  else
+    set(claimed, bit);
+
+  return true;
+}
+
+void BlockAudit::loadBitmap(__u32 group, const char *bitmap, __u32 blocksInGroup)
+{
+  // blocksPerGroup is always a multiple of 8, so every group starts on a byte
+  // boundary of the window's bitset.
+  const size_t groupStart = (size_t)group * blocksPerGroup;
+  if(groupStart < windowStart || groupStart >= windowEnd)
+    return;
+  if(blocksInGroup > windowEnd - groupStart)
+    blocksInGroup = windowEnd - groupStart;
+
+  char *dst = reinterpret_cast<char*>(allocated.data()) + (groupStart - windowStart) / 8;
+  memcpy(dst, bitmap, (blocksInGroup + 7) / 8);
+
+  // Clear the padding bits of a partial final byte
+  if(blocksInGroup % 8)
+    dst[blocksInGroup / 8] &= (char)((1 << (blocksInGroup % 8)) - 1);
+}
+
+void BlockAudit::beginDuplicatePass()
+{
+  for(auto &dup : duplicates)
+    dup.second.clear();
+  duplicatePass = true;
+}
+
+const char *BlockAudit::levelName(__u8 level)
+{
+  switch(level) {
+    case 1: return "INDIRECT ";
+    case 2: return "DOUBLE INDIRECT ";
+    case 3: return "TRIPLE INDIRECT ";
+    case XATTR_LEVEL: return "XATTR ";
+    default: return "";
+  }
+}
+
+size_t BlockAudit::report(FILE *out)
+{
+  size_t findings = 0;
+
+  for(auto &r : invalidRefs)
+    fprintf(out, "INVALID %sBLOCK %u IN INODE %u AT OFFSET %u\n",
+           levelName(r.second.level), r.first, r.second.inode, r.second.offset);
+  findings += invalidRefs.size();
+
+  for(auto &r : reservedRefs)
+    fprintf(out, "RESERVED %sBLOCK %u IN INODE %u AT OFFSET %u\n",
+           levelName(r.second.level), r.first, r.second.inode, r.second.offset);
+  findings += reservedRefs.size();
+
+  vector<__u32> dupBlocks;
+  dupBlocks.reserve(duplicates.size());
+  for(auto &dup : duplicates)
+    dupBlocks.push_back(dup.first);
+  std::sort(dupBlocks.begin(), dupBlocks.end());
+
+  for(__u32 block : dupBlocks) {
+    for(auto &ref : duplicates[block])
+      fprintf(out, "DUPLICATE %sBLOCK %u IN INODE %u AT OFFSET %u\n",
+             levelName(ref.level), block, ref.inode, ref.offset);
+    findings++;
+  }
+
+  // Diff the references against the bitmaps, one word at a time. Bits past
+  // the end of the window are never set in any of the sets, so no masking is
+  // needed.
+  for(size_t w = 0; w < allocated.size(); w++) {
+    const uint64_t used = claimed[w] | reserved[w];
+
+    for(uint64_t diff = allocated[w] & ~used; diff; diff &= diff - 1, findings++)
+      fprintf(out, "UNREFERENCED BLOCK %lu\n",
+             firstDataBlock + windowStart + w * WORD_BITS + __builtin_ctzll(diff));
+
+    for(uint64_t diff = claimed[w] & ~allocated[w]; diff; diff &= diff - 1, findings++)
+      fprintf(out, "ALLOCATED BLOCK %lu ON FREELIST\n",
+             firstDataBlock + windowStart + w * WORD_BITS + __builtin_ctzll(diff));
+  }
+
+  return findings;
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::unordered_map;
+using std::vector;
+
+// -------------------------------------------------- Block Audit
+//
+// Tracks every block reference made by the inodes of an image and compares
+// the result against the on-disk block bitmaps.
+//
+// References are recorded in a compact bitset (one bit per block) on their
+// first claim. Only blocks that are claimed more than once are remembered in
+// the (small) overflow hash, so memory stays at roughly blockCount/8 bytes for
+// the common case of a consistent image.
+//
+// Bit 'n' of every bitset corresponds to block (firstDataBlock + n), which is
+// the same layout the on-disk bitmaps use. This allows each group's bitmap to
+// be copied in directly and diffed a word at a time.
+//
+// When the bitsets for the whole image do not fit in the memory budget, the
+// audit is run over windows of whole groups, one BlockAudit per window. Each
+// window walks every inode again, but only keeps track of the blocks inside
+// it. Invalid and reserved references are only recorded by the first window.
+//
+class BlockAudit {
+ public:
+  // A single reference to a block, as needed to report it
+  struct BlockRef {
+    __u32 inode;
+    __u32 offset; // logical block offset within the file
+    __u8 level;   // 0 = data, 1 = IND, 2 = DIND, 3 = TIND, XATTR_LEVEL
+  };
+  static const __u8 XATTR_LEVEL = 4; // an extended attribute block (offset 0)
+
+  /*Audits the blocks of groups [firstGroup, firstGroup+groupCount)*/
+  BlockAudit(__u32 blockCount, __u32 firstDataBlock, __u32 blocksPerGroup,
+             __u32 firstGroup = 0, __u32 groupCount = ~0u);
+  virtual ~BlockAudit() = default;
+
+  /*Bytes of bitset needed per group*/
+  static size_t bytesPerGroup(__u32 blocksPerGroup) { return 3 * (size_t)blocksPerGroup / 8; }
+
+  /*Marks blocks [block, block+count) as file system metadata. Every reserved
+    range of the image must be given, not just those inside the window*/
+  virtual void reserve(__u32 block, __u32 count = 1);
+
+  /*Records a reference made by an inode. Returns false if the block is
+    invalid or reserved (and must therefore not be followed). During the
+    duplicate pass, only references to duplicate blocks are recorded*/
+  virtual bool reference(__u32 block, const BlockRef &ref);
+
+  /*Loads the on-disk bitmap of the given group*/
+  virtual void loadBitmap(__u32 group, const char *bitmap, __u32 blocksInGroup);
+
+  /*True if the walk claimed at least one block more than once*/
+  bool hasDuplicates() const { return !duplicates.empty(); }
+
+  /*Prepares for a second walk which collects every claim of a duplicate
+    block (including the first one, which the bitset cannot name)*/
+  void beginDuplicatePass();
+
+  /*Prints all findings. Returns the number of inconsistencies found*/
+  size_t report(FILE *out);
+
+ private:
+  static const size_t WORD_BITS = 64;
+
+  __u32 blockCount;
+  __u32 firstDataBlock;
+  __u32 blocksPerGroup;
+
+  // The window, as bit numbers [windowStart, windowEnd)
+  size_t windowStart;
+  size_t windowEnd;
+
+  vector<uint64_t> claimed;   // referenced at least once by an inode
+  vector<uint64_t> reserved;  // superblocks, descriptors, bitmaps, inode tables
+  vector<uint64_t> allocated; // allocated according to the on-disk bitmaps
+
+  // Every reserved range, including those outside the window, as [first, end)
+  vector<std::pair<__u32, __u32>> reservedRanges;
+  bool reservedRangesSorted = true;
+
+  // Blocks that were claimed more than once
+  unordered_map<__u32, vector<BlockRef>> duplicates;
+  bool duplicatePass = false;
+
+  // Invalid and reserved references are reported as they are found
+  vector<std::pair<__u32, BlockRef>> invalidRefs;
+  vector<std::pair<__u32, BlockRef>> reservedRefs;
+
+  bool test(const vector<uint64_t> &set, size_t bit) const;
+  void set(vector<uint64_t> &set, size_t bit);
+  bool inWindow(size_t bit) const { return bit >= windowStart && bit < windowEnd; }
+  bool isReservedOutsideWindow(__u32 block);
+
+  static const char *levelName(__u8 level);
+};
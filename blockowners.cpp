@@ -0,0 +1,75 @@
+#include "blockowners.hpp"
+#include <algorithm>
+
+bool BlockOwners::isWanted(__u32 block, __u32 count) const {
+  if (wanted.empty())
+    return true;
+
+  // The first range ending at or after 'block' is the only one that can overlap
+  auto it = std::lower_bound(wanted.begin(), wanted.end(), block,
+                             [](const Range &r, __u32 b) { return r.second < b; });
+  return it != wanted.end() && (uint64_t)it->first < (uint64_t)block + count;
+}
+
+void BlockOwners::add(__u32 block, __u32 count, Role role, __u32 inode, __u32 logical) {
+  if (count == 0 || !isWanted(block, count))
+    return;
+
+  // Consecutive data blocks of a file are merged into the previous extent
+  if (!extents.empty()) {
+    Extent &last = extents.back();
+    if (role == DATA && last.role == DATA && last.inode == inode &&
+        last.start + last.count == block && last.logical + last.count == logical) {
+      last.count += count;
+      return;
+    }
+  }
+  extents.push_back({block, count, inode, logical, role});
+}
+
+void BlockOwners::finish() {
+  std::stable_sort(extents.begin(), extents.end(),
+                   [](const Extent &a, const Extent &b) { return a.start < b.start; });
+
+  maxEnd.resize(extents.size());
+  __u32 end = 0;
+  for (size_t i = 0; i < extents.size(); i++) {
+    end = std::max(end, extents[i].start + extents[i].count);
+    maxEnd[i] = end;
+  }
+}
+
+size_t BlockOwners::lookup(__u32 block, vector<Owner> &owners) const {
+  // The last extent starting at or before 'block', then back while an earlier
+  // extent could still reach it
+  size_t i = std::upper_bound(extents.begin(), extents.end(), block,
+                              [](__u32 b, const Extent &e) { return b < e.start; }) - extents.begin();
+  const size_t before = owners.size();
+
+  while (i > 0 && maxEnd[i - 1] > block) {
+    const Extent &e = extents[--i];
+    if (block < e.start + e.count) {
+      const __u32 logical = (e.inode != 0) ? e.logical + (block - e.start) : e.logical;
+      owners.push_back({block, e.role, e.inode, logical});
+    }
+  }
+
+  std::reverse(owners.begin() + before, owners.end());
+  return owners.size() - before;
+}
+
+const char *BlockOwners::roleName(Role role) {
+  switch (role) {
+    case DATA:         return "DATA";
+    case IND:          return "IND";
+    case DIND:         return "DIND";
+    case TIND:         return "TIND";
+    case XATTR:        return "XATTR";
+    case SUPERBLOCK:   return "SUPERBLOCK";
+    case GDT:          return "GDT";
+    case BLOCK_BITMAP: return "BBITMAP";
+    case INODE_BITMAP: return "IBITMAP";
+    case INODE_TABLE:  return "ITABLE";
+  }
+  return "?";
+}
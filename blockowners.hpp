@@ -0,0 +1,80 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::vector;
+
+// -------------------------------------------------- Block Owners
+//
+// A reverse index from physical block number to whatever owns the block: an
+// inode (as data, as one of its IND, DIND and TIND blocks, or as its extended
+// attribute block) or the file system's own metadata. Built by EXT2::indexBlockOwners(), and queried with
+// 'lab3a --owner'.
+//
+// Owners are kept as extents sorted by first block: a file's contiguous data
+// blocks collapse into a single entry, so the index stays small for all but
+// the most fragmented images. Lookups are a binary search. Extents may
+// overlap (a block claimed twice); the running maximum of their ends bounds
+// how far back a lookup has to look for those.
+//
+// When only a few ranges of blocks are queried, restrict() keeps the index
+// down to the extents that overlap them (a binary search per extent added).
+//
+class BlockOwners {
+ public:
+  enum Role : __u8 {
+    DATA, IND, DIND, TIND, XATTR,                     // owned by an inode
+    SUPERBLOCK, GDT, BLOCK_BITMAP, INODE_BITMAP, INODE_TABLE // owned by a group
+  };
+
+  struct Owner {
+    __u32 block;
+    Role role;
+    __u32 inode;   // 0 for metadata
+    __u32 logical; // logical block of the file (the first one mapped, for
+                   // indirect blocks), or the group for metadata
+  };
+
+  typedef std::pair<__u32, __u32> Range; // first and last block
+
+  /*Only extents overlapping 'ranges' (sorted and disjoint) are kept from
+    now on. Must be called before the first add()*/
+  void restrict(vector<Range> ranges) { wanted = std::move(ranges); }
+
+  /*The image's block count, set by EXT2::indexBlockOwners()*/
+  void setBlockCount(__u32 count) { blockCount = count; }
+  __u32 getBlockCount() const { return blockCount; }
+
+  /*Records that blocks [block, block+count) belong to 'inode' (or to group
+    'logical' if inode is 0), starting at its logical block 'logical'*/
+  void add(__u32 block, __u32 count, Role role, __u32 inode, __u32 logical);
+
+  /*Sorts the index. Must be called after the last add() and before lookup()*/
+  void finish();
+
+  /*Appends every owner of 'block' to 'owners'. Returns how many there are*/
+  size_t lookup(__u32 block, vector<Owner> &owners) const;
+
+  size_t extentCount() const { return extents.size(); }
+
+  static const char *roleName(Role);
+
+ private:
+  struct Extent {
+    __u32 start;
+    __u32 count;
+    __u32 inode;
+    __u32 logical;
+    Role role;
+  };
+
+  vector<Extent> extents;
+  vector<__u32> maxEnd; // largest start + count of extents[0..i]
+  vector<Range> wanted; // empty for every block
+  __u32 blockCount = 0;
+
+  bool isWanted(__u32 block, __u32 count) const;
+};
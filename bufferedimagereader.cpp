@@ -1,34 +1,75 @@
 #include "bufferedimagereader.hpp"
+#include "trace.hpp"
 #include <sys/types.h>
+#include <algorithm>
 #include <iostream>
 #include <iterator>
 #include <string>
 #include <string.h>
 #include <sstream>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
 
 BufferedImageReader::BufferedImageReader(MetaFile *metafile) : ImageReader(metafile)
 {
     this->fs = new std::ifstream(meta->filename, std::ios::binary | std::ios::in);
+    this->fd = open(meta->filename.c_str(), O_RDONLY);
 
     this->readSuperBlock();
 }
 
-BufferedImageReader::~BufferedImageReader() {}
+BufferedImageReader::~BufferedImageReader()
+{
+  delete fs;
+  if (fd >= 0)
+    close(fd);
+}
 
 void BufferedImageReader::init()
 {
+    this->blockBufferGrant = MemoryGrant(meta->blockSize, meta->blockSize);
     this->blockBuffer = shared_ptr<char[]>(new char[meta->blockSize]);
 
-    this->multiBlockBufferCount = 8; // Give the multi-block buffer an arbitrary starting count.
+    // Give the multi-block buffer an arbitrary starting count (if the budget allows).
+    this->multiBlockGrant = MemoryGrant(8 * meta->blockSize, meta->blockSize);
+    this->multiBlockBufferCount = multiBlockGrant.size() / meta->blockSize;
     this->multiBlockBuffer = shared_ptr<char[]>(new char[multiBlockBufferCount * meta->blockSize]);
 }
 
+shared_ptr<char[]> BufferedImageReader::allocateSharedBlock(size_t blockIdx)
+{
+  // Expired entries are dropped now and then, so the index only ever holds
+  // roughly as many entries as there are live buffers.
+  if (manualBlockBuffers.size() >= nextCachePrune)
+  {
+    for (auto it = manualBlockBuffers.begin(); it != manualBlockBuffers.end();)
+      it = it->second.expired() ? manualBlockBuffers.erase(it) : std::next(it);
+    nextCachePrune = 2 * manualBlockBuffers.size() + CACHE_PRUNE_INTERVAL;
+  }
+
+  // Each buffer holds its share of the memory budget until the last user drops it
+  const size_t size = meta->blockSize;
+  MemoryBudget::global().acquire(size, size);
+  shared_ptr<char[]> buffer(new char[size], [size](char *p) {
+    delete[] p;
+    MemoryBudget::global().release(size);
+  });
+
+  manualBlockBuffers[blockIdx] = buffer;
+  return buffer;
+}
+
 int BufferedImageReader::readSuperBlock() {
 
   if (!fs)
     return -1;
 
+  // Images too short to hold a Super Block must not leave stale data behind
+  memset(&superBlock, 0, sizeof(superBlock));
+
   fs->unsetf(std::ios::skipws);
   fs->seekg(KiB, std::ios::beg);
   fs->read((char*)&superBlock, KiB);
@@ -47,8 +88,22 @@ int BufferedImageReader::readSuperBlock() {
   return 0;
 }
 
+void BufferedImageReader::readAt(char *buffer, size_t offset, size_t length)
+{
+  // A read past the end of the image (e.g. a corrupt block pointer) would
+  // otherwise leave the stream failed for every read that follows it.
+  fs->clear();
+  fs->seekg(offset, std::ios::beg);
+  fs->read(buffer, length);
+
+  const size_t got = fs->gcount();
+  if (got < length)
+    memset(buffer + got, 0, length - got);
+}
+
 shared_ptr<char[]> BufferedImageReader::getBlock(size_t blockIdx, BlockPersistenceType t)
 {
+  TRACE_SCOPE("getBlock", "reader", blockIdx);
   if (!fs)
     throw runtime_error("BufferedImageReader failed to initialize properly, or never initialized in the first place");
 
@@ -69,8 +124,7 @@ shared_ptr<char[]> BufferedImageReader::getBlock(size_t blockIdx, BlockPersisten
 
         if(weakBuf.expired())
         {
-          buffer = shared_ptr<char[]>(new char[meta->blockSize]);
-          manualBlockBuffers[blockIdx] = buffer;
+          buffer = allocateSharedBlock(blockIdx);
         }
         else
         {
@@ -79,8 +133,7 @@ shared_ptr<char[]> BufferedImageReader::getBlock(size_t blockIdx, BlockPersisten
 
       } catch(...) {
 
-        buffer = shared_ptr<char[]>(new char[meta->blockSize]);
-        manualBlockBuffers[blockIdx] = buffer;
+        buffer = allocateSharedBlock(blockIdx);
 
       }
 
@@ -90,62 +143,140 @@ shared_ptr<char[]> BufferedImageReader::getBlock(size_t blockIdx, BlockPersisten
       throw runtime_error("Unsupported BlockPersistenceType");
   }
 
-  fs->seekg(blockIdx * meta->blockSize, std::ios::beg);
-  fs->read(buffer.get(), meta->blockSize);
+  readAt(buffer.get(), blockIdx * meta->blockSize, meta->blockSize);
 
   return buffer;
 }
 
 shared_ptr<char[]> BufferedImageReader::getBlocks(size_t blockIdx, size_t numBlocks)
 {
+  TRACE_SCOPE("getBlocks", "reader", blockIdx);
   if (!fs)
     throw runtime_error("BufferedImageReader failed to initialize properly, or never initialized in the first place");
 
-  // Resize our internal buffer if it is not large enough for the request.
-  if(numBlocks > multiBlockBufferCount)
+  // Resize our internal buffer if it is not large enough for the request. Under
+  // a memory limit it is also shrunk back, so that a single large request does
+  // not pin its memory for the rest of the scan. Callers are expected to size
+  // their requests with MemoryBudget::affordable().
+  const bool limited = MemoryBudget::global().getLimit() != 0;
+  if(numBlocks > multiBlockBufferCount || (limited && numBlocks < multiBlockBufferCount))
   {
+    multiBlockBuffer = nullptr;
+    multiBlockGrant.reset();
+
+    multiBlockGrant = MemoryGrant(numBlocks * meta->blockSize, numBlocks * meta->blockSize);
     multiBlockBufferCount = numBlocks;
     multiBlockBuffer = shared_ptr<char[]>(new char[multiBlockBufferCount * meta->blockSize]);
   }
 
-  fs->seekg(blockIdx * meta->blockSize, std::ios::beg);
-  fs->read(this->multiBlockBuffer.get(), numBlocks * meta->blockSize);
+  readAt(this->multiBlockBuffer.get(), blockIdx * meta->blockSize, numBlocks * meta->blockSize);
 
   return this->multiBlockBuffer;
 }
 
-shared_ptr<char[]> BufferedImageReader::getGroupDescriptor()
+size_t BufferedImageReader::affordableBlocks(size_t wanted)
 {
-   // Only prepare the buffer once.
-  if(!groupDescriptorBuffer)
+  // The multi-block buffer is given up before it is reallocated, so the memory
+  // it already holds counts as available.
+  const size_t bytes = MemoryBudget::global().affordable(wanted * meta->blockSize, meta->blockSize)
+                     + multiBlockGrant.size();
+  return std::max<size_t>(1, std::min(wanted, bytes / meta->blockSize));
+}
+
+void BufferedImageReader::readBlocks(size_t blockIdx, size_t numBlocks, char *buffer)
+{
+  TRACE_SCOPE("readBlocks", "reader", blockIdx);
+  const size_t length = numBlocks * meta->blockSize;
+  if (readBytes((size_t)blockIdx * meta->blockSize, length, buffer) < length)
+    throw runtime_error("BlockReadBeyondEndOfImage");
+}
+
+size_t BufferedImageReader::readBytes(size_t offset, size_t length, char *buffer)
+{
+  if (fd < 0)
+    throw runtime_error("BufferedImageReader failed to initialize properly, or never initialized in the first place");
+
+  size_t got = 0;
+  while (got < length)
   {
-    const __u32 GDSIZE = sizeof(ext2_group_desc);
-    // Descriptor Table is located at block 1 if block size is 1KiB, otherwise block 2
-    const __u32 DESC_TABLE_BLOCK = (meta->blockSize == KiB) ? 2 : 1;
-    const __u32 DESC_TABLE_LEN = meta->blockGroupsCount;
-    const __u32 DESC_TABLE_SZ = DESC_TABLE_LEN * GDSIZE; // each GD is 32 bytes
-    const unsigned GD_BUFLEN = (GDSIZE * DESC_TABLE_LEN) / sizeof(char);
-
-
-    if(DESC_TABLE_LEN <= 0 || DESC_TABLE_SZ <= 0)
-      throw runtime_error("MalformedDescriptorTable");
-
-    if (!fs)
-      throw runtime_error("BufferedImageReader failed to initialize properly, or never initialized in the first place");
-
-    if (debug) {
-      printf("Group Descriptor Size: %d...\n", GDSIZE);
-      printf("Location of first Group Descriptor Table: Block %d...\n", DESC_TABLE_BLOCK);
-      printf("Total number of Group Descriptors: %d...\n", DESC_TABLE_LEN);
-      printf("Total size of Group Descriptor Table: %d...\n", DESC_TABLE_SZ);
-      printf("Size (in bytes) of buffer being used: %d...\n", GD_BUFLEN);
-    }
+    ssize_t n = pread(fd, buffer + got, length - got, (off_t)(offset + got));
+    if (n <= 0)
+      break;
+    got += n;
+  }
+
+  memset(buffer + got, 0, length - got);
+  return got;
+}
 
-    groupDescriptorBuffer = shared_ptr<char[]>(new char[GD_BUFLEN]);
+size_t BufferedImageReader::copyBytes(size_t offset, size_t length, int outFd, size_t outOffset)
+{
+  if (fd < 0)
+    throw runtime_error("BufferedImageReader failed to initialize properly, or never initialized in the first place");
 
-    fs->seekg(DESC_TABLE_BLOCK * meta->blockSize, std::ios::beg);
-    fs->read(groupDescriptorBuffer.get(), DESC_TABLE_SZ);
+  TRACE_SCOPE("copyBytes", "reader", offset / meta->blockSize);
+  loff_t in = offset, out = outOffset;
+  size_t copied = 0;
+
+  // copy_file_range() stays in the kernel, and may even share the extents
+  // (reflink) when both files are on the same file system
+  while (copied < length) {
+    ssize_t n = copy_file_range(fd, &in, outFd, &out, length - copied, 0);
+    if (n > 0) {
+      copied += n;
+      continue;
+    }
+    if (n == 0)
+      return copied; // end of the image
+    if (errno == EINTR)
+      continue;
+    if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+      throw runtime_error(std::string("CopyFailed: ") + strerror(errno));
+    break;
   }
 
-  return groupDescriptorBuffer;
+  // Not supported between these files (e.g. across file systems on older
+  // kernels): sendfile() still avoids the copy to user space, but writes at
+  // the output's file position
+  if (copied < length && lseek(outFd, out, SEEK_SET) < 0)
+    throw runtime_error(std::string("CopyFailed: ") + strerror(errno));
+
+  while (copied < length) {
+    off_t pos = in;
+    ssize_t n = sendfile(outFd, fd, &pos, length - copied);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw runtime_error(std::string("CopyFailed: ") + strerror(errno));
+    if (n == 0)
+      break;
+    in = pos;
+    copied += n;
+  }
+  return copied;
+}
+
+void BufferedImageReader::prefetch(const std::vector<__u32> &blocks)
+{
+  if (fd < 0 || blocks.empty())
+    return;
+
+  TRACE_SCOPE("prefetch", "reader", blocks.size());
+  std::vector<__u32> sorted;
+  sorted.reserve(blocks.size());
+  for (__u32 block : blocks)
+    if (block != 0 && block < meta->blockCount)
+      sorted.push_back(block);
+  std::sort(sorted.begin(), sorted.end());
+
+  // Neighbouring blocks are requested as one range, so the kernel can merge
+  // them into a single read
+  for (size_t i = 0; i < sorted.size();) {
+    size_t j = i + 1;
+    while (j < sorted.size() && sorted[j] <= sorted[j - 1] + 1)
+      j++;
+    posix_fadvise(fd, (off_t)sorted[i] * meta->blockSize,
+                  (off_t)(sorted[j - 1] - sorted[i] + 1) * meta->blockSize, POSIX_FADV_WILLNEED);
+    i = j;
+  }
 }
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <map>
 #include "imagereader.hpp"
+#include "memorybudget.hpp"
 
 using std::runtime_error;
 using std::make_shared;
@@ -21,13 +22,15 @@ class BufferedImageReader : public ImageReader {
 
   virtual void init();
 
-  struct ext2_super_block *getSuperBlock();
-
   virtual shared_ptr<char[]> getBlock(size_t blockIdx, BlockPersistenceType t);
 
   virtual shared_ptr<char[]> getBlocks(size_t blockIdx, size_t numBlocks);
+  virtual size_t affordableBlocks(size_t wanted);
 
-  virtual shared_ptr<char[]> getGroupDescriptor();
+  virtual void readBlocks(size_t blockIdx, size_t numBlocks, char *buffer);
+  virtual size_t readBytes(size_t offset, size_t length, char *buffer);
+  virtual size_t copyBytes(size_t offset, size_t length, int outFd, size_t outOffset);
+  virtual void prefetch(const std::vector<__u32> &blocks);
 
 protected:
 
@@ -35,17 +38,30 @@ protected:
 
 private:
 
+  /*Reads 'length' bytes at 'offset'; bytes past the end of the image read as 0*/
+  void readAt(char *buffer, size_t offset, size_t length);
+
+  /*Allocates (and indexes) a new SHARED block buffer*/
+  shared_ptr<char[]> allocateSharedBlock(size_t blockIdx);
+
   std::ifstream *fs;
 
-  shared_ptr<char[]> blockBuffer = nullptr;
+  /*Separate descriptor for positional (thread-safe) reads*/
+  int fd = -1;
 
-  shared_ptr<char[]> groupDescriptorBuffer = nullptr;
+  shared_ptr<char[]> blockBuffer = nullptr;
 
   shared_ptr<char[]> multiBlockBuffer = nullptr;
 
   map<size_t, weak_ptr<char[]>> manualBlockBuffers;
 
+  static const size_t CACHE_PRUNE_INTERVAL = 1024;
+  size_t nextCachePrune = CACHE_PRUNE_INTERVAL;
+
   /*The total number of blocks that can fit in the multiBlockBuffer*/
   size_t multiBlockBufferCount;
 
+  MemoryGrant blockBufferGrant;
+  MemoryGrant multiBlockGrant;
+
 };
@@ -0,0 +1,265 @@
+#include "compressedoutput.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdexcept>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_ZSTD_H
+#include <type_traits>
+#include <zstd.h>
+#endif
+
+const int CompressedOutput::DEFAULT_LEVEL;
+const size_t CompressedOutput::BUFFER_COUNT;
+const size_t CompressedOutput::BUFFER_SIZE;
+const size_t CompressedOutput::MIN_BUFFER_SIZE;
+
+// -------------------------------------------------- libzstd
+// The part of the stable zstd API (v1.4.0 and later) used here, resolved with
+// dlsym(). Where zstd.h is installed (HAVE_ZSTD_H, set by the Makefile from
+// pkg-config), its own declarations are used and the function pointers below
+// are checked against them at compile time. The copy in the #else branch is a
+// fallback for hosts without the header: it mirrors zstd.h and is only as
+// good as that, which is why the library's version is also checked at load.
+namespace {
+
+#ifdef HAVE_ZSTD_H
+typedef ZSTD_CCtx ZstdCCtx;
+typedef ZSTD_inBuffer ZstdInBuffer;
+typedef ZSTD_outBuffer ZstdOutBuffer;
+typedef ZSTD_cParameter ZstdParameter;
+typedef ZSTD_EndDirective ZstdEndDirective;
+const ZstdParameter ZSTD_C_COMPRESSION_LEVEL = ZSTD_c_compressionLevel;
+const ZstdParameter ZSTD_C_NB_WORKERS = ZSTD_c_nbWorkers;
+const ZstdEndDirective ZSTD_E_CONTINUE = ZSTD_e_continue;
+const ZstdEndDirective ZSTD_E_END = ZSTD_e_end;
+#else
+struct ZstdCCtx;
+struct ZstdInBuffer { const void *src; size_t size; size_t pos; };
+struct ZstdOutBuffer { void *dst; size_t size; size_t pos; };
+enum ZstdParameter { ZSTD_C_COMPRESSION_LEVEL = 100, ZSTD_C_NB_WORKERS = 400 };
+enum ZstdEndDirective { ZSTD_E_CONTINUE = 0, ZSTD_E_END = 2 };
+#endif
+
+// ZSTD_compressStream2() and the parameters above are stable from 1.4.0 on
+const unsigned MIN_ZSTD_VERSION = 10400;
+
+}
+
+struct CompressedOutput::Context {
+  void *library = nullptr;
+  ZstdCCtx *cctx = nullptr;
+
+  unsigned (*versionNumber)();
+  ZstdCCtx *(*createCCtx)();
+  size_t (*freeCCtx)(ZstdCCtx*);
+  size_t (*setParameter)(ZstdCCtx*, ZstdParameter, int);
+  size_t (*compressStream2)(ZstdCCtx*, ZstdOutBuffer*, ZstdInBuffer*, ZstdEndDirective);
+  unsigned (*isError)(size_t);
+  const char *(*getErrorName)(size_t);
+
+#ifdef HAVE_ZSTD_H
+  static_assert(std::is_same<decltype(versionNumber), decltype(&ZSTD_versionNumber)>::value &&
+                std::is_same<decltype(createCCtx), decltype(&ZSTD_createCCtx)>::value &&
+                std::is_same<decltype(freeCCtx), decltype(&ZSTD_freeCCtx)>::value &&
+                std::is_same<decltype(setParameter), decltype(&ZSTD_CCtx_setParameter)>::value &&
+                std::is_same<decltype(compressStream2), decltype(&ZSTD_compressStream2)>::value &&
+                std::is_same<decltype(isError), decltype(&ZSTD_isError)>::value &&
+                std::is_same<decltype(getErrorName), decltype(&ZSTD_getErrorName)>::value,
+                "the libzstd functions resolved do not match zstd.h");
+#endif
+
+  ~Context() {
+    if (cctx)
+      freeCCtx(cctx);
+    if (library)
+      dlclose(library);
+  }
+
+  template <typename F> void resolve(F &function, const char *name) {
+    function = reinterpret_cast<F>(dlsym(library, name));
+    if (!function)
+      throw std::runtime_error(std::string("ZstdSymbolMissing: ") + name);
+  }
+
+  void check(size_t result, const char *what) {
+    if (isError(result))
+      throw std::runtime_error(std::string(what) + ": " + getErrorName(result));
+  }
+};
+
+CompressedOutput::CompressedOutput(int fd, int level, int workers) : zstd(new Context), fd(fd)
+{
+  zstd->library = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+  if (!zstd->library)
+    throw std::runtime_error("ZstdUnavailable: libzstd.so.1 cannot be loaded");
+
+  zstd->resolve(zstd->versionNumber, "ZSTD_versionNumber");
+  const unsigned version = zstd->versionNumber();
+  if (version < MIN_ZSTD_VERSION)
+    throw std::runtime_error("ZstdTooOld: libzstd " + std::to_string(version / 10000) + "." +
+                             std::to_string(version / 100 % 100) + "." + std::to_string(version % 100));
+
+  zstd->resolve(zstd->createCCtx, "ZSTD_createCCtx");
+  zstd->resolve(zstd->freeCCtx, "ZSTD_freeCCtx");
+  zstd->resolve(zstd->setParameter, "ZSTD_CCtx_setParameter");
+  zstd->resolve(zstd->compressStream2, "ZSTD_compressStream2");
+  zstd->resolve(zstd->isError, "ZSTD_isError");
+  zstd->resolve(zstd->getErrorName, "ZSTD_getErrorName");
+
+  zstd->cctx = zstd->createCCtx();
+  if (!zstd->cctx)
+    throw std::runtime_error("ZstdContextError");
+  zstd->check(zstd->setParameter(zstd->cctx, ZSTD_C_COMPRESSION_LEVEL, level), "ZstdInvalidLevel");
+  if (workers > 0)
+    zstd->check(zstd->setParameter(zstd->cctx, ZSTD_C_NB_WORKERS, workers), "ZstdInvalidWorkers");
+
+  // The formatter's buffers, plus one for the compressed bytes
+  grant = MemoryGrant((BUFFER_COUNT + 1) * BUFFER_SIZE, (BUFFER_COUNT + 1) * MIN_BUFFER_SIZE);
+  bufferSize = std::max(grant.size() / (BUFFER_COUNT + 1), MIN_BUFFER_SIZE);
+  for (size_t i = 0; i <= BUFFER_COUNT; i++)
+    buffers.emplace_back(new char[bufferSize]);
+  lengths.assign(BUFFER_COUNT, 0);
+
+  current = 0;
+  for (size_t i = 1; i < BUFFER_COUNT; i++)
+    empty.push_back(i);
+
+  cookie_io_functions_t functions = {};
+  functions.write = cookieWrite;
+  file = fopencookie(this, "w", functions);
+  if (!file)
+    throw std::runtime_error("CompressedStreamOpenError");
+
+  compressor = std::thread(&CompressedOutput::compress, this);
+}
+
+CompressedOutput::~CompressedOutput()
+{
+  close();
+}
+
+bool CompressedOutput::close()
+{
+  if (closed)
+    return error.empty();
+  closed = true;
+
+  // Whatever stdio still holds comes through cookieWrite() first
+  fclose(file);
+  file = nullptr;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    lengths[current] = used;
+    full.push_back(current);
+    finished = true;
+  }
+  changed.notify_all();
+  compressor.join();
+
+  return error.empty();
+}
+
+/*PRIVATE -- called by stdio with the formatted bytes*/
+ssize_t CompressedOutput::cookieWrite(void *cookie, const char *data, size_t size)
+{
+  CompressedOutput &self = *static_cast<CompressedOutput*>(cookie);
+
+  for (size_t done = 0; done < size;) {
+    const size_t n = std::min(size - done, self.bufferSize - self.used);
+    memcpy(self.buffers[self.current].get() + self.used, data + done, n);
+    self.used += n;
+    done += n;
+    if (self.used == self.bufferSize)
+      self.handOff();
+  }
+  return size;
+}
+
+/*PRIVATE -- queues the current buffer for the compressor, and carries on in
+  the next empty one*/
+void CompressedOutput::handOff()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  lengths[current] = used;
+  full.push_back(current);
+  changed.notify_all();
+
+  changed.wait(guard, [this]() { return !empty.empty(); });
+  current = empty.front();
+  empty.pop_front();
+  used = 0;
+}
+
+/*PRIVATE -- the compressor thread. After a failure the remaining buffers are
+  still taken (and dropped), so the formatter never waits forever*/
+void CompressedOutput::compress()
+{
+  ZstdOutBuffer out = {buffers[BUFFER_COUNT].get(), bufferSize, 0};
+
+  auto drain = [&]() {
+    if (out.pos > 0 && error.empty() && !writeOut(static_cast<char*>(out.dst), out.pos))
+      error = std::string("CompressedWriteFailed: ") + strerror(errno);
+    out.pos = 0;
+  };
+
+  while (true) {
+    size_t index;
+    bool last;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      changed.wait(guard, [this]() { return !full.empty(); });
+      index = full.front();
+      full.pop_front();
+      last = finished && full.empty();
+    }
+
+    TRACE_SCOPE("zstd.compress", "output", lengths[index]);
+    ZstdInBuffer in = {buffers[index].get(), lengths[index], 0};
+    bytesIn += lengths[index];
+
+    // The frame is ended with the last buffer
+    const ZstdEndDirective directive = last ? ZSTD_E_END : ZSTD_E_CONTINUE;
+    try {
+      while (error.empty()) {
+        const size_t remaining = zstd->compressStream2(zstd->cctx, &out, &in, directive);
+        zstd->check(remaining, "ZstdCompressionFailed");
+        if (out.pos == out.size)
+          drain();
+        if (directive == ZSTD_E_CONTINUE ? in.pos == in.size : remaining == 0)
+          break;
+      }
+    } catch (std::runtime_error &e) {
+      error = e.what();
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      empty.push_back(index);
+    }
+    changed.notify_all();
+
+    if (last)
+      break;
+  }
+  drain();
+}
+
+/*PRIVATE*/
+bool CompressedOutput::writeOut(const char *data, size_t size)
+{
+  TRACE_SCOPE("zstd.write", "output", size);
+  for (size_t done = 0; done < size;) {
+    ssize_t n = write(fd, data + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  bytesOut += size;
+  return true;
+}
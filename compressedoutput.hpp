@@ -0,0 +1,91 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "memorybudget.hpp"
+
+// -------------------------------------------------- Compressed Output
+//
+// A FILE* whose contents are written to a file descriptor as a zstd stream.
+// Used by 'lab3a --zstd' for the report.
+//
+// The formatter writes into a ring of large buffers. Each buffer that fills up
+// is handed to a compressor thread, and the formatter carries on with the next
+// free one, so compression runs alongside the scan. The formatter only waits
+// when every buffer is queued, i.e. when compression is the bottleneck. The
+// compressed bytes are gathered into one more buffer and written out with a
+// single write() each time it is full.
+//
+// With 'workers' > 0, zstd itself also splits the stream into jobs compressed
+// on that many threads of its own (multithreaded frames).
+//
+// libzstd is loaded when the first CompressedOutput is created, not linked,
+// so lab3a still builds and runs where it is not installed. Versions before
+// 1.4.0 are refused.
+//
+class CompressedOutput {
+ public:
+  /*Throws runtime_error if libzstd cannot be loaded, or rejects the level or
+    the number of workers*/
+  CompressedOutput(int fd, int level, int workers = 0);
+  ~CompressedOutput();
+
+  CompressedOutput(const CompressedOutput&) = delete;
+  CompressedOutput &operator=(const CompressedOutput&) = delete;
+
+  /*The stream to format into. Not thread-safe, like any FILE* written from
+    several threads without locking*/
+  FILE *stream() const { return file; }
+
+  /*Flushes the stream, ends the zstd frame and waits for everything to be
+    written. Returns false (see getError()) if compressing or writing failed*/
+  bool close();
+
+  const std::string &getError() const { return error; }
+  uint64_t getBytesIn() const { return bytesIn; }
+  uint64_t getBytesOut() const { return bytesOut; }
+
+  static const int DEFAULT_LEVEL = 3;
+  static const size_t BUFFER_COUNT = 4;
+  static const size_t BUFFER_SIZE = 1 << 20;
+  static const size_t MIN_BUFFER_SIZE = 64 << 10;
+
+ private:
+  struct Context;
+  std::unique_ptr<Context> zstd;
+  const int fd;
+  FILE *file = nullptr;
+
+  MemoryGrant grant;
+  size_t bufferSize = 0;
+  std::vector<std::unique_ptr<char[]>> buffers; // the last one collects compressed bytes
+  std::vector<size_t> lengths;
+
+  // Filled by the formatter, emptied by the compressor
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<size_t> full;
+  std::deque<size_t> empty;
+  bool finished = false;
+
+  size_t current;     // the buffer being formatted into
+  size_t used = 0;
+  std::thread compressor;
+  bool closed = false;
+
+  std::string error;  // written by the compressor, read after it has exited
+  uint64_t bytesIn = 0;
+  uint64_t bytesOut = 0;
+
+  static ssize_t cookieWrite(void *cookie, const char *data, size_t size);
+  void handOff();
+  void compress();
+  bool writeOut(const char *data, size_t size);
+};
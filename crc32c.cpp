@@ -0,0 +1,134 @@
+#include "crc32c.hpp"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace {
+
+const uint32_t POLY = 0x82F63B78; // reflected
+
+struct Tables {
+  uint32_t t[8][256];
+
+  Tables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++)
+        c = (c >> 1) ^ (POLY & (0 - (c & 1)));
+      t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+      for (int s = 1; s < 8; s++)
+        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+  }
+};
+
+const Tables tables;
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *p, size_t length) {
+  for (; length >= 8; p += 8, length -= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = tables.t[7][lo & 0xFF] ^ tables.t[6][(lo >> 8) & 0xFF] ^
+          tables.t[5][(lo >> 16) & 0xFF] ^ tables.t[4][lo >> 24] ^
+          tables.t[3][hi & 0xFF] ^ tables.t[2][(hi >> 8) & 0xFF] ^
+          tables.t[1][(hi >> 16) & 0xFF] ^ tables.t[0][hi >> 24];
+  }
+  while (length--)
+    crc = (crc >> 8) ^ tables.t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char *p, size_t length) {
+  uint64_t c = crc;
+  for (; length >= 8; p += 8, length -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    c = _mm_crc32_u64(c, word);
+  }
+  while (length--)
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+  return (uint32_t)c;
+}
+
+bool detectSse42() {
+  __builtin_cpu_init(); // may run before the constructor that normally does this
+  return __builtin_cpu_supports("sse4.2");
+}
+
+const bool HAS_SSE42 = detectSse42();
+#else
+const bool HAS_SSE42 = false;
+#endif
+
+// -------------------------------------------------- Zero Extension
+// Feeding a zero byte to the (pre-inversion) register is a linear map over
+// GF(2). Its powers are applied by square-and-multiply, as in zlib's
+// crc32_combine(); SHIFTS[k] is the map for 2^k zero bytes.
+uint32_t multiply(const uint32_t *matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  for (int i = 0; vector; i++, vector >>= 1)
+    if (vector & 1)
+      sum ^= matrix[i];
+  return sum;
+}
+
+struct Shifts {
+  uint32_t m[64][32];
+
+  Shifts() {
+    // One zero bit, then square up to one byte (8 bits)
+    uint32_t bit[32];
+    bit[0] = POLY;
+    for (int i = 1; i < 32; i++)
+      bit[i] = 1u << (i - 1);
+
+    uint32_t square[32];
+    memcpy(m[0], bit, sizeof(bit));
+    for (int s = 0; s < 3; s++) {
+      for (int i = 0; i < 32; i++)
+        square[i] = multiply(m[0], m[0][i]);
+      memcpy(m[0], square, sizeof(square));
+    }
+    for (int k = 1; k < 64; k++)
+      for (int i = 0; i < 32; i++)
+        m[k][i] = multiply(m[k - 1], m[k - 1][i]);
+  }
+};
+
+const Shifts shifts;
+
+uint32_t shift(uint32_t reg, uint64_t bytes) {
+  for (int k = 0; bytes; k++, bytes >>= 1)
+    if (bytes & 1)
+      reg = multiply(shifts.m[k], reg);
+  return reg;
+}
+
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+  const unsigned char *p = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+  if (HAS_SSE42)
+    return ~crc32cHardware(~crc, p, length);
+#endif
+  return ~crc32cSoftware(~crc, p, length);
+}
+
+uint32_t crc32cZeros(uint32_t crc, uint64_t length) {
+  return ~shift(~crc, length);
+}
+
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) {
+  return shift(crcA, lengthB) ^ crcB;
+}
+
+bool crc32cHardware() {
+  return HAS_SSE42;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// -------------------------------------------------- CRC32C
+//
+// CRC-32C (Castagnoli, as used by iSCSI, ext4 and btrfs). Uses the SSE4.2 crc32
+// instruction when the CPU has it (checked once, at run time), and a
+// slicing-by-8 table otherwise; both give the same values.
+//
+// 'crc' is the value of the data so far (0 to start), e.g.
+// crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m).
+//
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/*The CRC of 'length' more zero bytes, in O(log length) time*/
+uint32_t crc32cZeros(uint32_t crc, uint64_t length);
+
+/*The CRC of A followed by B, from crcA, crcB and B's length*/
+uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, uint64_t lengthB);
+
+/*True if crc32c() uses the SSE4.2 instruction*/
+bool crc32cHardware();
@@ -0,0 +1,183 @@
+#include "csvvisitor.hpp"
+#include <sys/stat.h>
+#include <time.h>
+
+void CsvVisitor::onSuperBlock(const ext2_super_block &superBlock, const MetaFile &meta)
+{
+  fprintf(out, "SUPERBLOCK,%u,%u,%u,%u,%u,%u,%u\n",
+          superBlock.s_blocks_count,
+          superBlock.s_inodes_count,
+          meta.blockSize,
+          meta.inodeSize,
+          superBlock.s_blocks_per_group,
+          superBlock.s_inodes_per_group,
+          superBlock.s_first_ino
+          );
+}
+
+void CsvVisitor::onGroup(__u32 group, const ext2_group_desc &groupDesc,
+                         __u32 blocksInGroup, __u32 inodesInGroup)
+{
+  fprintf(out, "GROUP,%u,%u,%u,%u,%u,%u,%u,%u\n",
+          group,
+          blocksInGroup,
+          inodesInGroup,
+          groupDesc.bg_free_blocks_count,
+          groupDesc.bg_free_inodes_count,
+          groupDesc.bg_block_bitmap,
+          groupDesc.bg_inode_bitmap,
+          groupDesc.bg_inode_table);
+}
+
+void CsvVisitor::onFreeBlockRange(__u32 first, __u32 count)
+{
+  for (__u32 block = first; block < first + count; block++)
+    fprintf(out, "BFREE,%u\n", block);
+}
+
+void CsvVisitor::onFreeInodeRange(__u32 first, __u32 count)
+{
+  for (__u32 inode = first; inode < first + count; inode++)
+    fprintf(out, "IFREE,%u\n", inode);
+}
+
+char CsvVisitor::fileType(const ext2_inode &inode)
+{
+  if (S_ISREG(inode.i_mode))
+    return 'f';
+  else if (S_ISDIR(inode.i_mode))
+    return 'd';
+  else if (S_ISLNK(inode.i_mode))
+    return 's';
+  return '?';
+}
+
+uint64_t CsvVisitor::fileSize(const ext2_inode &inode)
+{
+  // With large_file, i_dir_acl holds the upper half of a regular file's size
+  if (S_ISREG(inode.i_mode))
+    return inode.i_size | (uint64_t)inode.i_dir_acl << 32;
+  return inode.i_size;
+}
+
+void CsvVisitor::onInode(__u32 inodeNumber, const ext2_inode &inode)
+{
+  const char mode = fileType(inode);
+
+  // Time format: dd/mm/yy hh:mm:ss\0
+  const size_t TIME_STR_LEN = 18;
+  char cTimeStr[TIME_STR_LEN];
+  char mTimeStr[TIME_STR_LEN];
+  char aTimeStr[TIME_STR_LEN];
+
+  time_t cTime = inode.i_ctime;
+  time_t mTime = inode.i_mtime;
+  time_t aTime = inode.i_atime;
+
+  struct tm tmBuf;
+  strftime(cTimeStr, TIME_STR_LEN, "%D %X", gmtime_r(&cTime, &tmBuf));
+  strftime(mTimeStr, TIME_STR_LEN, "%D %X", gmtime_r(&mTime, &tmBuf));
+  strftime(aTimeStr, TIME_STR_LEN, "%D %X", gmtime_r(&aTime, &tmBuf));
+
+  fprintf(out, "INODE,%u,%c,%o,%u,%u,%u,%s,%s,%s,%llu,%u",
+          inodeNumber,
+          mode,
+          inode.i_mode & 0x0FFF,
+          inode.i_uid,
+          inode.i_gid,
+          inode.i_links_count,
+          cTimeStr,
+          mTimeStr,
+          aTimeStr,
+          (unsigned long long)fileSize(inode),
+          inode.i_blocks
+          );
+
+  // Fast symbolic links keep their target in i_block, not block numbers
+  if (((mode == 'f') || (mode == 'd')) || ((mode == 's' && inode.i_size > 60)))
+    for (size_t i = 0; i < EXT2_N_BLOCKS; ++i)
+      fprintf(out, ",%u", inode.i_block[i]);
+
+  fprintf(out, "\n");
+}
+
+void CsvVisitor::onXattr(__u32 inodeNumber, __u32 block, const char *name, size_t nameLength,
+                         const char *value, size_t valueSize)
+{
+  fprintf(out, "XATTR,%u,%u,'%.*s',%zu,", inodeNumber, block, (int)nameLength, name, valueSize);
+
+  // Text (printable, maybe NUL-terminated) is quoted like names, anything else
+  // is written in hex
+  size_t text = valueSize;
+  if (text > 0 && value[text - 1] == '\0')
+    text--;
+  bool printable = true;
+  for (size_t i = 0; i < text && printable; i++)
+    printable = (value[i] >= 0x20 && value[i] < 0x7f);
+
+  if (printable) {
+    fprintf(out, "'%.*s'\n", (int)text, value);
+    return;
+  }
+  for (size_t i = 0; i < valueSize; i++)
+    fprintf(out, "%02x", (unsigned char)value[i]);
+  fputc('\n', out);
+}
+
+void CsvVisitor::onDirEntry(__u32 dirInode, size_t logicalOffset, const ext2_dir_entry &entry)
+{
+  fprintf(out, "DIRENT,%u,%lu,%u,%u,%u,'%.*s'",
+          dirInode,
+          logicalOffset,
+          entry.inode,
+          entry.rec_len,
+          entry.name_len,
+          entry.name_len,
+          entry.name);
+  if (!paths) {
+    fputc('\n', out);
+    return;
+  }
+
+  // Entries come a directory at a time, so its path is only assembled once
+  if (dirInode != pathDir) {
+    pathDir = dirInode;
+    pathDirFound = paths->path(dirInode, dirPath);
+  }
+
+  // '.' and '..' name the directory itself and its parent
+  if (PathIndex::isDot(entry.name, entry.name_len)) {
+    if (entry.name_len == 1)
+      entryPath = pathDirFound ? dirPath : "";
+    else if (!paths->path(entry.inode, entryPath))
+      entryPath.clear();
+  } else if (pathDirFound) {
+    entryPath.assign(dirPath, 0, dirPath.size() == 1 ? 0 : dirPath.size());
+    entryPath += '/';
+    entryPath.append(entry.name, entry.name_len);
+  } else {
+    entryPath.clear();
+  }
+  fprintf(out, ",%.*s\n", (int)entryPath.size(), entryPath.c_str());
+}
+
+void CsvVisitor::onIndirect(__u32 inodeNumber, __u32 level, size_t logicalBlock,
+                            __u32 indBlock, __u32 refBlock)
+{
+  fprintf(out, "INDIRECT,%u,%u,%lu,%u,%u\n",
+          inodeNumber,
+          level,
+          logicalBlock,
+          indBlock,
+          refBlock);
+}
+
+void CsvVisitor::onFileHash(__u32 inodeNumber, uint64_t size, __u32 crc)
+{
+  fprintf(out, "FILEHASH,%u,%llu,%08x\n", inodeNumber, (unsigned long long)size, crc);
+}
+
+void CsvVisitor::onPath(__u32 inodeNumber, const char *path, size_t length)
+{
+  fprintf(out, "PATH,%u,%.*s\n", inodeNumber, (int)length, path);
+}
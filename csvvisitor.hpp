@@ -0,0 +1,47 @@
+#pragma once
+#include <stdio.h>
+#include <string>
+#include "pathindex.hpp"
+#include "scanvisitor.hpp"
+
+// -------------------------------------------------- CSV Visitor
+//
+// Formats every structure it is shown as one line of the lab3a CSV report
+// (SUPERBLOCK, GROUP, BFREE, IFREE, INODE, XATTR, DIRENT, INDIRECT, FILEHASH
+// and PATH).
+//
+class CsvVisitor : public ScanVisitor {
+ public:
+  explicit CsvVisitor(FILE *out) : out(out) {}
+
+  void onSuperBlock(const ext2_super_block &, const MetaFile &) override;
+  void onGroup(__u32, const ext2_group_desc &, __u32, __u32) override;
+  void onFreeBlockRange(__u32, __u32) override;
+  void onFreeInodeRange(__u32, __u32) override;
+  void onInode(__u32, const ext2_inode &) override;
+  void onXattr(__u32, __u32, const char *, size_t, const char *, size_t) override;
+  void onDirEntry(__u32, size_t, const ext2_dir_entry &) override;
+  void onIndirect(__u32, __u32, size_t, __u32, __u32) override;
+  void onFileHash(__u32, uint64_t, __u32) override;
+  void onPath(__u32, const char *, size_t) override;
+
+  /*Ends every DIRENT line with the entry's full path, looked up in 'index'
+    (which must outlive the visitor). The field is empty when the directory
+    cannot be reached from the root*/
+  void setPaths(const PathIndex *index) { paths = index; }
+
+  /*The file type character used in INODE lines ('f', 'd', 's' or '?')*/
+  static char fileType(const ext2_inode &);
+
+  /*The size in INODE lines: 64 bits for regular files, 32 for the others*/
+  static uint64_t fileSize(const ext2_inode &);
+
+ private:
+  FILE *out;
+
+  const PathIndex *paths = nullptr;
+  __u32 pathDir = 0;     // the directory whose path is in dirPath
+  bool pathDirFound = false;
+  std::string dirPath;
+  std::string entryPath;
+};
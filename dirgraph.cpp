@@ -0,0 +1,374 @@
+#include "dirgraph.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DIRGRAPH_GRANT_CHUNK (64 * 1024)
+
+/*Grows 'grants' by DIRGRAPH_GRANT_CHUNK steps until they cover 'used' bytes.
+  Unless 'required', returns false as soon as the budget falls short*/
+static bool charge(vector<MemoryGrant> &grants, size_t &granted, size_t used, bool required)
+{
+  while (granted < used) {
+    grants.emplace_back(DIRGRAPH_GRANT_CHUNK, required ? DIRGRAPH_GRANT_CHUNK : 0);
+    granted += grants.back().size();
+    if (grants.back().size() < DIRGRAPH_GRANT_CHUNK)
+      return granted >= used;
+  }
+  return true;
+}
+
+// -------------------------------------------------- Finding Log
+DirGraph::FindingLog::~FindingLog()
+{
+  if (spill)
+    fclose(spill);
+}
+
+void DirGraph::FindingLog::add(__u32 inode, size_t offset, const string &text)
+{
+  count++;
+
+  if (!spill && charge(grants, granted, charged + sizeof(Finding) + text.size() + 1, false)) {
+    charged += sizeof(Finding) + text.size() + 1;
+    memory.push_back({inode, offset, text});
+    return;
+  }
+
+  if (!spill && !(spill = tmpfile()))
+    throw std::runtime_error("FindingSpillError");
+
+  const uint64_t offset64 = offset;
+  const __u32 length = text.size();
+  if (fwrite(&inode, sizeof(inode), 1, spill) != 1 || fwrite(&offset64, sizeof(offset64), 1, spill) != 1 ||
+      fwrite(&length, sizeof(length), 1, spill) != 1 || fwrite(text.data(), 1, length, spill) != length)
+    throw std::runtime_error("FindingSpillError");
+}
+
+void DirGraph::FindingLog::rewind()
+{
+  cursor = 0;
+  if (spill && fseek(spill, 0, SEEK_SET) != 0)
+    throw std::runtime_error("FindingSpillError");
+}
+
+bool DirGraph::FindingLog::next(Finding &f)
+{
+  if (cursor < memory.size()) {
+    f = memory[cursor++];
+    return true;
+  }
+  if (!spill || cursor == count)
+    return false;
+
+  uint64_t offset64;
+  __u32 length;
+  if (fread(&f.inode, sizeof(f.inode), 1, spill) != 1 || fread(&offset64, sizeof(offset64), 1, spill) != 1 ||
+      fread(&length, sizeof(length), 1, spill) != 1)
+    throw std::runtime_error("FindingSpillError");
+  f.offset = offset64;
+  f.text.resize(length);
+  if (fread(&f.text[0], 1, length, spill) != length)
+    throw std::runtime_error("FindingSpillError");
+
+  cursor++;
+  return true;
+}
+
+// -------------------------------------------------- Directory Graph
+DirGraph::Directory DirGraph::Directory::of(__u32 inodeNumber, const ext2_inode *inode)
+{
+  Directory dir;
+  dir.inode = inodeNumber;
+  dir.size = inode->i_size;
+  memcpy(dir.block, inode->i_block, sizeof(dir.block));
+  return dir;
+}
+
+DirGraph::DirGraph(__u32 inodesCount, __u32 firstInode, size_t memoryBudget, unsigned maxWorkers)
+{
+  this->inodesCount = inodesCount;
+  this->firstInode = firstInode;
+
+  const size_t words = (inodesCount + 63) / 64;
+  bitsetGrant = MemoryGrant(2 * words * sizeof(uint64_t), 2 * words * sizeof(uint64_t));
+  allocated.assign(words, 0);
+  isDirectory.assign(words, 0);
+
+  // Prefer one window over many workers: each extra window re-reads every
+  // directory, whereas fewer workers only costs parallelism.
+  const size_t perWorker = (size_t)inodesCount * sizeof(__u16);
+  unsigned workerCount = std::max<size_t>(1, std::min<size_t>(maxWorkers, memoryBudget / std::max<size_t>(perWorker, 1)));
+  windowSize = std::min<size_t>(inodesCount, std::max<size_t>(1, memoryBudget / (workerCount * sizeof(__u16))));
+
+  workers = vector<Worker>(workerCount);
+}
+
+bool DirGraph::test(const vector<uint64_t> &set, __u32 inodeNumber)
+{
+  return (set[(inodeNumber - 1) / 64] >> ((inodeNumber - 1) % 64)) & 1;
+}
+
+void DirGraph::set(vector<uint64_t> &set, __u32 inodeNumber)
+{
+  set[(inodeNumber - 1) / 64] |= (uint64_t)1 << ((inodeNumber - 1) % 64);
+}
+
+bool DirGraph::isChecked(__u32 inodeNumber) const
+{
+  // Reserved inodes (bad blocks, resize, journal...) are not linked from any
+  // directory; the root is the only exception.
+  return inodeNumber >= firstInode || inodeNumber == EXT2_ROOT_INO;
+}
+
+size_t DirGraph::directoryIndex(__u32 inodeNumber) const
+{
+  // directories are added in inode order, so they are already sorted
+  return std::lower_bound(directoryInodes.begin(), directoryInodes.end(), inodeNumber) - directoryInodes.begin();
+}
+
+bool DirGraph::getDirectory(size_t i, Directory &dir) const
+{
+  if (!keepRecords)
+    return false;
+  dir = records[i];
+  return true;
+}
+
+void DirGraph::addInode(__u32 inodeNumber, const ext2_inode *inode, bool inBitmap)
+{
+  const bool inUse = inode->i_mode != 0;
+
+  if (inUse) {
+    set(allocated, inodeNumber);
+
+    if (S_ISDIR(inode->i_mode) && inode->i_links_count != 0) {
+      set(isDirectory, inodeNumber);
+
+      // 4 bytes here, and 8 more for parentOf/dotDotOf once the scan begins
+      charge(directoryGrants, directoryGranted, (directoryInodes.size() + 1) * 3 * sizeof(__u32), true);
+      directoryInodes.push_back(inodeNumber);
+
+      if (keepRecords && charge(recordGrants, recordGranted, (records.size() + 1) * sizeof(Directory), false)) {
+        records.push_back(Directory::of(inodeNumber, inode));
+      } else if (keepRecords) {
+        keepRecords = false;
+        vector<Directory>().swap(records);
+        recordGrants.clear();
+        recordGranted = 0;
+      }
+    }
+  }
+
+  if (!isChecked(inodeNumber))
+    return;
+
+  char text[64];
+  if (inUse && !inBitmap) {
+    snprintf(text, sizeof(text), "ALLOCATED INODE %u ON FREELIST", inodeNumber);
+    bitmapFindings.add(inodeNumber, 0, text);
+  } else if (!inUse && inBitmap) {
+    snprintf(text, sizeof(text), "UNALLOCATED INODE %u NOT ON FREELIST", inodeNumber);
+    bitmapFindings.add(inodeNumber, 0, text);
+  }
+}
+
+void DirGraph::beginWindow(__u32 first)
+{
+  if (!parentOf) {
+    const size_t count = directoryInodes.size();
+    parentOf.reset(new std::atomic<__u32>[count]);
+    dotDotOf.reset(new __u32[count]());
+    for (size_t i = 0; i < count; i++)
+      parentOf[i].store(0, std::memory_order_relaxed);
+  }
+
+  windowFirst = first;
+  for (auto &worker : workers)
+    worker.counts.assign(windowSize, 0);
+}
+
+void DirGraph::addEdge(unsigned w, __u32 parent, __u32 child, const char *name,
+                       size_t nameLen, size_t offset, bool collect)
+{
+  Worker &worker = workers[w];
+  const string entryName(name, nameLen);
+
+  if (child > inodesCount) {
+    if (collect)
+      worker.findings.add(parent, offset, "DIRECTORY INODE " + std::to_string(parent) +
+                          " NAME '" + entryName + "' INVALID INODE " + std::to_string(child));
+    return;
+  }
+
+  if (child >= windowFirst && child - windowFirst < windowSize) {
+    __u16 &count = worker.counts[child - windowFirst];
+    if (count != UINT16_MAX)
+      count++;
+  }
+
+  if (!collect)
+    return;
+
+  if (!test(allocated, child)) {
+    worker.findings.add(parent, offset, "DIRECTORY INODE " + std::to_string(parent) +
+                        " NAME '" + entryName + "' UNALLOCATED INODE " + std::to_string(child));
+    return;
+  }
+
+  if (entryName == ".") {
+    if (child != parent)
+      worker.findings.add(parent, offset, "DIRECTORY INODE " + std::to_string(parent) +
+                          " NAME '.' LINK TO INODE " + std::to_string(child) +
+                          " SHOULD BE " + std::to_string(parent));
+  } else if (entryName == "..") {
+    const size_t i = directoryIndex(parent);
+    if (i < directoryInodes.size() && directoryInodes[i] == parent)
+      dotDotOf[i] = child;
+  } else if (test(isDirectory, child) && parent != 0 && parent <= inodesCount && test(isDirectory, parent)) {
+    std::atomic<__u32> &slot = parentOf[directoryIndex(child)];
+    __u32 seen = slot.load(std::memory_order_relaxed);
+    while ((seen == 0 || parent < seen) &&
+           !slot.compare_exchange_weak(seen, parent, std::memory_order_relaxed)) {}
+  }
+}
+
+void DirGraph::endWindow()
+{
+  vector<__u16> &total = workers[0].counts;
+
+  for (size_t w = 1; w < workers.size(); w++) {
+    const vector<__u16> &counts = workers[w].counts;
+    for (size_t i = 0; i < total.size(); i++) {
+      const uint32_t sum = (uint32_t)total[i] + counts[i];
+      total[i] = sum > UINT16_MAX ? UINT16_MAX : sum;
+    }
+  }
+}
+
+void DirGraph::checkLinkCount(__u32 inodeNumber, const ext2_inode *inode)
+{
+  if (!isChecked(inodeNumber) || inodeNumber < windowFirst || inodeNumber - windowFirst >= windowSize)
+    return;
+
+  const __u16 refs = workers[0].counts[inodeNumber - windowFirst];
+  if (refs != inode->i_links_count) {
+    char text[80];
+    snprintf(text, sizeof(text), "INODE %u HAS %u LINKS BUT LINKCOUNT IS %u",
+             inodeNumber, refs, inode->i_links_count);
+    linkFindings.add(inodeNumber, 0, text);
+  }
+}
+
+size_t DirGraph::report(FILE *out)
+{
+  const size_t count = directoryInodes.size();
+  if (!parentOf)
+    beginWindow(1);
+
+  size_t findings = 0;
+
+  bitmapFindings.rewind();
+  for (Finding f; bitmapFindings.next(f); findings++)
+    fprintf(out, "%s\n", f.text.c_str());
+
+  // -------------------------------------------------- Entries and '..' Consistency
+  // Each worker's findings are already sorted, and so are the '..' ones,
+  // which are made in directory order: merge them.
+  size_t nextDir = 0;
+  auto nextDotDot = [&](Finding &f) {
+    for (; nextDir < count; nextDir++) {
+      const __u32 dir = directoryInodes[nextDir];
+      const __u32 expected = (dir == EXT2_ROOT_INO) ? EXT2_ROOT_INO : parentOf[nextDir].load();
+      const __u32 dotDot = dotDotOf[nextDir];
+
+      if (expected != 0 && dotDot != 0 && dotDot != expected) {
+        char text[96];
+        snprintf(text, sizeof(text), "DIRECTORY INODE %u NAME '..' LINK TO INODE %u SHOULD BE %u",
+                 dir, dotDot, expected);
+        f = {dir, SIZE_MAX, text};
+        nextDir++;
+        return true;
+      }
+    }
+    return false;
+  };
+
+  const size_t SOURCES = workers.size() + 1;
+  vector<Finding> heads(SOURCES);
+  vector<bool> live(SOURCES);
+  for (size_t s = 0; s < workers.size(); s++) {
+    workers[s].findings.rewind();
+    live[s] = workers[s].findings.next(heads[s]);
+  }
+  live[SOURCES - 1] = nextDotDot(heads[SOURCES - 1]);
+
+  while (true) {
+    size_t best = SOURCES;
+    for (size_t s = 0; s < SOURCES; s++)
+      if (live[s] && (best == SOURCES || heads[s] < heads[best]))
+        best = s;
+    if (best == SOURCES)
+      break;
+
+    fprintf(out, "%s\n", heads[best].text.c_str());
+    findings++;
+    live[best] = (best == SOURCES - 1) ? nextDotDot(heads[best]) : workers[best].findings.next(heads[best]);
+  }
+
+  linkFindings.rewind();
+  for (Finding f; linkFindings.next(f); findings++)
+    fprintf(out, "%s\n", f.text.c_str());
+
+  // -------------------------------------------------- Reachability
+  // Follow the parent chain of each directory until it reaches the root, a
+  // directory with a known state, or loops back on itself; then follow it
+  // again to settle the state of every directory on the way. Unreachable
+  // subtree roots are flagged, and reported in inode order at the end.
+  enum : __u8 { UNKNOWN, VISITING, REACHABLE, UNREACHABLE, STATE = 0x7f, REPORTED = 0x80 };
+  MemoryGrant stateGrant(count, count);
+  vector<__u8> state(count, UNKNOWN);
+
+  for (size_t start = 0; start < count; start++) {
+    size_t i = start;
+    __u8 result = UNREACHABLE;
+
+    while (true) {
+      if ((state[i] & STATE) == REACHABLE || (state[i] & STATE) == UNREACHABLE) {
+        result = state[i] & STATE;
+        break;
+      }
+      if ((state[i] & STATE) == VISITING || directoryInodes[i] == EXT2_ROOT_INO) {
+        result = (directoryInodes[i] == EXT2_ROOT_INO) ? REACHABLE : UNREACHABLE;
+        if (result == UNREACHABLE)
+          state[i] |= REPORTED;
+        break;
+      }
+
+      state[i] = VISITING;
+
+      if (parentOf[i] == 0) {
+        // Nothing links to this directory; it roots an unreachable subtree
+        state[i] |= REPORTED;
+        break;
+      }
+      i = directoryIndex(parentOf[i]);
+    }
+
+    for (i = start; (state[i] & STATE) == VISITING || (state[i] & STATE) == UNKNOWN; i = directoryIndex(parentOf[i])) {
+      state[i] = (state[i] & REPORTED) | result;
+      if (parentOf[i] == 0 || directoryInodes[i] == EXT2_ROOT_INO)
+        break;
+    }
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (state[i] & REPORTED) {
+      fprintf(out, "UNREACHABLE DIRECTORY INODE %u\n", directoryInodes[i]);
+      findings++;
+    }
+  }
+  return findings;
+}
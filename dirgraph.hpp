@@ -0,0 +1,158 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ext2_fs.h"
+#include "memorybudget.hpp"
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Directory Graph
+//
+// Collects the (parent, child, name) edges of every directory in the image and
+// verifies them against the inode table:
+//
+//   - inode bitmap vs. allocated inodes
+//   - references to invalid or unallocated inodes
+//   - reference counts vs. i_links_count
+//   - '.' and '..' consistency
+//   - directories that cannot be reached from the root
+//
+// Edges are added concurrently by several workers. Each worker owns its own
+// reference count array, so no locking is needed while scanning; the arrays are
+// summed once the scan is over. To stay within a fixed memory budget, the count
+// arrays only ever cover a /window/ of the inode number space. Images with
+// more inodes than fit in the budget are scanned once per window.
+//
+// Everything else is charged to the MemoryBudget as well. What the checks
+// cannot do without (the two bitsets, and a few bytes per directory for its
+// parent and '..' target) is always granted. The rest degrades: directory
+// records are dropped once they no longer fit, and the caller re-reads the
+// inode instead; findings past their share are spilled to a temporary file.
+// Each worker must add the edges of its directories in (parent, offset)
+// order, so that its findings come out sorted and only need merging.
+//
+class DirGraph {
+ public:
+  struct Directory {
+    __u32 inode;
+    __u32 size;
+    __u32 block[EXT2_N_BLOCKS];
+
+    static Directory of(__u32 inodeNumber, const ext2_inode *inode);
+  };
+
+  DirGraph(__u32 inodesCount, __u32 firstInode, size_t memoryBudget, unsigned maxWorkers);
+  virtual ~DirGraph() = default;
+
+  /*Phase 0: called for every inode in the table, in order*/
+  void addInode(__u32 inodeNumber, const ext2_inode *inode, bool inBitmap);
+
+  /*Directories are numbered 0..count-1 in inode order. getDirectory()
+    returns false once the records have been dropped to save memory; the
+    caller then reads inode getDirectoryInode(i) itself*/
+  size_t getDirectoryCount() const { return directoryInodes.size(); }
+  __u32 getDirectoryInode(size_t i) const { return directoryInodes[i]; }
+  bool getDirectory(size_t i, Directory &dir) const;
+  unsigned getWorkerCount() const { return workers.size(); }
+  __u32 getWindowSize() const { return windowSize; }
+
+  /*Phase 1: clears the count arrays for inodes [first, first + windowSize)*/
+  void beginWindow(__u32 first);
+
+  /*Called by worker 'w' for every directory entry. Findings are only collected
+    during the first window, so that they are reported exactly once*/
+  virtual void addEdge(unsigned w, __u32 parent, __u32 child, const char *name,
+               size_t nameLen, size_t offset, bool collect);
+
+  /*Sums the per-worker count arrays*/
+  void endWindow();
+
+  /*Phase 2: called for every allocated inode inside the current window*/
+  void checkLinkCount(__u32 inodeNumber, const ext2_inode *inode);
+
+  /*Checks '..' entries and reachability, prints every finding and returns
+    the number of inconsistencies*/
+  size_t report(FILE *out);
+
+ private:
+  struct Finding {
+    __u32 inode;
+    size_t offset;
+    string text;
+    bool operator<(const Finding &f) const {
+      return inode < f.inode || (inode == f.inode && offset < f.offset);
+    }
+  };
+
+  // Findings in the order they were added: in memory while their grants
+  // allow, then appended to a temporary file
+  class FindingLog {
+   public:
+    FindingLog() {}
+    FindingLog(const FindingLog&) = delete;
+    FindingLog &operator=(const FindingLog&) = delete;
+    ~FindingLog();
+
+    void add(__u32 inode, size_t offset, const string &text);
+    size_t size() const { return count; }
+
+    /*Reads the findings back from the first one. Only once all are added*/
+    void rewind();
+    bool next(Finding &f);
+
+   private:
+    vector<Finding> memory;
+    vector<MemoryGrant> grants;
+    size_t charged = 0;
+    size_t granted = 0;
+    FILE *spill = nullptr;
+    size_t count = 0;
+    size_t cursor = 0;
+  };
+
+  struct Worker {
+    vector<__u16> counts;
+    FindingLog findings;
+  };
+
+  __u32 inodesCount;
+  __u32 firstInode;
+  __u32 windowFirst = 1;
+  __u32 windowSize;
+
+  MemoryGrant bitsetGrant;
+  vector<uint64_t> allocated;   // bit n-1 set if inode n is in use
+  vector<uint64_t> isDirectory; // bit n-1 set if inode n is a directory
+
+  vector<MemoryGrant> directoryGrants;
+  size_t directoryGranted = 0;
+  vector<__u32> directoryInodes;
+  vector<MemoryGrant> recordGrants;
+  size_t recordGranted = 0;
+  vector<Directory> records;    // same order as directoryInodes, while kept
+  bool keepRecords = true;
+
+  // Indexed like directoryInodes, filled by addEdge() during the first window.
+  // A directory's own entries are scanned by a single worker, so only the
+  // parent (the smallest directory linking to it) needs an atomic update.
+  MemoryGrant linkGrant;
+  std::unique_ptr<std::atomic<__u32>[]> parentOf;
+  std::unique_ptr<__u32[]> dotDotOf;
+
+  vector<Worker> workers;
+
+  FindingLog bitmapFindings;
+  FindingLog linkFindings;
+
+  static bool test(const vector<uint64_t> &set, __u32 inodeNumber);
+  static void set(vector<uint64_t> &set, __u32 inodeNumber);
+  bool isChecked(__u32 inodeNumber) const;
+  size_t directoryIndex(__u32 inodeNumber) const;
+};
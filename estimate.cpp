@@ -0,0 +1,178 @@
+#include "estimate.hpp"
+#include "csvvisitor.hpp"
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+
+const __u32 Estimate::STRATA;
+const __u32 Estimate::CHUNK_BLOCKS;
+constexpr double Estimate::Z;
+
+namespace {
+
+// The quantity and bucket of every Metric, in order
+const struct { const char *quantity; const char *bucket; } LABELS[Estimate::METRICS] = {
+  {"free_run_blocks", "1"}, {"free_run_blocks", "2-7"}, {"free_run_blocks", "8-63"},
+  {"free_run_blocks", "64-511"}, {"free_run_blocks", "512-4095"}, {"free_run_blocks", "4096+"},
+  {"files", "f"}, {"files", "d"}, {"files", "s"}, {"files", "?"},
+  {"size", "0"}, {"size", "1-4K"}, {"size", "4K-64K"}, {"size", "64K-1M"},
+  {"size", "1M-16M"}, {"size", "16M-256M"}, {"size", "256M-4G"}, {"size", "4G+"},
+  {"bytes", "all"},
+  {"extents", "1"}, {"extents", "2"}, {"extents", "3-4"}, {"extents", "5-8"},
+  {"extents", "9-16"}, {"extents", "17-32"}, {"extents", "33+"},
+  {"extents", "all"},
+};
+
+/*Sample variance of 'n' values, from their sum and sum of squares*/
+double sampleVariance(double sum, double squares, __u32 n) {
+  return (n < 2) ? 0 : std::max(0.0, (squares - sum * sum / n) / (n - 1));
+}
+
+}
+
+Estimate::Estimate(FILE *out, double fraction, uint64_t seed)
+    : out(out), groupRate(cbrt(fraction)), chunkRate(fraction / groupRate), seed(seed), random(seed) {}
+
+vector<__u32> Estimate::pickGroups(__u32 count) {
+  return pick(count, groupRate);
+}
+
+vector<__u32> Estimate::pickChunks(__u32 count) {
+  return pick(count, chunkRate);
+}
+
+/*PRIVATE*/
+vector<__u32> Estimate::pick(__u32 count, double rate) {
+  const __u32 wanted = std::min(count, std::max<__u32>(2, (__u32)ceil(rate * count)));
+  vector<__u32> all(count), picked;
+  for (__u32 i = 0; i < count; i++)
+    all[i] = i;
+  picked.reserve(wanted);
+  std::sample(all.begin(), all.end(), std::back_inserter(picked), wanted, random);
+  return picked;
+}
+
+void Estimate::beginStratum(__u32 groupsInStratum, __u32 sampledGroups) {
+  stratumGroups = groupsInStratum;
+  stratumSampled = sampledGroups;
+  groups.clear();
+  std::fill(withinVariance, withinVariance + METRICS, 0.0);
+
+  groupCount += groupsInStratum;
+  groupsSampled += sampledGroups;
+}
+
+void Estimate::beginGroup(__u32 chunksInGroup, __u32 sampledChunks) {
+  groupChunks = chunksInGroup;
+  groupSampled = sampledChunks;
+  chunks.clear();
+  std::fill(groupFixed, groupFixed + METRICS, 0.0);
+
+  chunkCount += chunksInGroup;
+  chunksSampled += sampledChunks;
+}
+
+void Estimate::addFreeRun(__u32 blocks) {
+  // 1, 2-7, 8-63, ... blocks
+  size_t bucket = (blocks > 1) ? 1 : 0;
+  for (__u32 r = blocks >> 3; r > 0 && bucket < 5; r >>= 3)
+    bucket++;
+  groupFixed[FREE_RUN + bucket] += blocks;
+}
+
+void Estimate::beginChunk() {
+  std::fill(chunk, chunk + METRICS, 0.0);
+}
+
+void Estimate::addFile(const ext2_inode &inode) {
+  static const char TYPES[] = "fds?";
+  chunk[FILE_TYPE + (strchr(TYPES, CsvVisitor::fileType(inode)) - TYPES)]++;
+  file = {};
+
+  if (!S_ISREG(inode.i_mode))
+    return;
+
+  // 0, then 1-4K, 4K-64K, ... bytes
+  const uint64_t size = CsvVisitor::fileSize(inode);
+  size_t bucket = (size > 0) ? 1 : 0;
+  for (uint64_t s = (size - 1) >> 12; size > 0 && s > 0 && bucket < 7; s >>= 4)
+    bucket++;
+  chunk[FILE_SIZE + bucket]++;
+  chunk[BYTES] += size;
+}
+
+void Estimate::endFile() {
+  if (file.blocks == 0)
+    return;
+
+  // 1, 2, 3-4, 5-8, ... extents, as in FRAG lines
+  size_t bucket = 0;
+  for (__u32 e = file.extents - 1; e > 0 && bucket < 6; e >>= 1)
+    bucket++;
+  chunk[EXTENTS + bucket]++;
+  chunk[EXTENT_TOTAL] += file.extents;
+}
+
+void Estimate::endChunk() {
+  chunks.add(chunk);
+}
+
+void Estimate::endGroup() {
+  double groupTotal[METRICS];
+  const double fpc = 1.0 - (double)groupSampled / groupChunks;
+
+  for (unsigned m = 0; m < METRICS; m++) {
+    const double mean = groupSampled ? chunks.sum[m] / groupSampled : 0;
+    groupTotal[m] = groupFixed[m] + groupChunks * mean;
+    if (groupSampled > 0)
+      withinVariance[m] += (double)groupChunks * groupChunks * fpc *
+                           sampleVariance(chunks.sum[m], chunks.squares[m], groupSampled) / groupSampled;
+  }
+  groups.add(groupTotal);
+}
+
+void Estimate::endStratum() {
+  if (stratumSampled == 0)
+    return;
+
+  const double scale = (double)stratumGroups / stratumSampled;
+  const double fpc = 1.0 - (double)stratumSampled / stratumGroups;
+
+  for (unsigned m = 0; m < METRICS; m++) {
+    total[m] += scale * groups.sum[m];
+    variance[m] += (double)stratumGroups * stratumGroups * fpc *
+                   sampleVariance(groups.sum[m], groups.squares[m], stratumSampled) / stratumSampled +
+                   scale * withinVariance[m];
+  }
+}
+
+void Estimate::report(uint64_t freeBlocks, uint64_t freeInodes) const {
+  fprintf(out, "SAMPLE,%llu,%llu,%llu,%llu,%llu\n",
+          (unsigned long long)groupCount, (unsigned long long)groupsSampled,
+          (unsigned long long)chunkCount, (unsigned long long)chunksSampled,
+          (unsigned long long)seed);
+  fprintf(out, "ESTIMATE,free_blocks,all,%llu,%llu,%llu\n", (unsigned long long)freeBlocks,
+          (unsigned long long)freeBlocks, (unsigned long long)freeBlocks);
+  fprintf(out, "ESTIMATE,free_inodes,all,%llu,%llu,%llu\n", (unsigned long long)freeInodes,
+          (unsigned long long)freeInodes, (unsigned long long)freeInodes);
+
+  for (unsigned m = 0; m < METRICS; m++) {
+    const double margin = Z * sqrt(variance[m]);
+    fprintf(out, "ESTIMATE,%s,%s,%.0f,%.0f,%.0f\n", LABELS[m].quantity, LABELS[m].bucket,
+            total[m], std::max(0.0, total[m] - margin), total[m] + margin);
+  }
+}
+
+// -------------------------------------------------- Sums
+void Estimate::Sums::clear() {
+  std::fill(sum, sum + METRICS, 0.0);
+  std::fill(squares, squares + METRICS, 0.0);
+}
+
+void Estimate::Sums::add(const double *values) {
+  for (unsigned m = 0; m < METRICS; m++) {
+    sum[m] += values[m];
+    squares[m] += values[m] * values[m];
+  }
+}
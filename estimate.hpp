@@ -0,0 +1,128 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::vector;
+
+// -------------------------------------------------- Estimate
+//
+// Approximate distributions of free space, file types, file sizes and
+// fragmentation, from a random sample of the image instead of a full scan
+// (lab3a --estimate). Fed by EXT2::printEstimate(), which does the reading.
+//
+// The sample is stratified and drawn in two stages. The groups are split into
+// at most STRATA bands of consecutive groups, so that every part of the disk is
+// represented. In each band a random sample of groups is drawn, and in each
+// sampled group a random sample of the inode table's chunks (CHUNK_BLOCKS
+// blocks each). The block bitmap of every sampled group is read whole. Groups
+// are sampled at the cube root of the requested fraction and chunks at the
+// rest of it (0.01 = 21.5% of the groups, and 4.6% of their chunks): files are
+// placed by group, so groups differ more than chunks of one group do, and a
+// group costs only its two bitmaps more. Each stage draws at least two units
+// wherever there are two, so that every variance can be estimated.
+//
+// A band's total is estimated as (M / m) * sum of the sampled groups' totals,
+// where a group's total is its bitmap count, or N * the mean of its sampled
+// chunks (M groups of which m are sampled, N chunks in the group). The
+// variance adds the spread between groups and, within each group, between
+// chunks, each with its finite population correction (the usual two-stage
+// estimator). Bands are independent, so their totals and variances add up.
+// Intervals are 95% normal ones, clamped at 0; a stage that reads everything
+// contributes no variance, so a fraction of 1 gives the exact counts.
+//
+// Output lines:
+//   SAMPLE,groups,sampled groups,table chunks,sampled chunks,seed
+//   ESTIMATE,quantity,bucket,estimate,low,high
+// Free blocks and inodes come from the group descriptors, and are exact.
+//
+class Estimate {
+ public:
+  static const __u32 STRATA = 16;
+  static const __u32 CHUNK_BLOCKS = 8;
+  static constexpr double Z = 1.96; // 95%
+
+  // One counter per quantity and bucket
+  enum Metric : unsigned {
+    FREE_RUN = 0,              // free blocks in runs of 1, 2-7, 8-63, 64-511, 512-4095, more
+    FILE_TYPE = FREE_RUN + 6,  // files of type f, d, s, ?
+    FILE_SIZE = FILE_TYPE + 4, // regular files of 0, 1-4K, 4K-64K, ..., 256M-4G, more bytes
+    BYTES = FILE_SIZE + 8,     // bytes in regular files
+    EXTENTS = BYTES + 1,       // files with 1, 2, 3-4, 5-8, 9-16, 17-32, more extents
+    EXTENT_TOTAL = EXTENTS + 7,
+    METRICS = EXTENT_TOTAL + 1
+  };
+
+  /*'fraction' (0 to 1) is the share of the inode tables to read*/
+  Estimate(FILE *out, double fraction, uint64_t seed);
+
+  /*A random sample of a stratum's 'count' groups, or of a group's 'count'
+    table chunks: indices 0 to count - 1, in increasing order*/
+  vector<__u32> pickGroups(__u32 count);
+  vector<__u32> pickChunks(__u32 count);
+
+  // Called in this order: a stratum's sampled groups, and each group's
+  // sampled chunks
+  void beginStratum(__u32 groups, __u32 sampledGroups);
+  void beginGroup(__u32 chunks, __u32 sampledChunks);
+  void addFreeRun(__u32 blocks); // from the group's block bitmap
+  void beginChunk();
+  void addFile(const ext2_inode &);
+  void endChunk();
+  void endGroup();
+  void endStratum();
+
+  /*The layout of the last file added, block by block in file order (as
+    FragStats is shown it)*/
+  void addBlock(__u32 block) {
+    if (file.blocks++ == 0)
+      file.extents = 1;
+    else if (block != file.last + 1)
+      file.extents++;
+    file.last = block;
+  }
+  void endFile();
+
+  /*Writes the SAMPLE line and every ESTIMATE line*/
+  void report(uint64_t freeBlocks, uint64_t freeInodes) const;
+
+ private:
+  struct Sums {
+    double sum[METRICS];
+    double squares[METRICS];
+    void clear();
+    void add(const double *values);
+  };
+
+  FILE *out;
+  const double groupRate; // of each stage
+  const double chunkRate;
+  const uint64_t seed;
+  std::mt19937_64 random;
+
+  struct { __u32 blocks; __u32 extents; __u32 last; } file = {};
+
+  double chunk[METRICS];      // the chunk being read
+  double groupFixed[METRICS]; // the group's bitmap counts
+  Sums chunks;                // of the group's sampled chunks
+  __u32 groupChunks = 0;
+  __u32 groupSampled = 0;
+
+  Sums groups;                // of the stratum's sampled groups' totals
+  double withinVariance[METRICS];
+  __u32 stratumGroups = 0;
+  __u32 stratumSampled = 0;
+
+  double total[METRICS] = {};
+  double variance[METRICS] = {};
+
+  uint64_t groupCount = 0;
+  uint64_t groupsSampled = 0;
+  uint64_t chunkCount = 0;
+  uint64_t chunksSampled = 0;
+
+  vector<__u32> pick(__u32 count, double rate);
+};
@@ -1,40 +1,67 @@
 #include "ext2.hpp"
 #include "bufferedimagereader.hpp"
+#include "crc32c.hpp"
+#include "threadpool.hpp"
+#include "trace.hpp"
+#include <endian.h>
 #include <iomanip>
+#include <exception>
+#include <fcntl.h>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <unistd.h>
+#include <thread>
+#include <type_traits>
 
 EXT2::EXT2(char *filename) {
+  TRACE_SCOPE("EXT2", "init");
+
   // -------------------------------------------------- Initial Meta Check
   try { meta = std::make_unique<MetaFile>(); }
   catch (...) { throw runtime_error("FileSystemAllocationError"); }
 
   meta->filename = string(filename);
 
-  if (stat(meta->filename.c_str(), &meta->stat) != 0)
-    throw runtime_error("FileSystemStatError");
+  {
+    TRACE_SCOPE("stat", "init");
+    if (stat(meta->filename.c_str(), &meta->stat) != 0)
+      throw runtime_error("FileSystemStatError");
+  }
 
   // -------------------------------------------------- Init Reader and Super Block
-  // slightly hacky way to use smart pointers with polymorphism (improvements welcomed)
-  unique_ptr<ImageReader> base(new BufferedImageReader(meta.get()));
-  imReader = std::move(base);
-  if(imReader == nullptr)
-    throw EXT2_error("MemoryAllocationErrorDuringInitialFileSystemRead");
-
-
-  try { parseSuperBlock(); }
-  catch (EXT2_error &e) { throw e; }
-  catch (...) { throw EXT2_error("SuperBlockParseError"); }
+  {
+    TRACE_SCOPE("superblock", "init");
+
+    // slightly hacky way to use smart pointers with polymorphism (improvements welcomed)
+    unique_ptr<ImageReader> base(new BufferedImageReader(meta.get()));
+    imReader = std::move(base);
+    if(imReader == nullptr)
+      throw EXT2_error("MemoryAllocationErrorDuringInitialFileSystemRead");
+
+
+    // -------------------------------------------------- Super Block Validation
+    // A primary that is unreadable, or that every sampled backup disagrees
+    // with, is replaced by a backup copy
+    try {
+      loadSuperBlock();
+      checkPrimarySuperBlock();
+    } catch (EXT2_error &e) {
+      if (!recoverSuperBlock())
+        throw;
+    }
 
-  imReader->init();
+    selectKernels();
 
-  // -------------------------------------------------- Super Block Validation
-  try { validateSuperBlock(); }
-  catch (runtime_error &e) { throw e; }
-  catch (...) { throw runtime_error("SuperBlockValiationError"); }
+    imReader->init();
+  }
 
   // -------------------------------------------------- Populate Group Descriptor Table
+  TRACE_SCOPE("gdt", "init");
   try { getGroupDescTbl(); }
   catch (EXT2_error &e) { throw e; }
   catch (...) { throw EXT2_error("GroupDescriptorReadError"); }
+  shardEndGroup = groupDescTbl->size();
 }
 
 
@@ -42,43 +69,25 @@ EXT2::~EXT2() {}
 
 
 bool EXT2::getGroupDescTbl() {
-  // Descriptor Table is located at block 1 if block size is 1KiB, otherwise block 2
-  const __u32 DESC_TABLE_LEN = meta->blockGroupsCount;
-  char *buf;
-
-  try {
-    shared_ptr<char[]> bufPtr = this->imReader->getGroupDescriptor();
-    buf = bufPtr.get();
-  } catch (...) {
-    throw EXT2_error("MalformeOrErroneousDescriptorTable");
-  }
+  // Only the location is needed here: descriptor blocks are read on first use
+  if (meta->blockGroupsCount == 0)
+    throw EXT2_error("MalformedDescriptorTable");
 
-
-  // buf now contains the entire block group descriptor table
-  // create group descriptor entires and append to the vector groupDescTbl
   try {
-    groupDescTbl = make_unique<vector<ext2_group_desc>>();
-    groupDescTbl->reserve(DESC_TABLE_LEN);
+    groupDescTbl = make_unique<GroupDescTable>(*imReader, imReader->getDescriptorTableBlock(),
+                                               meta->blockSize, meta->blockGroupsCount);
   }
   catch (...) { throw EXT2_error(IMPOSSIBLE_MALLOC); }
 
-  for (__u32 i = 0; i < DESC_TABLE_LEN; i++) {
-    unique_ptr<ext2_group_desc> tmp = make_unique<ext2_group_desc>();
-    if(memcpy(tmp.get(), &buf[i], sizeof(ext2_group_desc)) == nullptr)
-      return false;
-    groupDescTbl->push_back(std::move(*tmp));
-  }
-
   if (debug) {
-    int i = 0;
-    for(auto groupDesc : *groupDescTbl) {
-      printf("-------------------------------------------------- Group Descriptor %d:\n", i++);
-      printDescTable(groupDesc);
+    for (__u32 i = 0; i < groupDescTbl->size(); i++) {
+      printf("-------------------------------------------------- Group Descriptor %d:\n", i);
+      printDescTable((*groupDescTbl)[i]);
       printf("\n");
     }
   }
 
-  // These can ONLY be done once the vector is initialized
+  // These can ONLY be done once the table is initialized
   setBlocksInLastGroup();
   setInodesInLastGroup();
 
@@ -111,10 +120,10 @@ void EXT2::getMetaFileInfo(ext2_super_block *sb) {
     printf("Block size: %d...\n", KiB << sb->s_log_block_size);
   }
 
-  __u32 blockSize1 = meta->stat.st_size / sb->s_blocks_count;
+  uint64_t blockSize1 = meta->stat.st_size / sb->s_blocks_count;
   __u32 blockSize2 = KiB << sb->s_log_block_size;
   if (debug)
-    printf("Blocksize Calculations: [1:%d] [2:%d]...\n", blockSize1, blockSize2);
+    printf("Blocksize Calculations: [1:%llu] [2:%u]...\n", (unsigned long long)blockSize1, blockSize2);
   if (blockSize1 != blockSize2)
     throw EXT2_error("FileSystemMalformedBlockSizeError");
 
@@ -123,20 +132,16 @@ void EXT2::getMetaFileInfo(ext2_super_block *sb) {
   meta->blockSize = blockSize2;   // what size is each block?
   meta->inodesPerGroup = sb->s_inodes_per_group; // How many inodes per group?
   meta->blocksPerGroup = sb->s_blocks_per_group; // how many blocks per group?
-  meta->blockGroupSize = meta->blockSize * meta->blocksPerGroup; // what size is each block group?
-
-  // how many block groups are there? Note: the spec for project3a explicitly
-  // states that there will only be a single block group, so we can make some
-  // assumptions about valid input
-  const __u32 bgc = meta->blockCount / meta->blocksPerGroup;
-  meta->blockGroupsCount = (meta->blockCount < meta->blocksPerGroup) ? 1 : bgc;
+  meta->blockGroupSize = (unsigned long long)meta->blockSize * meta->blocksPerGroup; // what size is each block group?
+
+  // how many block groups are there? The last group may be partial, and
+  // groups are counted from the first data block (block 1 for 1KiB blocks).
+  if (meta->blocksPerGroup == 0 || sb->s_first_data_block >= meta->blockCount)
+    throw EXT2_error("FileSystemMalformedGroupLayoutError");
+  meta->blockGroupsCount =
+      (meta->blockCount - sb->s_first_data_block + meta->blocksPerGroup - 1) / meta->blocksPerGroup;
   if (debug)
     printf("Number of Block Groups: %d...\n", meta->blockGroupsCount);
-  if (meta->blockGroupsCount != 1)
-    throw EXT2_error(
-        "CS111ProjectSpecificationError -- Hi, TA... you promised there would "
-        "only be one group max! Why have you done this to us? Surely you will "
-        "not mark us down for this... considering it was in the specification :)");
 
 
   // --------------------------------------------------
@@ -202,514 +207,1787 @@ bool EXT2::parseSuperBlock() {
 }
 
 
+// -------------------------------------------------- CSV Reports
+// Each report is the CsvVisitor applied to the matching scan.
 void EXT2::printSuperBlock() {
-  ext2_super_block *superBlock = this->imReader->getSuperBlock();
+  CsvVisitor csv(out);
+  scanSuperBlock(csv);
+}
+
+void EXT2::printGroupSummary() {
+  CsvVisitor csv(out);
+  scanGroups(csv);
+}
+
+void EXT2::printFreeBlockEntries() {
+  CsvVisitor csv(out);
+  scanFreeBlocks(csv);
+}
+
+void EXT2::printFreeInodeEntries() {
+  CsvVisitor csv(out);
+  scanFreeInodes(csv);
+}
+
+void EXT2::printInodeSummary(unsigned sections) {
+  CsvVisitor csv(out);
+  if ((sections & SECTION_DIRENT) && (sections & SECTION_DIRENT_PATH))
+    csv.setPaths(&indexPaths());
+  if (!(sections & SECTION_FRAG)) {
+    scanInodes(csv, sections);
+    return;
+  }
+
+  FragStats frag(out, imReader->getSuperBlock()->s_first_data_block, meta->blocksPerGroup,
+                 groupDescTbl->size());
+  scanInodes(csv, sections, &frag);
+  frag.report();
+}
+
+void EXT2::printFileHashes() {
+  CsvVisitor csv(out);
+  scanFileHashes(csv);
+}
+
+void EXT2::printPaths() {
+  CsvVisitor csv(out);
+  scanPaths(csv);
+}
+
+void EXT2::printReport(unsigned sections) {
+  if (sections & SECTION_SUPER)
+    printSuperBlock();
+  if (sections & SECTION_GROUPS)
+    printGroupSummary();
+  if (sections & SECTION_BFREE)
+    printFreeBlockEntries();
+  if (sections & SECTION_IFREE)
+    printFreeInodeEntries();
+  if (sections & (SECTION_INODE_WALK | SECTION_FRAG | SECTION_XATTR))
+    printInodeSummary(sections & (SECTION_INODE_WALK | SECTION_FRAG | SECTION_DIRENT_PATH | SECTION_XATTR));
+  if (sections & SECTION_PATH)
+    printPaths();
+  if (sections & SECTION_HASH)
+    printFileHashes();
+}
 
-  printf("SUPERBLOCK,%d,%d,%d,%d,%d,%d,%d\n",
-         superBlock->s_blocks_count,
-         superBlock->s_inodes_count,
-         meta->blockSize,
-         meta->inodeSize,
-         superBlock->s_blocks_per_group,
-         superBlock->s_inodes_per_group,
-         superBlock->s_first_ino
-         );
+
+// -------------------------------------------------- Scans
+void EXT2::scanSuperBlock(ScanVisitor &visitor) {
+  TRACE_SCOPE("super", "section");
+  ext2_super_block &superBlock = *this->imReader->getSuperBlock();
+
+  visitor.onSuperBlock(superBlock, *meta);
 
 
   // // TODO: Remove everything below
   // if (debug) {
-  //   cout << "inodes count: " << superBlock->s_inodes_count << endl;
-  //   cout << "blocks count: " << superBlock->s_blocks_count << endl;
-  //   cout << "reserved blocks count: " << superBlock->s_r_blocks_count << endl;
-  //   cout << "free blocks count: " << superBlock->s_free_blocks_count << endl;
-  //   cout << "free inodes count: " << superBlock->s_free_inodes_count << endl;
-  //   cout << "first data block: " << superBlock->s_first_data_block << endl;
-  //   cout << "log block size: " << superBlock->s_log_block_size << endl;
-  //   cout << "log frag size: " << superBlock->s_log_frag_size << endl;
-  //   cout << "blocks per group: " << superBlock->s_blocks_per_group << endl;
-  //   cout << "frags per group: " << superBlock->s_frags_per_group << endl;
-  //   cout << "inodes per group: " << superBlock->s_inodes_per_group << endl;
-  //   cout << "mount time: " << superBlock->s_mtime << endl;
-  //   cout << "write time: " << superBlock->s_wtime << endl;
-  //   cout << "mount count: " << superBlock->s_mnt_count << endl;
-  //   cout << "max mount count: " << superBlock->s_max_mnt_count << endl;
-  //   cout << "magic signature: " << superBlock->s_magic << endl;
-  //   cout << "file system state: " << superBlock->s_state << endl;
-  //   cout << "errors: " << superBlock->s_errors << endl;
-  //   cout << "minor revision level: " << superBlock->s_minor_rev_level << endl;
-  //   cout << "time of last check: " << superBlock->s_lastcheck << endl;
-  //   cout << "max time between checks: " << superBlock->s_checkinterval << endl;
-  //   cout << "creator OS: " << superBlock->s_creator_os << endl;
-  //   cout << "revision level: " << superBlock->s_rev_level << endl;
-  //   cout << "default uid for reserved blocks: " << superBlock->s_def_resuid
+  //   cout << "inodes count: " << superBlock.s_inodes_count << endl;
+  //   cout << "blocks count: " << superBlock.s_blocks_count << endl;
+  //   cout << "reserved blocks count: " << superBlock.s_r_blocks_count << endl;
+  //   cout << "free blocks count: " << superBlock.s_free_blocks_count << endl;
+  //   cout << "free inodes count: " << superBlock.s_free_inodes_count << endl;
+  //   cout << "first data block: " << superBlock.s_first_data_block << endl;
+  //   cout << "log block size: " << superBlock.s_log_block_size << endl;
+  //   cout << "log frag size: " << superBlock.s_log_frag_size << endl;
+  //   cout << "blocks per group: " << superBlock.s_blocks_per_group << endl;
+  //   cout << "frags per group: " << superBlock.s_frags_per_group << endl;
+  //   cout << "inodes per group: " << superBlock.s_inodes_per_group << endl;
+  //   cout << "mount time: " << superBlock.s_mtime << endl;
+  //   cout << "write time: " << superBlock.s_wtime << endl;
+  //   cout << "mount count: " << superBlock.s_mnt_count << endl;
+  //   cout << "max mount count: " << superBlock.s_max_mnt_count << endl;
+  //   cout << "magic signature: " << superBlock.s_magic << endl;
+  //   cout << "file system state: " << superBlock.s_state << endl;
+  //   cout << "errors: " << superBlock.s_errors << endl;
+  //   cout << "minor revision level: " << superBlock.s_minor_rev_level << endl;
+  //   cout << "time of last check: " << superBlock.s_lastcheck << endl;
+  //   cout << "max time between checks: " << superBlock.s_checkinterval << endl;
+  //   cout << "creator OS: " << superBlock.s_creator_os << endl;
+  //   cout << "revision level: " << superBlock.s_rev_level << endl;
+  //   cout << "default uid for reserved blocks: " << superBlock.s_def_resuid
   //        << endl;
-  //   cout << "default gid for reserved blocks: " << superBlock->s_def_resgid
+  //   cout << "default gid for reserved blocks: " << superBlock.s_def_resgid
   //        << endl;
-  //   cout << "first non-reserved inode: " << superBlock->s_first_ino << endl;
-  //   cout << "size of inode structure: " << superBlock->s_inode_size << endl;
-  //   cout << "compatible feature set: " << superBlock->s_feature_compat << endl;
-  //   cout << "incompatible feature set: " << superBlock->s_feature_incompat
+  //   cout << "first non-reserved inode: " << superBlock.s_first_ino << endl;
+  //   cout << "size of inode structure: " << superBlock.s_inode_size << endl;
+  //   cout << "compatible feature set: " << superBlock.s_feature_compat << endl;
+  //   cout << "incompatible feature set: " << superBlock.s_feature_incompat
   //        << endl;
   //   cout << "readonly-compatible feature set: "
-  //        << superBlock->s_feature_ro_compat << endl;
-  //   cout << "Reserved padding (size: " << sizeof(superBlock->s_reserved)
-  //        << "): " << superBlock->s_reserved << endl;
+  //        << superBlock.s_feature_ro_compat << endl;
+  //   cout << "Reserved padding (size: " << sizeof(superBlock.s_reserved)
+  //        << "): " << superBlock.s_reserved << endl;
   // }
 }
 
 
-void EXT2::printGroupSummary() {
+void EXT2::scanGroups(ScanVisitor &visitor) {
+  TRACE_SCOPE("groups", "section");
   if (groupDescTbl->size() <= 0)
     throw EXT2_error("EmptyGroupDescriptorTable");
 
   const __u32 GROUP_COUNT = groupDescTbl->size();
-  __u32 GS2 = 0; // group number
-  __u32 GS3 = 0; // blocks in group
-  __u32 GS4 = meta->inodesPerGroup; // inodes per group
-  __u16 GS5 = 0; // free blocks count
-  __u16 GS6 = 0; // free inodes count
-  __u32 GS7 = 0; // block bitmap
-  __u32 GS8 = 0; // inode bitmap
-  __u32 GS9 = 0; // inode table
 
-  for (auto groupDesc : *groupDescTbl) {
-    GS3 = (GS2 == GROUP_COUNT-1) ? meta->blocksInLastGroup : meta->blocksPerGroup;
-    GS5 = groupDesc.bg_free_blocks_count;
-    GS6 = groupDesc.bg_free_inodes_count;
-    GS7 = groupDesc.bg_block_bitmap;
-    GS8 = groupDesc.bg_inode_bitmap;
-    GS9 = groupDesc.bg_inode_table;
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+    const __u32 blocksInGroup =
+        (group == GROUP_COUNT - 1) ? meta->blocksInLastGroup : meta->blocksPerGroup;
+    visitor.onGroup(group, (*groupDescTbl)[group], blocksInGroup, meta->inodesPerGroup);
+  }
+}
+
+void EXT2::scanBitmapRanges(const char *bitmap, __u32 bits, __u32 blockSize, __u32 firstNumber,
+                            std::function<void(__u32, __u32)> onRange) {
+  // A bitmap never spans more than its block
+  bits = std::min(bits, blockSize * MASK_SIZE);
+
+  // The bitmap is read 64 bits at a time. ext2 numbers bits from the least
+  // significant bit of each byte, which is the order of a little-endian word.
+  // Block sizes are multiples of 8 bytes, so the last word is within the block
+  auto nextBit = [&](__u32 from, bool value) -> __u32 {
+    while (from < bits) {
+      uint64_t word;
+      memcpy(&word, bitmap + from / 64 * 8, sizeof(word));
+      word = le64toh(word);
+      if (!value)
+        word = ~word;
+      word &= ~(uint64_t)0 << (from % 64);
+      if (word)
+        return std::min(bits, from / 64 * 64 + __builtin_ctzll(word));
+      from = from / 64 * 64 + 64;
+    }
+    return bits;
+  };
 
-    printf("GROUP,%d,%d,%d,%d,%d,%d,%d,%d\n", GS2++, GS3, GS4, GS5, GS6, GS7,
-           GS8, GS9);
+  for (__u32 runStart = nextBit(0, false); runStart < bits;) {
+    const __u32 runEnd = nextBit(runStart, true);
+    onRange(firstNumber + runStart, runEnd - runStart);
+    runStart = nextBit(runEnd, false);
   }
 }
 
-void EXT2::printFreeBlockEntries(){
+void EXT2::scanFreeBlocks(ScanVisitor &visitor) {
+  TRACE_SCOPE("bfree", "section");
   if (groupDescTbl->size() <= 0)
     throw EXT2_error("EmptyGroupDescriptorTable");
 
   const __u32 GROUP_COUNT = groupDescTbl->size();
-  __u32 bitmapSize = meta->blocksPerGroup;
-  __u32 iters = bitmapSize / MASK_SIZE;
-  __u32 bitmapAddr = 0;
-  __u32 index = 0;
-  const __u8 residuals = bitmapSize % MASK_SIZE;
-
-  // if (for some reason) the bitmap size is not a multiple of 8, then the final
-  // byte will contain at least one bit which does not correspond to an actual
-  // block entry. In this case, the value stored in 'iters' will have been
-  // truncated. To compensate for this, we check for residuals (anything left
-  // after the calculation of 'iters'). If so, that means we will need an
-  // additional iteration to deal with those extra bits.
-  iters = residuals ? iters + 1 : iters;
-
-  // Block 1 corresponds to bit 0 of byte 0
-  for(auto groupDesc : *groupDescTbl) {
-    bitmapAddr = groupDesc.bg_block_bitmap;
 
-    shared_ptr<char[]> bufPtr = imReader->getBlock(bitmapAddr);
-    char *buf = bufPtr.get();
+  // The first data block (block 1 for 1KiB blocks, else 0) corresponds to
+  // bit 0 of byte 0
+  const __u32 firstDataBlock = imReader->getSuperBlock()->s_first_data_block;
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+    TRACE_SCOPE("bfree.group", "group", group);
+    const __u32 bitmapAddr = (*groupDescTbl)[group].bg_block_bitmap;
+    const __u32 groupStart = firstDataBlock + group * meta->blocksPerGroup;
+    // Only the blocks below s_blocks_count have a bit
+    const __u32 bitmapSize =
+        (group == GROUP_COUNT - 1) ? meta->blockCount - groupStart : meta->blocksPerGroup;
 
-    if(index++ == GROUP_COUNT - 1)
-      bitmapSize = meta->blocksInLastGroup;
+    shared_ptr<char[]> bufPtr = imReader->getBlock(bitmapAddr);
 
     if (debug) {
-      printf("-------------------------------------------------- printFreeBlockEntries()\n");
+      printf("-------------------------------------------------- scanFreeBlocks()\n");
       printf("Group Count: %d...\n", GROUP_COUNT);
       printf("Bitmap Size: %d bits...\n", bitmapSize);
       printf("Bitmap Block Address: %d...\n", bitmapAddr);
-      printf("Number of Iterations (8 bits per): %d...\n", bitmapSize/MASK_SIZE);
-      printf("-------------------------------------------------- /printFreeBlockEntries()\n");
+      printf("-------------------------------------------------- /scanFreeBlocks()\n");
     }
 
-    // perform bitmask then switch on the results (to print or not to print BFREE)
-    __u8 bitMask = 0x00;
-    for (__u32 maskIt = 0x00000000; maskIt < iters; maskIt += 0x00000001) {
-      bitMask = buf[maskIt] & MASK;
-      __u8 bit = 1;
-
-      if(maskIt == iters - 1 && residuals) {
-        // if the most significant byte contains padding
-        for (__u32 k = 0; k < residuals; k++, bit <<= 1)
-          if (!(bitMask & bit))
-            printf("BFREE,%d\n", (maskIt * 8) + k + 1);
-
-      } else {
-        for (__u32 k = 0; k < MASK_SIZE; k++, bit <<= 1)
-          if (!(bitMask & bit))
-            printf("BFREE,%d\n", (maskIt * 8) + k + 1);
-      } // END if(maskIt == iters...) else...
-
-    } // END for(__u32 maskIt = 0x....)
-  } // END for(auto groupDesc...)
+    scanBitmapRanges(bufPtr.get(), bitmapSize, meta->blockSize, groupStart,
+                     [&](__u32 first, __u32 count) { visitor.onFreeBlockRange(first, count); });
+  }
 }
 
-
-void EXT2::printFreeInodeEntries(){
-  __u32 bitmapSize = meta->inodesPerGroup;
+void EXT2::scanFreeInodes(ScanVisitor &visitor) {
+  TRACE_SCOPE("ifree", "section");
+  const __u32 bitmapSize = meta->inodesPerGroup;
   // TODO: will the bitmap size ALWAYS equal the number of inodes per group?
 
-  __u32 iters = bitmapSize / MASK_SIZE;
-  __u32 bitmapAddr = 0;
-  const __u8 residuals = bitmapSize % MASK_SIZE;
-
-  // if (for some reason) the bitmap size is not a multiple of 8, then the final
-  // byte will contain at least one bit which does not correspond to an actual
-  // inode entry. In this case, the value stored in 'iters' will have been
-  // truncated. To compensate for this, we check for residuals (anything left
-  // after the calculation of 'iters'). If so, that means we will need an
-  // additional iteration to deal with those extra bits.
-  iters = residuals ? iters + 1 : iters;
-
-  for (auto groupDesc : *groupDescTbl) {
-    bitmapAddr = groupDesc.bg_inode_bitmap;
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+    TRACE_SCOPE("ifree.group", "group", group);
+    const __u32 bitmapAddr = (*groupDescTbl)[group].bg_inode_bitmap;
 
     shared_ptr<char[]> bufPtr = imReader->getBlock(bitmapAddr);
-    char *buf = bufPtr.get();
 
     if (debug) {
-      printf("--------------------------------------------------printFreeInodeEntries()\n");
+      printf("--------------------------------------------------scanFreeInodes()\n");
       printf("Bitmap Size: %d bits...\n", bitmapSize);
       printf("Bitmap Block Address: %d...\n", bitmapAddr);
-      printf("Number of Iterations (8bpi): %d...\n", bitmapSize / MASK_SIZE);
-      printf("--------------------------------------------------/printFreeInodeEntries()\n");
+      printf("--------------------------------------------------/scanFreeInodes()\n");
     }
 
-    __u8 bitMask = 0x00;
-    for(__u32 maskIt = 0x00000000; maskIt < iters; maskIt += 0x00000001) {
-      bitMask = buf[maskIt] & MASK;
-      __u8 bit = 1;
+    scanBitmapRanges(bufPtr.get(), bitmapSize, meta->blockSize, group * meta->inodesPerGroup + 1,
+                     [&](__u32 first, __u32 count) { visitor.onFreeInodeRange(first, count); });
+  }
+}
+
+namespace {
+
+/*Sits between the indirect block walk and the caller's visitor: every block
+  reached is shown to the FragStats, and only passed on if INDIRECT lines were
+  asked for*/
+class LayoutVisitor : public ScanVisitor {
+ public:
+  LayoutVisitor(ScanVisitor &next, bool forward, FragStats &frag) : next(next), forward(forward), frag(frag) {}
+
+  void onIndirect(__u32 inodeNumber, __u32 level, size_t logicalBlock, __u32 indBlock, __u32 refBlock) override {
+    frag.add(refBlock);
+    if (forward)
+      next.onIndirect(inodeNumber, level, logicalBlock, indBlock, refBlock);
+  }
+
+ private:
+  ScanVisitor &next;
+  const bool forward;
+  FragStats &frag;
+};
+
+/*Passes the blocks of the indirect walk to an Estimate, for its extents*/
+class ExtentVisitor : public ScanVisitor {
+ public:
+  explicit ExtentVisitor(Estimate &estimate) : estimate(estimate) {}
 
-      if(maskIt == iters - 1 && residuals) {
-        // if the last byte contains padding
-        for(__u32 k = 0; k < residuals; k++, bit <<=1)
-          if(!(bitMask & bit))
-            printf("IFREE,%d\n", (maskIt * 8) + k + 1);
+  void onIndirect(__u32, __u32, size_t, __u32, __u32 refBlock) override { estimate.addBlock(refBlock); }
 
-      } else {
-        for (__u32 k = 0; k < MASK_SIZE; k++, bit <<= 1)
-          if (!(bitMask & bit))
-            printf("IFREE,%d\n", (maskIt * 8) + k + 1);
-      } // END if(maskIt == iters...) else...
+ private:
+  Estimate &estimate;
+};
 
-    }// END for(__u32 maskIt...)
-  } // END for(auto groupDesc...)
 }
 
+size_t EXT2::indirectFirstBlock(__u32 blockSize, __u32 level) {
+  const size_t PTRS = blockSize / sizeof(__u32);
+  size_t first = EXT2_NDIR_BLOCKS, span = 1;
 
-void EXT2::printInodeSummary() {
-  const unsigned INODE_TABLE_BLOCK_COUNT =
-      (meta->inodesPerGroup /
-       (meta->blockSize / meta->inodeSize));
-  ext2_super_block *superBlock = imReader->getSuperBlock();
+  for (__u32 l = 1; l < level; l++) {
+    span *= PTRS;
+    first += span;
+  }
+  return first;
+}
 
-  for(auto groupDesc : *groupDescTbl) 
-  {
-    shared_ptr<char[]> inodeBufferPtr = imReader->getBlocks(groupDesc.bg_inode_bitmap, 1 + INODE_TABLE_BLOCK_COUNT);
+void EXT2::scanInodes(ScanVisitor &visitor, unsigned sections, FragStats *frag) {
+  TRACE_SCOPE("inodes", "section");
+
+  // The fragmentation statistics need the same indirect blocks as the INDIRECT
+  // lines, so both are served by one walk
+  std::unique_ptr<LayoutVisitor> layout;
+  if (frag)
+    layout = std::make_unique<LayoutVisitor>(visitor, sections & SECTION_INDIRECT, *frag);
+  ScanVisitor &indirectVisitor = layout ? *layout : visitor;
+
+  // Emits one inode, then its directory entries and indirect references
+  auto emit = [&](size_t inodeNumber, ext2_inode *currentInode) {
+    if (sections & SECTION_INODES)
+      visitor.onInode(inodeNumber, *currentInode);
+
+    if ((sections & SECTION_XATTR) && currentInode->i_file_acl != 0)
+      scanXattrs(visitor, inodeNumber, currentInode->i_file_acl);
+
+    // Print out all of the directory entries
+    if ((sections & SECTION_DIRENT) && S_ISDIR(currentInode->i_mode))
+      scanDirInode(visitor, currentInode, inodeNumber);
+
+    const __u16 mode = currentInode->i_mode;
+    const bool hasBlocks = S_ISDIR(mode) || S_ISREG(mode);
+
+    // Fast symbolic links keep their target in i_block, not block numbers
+    if (frag) {
+      if (!hasBlocks && !(S_ISLNK(mode) && currentInode->i_size > 60))
+        return;
+      frag->beginFile(inodeNumber);
+      for (size_t i = 0; i < EXT2_NDIR_BLOCKS; i++)
+        if (currentInode->i_block[i] != 0)
+          frag->add(currentInode->i_block[i]);
+    }
 
-    void *inodeBuffer = inodeBufferPtr.get();
+    if ((sections & SECTION_INDIRECT || frag) && hasBlocks) {
+      for (size_t level = 1; level <= 3; level++) {
+        const __u32 indBlockNum = currentInode->i_block[EXT2_NDIR_BLOCKS + level - 1];
+        if (indBlockNum == 0)
+          continue;
 
-    char *inodeBitmap = static_cast<char *>(
-        inodeBuffer); // the inode bitmap is the first block of the buffer
+        if (frag)
+          frag->add(indBlockNum);
+        scanIndirectBlockRefs(indirectVisitor, imReader->getBlock(indBlockNum, ImageReader::BlockPersistenceType::SHARED),
+                              indBlockNum, indirectFirstBlock(meta->blockSize, level), inodeNumber, level);
+      }
+    }
 
-    ext2_inode *inodeTable =
-        static_cast<ext2_inode *>(inodeBuffer) +
-        meta->blockSize / sizeof(ext2_inode); // inode table is 2nd block to end of inodeBuffer
+    if (frag)
+      frag->endFile();
+  };
+
+  // Without directory or indirect blocks to read, there is nothing to overlap
+  const bool readsBlocks = (sections & (SECTION_DIRENT | SECTION_INDIRECT | SECTION_XATTR)) || frag;
+
+  // -------------------------------------------------- Pipeline
+  // Inodes are decoded a window at a time. The directory and indirect blocks
+  // of the whole window are handed to the reader as a prefetch hint before
+  // any of them is emitted, so the device works on those reads while earlier
+  // inodes are formatted, instead of one blocking read per pointer block.
+  vector<std::pair<__u32, ext2_inode>> window;
+  vector<__u32> prefetch;
+  window.reserve(SCAN_PREFETCH_WINDOW);
+
+  auto flush = [&]() {
+    TRACE_SCOPE("inodes.window", "window", window.empty() ? -1 : window.front().first);
+    prefetch.clear();
+    for (auto &entry : window) {
+      const ext2_inode &inode = entry.second;
+      if ((sections & SECTION_DIRENT) && S_ISDIR(inode.i_mode)) {
+        const size_t blocks = std::min<size_t>((inode.i_size + meta->blockSize - 1) / meta->blockSize,
+                                               EXT2_NDIR_BLOCKS + 1);
+        prefetch.insert(prefetch.end(), inode.i_block, inode.i_block + blocks);
+      }
+      if ((sections & SECTION_INDIRECT || frag) && (S_ISDIR(inode.i_mode) || S_ISREG(inode.i_mode)))
+        prefetch.insert(prefetch.end(), inode.i_block + EXT2_NDIR_BLOCKS, inode.i_block + EXT2_N_BLOCKS);
+      // A shared attribute block is only read for the first of its inodes
+      if ((sections & SECTION_XATTR) && inode.i_file_acl != 0 && !getXattrCache().contains(inode.i_file_acl))
+        prefetch.push_back(inode.i_file_acl);
+    }
+    imReader->prefetch(prefetch);
+
+    for (auto &entry : window)
+      emit(entry.first, &entry.second);
+    window.clear();
+  };
+
+  forEachInode([&](size_t inodeNumber, ext2_inode *currentInode) {
+    // Filtered out inodes are never formatted, nor are their blocks read
+    if (filter && !filter->matches(inodeNumber, *currentInode))
+      return;
+
+    if (!readsBlocks) {
+      emit(inodeNumber, currentInode);
+      return;
+    }
+
+    window.emplace_back(inodeNumber, *currentInode);
+    if (window.size() == SCAN_PREFETCH_WINDOW)
+      flush();
+  });
+  flush();
+}
+
+template <__u32 BS>
+void EXT2::scanIndirectBlockRefsKernel(ScanVisitor &visitor, shared_ptr<char[]> indBlock, size_t indBlockNum, size_t baseLogicalOffset, size_t inodeNum, size_t level) {
+  const __u32 PTRS = (BS ? BS : meta->blockSize) / sizeof(__u32);
+
+  uint32_t *blockIdx = reinterpret_cast<uint32_t*>(indBlock.get());
+
+  size_t span = 1; // logical blocks mapped by each entry
+  for (size_t l = 1; l < level; l++)
+    span *= PTRS;
 
-    ext2_inode *currentInode;
+  // Every pointer block below this one is about to be read
+  if (level > 1)
+    imReader->prefetch(vector<__u32>(blockIdx, blockIdx + PTRS));
 
-    for(size_t i = 0; i < superBlock->s_inodes_count/8; ++i)
+  for(size_t i = 0; i < PTRS; i++)
+  {
+    if(blockIdx[i] != 0)
     {
-      size_t inodeOffset = 8*i;
+      visitor.onIndirect(inodeNum, level, baseLogicalOffset + i * span, indBlockNum, blockIdx[i]);
 
-      for(size_t bitIdx = 0; bitIdx < 8; ++bitIdx)
-      {
-        if((inodeBitmap[i] >> bitIdx) & 0x01)
-        {
-          size_t inodeNumber = inodeOffset + bitIdx + 1; // Inode number starts at 1, not 0
-          currentInode = reinterpret_cast<ext2_inode*>(((char*)inodeTable) + meta->inodeSize*(inodeNumber - 1)); 
-
-          // Skip unallocated inodes
-          if((currentInode->i_mode == 0) || (currentInode->i_links_count == 0))
-            continue;
-
-          char mode;
-
-          // Time format: dd/mm/yy hh:mm:ss\0
-          const size_t TIME_STR_LEN = 18;
-          char cTimeStr[TIME_STR_LEN];
-          char mTimeStr[TIME_STR_LEN];
-          char aTimeStr[TIME_STR_LEN];
-
-          time_t cTime = currentInode->i_ctime;
-          time_t mTime = currentInode->i_mtime;
-          time_t aTime = currentInode->i_atime;
-
-          strftime(cTimeStr, TIME_STR_LEN, "%D %X", gmtime(&cTime));
-          strftime(mTimeStr, TIME_STR_LEN, "%D %X", gmtime(&mTime));
-          strftime(aTimeStr, TIME_STR_LEN, "%D %X", gmtime(&aTime));
-
-          if(S_ISREG(currentInode->i_mode))
-            mode = 'f';
-          else if(S_ISDIR(currentInode->i_mode))
-            mode = 'd';
-          else if(S_ISLNK(currentInode->i_mode))
-            mode = 's';
-          else
-            mode = '?';
-
-          printf("INODE,%lu,%c,%o,%d,%d,%d,%s,%s,%s,%d,%d",
-                inodeNumber,
-                mode,
-                currentInode->i_mode & 0x0FFF,
-                currentInode->i_uid,
-                currentInode->i_gid,
-                currentInode->i_links_count,
-                cTimeStr,
-                mTimeStr,
-                aTimeStr,
-                currentInode->i_size,
-                currentInode->i_blocks
-                );
-
-          if(((mode == 'f') || (mode == 'd')) || ((mode == 's' && currentInode->i_size > 60)))
-          {
-            for(size_t i = 0; i < 15; ++i)
-            {
-              printf(",%d", currentInode->i_block[i]);
-            }
-          }
+      if(level > 1)
+        scanIndirectBlockRefsKernel<BS>(visitor, imReader->getBlock(blockIdx[i], ImageReader::BlockPersistenceType::SHARED),
+                                        blockIdx[i], baseLogicalOffset + i * span, inodeNum, level - 1);
+    }
+  }
+}
 
-          printf("\n");
+size_t EXT2::auditBlocks() {
+  TRACE_SCOPE("auditBlocks", "section");
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  const size_t GROUP_BYTES = BlockAudit::bytesPerGroup(meta->blocksPerGroup);
 
-          // Print out all of the directory entries
-          if(mode == 'd') {
-            printDirInode(currentInode, inodeNumber);
-          }
+  // Audit as many groups at once as the memory budget allows (at least one)
+  MemoryGrant grant(GROUP_COUNT * GROUP_BYTES, GROUP_BYTES);
+  const __u32 WINDOW_GROUPS = std::max<size_t>(1, grant.size() / GROUP_BYTES);
+  size_t findings = 0;
 
-          if(mode == 'd' || mode == 'f') {
-            if(currentInode->i_block[EXT2_IND_BLOCK] != 0)
-            {
-              printIndirectBlockRefs(imReader->getBlock(currentInode->i_block[EXT2_IND_BLOCK], ImageReader::BlockPersistenceType::SHARED), 
-                                     currentInode->i_block[EXT2_IND_BLOCK], 0, inodeNumber, 1);
-            }
-            if(currentInode->i_block[EXT2_DIND_BLOCK] != 0)
-            {
-              printIndirectBlockRefs(imReader->getBlock(currentInode->i_block[EXT2_DIND_BLOCK], ImageReader::BlockPersistenceType::SHARED), 
-                                     currentInode->i_block[EXT2_DIND_BLOCK], 256, inodeNumber, 2);
-            }
-            if(currentInode->i_block[EXT2_TIND_BLOCK] != 0)
-            {
-              printIndirectBlockRefs(imReader->getBlock(currentInode->i_block[EXT2_TIND_BLOCK], ImageReader::BlockPersistenceType::SHARED), 
-                                     currentInode->i_block[EXT2_TIND_BLOCK], 257*256, inodeNumber, 3);
-            }
-          }
+  for (__u32 first = 0; first < GROUP_COUNT; first += WINDOW_GROUPS)
+    findings += auditBlockWindow(first, std::min(WINDOW_GROUPS, GROUP_COUNT - first));
 
-        }
-      }
+  return findings;
+}
+
+/*PRIVATE*/
+size_t EXT2::auditBlockWindow(__u32 firstGroup, __u32 groupCount) {
+  TRACE_SCOPE("audit.window", "window", firstGroup);
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+
+  BlockAudit audit(meta->blockCount, imReader->getSuperBlock()->s_first_data_block, meta->blocksPerGroup,
+                   firstGroup, groupCount);
+  reserveMetadata(audit);
+
+  // -------------------------------------------------- Block References
+  // Every window walks all inodes, so they are read from the column cache.
+  // An extended attribute block is shared by every inode with the same
+  // attributes: it is referenced once, by the first of them.
+  vector<std::pair<__u32, __u32>> xattrRefs; // (block, inode)
+  auto auditGroup = [&](const InodeColumns &inodes) {
+    for (size_t i = 0; i < inodes.count(); i++) {
+      auditInodeBlocks(audit, inodes.ino[i], inodes.mode[i], inodes.size[i], inodes.blocksOf(i));
+      if (inodes.fileAcl[i] != 0)
+        xattrRefs.emplace_back(inodes.fileAcl[i], inodes.ino[i]);
     }
+  };
+  auto auditXattrs = [&]() {
+    for (size_t i = 0; i < xattrRefs.size(); i++)
+      if (i == 0 || xattrRefs[i].first != xattrRefs[i - 1].first)
+        audit.reference(xattrRefs[i].first, {xattrRefs[i].second, 0, BlockAudit::XATTR_LEVEL});
+  };
+  forEachInodeGroup(auditGroup);
+  std::sort(xattrRefs.begin(), xattrRefs.end());
+  auditXattrs();
+
+  // The bitset only remembers that a block was claimed, not by whom. In the
+  // (rare) case of duplicates, walk again to name every claimant.
+  if (audit.hasDuplicates()) {
+    audit.beginDuplicatePass();
+    xattrRefs.clear();
+    forEachInodeGroup(auditGroup);
+    std::sort(xattrRefs.begin(), xattrRefs.end());
+    auditXattrs();
+  }
+
+  // -------------------------------------------------- On-Disk Bitmaps
+  for (__u32 group = firstGroup; group < firstGroup + groupCount; group++) {
+    shared_ptr<char[]> bitmap = imReader->getBlock((*groupDescTbl)[group].bg_block_bitmap);
+    audit.loadBitmap(group, bitmap.get(),
+                     (group == GROUP_COUNT - 1) ? meta->blocksInLastGroup : meta->blocksPerGroup);
   }
+
+  return audit.report(out);
 }
 
-void EXT2::printDirInode(ext2_inode *dirInode, size_t inodeNumber) {
+/*PRIVATE -- Super Block and descriptor copies, bitmaps and inode tables can
+  never be referenced by an inode*/
+void EXT2::reserveMetadata(BlockAudit &audit) {
+  ext2_super_block *superBlock = imReader->getSuperBlock();
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  const __u32 GDT_BLOCKS =
+      (GROUP_COUNT * sizeof(ext2_group_desc) + meta->blockSize - 1) / meta->blockSize;
+
+  for (__u32 group = 0; group < GROUP_COUNT; group++) {
+    const ext2_group_desc &groupDesc = (*groupDescTbl)[group];
 
-  shared_ptr<char[]> dirBlock;
-  struct ext2_dir_entry *entry;
-  size_t entryOffset = 0;
-  size_t logicalOffset = 0;
+    if (groupHasSuperBlock(group))
+      audit.reserve(superBlock->s_first_data_block + group * meta->blocksPerGroup,
+                    1 + GDT_BLOCKS);
 
-  //Scan the direct block references.
-  for(int blockIdx = 0; blockIdx < 12; blockIdx++)
-  {
+    audit.reserve(groupDesc.bg_block_bitmap);
+    audit.reserve(groupDesc.bg_inode_bitmap);
+    audit.reserve(groupDesc.bg_inode_table, inodeTableBlockCount());
+  }
+}
 
-    dirBlock = imReader->getBlock(dirInode->i_block[blockIdx]);
-    entry = reinterpret_cast<ext2_dir_entry*>(dirBlock.get());
+void EXT2::auditInodeBlocks(BlockAudit &audit, __u32 inodeNumber, __u16 mode, __u32 size,
+                            const __u32 *iBlock) {
+  // Fast symbolic links keep their target in i_block, not block numbers
+  if (!(S_ISREG(mode) || S_ISDIR(mode) || (S_ISLNK(mode) && size > 60)))
+    return;
 
-    while(entryOffset < dirInode->i_size)
-    {
-      if(entry->rec_len == 0)
-        break;
+  const __u32 PTRS = meta->blockSize / sizeof(__u32);
+  __u32 offset = 0;
 
-      if(entry->inode != 0)
-      {
-        printf("DIRENT,%lu,%lu,%d,%d,%d,'%.*s'\n",
-                inodeNumber,
-                logicalOffset,
-                entry->inode,
-                entry->rec_len,
-                entry->name_len,
-                entry->name_len,
-                entry->name);
-
-        logicalOffset += entry->rec_len;
+  for (__u32 i = 0; i < EXT2_NDIR_BLOCKS; i++, offset++)
+    if (iBlock[i] != 0)
+      audit.reference(iBlock[i], {inodeNumber, offset, 0});
+
+  // Logical offsets of the first block reached through IND, DIND and TIND
+  const __u32 span[3] = {1, PTRS, PTRS * PTRS};
+  for (__u8 level = 1; level <= 3; level++) {
+    const __u32 block = iBlock[EXT2_NDIR_BLOCKS + level - 1];
+
+    if (block != 0 && audit.reference(block, {inodeNumber, offset, level}))
+      auditIndirectBlock(audit, block, inodeNumber, offset, level);
+
+    offset += span[level - 1] * PTRS;
+  }
+}
+
+template <__u32 BS>
+void EXT2::auditIndirectBlockKernel(BlockAudit &audit, __u32 indBlockNum, __u32 inodeNumber,
+                                    __u32 baseOffset, __u8 level) {
+  shared_ptr<char[]> indBlock = imReader->getBlock(indBlockNum, ImageReader::BlockPersistenceType::SHARED);
+  const __u32 *entries = reinterpret_cast<__u32*>(indBlock.get());
+
+  const __u32 PTRS = (BS ? BS : meta->blockSize) / sizeof(__u32);
+  __u32 span = 1; // logical blocks covered by each entry
+  for (__u8 l = 1; l < level; l++)
+    span *= PTRS;
+
+  for (__u32 i = 0; i < PTRS; i++) {
+    if (entries[i] == 0)
+      continue;
+
+    const __u32 offset = baseOffset + i * span;
+    if (audit.reference(entries[i], {inodeNumber, offset, (__u8)(level - 1)}) && level > 1)
+      auditIndirectBlockKernel<BS>(audit, entries[i], inodeNumber, offset, level - 1);
+  }
+}
+
+// -------------------------------------------------- Block Owners
+void EXT2::indexBlockOwners(BlockOwners &owners) {
+  TRACE_SCOPE("indexBlockOwners", "section");
+  ext2_super_block *superBlock = imReader->getSuperBlock();
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  const __u32 GDT_BLOCKS =
+      (GROUP_COUNT * sizeof(ext2_group_desc) + meta->blockSize - 1) / meta->blockSize;
+  owners.setBlockCount(meta->blockCount);
+
+  // Metadata is owned by its group, recorded as the logical block
+  for (__u32 group = 0; group < GROUP_COUNT; group++) {
+    const ext2_group_desc &groupDesc = (*groupDescTbl)[group];
+
+    if (groupHasSuperBlock(group)) {
+      const __u32 first = superBlock->s_first_data_block + group * meta->blocksPerGroup;
+      owners.add(first, 1, BlockOwners::SUPERBLOCK, 0, group);
+      owners.add(first + 1, GDT_BLOCKS, BlockOwners::GDT, 0, group);
+    }
+    owners.add(groupDesc.bg_block_bitmap, 1, BlockOwners::BLOCK_BITMAP, 0, group);
+    owners.add(groupDesc.bg_inode_bitmap, 1, BlockOwners::INODE_BITMAP, 0, group);
+    owners.add(groupDesc.bg_inode_table, inodeTableBlockCount(), BlockOwners::INODE_TABLE, 0, group);
+  }
+
+  // Same walk as auditInodeBlocks(), but out of range blocks are skipped
+  // instead of reported. Any inode may own the blocks asked about, so every
+  // group's descriptor and inode bitmap is read, however few the blocks; of
+  // the inode tables, only the blocks holding inodes in use are
+  const __u32 PTRS = meta->blockSize / sizeof(__u32);
+  const __u32 span[3] = {1, PTRS, PTRS * PTRS};
+
+  forEachInodeGroup([&](const InodeColumns &inodes) {
+    for (size_t i = 0; i < inodes.count(); i++) {
+      // Every inode sharing an attribute block owns it
+      if (inodes.fileAcl[i] != 0 && inodes.fileAcl[i] < meta->blockCount)
+        owners.add(inodes.fileAcl[i], 1, BlockOwners::XATTR, inodes.ino[i], 0);
+
+      const __u16 mode = inodes.mode[i];
+      if (!(S_ISREG(mode) || S_ISDIR(mode) || (S_ISLNK(mode) && inodes.size[i] > 60)))
+        continue;
+
+      const __u32 *iBlock = inodes.blocksOf(i);
+      __u32 offset = 0;
+
+      for (__u32 b = 0; b < EXT2_NDIR_BLOCKS; b++, offset++)
+        if (iBlock[b] != 0 && iBlock[b] < meta->blockCount)
+          owners.add(iBlock[b], 1, BlockOwners::DATA, inodes.ino[i], offset);
+
+      for (__u8 level = 1; level <= 3; level++) {
+        indexIndirectBlock(owners, iBlock[EXT2_NDIR_BLOCKS + level - 1], inodes.ino[i], offset, level);
+        offset += span[level - 1] * PTRS;
       }
+    }
+  });
 
-      entry = reinterpret_cast<ext2_dir_entry*>((char*)entry + entry->rec_len);
-      entryOffset += entry->rec_len;
+  owners.finish();
+}
+
+/*PRIVATE*/
+void EXT2::indexIndirectBlock(BlockOwners &owners, __u32 indBlockNum, __u32 inodeNumber,
+                              __u32 baseOffset, __u8 level) {
+  if (indBlockNum == 0 || indBlockNum >= meta->blockCount)
+    return;
+
+  static const BlockOwners::Role ROLES[] = {BlockOwners::IND, BlockOwners::DIND, BlockOwners::TIND};
+  owners.add(indBlockNum, 1, ROLES[level - 1], inodeNumber, baseOffset);
+
+  shared_ptr<char[]> indBlock = imReader->getBlock(indBlockNum, ImageReader::BlockPersistenceType::SHARED);
+  const __u32 *entries = reinterpret_cast<__u32*>(indBlock.get());
+
+  const __u32 PTRS = meta->blockSize / sizeof(__u32);
+  __u32 span = 1;
+  for (__u8 l = 1; l < level; l++)
+    span *= PTRS;
+
+  for (__u32 i = 0; i < PTRS; i++) {
+    if (level > 1)
+      indexIndirectBlock(owners, entries[i], inodeNumber, baseOffset + i * span, level - 1);
+    else if (entries[i] != 0 && entries[i] < meta->blockCount)
+      owners.add(entries[i], 1, BlockOwners::DATA, inodeNumber, baseOffset + i);
+  }
+}
+
+size_t EXT2::verifyDirectoryGraph() {
+  TRACE_SCOPE("verifyDirectoryGraph", "section");
+  ext2_super_block *superBlock = imReader->getSuperBlock();
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  const unsigned MAX_WORKERS = std::max(1u, std::thread::hardware_concurrency());
+
+  // The link count windows shrink (and multiply) under a memory limit
+  const size_t wanted = (size_t)superBlock->s_inodes_count * sizeof(__u16) * MAX_WORKERS;
+  MemoryGrant countsGrant(std::min<size_t>(wanted, DIRGRAPH_MEMORY_BUDGET),
+                          std::min<size_t>(wanted, DIRGRAPH_MIN_BUDGET));
+
+  DirGraph graph(superBlock->s_inodes_count,
+                 (meta->rev == EXT2_OLD_REV) ? EXT2_GOOD_OLD_FIRST_INO : superBlock->s_first_ino,
+                 countsGrant.size(), MAX_WORKERS);
+
+  // -------------------------------------------------- Phase 0: Inode Tables
+  for (__u32 group = 0; group < GROUP_COUNT; group++) {
+    TRACE_SCOPE("dirgraph.inodes.group", "group", group);
+    forEachTableInode(group, [&](__u32 inodeNumber, const ext2_inode *inode, bool inBitmap) {
+      graph.addInode(inodeNumber, inode, inBitmap);
+    });
+  }
+
+  // -------------------------------------------------- Phase 1 & 2: Edges and Link Counts
+  const size_t DIRECTORIES = graph.getDirectoryCount();
+  const unsigned WORKERS = graph.getWorkerCount();
+
+  // 64-bit, so that the last window does not wrap past UINT32_MAX inodes
+  for (__u64 first = 1; first <= superBlock->s_inodes_count; first += graph.getWindowSize()) {
+    TRACE_SCOPE("dirgraph.window", "window", first);
+    graph.beginWindow(first);
+
+    // Directories are dealt round-robin to the workers
+    vector<std::thread> threads;
+    vector<std::exception_ptr> errors(WORKERS);
+    for (unsigned w = 0; w < WORKERS; w++) {
+      threads.emplace_back([&, w]() {
+        TRACE_SCOPE("dirgraph.worker", "worker", w);
+        try {
+          for (size_t d = w; d < DIRECTORIES; d += WORKERS) {
+            // Without the records (see DirGraph::getDirectory), re-read the inode
+            DirGraph::Directory dir;
+            if (!graph.getDirectory(d, dir)) {
+              ext2_inode inode;
+              readInode(graph.getDirectoryInode(d), inode);
+              dir = DirGraph::Directory::of(graph.getDirectoryInode(d), &inode);
+            }
+            scanDirectory(graph, w, dir, first == 1);
+          }
+        } catch (...) {
+          errors[w] = std::current_exception();
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+    for (auto &e : errors)
+      if (e)
+        std::rethrow_exception(e);
+
+    graph.endWindow();
+
+    // Only the groups overlapping this window need to be read again
+    const __u32 last = std::min<__u64>(superBlock->s_inodes_count, first + graph.getWindowSize() - 1);
+    for (__u32 group = (first - 1) / meta->inodesPerGroup; group <= (last - 1) / meta->inodesPerGroup; group++) {
+      TRACE_SCOPE("dirgraph.links.group", "group", group);
+      forEachInodeTableChunk(group, [&](__u32 firstIdx, __u32 count, char *table) {
+        for (__u32 idx = firstIdx; idx < firstIdx + count; idx++) {
+          ext2_inode *inode = reinterpret_cast<ext2_inode*>(table + (size_t)meta->inodeSize * (idx - firstIdx));
+          if (inode->i_mode != 0)
+            graph.checkLinkCount(group * meta->inodesPerGroup + idx + 1, inode);
+        }
+      });
     }
   }
 
-  //Scan the singly indirect block.
-  shared_ptr<char[]> sindBlock = imReader->getBlock(dirInode->i_block[EXT2_IND_BLOCK], ImageReader::BlockPersistenceType::SHARED);
-  int *sindBlockEntries = reinterpret_cast<int*>(sindBlock.get());
-  for(size_t iBlockIdx = 0; iBlockIdx < meta->blockSize/4; iBlockIdx++)
-  {
-    if(sindBlockEntries[iBlockIdx] == 0)
-      continue;
+  return graph.report(out);
+}
 
-    dirBlock = imReader->getBlock(sindBlockEntries[iBlockIdx]);
-    entry = reinterpret_cast<ext2_dir_entry*>(dirBlock.get());
+/*PRIVATE -- calls fn(inodeNumber, inode, inBitmap) for every inode of a
+  group's table, in use or not, up to s_inodes_count*/
+void EXT2::forEachTableInode(__u32 group, std::function<void(__u32, const ext2_inode*, bool)> fn) {
+  const __u32 INODES_COUNT = imReader->getSuperBlock()->s_inodes_count;
+  shared_ptr<char[]> bitmapPtr = imReader->getBlock((*groupDescTbl)[group].bg_inode_bitmap, ImageReader::BlockPersistenceType::SHARED);
 
-    while(entryOffset < dirInode->i_size)
-    {
-      if(entry->rec_len == 0)
+  forEachInodeTableChunk(group, [&](__u32 firstIdx, __u32 count, char *table) {
+    for (__u32 idx = firstIdx; idx < firstIdx + count; idx++) {
+      const __u32 inodeNumber = group * meta->inodesPerGroup + idx + 1;
+      if (inodeNumber > INODES_COUNT)
         break;
 
-      if(entry->inode != 0)
-      {
-        printf("DIRENT,%lu,%lu,%d,%d,%d,'%.*s'\n",
-                inodeNumber,
-                logicalOffset,
-                entry->inode,
-                entry->rec_len,
-                entry->name_len,
-                entry->name_len,
-                entry->name);
-
-        logicalOffset += entry->rec_len;
-      }
+      fn(inodeNumber, reinterpret_cast<ext2_inode*>(table + (size_t)meta->inodeSize * (idx - firstIdx)),
+         (bitmapPtr[idx / 8] >> (idx % 8)) & 0x01);
+    }
+  });
+}
+
+/*PRIVATE -- thread-safe. The one walk over the entries of a directory: every
+  block holding its 'size' bytes, in order, each through forEachBlockEntry()*/
+template <__u32 BS, typename Fn>
+void EXT2::forEachDirectoryEntryKernel(__u32 size, const __u32 *iBlock, Fn &fn) {
+  const __u32 BLOCK_SIZE = BS ? BS : meta->blockSize;
+  unique_ptr<char[]> buf(new char[BLOCK_SIZE]);
+
+  auto onBlock = [&](uint64_t logical, __u32 block) {
+    imReader->readBlocks(block, 1, buf.get());
+    forEachBlockEntry(buf.get(), BLOCK_SIZE, [&](size_t off, const ext2_dir_entry &entry) {
+      fn(logical * BLOCK_SIZE + off, entry);
+    });
+  };
+  forEachDataBlockKernel<BS>(iBlock, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, onBlock);
+}
+
+
+/*PRIVATE -- thread-safe. Calls fn(logical, physical) for each mapped block
+  among the first 'count' logical blocks of an inode's block map, in order.
+  Holes, and pointers past the end of the image, are skipped without being
+  enumerated*/
+template <__u32 BS, typename Fn>
+void EXT2::forEachDataBlockKernel(const __u32 *iBlock, uint64_t count, Fn &fn) {
+  const __u32 PTRS = (BS ? BS : meta->blockSize) / sizeof(__u32);
+
+  for (__u32 i = 0; i < EXT2_NDIR_BLOCKS && i < count; i++)
+    if (iBlock[i] != 0 && iBlock[i] < meta->blockCount)
+      fn(i, iBlock[i]);
+
+  uint64_t logical = EXT2_NDIR_BLOCKS, span = PTRS;
+  for (__u32 level = 1; level <= 3 && logical < count; level++, logical += span, span *= PTRS)
+    forEachIndirectDataBlockKernel<BS>(iBlock[EXT2_NDIR_BLOCKS + level - 1], level, logical, count, fn);
+}
+
+template <__u32 BS, typename Fn>
+void EXT2::forEachIndirectDataBlockKernel(__u32 indBlockNum, __u32 level, uint64_t logical, uint64_t count, Fn &fn) {
+  const __u32 PTRS = (BS ? BS : meta->blockSize) / sizeof(__u32);
+
+  // A missing indirect block is a hole spanning everything beneath it
+  if (indBlockNum == 0 || indBlockNum >= meta->blockCount)
+    return;
+
+  uint64_t span = 1; // logical blocks mapped by each entry
+  for (__u32 l = 1; l < level; l++)
+    span *= PTRS;
+
+  unique_ptr<__u32[]> entries(new __u32[PTRS]);
+  imReader->readBlocks(indBlockNum, 1, reinterpret_cast<char*>(entries.get()));
+
+  for (__u32 i = 0; i < PTRS && logical + i * span < count; i++) {
+    if (level > 1)
+      forEachIndirectDataBlockKernel<BS>(entries[i], level - 1, logical + i * span, count, fn);
+    else if (entries[i] != 0 && entries[i] < meta->blockCount)
+      fn(logical + i, entries[i]);
+  }
+}
+
+bool EXT2::groupHasSuperBlock(__u32 group) {
+  return BackupCheck::hasSuperBlockCopy(group, *imReader->getSuperBlock());
+}
+
+/*PRIVATE*/
+void EXT2::loadSuperBlock() {
+  try { parseSuperBlock(); }
+  catch (EXT2_error &e) { throw e; }
+  catch (...) { throw EXT2_error("SuperBlockParseError"); }
+
+  if (!validateSuperBlock())
+    throw EXT2_error("SuperBlockValidationError");
+}
+
+/*PRIVATE -- samples the backup Super Blocks. If they all agree with each other
+  but not with the primary, it is the primary that is damaged, and the first of
+  them is used instead*/
+void EXT2::checkPrimarySuperBlock() {
+  BackupCheck check(*imReader, *imReader->getSuperBlock());
+  check.run(false, nullptr);
+
+  __u32 group;
+  if (!check.primaryOutvoted(group))
+    return;
+
+  ext2_super_block copy;
+  check.readCopy(group, copy);
+  imReader->useBackup(copy, check.descriptorBlock(group));
+  loadSuperBlock();
+  superBlockGroup = group;
+}
+
+/*PRIVATE -- looks for an intact backup when the primary cannot be used at all.
+  Returns false if there is none*/
+bool EXT2::recoverSuperBlock() {
+  ext2_super_block copy;
+  size_t descriptorBlock;
+  const __u32 group = BackupCheck::findBackup(*imReader, meta->stat.st_size, copy, descriptorBlock);
+  if (group == 0)
+    return false;
+
+  imReader->useBackup(copy, descriptorBlock);
+  try { loadSuperBlock(); }
+  catch (...) { return false; }
 
-      entry = reinterpret_cast<ext2_dir_entry*>((char*)entry + entry->rec_len);
-      entryOffset += entry->rec_len;
+  superBlockGroup = group;
+  return true;
+}
+
+size_t EXT2::checkBackups(bool all) {
+  size_t findings = 0;
+  if (superBlockGroup != 0) {
+    fprintf(out, "PRIMARY SUPERBLOCK IS DAMAGED, USING BACKUP IN GROUP %u\n", superBlockGroup);
+    findings++;
+  }
+
+  BackupCheck check(*imReader, *imReader->getSuperBlock());
+  check.run(all, groupDescTbl.get());
+  return findings + check.report(out);
+}
+
+__u32 EXT2::inodeTableBlockCount() {
+  return ((uint64_t)meta->inodesPerGroup * meta->inodeSize + meta->blockSize - 1) / meta->blockSize;
+}
+
+/*PRIVATE -- calls fn(firstIdx, count, table) for consecutive chunks of a
+  group's inode table, each as large as the memory budget allows. With an
+  inode 'bitmap', a chunk is trimmed to the blocks from its first inode in use
+  to its last, and skipped if it has none, so a group with few inodes in use
+  costs few reads. fn may call getBlock(), but must not call getBlocks()*/
+void EXT2::forEachInodeTableChunk(__u32 group, std::function<void(__u32, __u32, char*)> fn,
+                                  const char *bitmap) {
+  const __u32 TABLE_BLOCKS = inodeTableBlockCount();
+  const __u32 INODES_PER_BLOCK = meta->blockSize / meta->inodeSize;
+  const __u32 CHUNK_BLOCKS = imReader->affordableBlocks(TABLE_BLOCKS);
+  const __u32 tableStart = (*groupDescTbl)[group].bg_inode_table;
+  auto inUse = [&](__u32 idx) { return (bitmap[idx / 8] >> (idx % 8)) & 0x01; };
+
+  for (__u32 chunk = 0; chunk < TABLE_BLOCKS; chunk += CHUNK_BLOCKS) {
+    __u32 block = chunk;
+    __u32 blocks = std::min(CHUNK_BLOCKS, TABLE_BLOCKS - chunk);
+
+    if (bitmap) {
+      __u32 first = chunk * INODES_PER_BLOCK;
+      __u32 end = std::min(first + blocks * INODES_PER_BLOCK, meta->inodesPerGroup);
+      // Free inodes are skipped a byte of the bitmap at a time
+      while (first < end && !inUse(first))
+        first += (first % 8 == 0 && bitmap[first / 8] == 0) ? 8 : 1;
+      if (first >= end)
+        continue;
+      while (!inUse(end - 1))
+        end--;
+      block = first / INODES_PER_BLOCK;
+      blocks = (end - 1) / INODES_PER_BLOCK - block + 1;
     }
+
+    const __u32 firstIdx = block * INODES_PER_BLOCK;
+    const __u32 count = std::min(blocks * INODES_PER_BLOCK, meta->inodesPerGroup - firstIdx);
+
+    shared_ptr<char[]> tablePtr = imReader->getBlocks(tableStart + block, blocks);
+    fn(firstIdx, count, tablePtr.get());
   }
+}
 
-  //Scan the doubly indirect block.
-  shared_ptr<char[]> dindBlock = imReader->getBlock(dirInode->i_block[EXT2_DIND_BLOCK], ImageReader::BlockPersistenceType::SHARED);
-  int *dindBlockEntries = reinterpret_cast<int*>(dindBlock.get());
-  for(size_t diBlockIdx = 0; diBlockIdx < meta->blockSize/4; diBlockIdx++)
-  {
-    if(dindBlockEntries[diBlockIdx] == 0)
-      continue;
+/*PRIVATE -- calls fn(inodeNumber, inode) for every allocated, in-use inode of
+  'group'. fn may call getBlock(), but must not call getBlocks()*/
+template <__u32 IS, typename Fn>
+void EXT2::forEachGroupInodeKernel(__u32 group, Fn &fn) {
+  const __u32 INODE_SIZE = IS ? IS : meta->inodeSize;
 
-    sindBlock = imReader->getBlock(dindBlockEntries[diBlockIdx], ImageReader::BlockPersistenceType::SHARED);
-    sindBlockEntries = reinterpret_cast<int*>(sindBlock.get());
+  shared_ptr<char[]> bitmapPtr = imReader->getBlock((*groupDescTbl)[group].bg_inode_bitmap, ImageReader::BlockPersistenceType::SHARED);
+  const char *bitmap = bitmapPtr.get();
 
-    for(size_t iBlockIdx = 0; iBlockIdx < meta->blockSize/4; iBlockIdx++)
-    {
-      if(sindBlockEntries[iBlockIdx] == 0)
+  forEachInodeTableChunk(group, [&](__u32 firstIdx, __u32 count, char *table) {
+    for (__u32 idx = firstIdx; idx < firstIdx + count; idx++) {
+      // Free inodes are skipped a byte of the bitmap at a time
+      if (idx % 8 == 0 && bitmap[idx / 8] == 0) {
+        idx += 7;
+        continue;
+      }
+      if (!((bitmap[idx / 8] >> (idx % 8)) & 0x01))
         continue;
 
-      dirBlock = imReader->getBlock(sindBlockEntries[iBlockIdx]);
-      entry = reinterpret_cast<ext2_dir_entry*>(dirBlock.get());
+      ext2_inode *inode = reinterpret_cast<ext2_inode*>(table + (size_t)INODE_SIZE * (idx - firstIdx));
+      if (inode->i_mode == 0 || inode->i_links_count == 0)
+        continue;
 
-      while(entryOffset < dirInode->i_size)
-      {
-        if(entry->rec_len == 0)
-          break;
-
-        if(entry->inode != 0)
-        {
-          printf("DIRENT,%lu,%lu,%d,%d,%d,'%.*s'\n",
-                  inodeNumber,
-                  logicalOffset,
-                  entry->inode,
-                  entry->rec_len,
-                  entry->name_len,
-                  entry->name_len,
-                  entry->name);
-
-          logicalOffset += entry->rec_len;
+      fn((size_t)group * meta->inodesPerGroup + idx + 1, inode);
+    }
+  }, bitmap);
+}
+
+/*PRIVATE -- calls fn(inodeNumber, inode) for every allocated, in-use inode*/
+template <typename Fn>
+void EXT2::forEachInode(Fn &&fn) {
+  withInodeSize([&](auto is) {
+    for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+      TRACE_SCOPE("inodes.group", "group", group);
+      forEachGroupInodeKernel<decltype(is)::value>(group, fn);
+    }
+  });
+}
+
+// -------------------------------------------------- Inode Columns
+void EXT2::forEachInodeGroup(std::function<void(const InodeColumns&)> fn) {
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++)
+    fn(getInodeColumns(group));
+}
+
+/*PRIVATE -- decodes a group's inodes, or returns its cached columns. A group is
+  cached the second time it is decoded (a single pass gains nothing from it),
+  while the cache stays within INODE_COLUMN_CACHE_BUDGET and a quarter of the
+  memory limit, if any, so that the readers keep the rest. The columns are only
+  valid until the next call*/
+const InodeColumns &EXT2::getInodeColumns(__u32 group) {
+  if (inodeColumns.empty()) {
+    inodeColumns.resize(groupDescTbl->size());
+    inodeColumnsDecoded.resize(groupDescTbl->size());
+  }
+  if (inodeColumns[group])
+    return *inodeColumns[group];
+
+  TRACE_SCOPE("inodes.decode", "group", group);
+
+  // Groups are decoded into one scratch buffer, sized for a full group, and
+  // only copied out (to their exact size) to be cached
+  if (!inodeColumnScratch)
+    inodeColumnScratch = make_unique<InodeColumns>(group, meta->inodesPerGroup);
+  inodeColumnScratch->clear(group);
+
+  auto append = [&](size_t ino, ext2_inode *inode) {
+    inodeColumnScratch->append(ino, *inode);
+  };
+  withInodeSize([&](auto is) { forEachGroupInodeKernel<decltype(is)::value>(group, append); });
+
+  const size_t LIMIT = MemoryBudget::global().getLimit();
+  const size_t CACHE_BUDGET = LIMIT ? std::min<size_t>(INODE_COLUMN_CACHE_BUDGET, LIMIT / 4)
+                                    : INODE_COLUMN_CACHE_BUDGET;
+  const size_t bytes = InodeColumns::bytesFor(inodeColumnScratch->count());
+
+  if (!inodeColumnsDecoded[group]) {
+    inodeColumnsDecoded[group] = true;
+  } else if (inodeColumnBytes + bytes <= CACHE_BUDGET) {
+    MemoryGrant grant(bytes, 0);
+    if (grant.size() == bytes) {
+      inodeColumnBytes += bytes;
+      inodeColumnGrants.push_back(std::move(grant));
+      inodeColumns[group] = inodeColumnScratch->compact();
+      return *inodeColumns[group];
+    }
+  }
+  return *inodeColumnScratch;
+}
+
+// -------------------------------------------------- File Hashes
+void EXT2::scanFileHashes(ScanVisitor &visitor) {
+  TRACE_SCOPE("fileHashes", "section");
+  struct File {
+    __u32 inodeNumber;
+    ext2_inode inode;
+    __u32 crc;
+  };
+
+  // Each worker reads a chunk at a time, so the budget bounds the buffers
+  const unsigned WORKERS = std::max(1u, std::thread::hardware_concurrency());
+  MemoryGrant grant((size_t)WORKERS * FILE_HASH_CHUNK, (size_t)WORKERS * meta->blockSize);
+  const size_t CHUNK = std::max<size_t>(meta->blockSize, grant.size() / WORKERS / meta->blockSize * meta->blockSize);
+
+  ThreadPool pool(WORKERS);
+  std::mutex errorLock;
+  std::exception_ptr error;
+  vector<File> files;
+  files.reserve(FILE_HASH_BATCH);
+
+  // Files are hashed a batch at a time, and reported in inode order
+  auto hashBatch = [&]() {
+    // Started in the order of their first block, so that together the
+    // workers sweep the image more or less in physical order
+    vector<size_t> order(files.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return files[a].inode.i_block[0] < files[b].inode.i_block[0];
+    });
+
+    for (size_t i : order) {
+      pool.submit([&, i]() {
+        try {
+          File &file = files[i];
+          const size_t bytes = std::max<uint64_t>(1, std::min<uint64_t>(CHUNK, fileSize(file.inode)));
+          unique_ptr<char[]> buffer(new char[bytes]);
+          file.crc = hashFile(file.inode, buffer.get(), bytes);
+        } catch (...) {
+          std::lock_guard<std::mutex> guard(errorLock);
+          if (!error)
+            error = std::current_exception();
         }
+      });
+    }
+    pool.wait();
+    if (error)
+      std::rethrow_exception(error);
+
+    for (auto &file : files)
+      visitor.onFileHash(file.inodeNumber, fileSize(file.inode), file.crc);
+    files.clear();
+  };
+
+  forEachInode([&](size_t inodeNumber, ext2_inode *inode) {
+    if (!S_ISREG(inode->i_mode) || (filter && !filter->matches(inodeNumber, *inode)))
+      return;
+
+    files.push_back({(__u32)inodeNumber, *inode, 0});
+    if (files.size() == FILE_HASH_BATCH)
+      hashBatch();
+  });
+  hashBatch();
+}
 
-        entry = reinterpret_cast<ext2_dir_entry*>((char*)entry + entry->rec_len);
-        entryOffset += entry->rec_len;
-      }
+/*PRIVATE*/
+__u32 EXT2::hashFile(const ext2_inode &inode, char *buffer, size_t bufferSize) {
+  const uint64_t size = fileSize(inode);
+  uint64_t hashed = 0;
+  __u32 crc = 0;
+
+  // Holes (and the tail past the last block) are hashed as the zeros they
+  // read as, without touching the image
+  forEachFileRun(inode, (size + meta->blockSize - 1) / meta->blockSize,
+                 [&](uint64_t logical, __u32 physical, __u32 count) {
+    const uint64_t start = logical * meta->blockSize;
+    const uint64_t length = std::min<uint64_t>((uint64_t)count * meta->blockSize, size - start);
+    crc = crc32cZeros(crc, start - hashed);
+
+    for (uint64_t done = 0; done < length;) {
+      const size_t n = std::min<uint64_t>(bufferSize, length - done);
+      if (imReader->readBytes((size_t)physical * meta->blockSize + done, n, buffer) < n)
+        throw runtime_error("BlockReadBeyondEndOfImage");
+      crc = crc32c(crc, buffer, n);
+      done += n;
     }
+    hashed = start + length;
+  });
+
+  return crc32cZeros(crc, size - hashed);
+}
+
+
+// -------------------------------------------------- Estimate
+void EXT2::printEstimate(double fraction, uint64_t seed) {
+  TRACE_SCOPE("estimate", "section");
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  const __u32 TABLE_CHUNKS = (inodeTableBlockCount() + Estimate::CHUNK_BLOCKS - 1) / Estimate::CHUNK_BLOCKS;
+
+  // The descriptors hold the exact free counts, at a fraction of a block per group
+  uint64_t freeBlocks = 0, freeInodes = 0;
+  for (__u32 group = 0; group < GROUP_COUNT; group++) {
+    freeBlocks += (*groupDescTbl)[group].bg_free_blocks_count;
+    freeInodes += (*groupDescTbl)[group].bg_free_inodes_count;
   }
 
-  //Scan the triply indirect block.
-  shared_ptr<char[]> tindBlock = imReader->getBlock(dirInode->i_block[EXT2_TIND_BLOCK], ImageReader::BlockPersistenceType::SHARED);
-  int *tindBlockEntries = reinterpret_cast<int*>(tindBlock.get());
-  for(size_t tiBlockIdx = 0; tiBlockIdx < meta->blockSize/4; tiBlockIdx++)
-  {
-    if(tindBlockEntries[tiBlockIdx] == 0)
-      continue;
+  Estimate estimate(out, fraction, seed);
+  const __u32 STRATA = std::min(GROUP_COUNT, Estimate::STRATA);
+  vector<__u32> prefetch;
+
+  for (__u32 stratum = 0; stratum < STRATA; stratum++) {
+    TRACE_SCOPE("estimate.stratum", "stratum", stratum);
+    const __u32 first = (uint64_t)stratum * GROUP_COUNT / STRATA;
+    const __u32 count = (uint64_t)(stratum + 1) * GROUP_COUNT / STRATA - first;
+
+    // The whole stratum is drawn first, so that its reads can be prefetched
+    // together
+    vector<__u32> groups = estimate.pickGroups(count);
+    vector<vector<__u32>> chunks;
+    prefetch.clear();
+    for (__u32 &group : groups) {
+      group += first;
+      const ext2_group_desc &groupDesc = (*groupDescTbl)[group];
+      chunks.push_back(estimate.pickChunks(TABLE_CHUNKS));
+      prefetch.push_back(groupDesc.bg_block_bitmap);
+      prefetch.push_back(groupDesc.bg_inode_bitmap);
+      for (__u32 chunk : chunks.back())
+        for (__u32 b = 0; b < Estimate::CHUNK_BLOCKS; b++)
+          prefetch.push_back(groupDesc.bg_inode_table + chunk * Estimate::CHUNK_BLOCKS + b);
+    }
+    imReader->prefetch(prefetch);
 
-    dindBlock = imReader->getBlock(tindBlockEntries[tiBlockIdx], ImageReader::BlockPersistenceType::SHARED);
-    dindBlockEntries = reinterpret_cast<int*>(dindBlock.get());
+    estimate.beginStratum(count, groups.size());
+    for (size_t i = 0; i < groups.size(); i++)
+      estimateGroup(estimate, groups[i], TABLE_CHUNKS, chunks[i]);
+    estimate.endStratum();
+  }
 
-    for(size_t diBlockIdx = 0; diBlockIdx < meta->blockSize/4; diBlockIdx++)
-    {
-      if(dindBlockEntries[diBlockIdx] == 0)
+  estimate.report(freeBlocks, freeInodes);
+}
+
+/*PRIVATE -- the group's free runs, and its inodes in the sampled chunks of
+  its table*/
+void EXT2::estimateGroup(Estimate &estimate, __u32 group, __u32 tableChunks, const vector<__u32> &chunks) {
+  const ext2_group_desc &groupDesc = (*groupDescTbl)[group];
+  const __u32 TABLE_BLOCKS = inodeTableBlockCount();
+  const __u32 INODES_PER_BLOCK = meta->blockSize / meta->inodeSize;
+  const __u32 groupStart = imReader->getSuperBlock()->s_first_data_block + group * meta->blocksPerGroup;
+  const __u32 bitmapSize =
+      (group == groupDescTbl->size() - 1) ? meta->blockCount - groupStart : meta->blocksPerGroup;
+
+  estimate.beginGroup(tableChunks, chunks.size());
+  scanBitmapRanges(imReader->getBlock(groupDesc.bg_block_bitmap).get(), bitmapSize, meta->blockSize,
+                   groupStart, [&](__u32, __u32 count) { estimate.addFreeRun(count); });
+
+  shared_ptr<char[]> bitmapPtr = imReader->getBlock(groupDesc.bg_inode_bitmap, ImageReader::BlockPersistenceType::SHARED);
+  const char *bitmap = bitmapPtr.get();
+  ExtentVisitor extents(estimate);
+
+  for (__u32 chunk : chunks) {
+    const __u32 block = chunk * Estimate::CHUNK_BLOCKS;
+    const __u32 blocks = std::min(Estimate::CHUNK_BLOCKS, TABLE_BLOCKS - block);
+    const __u32 firstIdx = block * INODES_PER_BLOCK;
+    const __u32 count = std::min(blocks * INODES_PER_BLOCK, meta->inodesPerGroup - firstIdx);
+    shared_ptr<char[]> table = imReader->getBlocks(groupDesc.bg_inode_table + block, blocks);
+
+    estimate.beginChunk();
+    for (__u32 idx = firstIdx; idx < firstIdx + count; idx++) {
+      if (!((bitmap[idx / 8] >> (idx % 8)) & 0x01))
+        continue;
+      const ext2_inode &inode = *reinterpret_cast<ext2_inode*>(table.get() + (size_t)meta->inodeSize * (idx - firstIdx));
+      const size_t inodeNumber = (size_t)group * meta->inodesPerGroup + idx + 1;
+      if (inode.i_mode == 0 || inode.i_links_count == 0 || (filter && !filter->matches(inodeNumber, inode)))
         continue;
 
-      sindBlock = imReader->getBlock(dindBlockEntries[diBlockIdx], ImageReader::BlockPersistenceType::SHARED);
-      sindBlockEntries = reinterpret_cast<int*>(sindBlock.get());
+      estimate.addFile(inode);
 
-      for(size_t iBlockIdx = 0; iBlockIdx < meta->blockSize/4; iBlockIdx++)
-      {
-        if(sindBlockEntries[iBlockIdx] == 0)
+      // The same blocks, in the same order, as the FRAG lines are given
+      const __u16 mode = inode.i_mode;
+      if (!(S_ISDIR(mode) || S_ISREG(mode) || (S_ISLNK(mode) && inode.i_size > 60)))
+        continue;
+      for (size_t i = 0; i < EXT2_NDIR_BLOCKS; i++)
+        if (inode.i_block[i] != 0)
+          estimate.addBlock(inode.i_block[i]);
+      for (size_t level = 1; level <= 3 && !S_ISLNK(mode); level++) {
+        const __u32 indBlockNum = inode.i_block[EXT2_NDIR_BLOCKS + level - 1];
+        if (indBlockNum == 0)
           continue;
+        estimate.addBlock(indBlockNum);
+        scanIndirectBlockRefs(extents, imReader->getBlock(indBlockNum, ImageReader::BlockPersistenceType::SHARED),
+                              indBlockNum, indirectFirstBlock(meta->blockSize, level), inodeNumber, level);
+      }
+      estimate.endFile();
+    }
+    estimate.endChunk();
+  }
+  estimate.endGroup();
+}
 
-        dirBlock = imReader->getBlock(sindBlockEntries[iBlockIdx]);
-        entry = reinterpret_cast<ext2_dir_entry*>(dirBlock.get());
-
-        while(entryOffset < dirInode->i_size)
-        {
-          if(entry->rec_len == 0)
-            break;
-
-          if(entry->inode != 0)
-          {
-            printf("DIRENT,%lu,%lu,%d,%d,%d,'%.*s'\n",
-                    inodeNumber,
-                    logicalOffset,
-                    entry->inode,
-                    entry->rec_len,
-                    entry->name_len,
-                    entry->name_len,
-                    entry->name);
-
-            logicalOffset += entry->rec_len;
-          }
+// -------------------------------------------------- Paths
+const PathIndex &EXT2::indexPaths() {
+  if (pathIndex)
+    return *pathIndex;
+  TRACE_SCOPE("indexPaths", "section");
+
+  vector<__u32> directories;
+  forEachInodeGroup([&](const InodeColumns &inodes) {
+    for (size_t i = 0; i < inodes.count(); i++)
+      if (S_ISDIR(inodes.mode[i]))
+        directories.push_back(inodes.ino[i]);
+  });
+  pathIndex = make_unique<PathIndex>(std::move(directories));
+
+  // Each directory is linked to its parent by the first entry that names it
+  forEachDirectory([&](__u32 dir, __u32 size, const __u32 *iBlock) {
+    forEachDirectoryEntry(size, iBlock, [&](size_t, const ext2_dir_entry &entry) {
+      if (!PathIndex::isDot(entry.name, entry.name_len) && pathIndex->isDirectory(entry.inode))
+        pathIndex->link(entry.inode, dir, entry.name, entry.name_len);
+    });
+  });
+  return *pathIndex;
+}
 
-          entry = reinterpret_cast<ext2_dir_entry*>((char*)entry + entry->rec_len);
-          entryOffset += entry->rec_len;
-        }
-      }
+void EXT2::scanPaths(ScanVisitor &visitor) {
+  TRACE_SCOPE("paths", "section");
+  const PathIndex &index = indexPaths();
+
+  // A filter selects inodes, wherever they are linked from, so the matching
+  // ones are found first
+  vector<bool> matched;
+  if (filter) {
+    matched.resize((size_t)imReader->getSuperBlock()->s_inodes_count + 1);
+    forEachInode([&](size_t inodeNumber, ext2_inode *inode) {
+      matched[inodeNumber] = filter->matches(inodeNumber, *inode);
+    });
+  }
+  auto report = [&](__u32 inodeNumber, const string &path) {
+    if (!filter || (inodeNumber < matched.size() && matched[inodeNumber]))
+      visitor.onPath(inodeNumber, path.c_str(), path.size());
+  };
+
+  string dirPath, path;
+  if (index.path(EXT2_ROOT_INO, path))
+    report(EXT2_ROOT_INO, path);
+
+  // Entries of directories that cannot be reached from the root have no path
+  forEachDirectory([&](__u32 dir, __u32 size, const __u32 *iBlock) {
+    if (!index.path(dir, dirPath))
+      return;
+    if (dirPath.size() == 1)
+      dirPath.clear(); // the root, whose entries are "/name"
+
+    forEachDirectoryEntry(size, iBlock, [&](size_t, const ext2_dir_entry &entry) {
+      if (PathIndex::isDot(entry.name, entry.name_len))
+        return;
+      path = dirPath;
+      path += '/';
+      path.append(entry.name, entry.name_len);
+      report(entry.inode, path);
+    });
+  });
+}
+
+/*PRIVATE -- the directory blocks of each group are prefetched together, as in
+  scanInodes()*/
+void EXT2::forEachDirectory(std::function<void(__u32, __u32, const __u32*)> fn) {
+  vector<__u32> prefetch;
+
+  forEachInodeGroup([&](const InodeColumns &inodes) {
+    prefetch.clear();
+    for (size_t i = 0; i < inodes.count(); i++) {
+      if (!S_ISDIR(inodes.mode[i]))
+        continue;
+      const size_t blocks = std::min<size_t>((inodes.size[i] + meta->blockSize - 1) / meta->blockSize,
+                                             EXT2_NDIR_BLOCKS + 1);
+      prefetch.insert(prefetch.end(), inodes.blocksOf(i), inodes.blocksOf(i) + blocks);
     }
+    imReader->prefetch(prefetch);
+
+    for (size_t i = 0; i < inodes.count(); i++)
+      if (S_ISDIR(inodes.mode[i]))
+        fn(inodes.ino[i], inodes.size[i], inodes.blocksOf(i));
+  });
+}
+
+// -------------------------------------------------- Extended Attributes
+size_t EXT2::verifyXattrBlocks() {
+  TRACE_SCOPE("verifyXattrBlocks", "section");
+
+  // (block, inode) for every inode with an attribute block, by block
+  vector<std::pair<__u32, __u32>> refs;
+  forEachInodeGroup([&](const InodeColumns &inodes) {
+    for (size_t i = 0; i < inodes.count(); i++)
+      if (inodes.fileAcl[i] != 0)
+        refs.emplace_back(inodes.fileAcl[i], inodes.ino[i]);
+  });
+  std::sort(refs.begin(), refs.end());
+
+  size_t findings = 0;
+  forEachXattrBlock(refs, [&](__u32 block, __u32 firstInode, size_t references, const XattrCache::Block &decoded) {
+    findings += XattrCache::audit(out, block, firstInode, references, decoded.valid, decoded.refcount);
+  });
+  return findings;
+}
+
+/*PRIVATE -- calls fn(block, first inode, references, decoded) for each block
+  of 'refs' (sorted (block, inode) pairs) inside the image. Each block is read
+  once, in disk order, a batch of them prefetched ahead*/
+void EXT2::forEachXattrBlock(const vector<std::pair<__u32, __u32>> &refs,
+                             std::function<void(__u32, __u32, size_t, const XattrCache::Block&)> fn) {
+  XattrCache &cache = getXattrCache();
+  vector<__u32> prefetch;
+
+  for (size_t first = 0, next; first < refs.size(); first = next) {
+    const __u32 block = refs[first].first;
+    for (next = first + 1; next < refs.size() && refs[next].first == block; next++)
+      ;
+    if (block >= meta->blockCount)
+      continue;
+
+    if (prefetch.empty() || block >= prefetch.back()) {
+      prefetch.clear();
+      for (size_t i = first; i < refs.size() && prefetch.size() < SCAN_PREFETCH_WINDOW; i++)
+        if (refs[i].first < meta->blockCount && (prefetch.empty() || refs[i].first != prefetch.back()))
+          prefetch.push_back(refs[i].first);
+      imReader->prefetch(prefetch);
+    }
+
+    fn(block, refs[first].second, next - first, *cache.get(block));
   }
 }
 
-void EXT2::printIndirectBlockRefs(shared_ptr<char[]> indBlock, size_t indBlockNum, size_t baseLogicalOffset, size_t inodeNum, size_t level)
-{
-  uint32_t *blockIdx = reinterpret_cast<uint32_t*>(indBlock.get());
+/*PRIVATE -- blocks past the end of the image are left to the block audit*/
+void EXT2::scanXattrs(ScanVisitor &visitor, __u32 inodeNumber, __u32 block) {
+  if (block >= meta->blockCount)
+    return;
 
-  for(size_t i = 0; i < meta->blockSize/4; i++)
-  {
-    if(blockIdx[i] != 0)
-    {
-      printf("INDIRECT,%lu,%lu,%lu,%lu,%d\n",
-            inodeNum,
-            level,
-            EXT2_NDIR_BLOCKS + baseLogicalOffset + i,
-            indBlockNum,
-            blockIdx[i]
-            );
+  shared_ptr<const XattrCache::Block> decoded = getXattrCache().get(block);
+  for (auto &attribute : decoded->attributes)
+    visitor.onXattr(inodeNumber, block, attribute.name.data(), attribute.name.size(),
+                    attribute.value.data(), attribute.value.size());
+}
 
-      if(level > 1)
-        printIndirectBlockRefs(imReader->getBlock(blockIdx[i], ImageReader::BlockPersistenceType::SHARED), 
-                               blockIdx[i], baseLogicalOffset, inodeNum, level - 1);
+/*PRIVATE -- created on first use, and shared by the report and the audit*/
+XattrCache &EXT2::getXattrCache() {
+  if (!xattrCache)
+    xattrCache = make_unique<XattrCache>(*imReader, meta->blockSize, XATTR_CACHE_BUDGET);
+  return *xattrCache;
+}
+
+// -------------------------------------------------- Shards
+void EXT2::setShard(__u32 index, __u32 count) {
+  ShardHeader::groupRange(groupDescTbl->size(), index, count, shardFirstGroup, shardEndGroup);
+  shardIndex = index;
+  shardCount = count;
+}
+
+/*PRIVATE -- the SHARD line: this shard, and what every shard of the run shares*/
+ShardHeader EXT2::shardHeader(const char *kind, unsigned sections) {
+  ext2_super_block *superBlock = imReader->getSuperBlock();
+  ShardHeader header;
+  header.index = shardIndex + 1;
+  header.count = shardCount;
+  header.firstGroup = shardFirstGroup;
+  header.endGroup = shardEndGroup;
+  header.kind = kind;
+  header.sections = sections;
+  header.where = filter ? filter->getExpression() : "";
+
+  // ext2_fs.h predates s_uuid: it is the first 16 bytes of s_reserved
+  const __u8 *uuid = reinterpret_cast<const __u8*>(superBlock->s_reserved);
+  char text[33];
+  for (int i = 0; i < 16; i++)
+    snprintf(text + 2 * i, 3, "%02x", uuid[i]);
+  header.uuid = text;
+  header.writeTime = superBlock->s_wtime;
+
+  header.blockCount = meta->blockCount;
+  header.firstDataBlock = superBlock->s_first_data_block;
+  header.blocksPerGroup = meta->blocksPerGroup;
+  header.groupCount = groupDescTbl->size();
+  header.inodesCount = superBlock->s_inodes_count;
+  header.firstInode = (meta->rev == EXT2_OLD_REV) ? EXT2_GOOD_OLD_FIRST_INO : superBlock->s_first_ino;
+  return header;
+}
+
+void EXT2::printShardReport(unsigned sections) {
+  ShardWriter writer(out);
+  writer.header(shardHeader("report", sections));
+  // The SUPERBLOCK line belongs to no group: the first shard writes it
+  printReport(shardIndex == 0 ? sections : sections & ~SECTION_SUPER);
+  writer.end();
+}
+
+void EXT2::printShardAudit(bool audit, bool allBackups) {
+  TRACE_SCOPE("shardAudit", "section");
+  ShardWriter writer(out);
+  writer.header(shardHeader(audit ? (allBackups ? "audit+backups" : "audit") : "backups", 0));
+
+  // -------------------------------------------------- Backups
+  // A check of the whole image, but a cheap one: the first shard makes it,
+  // and its findings are passed on as they are
+  if (shardIndex == 0) {
+    char *text = nullptr;
+    size_t length = 0;
+    FILE *findings = open_memstream(&text, &length);
+    if (!findings)
+      throw runtime_error(IMPOSSIBLE_MALLOC);
+
+    FILE *report = out;
+    out = findings;
+    try {
+      checkBackups(allBackups);
+    } catch (...) {
+      out = report;
+      fclose(findings);
+      free(text);
+      throw;
+    }
+    out = report;
+    fclose(findings);
+
+    for (char *line = text, *end; line < text + length; line = end + 1) {
+      end = static_cast<char*>(memchr(line, '\n', text + length - line));
+      if (!end)
+        end = text + length;
+      writer.backup(line, end - line);
+    }
+    free(text);
+  }
+
+  if (!audit) {
+    writer.end();
+    return;
+  }
+
+  // -------------------------------------------------- Block References
+  // Every shard follows the references of its own inodes, which needs every
+  // reserved block of the image
+  ShardBlockLog blocks(writer, meta->blockCount, imReader->getSuperBlock()->s_first_data_block,
+                       meta->blocksPerGroup, groupDescTbl->size(), meta->blockSize, shardIndex == 0);
+  reserveMetadata(blocks);
+
+  vector<std::pair<__u32, __u32>> xattrRefs; // (block, inode)
+  forEachInodeGroup([&](const InodeColumns &inodes) {
+    for (size_t i = 0; i < inodes.count(); i++) {
+      auditInodeBlocks(blocks, inodes.ino[i], inodes.mode[i], inodes.size[i], inodes.blocksOf(i));
+      if (inodes.fileAcl[i] != 0)
+        xattrRefs.emplace_back(inodes.fileAcl[i], inodes.ino[i]);
+    }
+  });
+
+  // -------------------------------------------------- Extended Attributes
+  std::sort(xattrRefs.begin(), xattrRefs.end());
+  for (auto &ref : xattrRefs)
+    writer.xattrRef(ref.first, ref.second);
+  forEachXattrBlock(xattrRefs, [&](__u32 block, __u32, size_t, const XattrCache::Block &decoded) {
+    writer.xattrBlock(block, decoded.valid, decoded.refcount);
+  });
+
+  // -------------------------------------------------- On-Disk Bitmaps
+  const __u32 GROUP_COUNT = groupDescTbl->size();
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+    shared_ptr<char[]> bitmap = imReader->getBlock((*groupDescTbl)[group].bg_block_bitmap);
+    blocks.loadBitmap(group, bitmap.get(),
+                      (group == GROUP_COUNT - 1) ? meta->blocksInLastGroup : meta->blocksPerGroup);
+  }
+
+  // -------------------------------------------------- Directory Graph
+  // The inodes as DirGraph::addInode() sees them (those it ignores are left
+  // out), then the entries of the shard's directories
+  vector<__u32> directories;
+  for (__u32 group = shardFirstGroup; group < shardEndGroup; group++) {
+    forEachTableInode(group, [&](__u32 inodeNumber, const ext2_inode *inode, bool inBitmap) {
+      if (inode->i_mode == 0 && !inBitmap)
+        return;
+      writer.inode(inodeNumber, inode->i_mode, inode->i_links_count, inBitmap);
+
+      if (S_ISDIR(inode->i_mode) && inode->i_links_count != 0)
+        directories.push_back(inodeNumber);
+    });
+  }
+
+  ShardEdgeLog edges(writer);
+  for (__u32 inodeNumber : directories) {
+    ext2_inode inode;
+    readInode(inodeNumber, inode);
+    scanDirectory(edges, 0, DirGraph::Directory::of(inodeNumber, &inode), true);
+  }
+  writer.end();
+}
+
+// -------------------------------------------------- Extraction
+struct EXT2::Extraction {
+  ThreadPool pool;
+  std::mutex lock;
+  std::set<__u32> directories; // extracted (or being extracted) so far
+  vector<string> errors;
+
+  void fail(const string &destination, const char *error) {
+    std::lock_guard<std::mutex> guard(lock);
+    errors.push_back(destination + ": " + error);
+  }
+};
+
+// A directory of the extracted tree, open for as long as tasks still create
+// entries in it. Entries are made relative to it, one name at a time and
+// without following symbolic links, so that nothing in the image (such as a
+// symbolic link and a directory of the same name) can redirect a write
+// outside of the destination. It is created writable; its own mode and times
+// are given back once the last of those tasks is done, since every entry
+// made in it would change its mtime
+struct EXT2::OutputDirectory {
+  Extraction &extraction;
+  const int fd;
+  const string destination;
+  const mode_t mode;
+  const struct timespec times[2];
+
+  OutputDirectory(Extraction &extraction, int fd, const string &destination, const ext2_inode &inode)
+      : extraction(extraction), fd(fd), destination(destination), mode(inode.i_mode & 07777),
+        times{{(time_t)inode.i_atime, 0}, {(time_t)inode.i_mtime, 0}} {}
+
+  ~OutputDirectory() {
+    if (fchmod(fd, mode) != 0)
+      extraction.fail(destination, (string("CannotSetMode: ") + strerror(errno)).c_str());
+    else if (futimens(fd, times) != 0)
+      extraction.fail(destination, (string("CannotSetTimes: ") + strerror(errno)).c_str());
+    close(fd);
+  }
+};
+
+vector<string> EXT2::extract(const string &source, const string &destination) {
+  TRACE_SCOPE("extract", "section");
+  const __u32 inodeNumber = resolvePath(source);
+
+  Extraction extraction{ThreadPool(std::max(1u, std::thread::hardware_concurrency())), {}, {}, {}};
+  extraction.pool.submit([&]() { extractInode(extraction, inodeNumber, nullptr, destination, destination); });
+  extraction.pool.wait();
+
+  return extraction.errors;
+}
+
+/*PRIVATE*/
+__u32 EXT2::resolvePath(const string &path) {
+  // A plain number is an inode number
+  if (!path.empty() && path.find_first_not_of("0123456789") == string::npos) {
+    const unsigned long inodeNumber = strtoul(path.c_str(), nullptr, 10);
+    if (inodeNumber == 0 || inodeNumber > imReader->getSuperBlock()->s_inodes_count)
+      throw runtime_error("NoSuchInode: " + path);
+    return inodeNumber;
+  }
+
+  __u32 inodeNumber = EXT2_ROOT_INO;
+  std::stringstream ss(path);
+  string name;
+
+  while (std::getline(ss, name, '/')) {
+    if (name.empty() || name == ".")
+      continue;
+
+    ext2_inode dir;
+    readInode(inodeNumber, dir);
+    if (!S_ISDIR(dir.i_mode))
+      throw runtime_error("NotADirectory: " + path);
+
+    __u32 found = 0;
+    forEachDirectoryEntry(dir.i_size, dir.i_block, [&](size_t, const ext2_dir_entry &entry) {
+      if (!found && name.compare(0, string::npos, entry.name, entry.name_len) == 0)
+        found = entry.inode;
+    });
+    if (found == 0)
+      throw runtime_error("NoSuchFile: " + path);
+    inodeNumber = found;
+  }
+  return inodeNumber;
+}
+
+void EXT2::readInode(__u32 inodeNumber, ext2_inode &inode) {
+  if (inodeNumber == 0 || inodeNumber > imReader->getSuperBlock()->s_inodes_count)
+    throw runtime_error("InvalidInodeNumber");
+
+  const __u32 group = (inodeNumber - 1) / meta->inodesPerGroup;
+  const __u32 index = (inodeNumber - 1) % meta->inodesPerGroup;
+  const size_t offset = (size_t)(*groupDescTbl)[group].bg_inode_table * meta->blockSize +
+                        (size_t)index * meta->inodeSize;
+  imReader->readBytes(offset, sizeof(ext2_inode), reinterpret_cast<char*>(&inode));
+}
+
+void EXT2::forEachFileRun(const ext2_inode &inode, uint64_t blockCount,
+                          std::function<void(uint64_t, __u32, __u32)> fn) {
+  uint64_t runLogical = 0;
+  __u32 runPhysical = 0, runLength = 0;
+
+  forEachDataBlock(inode.i_block, blockCount, [&](uint64_t logical, __u32 physical) {
+    if (runLength > 0 && logical == runLogical + runLength && physical == runPhysical + runLength) {
+      runLength++;
+      return;
+    }
+    if (runLength > 0)
+      fn(runLogical, runPhysical, runLength);
+    runLogical = logical;
+    runPhysical = physical;
+    runLength = 1;
+  });
+
+  if (runLength > 0)
+    fn(runLogical, runPhysical, runLength);
+}
+
+/*PRIVATE -- 'parent' is null for the destination given by the user, which
+  is a path and may already exist. Every entry below it is created in its
+  parent directory, and must not exist yet*/
+void EXT2::extractInode(Extraction &extraction, __u32 inodeNumber, shared_ptr<OutputDirectory> parent,
+                        const string &name, const string &destination) {
+  try {
+    ext2_inode inode;
+    readInode(inodeNumber, inode);
+
+    const int dirFd = parent ? parent->fd : AT_FDCWD;
+    const char *path = parent ? name.c_str() : destination.c_str();
+
+    if (S_ISREG(inode.i_mode)) {
+      extractFile(inode, dirFd, path, parent != nullptr);
+    } else if (S_ISLNK(inode.i_mode)) {
+      extractSymlink(inode, dirFd, path);
+    } else if (S_ISDIR(inode.i_mode)) {
+      {
+        // A corrupt image may link a directory twice, or into its own subtree
+        std::lock_guard<std::mutex> guard(extraction.lock);
+        if (!extraction.directories.insert(inodeNumber).second)
+          throw runtime_error("DirectoryAlreadyExtracted");
+      }
+
+      if (mkdirat(dirFd, path, S_IRWXU) != 0 && (parent || errno != EEXIST))
+        throw runtime_error(errno == EEXIST ? string("DuplicateEntryName")
+                                            : string("CannotCreateDirectory: ") + strerror(errno));
+
+      const int fd = openat(dirFd, path, O_RDONLY | O_DIRECTORY | (parent ? O_NOFOLLOW : 0));
+      if (fd < 0)
+        throw runtime_error(string("CannotOpenDirectory: ") + strerror(errno));
+      shared_ptr<OutputDirectory> dir = std::make_shared<OutputDirectory>(extraction, fd, destination, inode);
+      // An existing destination, or one the umask left read-only, must take
+      // the entries first
+      if (fchmod(fd, S_IRWXU) != 0)
+        throw runtime_error(string("CannotSetMode: ") + strerror(errno));
+
+      // Every entry becomes a task of its own, so a large tree spreads over
+      // the whole pool
+      forEachDirectoryEntry(inode.i_size, inode.i_block, [&](size_t, const ext2_dir_entry &entry) {
+        if (entry.name_len == 0 || PathIndex::isDot(entry.name, entry.name_len) ||
+            memchr(entry.name, '/', entry.name_len))
+          return;
+        const __u32 entryInode = entry.inode;
+        const string name(entry.name, entry.name_len);
+        extraction.pool.submit([this, &extraction, entryInode, dir, name, destination]() {
+          extractInode(extraction, entryInode, dir, name, destination + "/" + name);
+        });
+      });
+    } else {
+      throw runtime_error("UnsupportedFileType");
     }
+  } catch (runtime_error &e) {
+    extraction.fail(destination, e.what());
+  } catch (std::exception &e) {
+    extraction.fail(destination, e.what());
   }
 }
 
+/*PRIVATE -- an 'exclusive' file must not exist yet, not even as a symbolic link*/
+void EXT2::extractFile(const ext2_inode &inode, int dirFd, const char *path, bool exclusive) {
+  TRACE_SCOPE("extract.file", "file");
+  const uint64_t size = fileSize(inode);
+
+  int fd = openat(dirFd, path, O_WRONLY | O_CREAT | (exclusive ? O_EXCL | O_NOFOLLOW : O_TRUNC),
+                  inode.i_mode & 07777);
+  if (fd < 0)
+    throw runtime_error(errno == EEXIST ? string("DuplicateEntryName")
+                                        : string("CannotCreateFile: ") + strerror(errno));
+
+  try {
+    // Only allocated runs are copied; whatever lies between them is left as
+    // a hole, and the final size (and any trailing hole) comes from ftruncate
+    forEachFileRun(inode, (size + meta->blockSize - 1) / meta->blockSize,
+                   [&](uint64_t logical, __u32 physical, __u32 count) {
+      const uint64_t start = logical * meta->blockSize;
+      const uint64_t length = std::min<uint64_t>((uint64_t)count * meta->blockSize, size - start);
+      imReader->copyBytes((size_t)physical * meta->blockSize, length, fd, start);
+    });
+
+    if (ftruncate(fd, size) != 0)
+      throw runtime_error(string("CannotWriteFile: ") + strerror(errno));
+
+    // The mode given to openat() went through the umask
+    if (fchmod(fd, inode.i_mode & 07777) != 0)
+      throw runtime_error(string("CannotSetMode: ") + strerror(errno));
+    const struct timespec times[2] = {{(time_t)inode.i_atime, 0}, {(time_t)inode.i_mtime, 0}};
+    if (futimens(fd, times) != 0)
+      throw runtime_error(string("CannotSetTimes: ") + strerror(errno));
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+
+  if (close(fd) != 0)
+    throw runtime_error(string("CannotWriteFile: ") + strerror(errno));
+}
+
+uint64_t EXT2::fileSize(const ext2_inode &inode) {
+  // Revision 0 has no large files
+  if (meta->rev == EXT2_OLD_REV)
+    return inode.i_size;
+  return CsvVisitor::fileSize(inode);
+}
+
+void EXT2::extractSymlink(const ext2_inode &inode, int dirFd, const char *path) {
+  string target;
+
+  // Fast symbolic links keep their target in i_block
+  if (inode.i_size <= 60) {
+    target.assign(reinterpret_cast<const char*>(inode.i_block), inode.i_size);
+  } else {
+    if (inode.i_size >= meta->blockSize || inode.i_block[0] == 0 || inode.i_block[0] >= meta->blockCount)
+      throw runtime_error("InvalidSymbolicLink");
+    unique_ptr<char[]> buf(new char[meta->blockSize]);
+    imReader->readBlocks(inode.i_block[0], 1, buf.get());
+    target.assign(buf.get(), inode.i_size);
+  }
+
+  if (symlinkat(target.c_str(), dirFd, path) != 0)
+    throw runtime_error(errno == EEXIST ? string("DuplicateEntryName")
+                                        : string("CannotCreateSymbolicLink: ") + strerror(errno));
+
+  // A symbolic link has no mode of its own, but it has times
+  const struct timespec times[2] = {{(time_t)inode.i_atime, 0}, {(time_t)inode.i_mtime, 0}};
+  if (utimensat(dirFd, path, times, AT_SYMLINK_NOFOLLOW) != 0)
+    throw runtime_error(string("CannotSetTimes: ") + strerror(errno));
+}
+
+
+// -------------------------------------------------- Scan Kernels
+// The hot loops are compiled once per supported block size (BS) and inode size
+// (IS), so that strides and loop bounds are constants. A parameter of 0 reads
+// the value from meta instead, for any other geometry. Kernels without a
+// callback are chosen once, right after the Super Block is parsed. Kernels
+// that take one are also templated on it, so that it is inlined into the loop;
+// their wrappers pick the specialization with withBlockSize()/withInodeSize().
+template <__u32 BS>
+void EXT2::selectBlockKernels() {
+  kernels.scanIndirectBlockRefs = &EXT2::scanIndirectBlockRefsKernel<BS>;
+  kernels.auditIndirectBlock = &EXT2::auditIndirectBlockKernel<BS>;
+}
+
+void EXT2::selectKernels() {
+  switch (meta->blockSize) {
+    case 1 * KiB: selectBlockKernels<1 * KiB>(); break;
+    case 2 * KiB: selectBlockKernels<2 * KiB>(); break;
+    case 4 * KiB: selectBlockKernels<4 * KiB>(); break;
+    case 8 * KiB: selectBlockKernels<8 * KiB>(); break;
+    default:      selectBlockKernels<0>(); break;
+  }
+
+}
+
+/*PRIVATE -- calls fn(std::integral_constant<__u32, BS>()) for the block size
+  specialization matching the image, as selectKernels() does*/
+template <typename Fn>
+void EXT2::withBlockSize(Fn &&fn) {
+  switch (meta->blockSize) {
+    case 1 * KiB: fn(std::integral_constant<__u32, 1 * KiB>()); break;
+    case 2 * KiB: fn(std::integral_constant<__u32, 2 * KiB>()); break;
+    case 4 * KiB: fn(std::integral_constant<__u32, 4 * KiB>()); break;
+    case 8 * KiB: fn(std::integral_constant<__u32, 8 * KiB>()); break;
+    default:      fn(std::integral_constant<__u32, 0>()); break;
+  }
+}
+
+/*PRIVATE -- likewise, for the inode size*/
+template <typename Fn>
+void EXT2::withInodeSize(Fn &&fn) {
+  switch (meta->inodeSize) {
+    case 128: fn(std::integral_constant<__u32, 128>()); break;
+    case 256: fn(std::integral_constant<__u32, 256>()); break;
+    default:  fn(std::integral_constant<__u32, 0>()); break;
+  }
+}
+
+template <typename Fn>
+void EXT2::forEachDirectoryEntry(__u32 size, const __u32 *iBlock, Fn &&fn) {
+  withBlockSize([&](auto bs) { forEachDirectoryEntryKernel<decltype(bs)::value>(size, iBlock, fn); });
+}
+
+void EXT2::scanDirInode(ScanVisitor &visitor, ext2_inode *dirInode, size_t inodeNumber) {
+  forEachDirectoryEntry(dirInode->i_size, dirInode->i_block, [&](size_t offset, const ext2_dir_entry &entry) {
+    visitor.onDirEntry(inodeNumber, offset, entry);
+  });
+}
+
+void EXT2::scanIndirectBlockRefs(ScanVisitor &visitor, shared_ptr<char[]> indBlock, size_t indBlockNum,
+                                 size_t baseLogicalOffset, size_t inodeNum, size_t level) {
+  (this->*kernels.scanIndirectBlockRefs)(visitor, indBlock, indBlockNum, baseLogicalOffset, inodeNum, level);
+}
+
+void EXT2::auditIndirectBlock(BlockAudit &audit, __u32 indBlockNum, __u32 inodeNumber,
+                              __u32 baseOffset, __u8 level) {
+  (this->*kernels.auditIndirectBlock)(audit, indBlockNum, inodeNumber, baseOffset, level);
+}
+
+/*PRIVATE -- thread-safe*/
+template <typename Fn>
+void EXT2::forEachDataBlock(const __u32 *iBlock, uint64_t count, Fn &&fn) {
+  withBlockSize([&](auto bs) { forEachDataBlockKernel<decltype(bs)::value>(iBlock, count, fn); });
+}
+
+
+/*PRIVATE -- thread-safe*/
+void EXT2::scanDirectory(DirGraph &graph, unsigned worker, const DirGraph::Directory &dir, bool collect) {
+  forEachDirectoryEntry(dir.size, dir.block, [&](size_t offset, const ext2_dir_entry &entry) {
+    graph.addEdge(worker, dir.inode, entry.inode, entry.name, entry.name_len, offset, collect);
+  });
+}
+
 /*PRIVATE -- throws labeled runtime_error*/
 bool EXT2::validateSuperBlock() {
-  // Returns true if valid, else false. 
+  // Returns true if valid, else false. Only what the scan relies on is checked
+  // here; the block size and group count were checked by getMetaFileInfo().
   ext2_super_block *superBlock = this->imReader->getSuperBlock();
+  const __u32 BITS_PER_BLOCK = meta->blockSize * 8;
 
   // The major revision number will inform the DS&A we use to read the FS. Here,
   // we check the revision number and set specific flags that we will use during
@@ -717,16 +1995,33 @@ bool EXT2::validateSuperBlock() {
   meta->rev = superBlock->s_rev_level;
 
   switch(meta->rev) {
-    case 0: // Revision 0
-      if(superBlock->s_first_ino != EXT2_GOOD_OLD_FIRST_INO)
+    case 0: // Revision 0 (s_first_ino is not defined, but must not be wrong)
+      if(superBlock->s_first_ino != 0 && superBlock->s_first_ino != EXT2_GOOD_OLD_FIRST_INO)
         return false;
       break;
 
     case 1: // Revision 1
+      if(superBlock->s_first_ino < EXT2_GOOD_OLD_FIRST_INO)
+        return false;
+      if(meta->inodeSize < EXT2_OLD_INODE_SIZE || meta->inodeSize > meta->blockSize ||
+         (meta->inodeSize & (meta->inodeSize - 1)) != 0)
+        return false;
       break;
     default: // Error
       return false;
   }
+
+  // Each group's bitmaps are a single block
+  if(meta->blocksPerGroup > BITS_PER_BLOCK || meta->inodesPerGroup == 0 ||
+     meta->inodesPerGroup > BITS_PER_BLOCK)
+    return false;
+
+  if(superBlock->s_first_data_block != ((meta->blockSize == KiB) ? 1u : 0u))
+    return false;
+
+  if((uint64_t)meta->blockGroupsCount * meta->inodesPerGroup != superBlock->s_inodes_count)
+    return false;
+
   return true;
 }
 
@@ -746,39 +2041,28 @@ void EXT2::printDescTable(struct ext2_group_desc gd) {
 void EXT2::setBlocksInLastGroup() {
   // --------------------------------------------------
   // Blocks in last group
-  __u32 fsSize = meta->stat.st_size;
-  __u32 blockSize = meta->blockSize;
-  __u32 groupSize = meta->blockGroupSize;
-
-  if(fsSize < groupSize || fsSize % groupSize != 0) {
-    // The total number of blocks in the last group may not be equal to the
-    // s_blocks_per_group value found in the Super Block.
-    //
-    // This might happen if:
-    // A) (fs.size < group.size)
-    // B) (fs.size % group.size) != 0
-    //
-    // If that is the case, we can find the total number of blocks in the last
-    // group by finding the residual.
-    if(groupDescTbl->size() <= 0)
-      throw EXT2_error("EmptyGroupDescriptorTable");
-
-    __u32 fullGroupsCount = groupDescTbl->size() - 1; // last group not included
-    int res = (fsSize - (fullGroupsCount * groupSize)) / blockSize;
+  // The total number of blocks in the last group may not be equal to the
+  // s_blocks_per_group value found in the Super Block: the groups share
+  // s_blocks_count between them, and the last one holds the residual. This is
+  // worked out from the Super Block in 64 bits, since neither the image size
+  // nor the size of all the full groups fits in 32 bits on large images.
+  if(groupDescTbl->size() <= 0)
+    throw EXT2_error("EmptyGroupDescriptorTable");
 
-    if (debug) {
-      printf("------------------------------blocksInLastGroup()\n");
-      printf("File Size: %d...\n", fsSize);
-      printf("Number of Full Groups: %d...\n", fullGroupsCount);
-      printf("Group Size: %d...\n", groupSize);
-      printf("Block Size: %d...\n", blockSize);
-      printf("Blocks in Last Group: %d...\n", res);
-      printf("------------------------------/blocksInLastGroup()\n");
-    }
+  const __u32 fullGroupsCount = groupDescTbl->size() - 1; // last group not included
+  const uint64_t fullGroupsBlocks = (uint64_t)fullGroupsCount * meta->blocksPerGroup;
+  const __u32 res = meta->blockCount - fullGroupsBlocks;
+
+  if (debug) {
+    printf("------------------------------blocksInLastGroup()\n");
+    printf("Blocks Count: %u...\n", meta->blockCount);
+    printf("Number of Full Groups: %u...\n", fullGroupsCount);
+    printf("Blocks Per Group: %u...\n", meta->blocksPerGroup);
+    printf("Blocks in Last Group: %u...\n", res);
+    printf("------------------------------/blocksInLastGroup()\n");
+  }
 
-    meta->blocksInLastGroup = res;
-  } else
-    meta->blocksInLastGroup = meta->blocksPerGroup;
+  meta->blocksInLastGroup = res;
 }
 
 void EXT2::setInodesInLastGroup() {
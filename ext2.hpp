@@ -1,5 +1,20 @@
 #include "imagereader.hpp"
 #include "metafile.hpp"
+#include "blockaudit.hpp"
+#include "blockowners.hpp"
+#include "backupcheck.hpp"
+#include "dirgraph.hpp"
+#include "estimate.hpp"
+#include "fragstats.hpp"
+#include "groupdesctable.hpp"
+#include "scanvisitor.hpp"
+#include "csvvisitor.hpp"
+#include "memorybudget.hpp"
+#include "inodecolumns.hpp"
+#include "inodefilter.hpp"
+#include "pathindex.hpp"
+#include "shard.hpp"
+#include "xattrcache.hpp"
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -13,6 +28,7 @@
 #include <stdexcept>
 #include <vector>
 #include <ctime>
+#include <functional>
 
 #define KiB 1024
 #define SUPERBLOCK_SIZE sizeof(ext2_super_block)
@@ -20,6 +36,13 @@
 #define EXT2_DYNAMIC_REV 1
 #define EXT2_OLD_INODE_SIZE 128
 #define IMPOSSIBLE_MALLOC "MemoryAllocationImpossible"
+#define DIRGRAPH_MEMORY_BUDGET (256 * KiB * KiB)
+#define DIRGRAPH_MIN_BUDGET (64 * KiB)
+#define INODE_COLUMN_CACHE_BUDGET (256 * KiB * KiB)
+#define XATTR_CACHE_BUDGET (16 * KiB * KiB) // decoded extended attribute blocks
+#define SCAN_PREFETCH_WINDOW 256 // inodes whose blocks are prefetched together
+#define FILE_HASH_BATCH 4096 // files hashed per round of the thread pool
+#define FILE_HASH_CHUNK (1 * KiB * KiB) // bytes read at a time, per worker
 
 const __u8 MASK = 0xFF;
 const __u32 MASK_SIZE = sizeof(__u8) * 8;
@@ -48,24 +71,154 @@ public:
   string s_;
 };
 
+// -------------------------------------------------- Report Sections
+// Bitmask selecting which parts of the report are produced. Sections that are
+// not selected are never computed: e.g. SECTION_IFREE alone only reads the
+// inode bitmaps, and SECTION_SUPER | SECTION_GROUPS reads no bitmaps or inode
+// tables at all.
+enum ReportSection : unsigned {
+  SECTION_SUPER    = 1 << 0, // SUPERBLOCK
+  SECTION_GROUPS   = 1 << 1, // GROUP
+  SECTION_BFREE    = 1 << 2, // BFREE
+  SECTION_IFREE    = 1 << 3, // IFREE
+  SECTION_INODES   = 1 << 4, // INODE
+  SECTION_DIRENT   = 1 << 5, // DIRENT (reads directory blocks)
+  SECTION_INDIRECT = 1 << 6, // INDIRECT (reads indirect blocks)
+  SECTION_INODE_WALK = SECTION_INODES | SECTION_DIRENT | SECTION_INDIRECT,
+  SECTION_ALL      = 0x7F,
+  SECTION_FRAG     = 1 << 7, // FILEFRAG and FRAG (reads indirect blocks), not part of ALL
+  SECTION_HASH     = 1 << 8, // FILEHASH (reads every regular file), not part of ALL
+  SECTION_PATH     = 1 << 9, // PATH (reads directory blocks), not part of ALL
+  SECTION_DIRENT_PATH = 1 << 10, // a full path column on DIRENT lines, not part of ALL
+  SECTION_XATTR    = 1 << 11, // XATTR (reads extended attribute blocks), not part of ALL
+};
+
 // -------------------------------------------------- EXT2
 class EXT2 {
  public:
   EXT2(char *);
   ~EXT2();
+
+  // Reports are written to stdout unless redirected here
+  void setOutput(FILE *stream) { out = stream; }
+  // Only inodes matching the filter (and their entries and indirect blocks)
+  // are reported by scanInodes. The filter must outlive the scan
+  void setFilter(const InodeFilter *inodeFilter) { filter = inodeFilter; }
   bool readSuperBlock(); // validate and populate superBlock
   bool parseSuperBlock(); // validate and populate metaFile
 
-  // Top Level Reporting Methods
+  // Top Level Reporting Methods (CSV)
   void printSuperBlock();
   void printGroupSummary();
   void printFreeBlockEntries();
   void printFreeInodeEntries();
-  void printInodeSummary();
+  void printInodeSummary(unsigned sections = SECTION_INODE_WALK);
+  void printFileHashes();
+  void printPaths();
   // void printDirectoryEntries();
-  
+
+  /*Prints the selected ReportSections, in report order*/
+  void printReport(unsigned sections = SECTION_ALL);
+
+  // Scans -- walk the image and hand each decoded structure to a visitor
+  void scanSuperBlock(ScanVisitor&);
+  void scanGroups(ScanVisitor&);
+  void scanFreeBlocks(ScanVisitor&);
+  void scanFreeInodes(ScanVisitor&);
+  /*Reports each run of clear bits among the first 'bits' of a one block
+    'bitmap' as a range, numbered from 'firstNumber'*/
+  static void scanBitmapRanges(const char *bitmap, __u32 bits, __u32 blockSize, __u32 firstNumber,
+                               std::function<void(__u32, __u32)> onRange);
+  /*Calls fn(offset, entry) for each entry in use of one directory block. An
+    entry must fit in the block, and its name in the entry: the rest of the
+    block is skipped from the first one that does not. Every walk over
+    directory entries, StreamScan's included, validates them here*/
+  template <typename Fn>
+  static void forEachBlockEntry(const char *block, __u32 blockSize, Fn &&fn) {
+    const size_t ENTRY_HEADER = 8; // inode, rec_len, name_len, file_type
+
+    for (size_t off = 0; off + ENTRY_HEADER <= blockSize;) {
+      const ext2_dir_entry &entry = *reinterpret_cast<const ext2_dir_entry*>(block + off);
+      if (entry.rec_len < ENTRY_HEADER || off + entry.rec_len > blockSize ||
+          entry.name_len > entry.rec_len - ENTRY_HEADER)
+        break;
+
+      if (entry.inode != 0)
+        fn(off, entry);
+      off += entry.rec_len;
+    }
+  }
+  /*Logical block number of the first block mapped through the single
+    (level 1), double (2) or triple (3) indirect block of an inode*/
+  static size_t indirectFirstBlock(__u32 blockSize, __u32 level);
+  void scanInodes(ScanVisitor&, unsigned sections = SECTION_INODE_WALK, // inodes, directory entries and indirect refs
+                  FragStats *frag = nullptr); // and the layout of every file, in the same pass
+  void scanFileHashes(ScanVisitor&); // regular files, hashed on a thread pool
+  void scanPaths(ScanVisitor&); // every directory entry but '.' and '..', with its full path
+
+  /*The path of every directory, built from the directory blocks by the first
+    call and kept until the EXT2 is destroyed*/
+  const PathIndex &indexPaths();
+
+  // Consistency Checks (return the number of inconsistencies found)
+  size_t auditBlocks();
+  size_t verifyDirectoryGraph();
+  /*Compares the reference count of every extended attribute block with the
+    number of inodes that point to it, and checks that it can be decoded*/
+  size_t verifyXattrBlocks();
+
+  /*Cross-checks the backup Super Blocks and Group Descriptor Tables against the
+    primary ones: all of them, or a bounded sample (see BackupCheck)*/
+  size_t checkBackups(bool all = false);
+
+  /*Approximate distributions of free space, file types, sizes and extents
+    from a random sample of a 'fraction' of the inode tables, instead of the
+    report (see Estimate)*/
+  void printEstimate(double fraction, uint64_t seed);
+
+  /*Records the owner of every block referenced by an inode or reserved for
+    the file system's metadata, then finishes the index*/
+  void indexBlockOwners(BlockOwners&);
+
+  // Shards -- see shard.hpp
+  /*Restricts the report and the audit's reading to the groups of shard
+    'index' (0 to count - 1) of 'count'*/
+  void setShard(__u32 index, __u32 count);
+  /*The report of the shard's groups, as a report shard*/
+  void printShardReport(unsigned sections);
+  /*The backup check (by the first shard) and, if 'audit', everything the
+    audits need of the shard's groups, as an audit shard*/
+  void printShardAudit(bool audit, bool allBackups);
+
+  /*0 if the primary Super Block is in use, else the group of the backup that
+    replaced a damaged primary*/
+  __u32 getSuperBlockGroup() const { return superBlockGroup; }
+
+  // Inode Columns -- the allocated inodes of each group, decoded
+  /*Calls fn once per group (of the shard, if any), in order. Decoded groups are cached, so later
+    passes neither read nor decode the inode tables again*/
+  void forEachInodeGroup(std::function<void(const InodeColumns&)>);
+
+  // Extraction
+  /*Copies the regular file, symbolic link or directory tree 'source' (a path
+    from the root of the image, or an inode number) to 'destination'. Holes
+    stay holes, and directories are extracted on a thread pool. Returns one
+    message per entry that could not be extracted. Throws runtime_error if
+    'source' does not exist*/
+  vector<string> extract(const string &source, const string &destination);
+
 
  private:
+  FILE *out = stdout;
+  const InodeFilter *filter = nullptr;
+  __u32 superBlockGroup = 0;
+
+  // ~shard~ -- the groups [shardFirstGroup, shardEndGroup) are the ones read
+  __u32 shardIndex = 0;
+  __u32 shardCount = 1;
+  __u32 shardFirstGroup = 0;
+  __u32 shardEndGroup = 0;
+
   // ~imReader~ provides an interface for file operations
   unique_ptr<ImageReader> imReader = nullptr;
 
@@ -73,14 +226,22 @@ class EXT2 {
   // file system itself
   unique_ptr<MetaFile> meta = nullptr;
 
-  // ~groupDescTbl~ contains a copy of the /first/ Group Descriptor Table
-  unique_ptr<vector<ext2_group_desc>> groupDescTbl = nullptr;
+  // ~groupDescTbl~ pages in the Group Descriptor Table in use as it is read
+  unique_ptr<GroupDescTable> groupDescTbl = nullptr;
 
 
   unique_ptr<ext2_inode> rootInode = nullptr;
   unique_ptr<vector<ext2_inode>> inodeTbl = nullptr;
-  unique_ptr<vector<ext2_inode *>> inodeDirType = nullptr;
-  unique_ptr<list<ext2_dir_entry>> dirTree = nullptr;
+
+  // ~inodeColumns~ caches decoded groups (null = not cached); see getInodeColumns()
+  vector<unique_ptr<InodeColumns>> inodeColumns;
+  unique_ptr<InodeColumns> inodeColumnScratch;
+  vector<bool> inodeColumnsDecoded;
+  vector<MemoryGrant> inodeColumnGrants;
+  size_t inodeColumnBytes = 0;
+
+  unique_ptr<PathIndex> pathIndex;
+  unique_ptr<XattrCache> xattrCache; // see getXattrCache()
 
 
   void blockDump(size_t);
@@ -89,11 +250,76 @@ class EXT2 {
   void getMetaFileInfo(ext2_super_block*);
   bool getGroupDescTbl();
 
-  void printDirInode(ext2_inode*, size_t);
-  void printIndirectBlockRefs(shared_ptr<char[]>, size_t, size_t, size_t, size_t);
+  // -------------------------------------------------- Scan Kernels
+  // Specialized on block size (BS) and inode size (IS); see selectKernels()
+  struct Kernels {
+    void (EXT2::*scanIndirectBlockRefs)(ScanVisitor&, shared_ptr<char[]>, size_t, size_t, size_t, size_t);
+    void (EXT2::*auditIndirectBlock)(BlockAudit&, __u32, __u32, __u32, __u8);
+  } kernels;
+
+  void selectKernels();
+  template <__u32 BS> void selectBlockKernels();
+  template <typename Fn> void withBlockSize(Fn &&);
+  template <typename Fn> void withInodeSize(Fn &&);
+  template <__u32 IS, typename Fn> void forEachGroupInodeKernel(__u32, Fn &);
+  template <__u32 BS> void scanIndirectBlockRefsKernel(ScanVisitor&, shared_ptr<char[]>, size_t, size_t, size_t, size_t);
+  template <__u32 BS> void auditIndirectBlockKernel(BlockAudit&, __u32, __u32, __u32, __u8);
+  template <__u32 BS, typename Fn> void forEachDataBlockKernel(const __u32*, uint64_t, Fn &);
+  template <__u32 BS, typename Fn> void forEachIndirectDataBlockKernel(__u32, __u32, uint64_t, uint64_t, Fn &);
+  template <__u32 BS, typename Fn> void forEachDirectoryEntryKernel(__u32, const __u32*, Fn &);
+
+  void scanDirInode(ScanVisitor&, ext2_inode*, size_t);
+  void scanIndirectBlockRefs(ScanVisitor&, shared_ptr<char[]>, size_t, size_t, size_t, size_t);
+  void scanXattrs(ScanVisitor&, __u32 inodeNumber, __u32 block);
+  void forEachXattrBlock(const vector<std::pair<__u32, __u32>> &refs,
+                         std::function<void(__u32, __u32, size_t, const XattrCache::Block&)>);
+  XattrCache &getXattrCache();
+
+  bool groupHasSuperBlock(__u32);
+  __u32 inodeTableBlockCount();
+  void forEachInodeTableChunk(__u32 group, std::function<void(__u32, __u32, char*)>,
+                              const char *bitmap = nullptr);
+  template <typename Fn> void forEachInode(Fn &&);
+  void forEachTableInode(__u32 group, std::function<void(__u32, const ext2_inode*, bool)>);
+  ShardHeader shardHeader(const char *kind, unsigned sections);
+  /*Calls fn(inode, size, i_block) for every directory, in inode order*/
+  void forEachDirectory(std::function<void(__u32, __u32, const __u32*)>);
+  /*Calls fn(offset, entry) for every entry in use of a directory, in order.
+    Every walk over directory entries goes through here. Thread-safe*/
+  template <typename Fn> void forEachDirectoryEntry(__u32 size, const __u32 *iBlock, Fn &&);
+  const InodeColumns &getInodeColumns(__u32 group);
+  size_t auditBlockWindow(__u32 firstGroup, __u32 groupCount);
+  void reserveMetadata(BlockAudit&);
+  void auditInodeBlocks(BlockAudit&, __u32 inodeNumber, __u16 mode, __u32 size, const __u32 *iBlock);
+  void auditIndirectBlock(BlockAudit&, __u32, __u32, __u32, __u8);
+  void indexIndirectBlock(BlockOwners&, __u32 indBlockNum, __u32 inodeNumber, __u32 baseOffset, __u8 level);
+
+  template <typename Fn> void forEachDataBlock(const __u32 *iBlock, uint64_t count, Fn &&);
+
+  // Extraction (thread-safe: all reads go through readBytes()/readBlocks())
+  struct Extraction;
+  struct OutputDirectory;
+  __u32 resolvePath(const string &path);
+  void readInode(__u32 inodeNumber, ext2_inode &inode);
+  /*Calls fn(logical, physical, count) for each run of blocks that are
+    consecutive both in the file and on disk, in file order. Holes are skipped
+    without being enumerated*/
+  void forEachFileRun(const ext2_inode &, uint64_t blockCount, std::function<void(uint64_t, __u32, __u32)>);
+  void extractInode(Extraction &, __u32 inodeNumber, shared_ptr<OutputDirectory> parent,
+                    const string &name, const string &destination);
+  void extractFile(const ext2_inode &, int dirFd, const char *path, bool exclusive);
+  uint64_t fileSize(const ext2_inode &);
+  __u32 hashFile(const ext2_inode &, char *buffer, size_t bufferSize);
+  void extractSymlink(const ext2_inode &, int dirFd, const char *path);
+  void scanDirectory(DirGraph&, unsigned, const DirGraph::Directory&, bool);
+
+  void estimateGroup(Estimate &, __u32 group, __u32 tableChunks, const vector<__u32> &chunks);
 
 
   bool validateSuperBlock(); // throws labeled runtime_error
+  void loadSuperBlock(); // parse and validate, throws labeled EXT2_error
+  void checkPrimarySuperBlock();
+  bool recoverSuperBlock();
   void printDescTable(struct ext2_group_desc);
   void setBlocksInLastGroup();
   void setInodesInLastGroup();
@@ -17,6 +17,8 @@
  *  Simplified for OS project use by Mark Kampe
  */
 
+#pragma once
+
 /* types normally from linux/types.h	*/
 typedef __uint32_t	__u32;
 typedef __uint16_t	__u16;
@@ -166,6 +168,11 @@ struct ext2_super_block {
 	__u32	s_reserved[230];	/* Padding to the end of the block */
 };
 
+/*
+ * Feature set definitions
+ */
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
+
 /*
  * Structure of a directory entry
  */
@@ -0,0 +1,73 @@
+#include "fragstats.hpp"
+
+FragStats::FragStats(FILE *out, __u32 firstDataBlock, __u32 blocksPerGroup, __u32 groupCount)
+  : out(out), firstDataBlock(firstDataBlock), blocksPerGroup(blocksPerGroup), groups(groupCount) {}
+
+void FragStats::beginFile(__u32 inodeNumber) {
+  file = {};
+  file.inode = inodeNumber;
+}
+
+void FragStats::endFile() {
+  if (file.blocks == 0)
+    return;
+
+  total.add(file);
+
+  // Blocks past the end of the image (corrupt pointers) only count globally
+  const __u32 group = (file.first - firstDataBlock) / blocksPerGroup;
+  if (file.first >= firstDataBlock && group < groups.size())
+    groups[group].add(file);
+
+  if (file.extents > 1)
+    fprintf(out, "FILEFRAG,%u,%u,%u,%.3f,%.1f,%u,%u\n",
+            file.inode, file.blocks, file.extents,
+            contiguity(file.blocks, file.extents, 1), averageGap(file.gapSum, file.extents, 1),
+            file.first, file.last);
+}
+
+void FragStats::report() const {
+  char scope[24];
+  for (size_t group = 0; group < groups.size(); group++) {
+    if (groups[group].files == 0)
+      continue;
+    snprintf(scope, sizeof(scope), "%zu", group);
+    groups[group].print(out, scope);
+  }
+  total.print(out, "all");
+}
+
+void FragStats::Totals::add(const File &file) {
+  files++;
+  blocks += file.blocks;
+  extents += file.extents;
+  gapSum += file.gapSum;
+  if (file.extents > 1)
+    fragmented++;
+
+  // 1, 2, 3-4, 5-8, ... extents
+  size_t bucket = 0;
+  for (__u32 e = file.extents - 1; e > 0 && bucket < BUCKETS - 1; e >>= 1)
+    bucket++;
+  histogram[bucket]++;
+}
+
+void FragStats::Totals::print(FILE *out, const char *scope) const {
+  fprintf(out, "FRAG,%s,%llu,%llu,%llu,%llu,%.3f,%.1f", scope,
+          (unsigned long long)files, (unsigned long long)blocks,
+          (unsigned long long)extents, (unsigned long long)fragmented,
+          contiguity(blocks, extents, files), averageGap(gapSum, extents, files));
+  for (size_t i = 0; i < BUCKETS; i++)
+    fprintf(out, ",%llu", (unsigned long long)histogram[i]);
+  fprintf(out, "\n");
+}
+
+double FragStats::contiguity(uint64_t blocks, uint64_t extents, uint64_t files) {
+  // Each file has (blocks - 1) neighbouring pairs, of which (extents - 1) break
+  const uint64_t pairs = blocks - files;
+  return (pairs > 0) ? (double)(blocks - extents) / pairs : 1.0;
+}
+
+double FragStats::averageGap(uint64_t gapSum, uint64_t extents, uint64_t files) {
+  return (extents > files) ? (double)gapSum / (extents - files) : 0.0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::vector;
+
+// -------------------------------------------------- Fragmentation Statistics
+//
+// Measures how each file is laid out on disk, from the blocks it is shown in
+// file order (data and indirect blocks alike, as ext2 allocates an indirect
+// block just before the data it maps). Fed by the inode walk of the report,
+// so it reads nothing itself.
+//
+// An extent is a run of physically consecutive blocks. Per file, this counts
+// extents, the share of neighbouring blocks that are consecutive (its
+// contiguity) and the average jump between extents (its gap). Files are then
+// folded into global and per-group totals, by the group of their first block,
+// and only one file is held at a time.
+//
+// Output lines:
+//   FILEFRAG,inode,blocks,extents,contiguity,average gap,first block,last block
+//     streamed for every file with more than one extent
+//   FRAG,group (or 'all'),files,blocks,extents,fragmented files,contiguity,
+//     average gap, then the number of files with 1, 2, 3-4, 5-8, 9-16, 17-32
+//     and more extents
+//
+class FragStats {
+ public:
+  static const size_t BUCKETS = 7;
+
+  FragStats(FILE *out, __u32 firstDataBlock, __u32 blocksPerGroup, __u32 groupCount);
+
+  void beginFile(__u32 inodeNumber);
+
+  /*The file's next block, in file order. Holes are not passed*/
+  void add(__u32 block) {
+    if (file.blocks == 0) {
+      file.first = block;
+      file.extents = 1;
+    } else if (block != file.last + 1) {
+      file.extents++;
+      file.gapSum += (block > file.last) ? block - file.last - 1 : file.last + 1 - block;
+    }
+    file.last = block;
+    file.blocks++;
+  }
+
+  void endFile();
+
+  /*Writes the FRAG lines of every group that holds a file, then the totals*/
+  void report() const;
+
+ private:
+  struct File {
+    __u32 inode;
+    __u32 blocks;
+    __u32 extents;
+    __u32 first;
+    __u32 last;
+    uint64_t gapSum; // blocks jumped over between extents
+  };
+
+  struct Totals {
+    uint64_t files = 0;
+    uint64_t blocks = 0;
+    uint64_t extents = 0;
+    uint64_t fragmented = 0;
+    uint64_t gapSum = 0;
+    uint64_t histogram[BUCKETS] = {};
+
+    void add(const File &);
+    void print(FILE *out, const char *scope) const;
+  };
+
+  FILE *out;
+  const __u32 firstDataBlock;
+  const __u32 blocksPerGroup;
+  File file = {};
+  Totals total;
+  vector<Totals> groups;
+
+  /*Fraction of neighbouring blocks that are consecutive (1 for single blocks)*/
+  static double contiguity(uint64_t blocks, uint64_t extents, uint64_t files);
+  static double averageGap(uint64_t gapSum, uint64_t extents, uint64_t files);
+};
@@ -0,0 +1,31 @@
+#include "groupdesctable.hpp"
+#include "trace.hpp"
+
+GroupDescTable::GroupDescTable(ImageReader &reader, size_t firstBlock, __u32 blockSize, __u32 groupCount)
+  : reader(reader), firstBlock(firstBlock), blockSize(blockSize), groupCount(groupCount),
+    perPage(blockSize / sizeof(ext2_group_desc)),
+    pageCount((groupCount + perPage - 1) / perPage),
+    pages(new std::atomic<ext2_group_desc*>[pageCount]()) {}
+
+GroupDescTable::~GroupDescTable() {
+  for (size_t i = 0; i < pageCount; i++)
+    delete[] pages[i].load(std::memory_order_relaxed);
+}
+
+const ext2_group_desc *GroupDescTable::loadPage(size_t page) const {
+  std::lock_guard<std::mutex> guard(lock);
+
+  // Another thread may have loaded it while this one waited
+  ext2_group_desc *descriptors = pages[page].load(std::memory_order_relaxed);
+  if (descriptors)
+    return descriptors;
+
+  TRACE_SCOPE("gdt.page", "init", page);
+  descriptors = new ext2_group_desc[perPage];
+  reader.readBytes((firstBlock + page) * blockSize, (size_t)perPage * sizeof(ext2_group_desc),
+                   reinterpret_cast<char*>(descriptors));
+  loaded++;
+
+  pages[page].store(descriptors, std::memory_order_release);
+  return descriptors;
+}
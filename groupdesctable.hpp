@@ -0,0 +1,57 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "ext2_fs.h"
+#include "imagereader.hpp"
+
+// -------------------------------------------------- Group Descriptor Table
+//
+// A lazily paged view of the Group Descriptor Table. Nothing is read when it
+// is created: each descriptor block (a page) is read the first time one of its
+// descriptors is asked for, and kept until the table is destroyed. Opening an
+// image with hundreds of thousands of groups therefore costs a zeroed pointer
+// per descriptor block, and a query that touches one group reads one block.
+//
+// Lookups are safe from several threads at once. A loaded page is found with
+// a single acquire load; only loading one takes a lock (and reads with
+// ImageReader::readBytes()).
+//
+class GroupDescTable {
+ public:
+  /*'firstBlock' is the block holding the first descriptor*/
+  GroupDescTable(ImageReader &reader, size_t firstBlock, __u32 blockSize, __u32 groupCount);
+  ~GroupDescTable();
+
+  GroupDescTable(const GroupDescTable&) = delete;
+  GroupDescTable &operator=(const GroupDescTable&) = delete;
+
+  __u32 size() const { return groupCount; }
+
+  /*The descriptor of 'group', which must be < size()*/
+  const ext2_group_desc &operator[](__u32 group) const {
+    const ext2_group_desc *page = pages[group / perPage].load(std::memory_order_acquire);
+    if (!page)
+      page = loadPage(group / perPage);
+    return page[group % perPage];
+  }
+
+  /*Descriptor blocks read so far*/
+  size_t pagesLoaded() const { return loaded; }
+
+ private:
+  ImageReader &reader;
+  const size_t firstBlock;
+  const __u32 blockSize;
+  const __u32 groupCount;
+  const __u32 perPage; // descriptors per block
+  const size_t pageCount;
+
+  std::unique_ptr<std::atomic<ext2_group_desc*>[]> pages;
+  mutable std::mutex lock;
+  mutable size_t loaded = 0;
+
+  const ext2_group_desc *loadPage(size_t page) const;
+};
@@ -0,0 +1,506 @@
+#include "imagegenerator.hpp"
+#include <algorithm>
+#include <deque>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::runtime_error;
+
+#define KiB 1024
+#define FIRST_INO 11
+#define LOST_FOUND_INO 11
+#define TIMESTAMP 1500000000
+#define DIRENT_NAME_MAX 12 // "d" or "f" followed by an inode number
+#define FEATURE_INCOMPAT_FILETYPE 0x0002
+#define FEATURE_RO_COMPAT_LARGE_FILE 0x0002
+
+ImageGenerator::ImageGenerator(const ImageSpec &spec) : spec(spec), rng(spec.seed) {}
+
+// -------------------------------------------------- Layout
+void ImageGenerator::layout()
+{
+  blockSize = spec.blockSize;
+  if (blockSize != KiB && blockSize != 2 * KiB && blockSize != 4 * KiB)
+    throw runtime_error("UnsupportedBlockSize");
+  if (spec.rev > 1)
+    throw runtime_error("UnsupportedRevision");
+
+  const __u32 inodeSize = (spec.rev == 0) ? 128 : spec.inodeSize;
+  if (inodeSize < 128 || inodeSize > blockSize || (inodeSize & (inodeSize - 1)))
+    throw runtime_error("UnsupportedInodeSize");
+  spec.inodeSize = inodeSize;
+
+  if (spec.size / blockSize > UINT32_MAX)
+    throw runtime_error("ImageTooLarge");
+  if (spec.fanOut == 0 || spec.indirectDepth > 3)
+    throw runtime_error("InvalidTreeShape");
+
+  blockCount = spec.size / blockSize;
+  firstDataBlock = (blockSize == KiB) ? 1 : 0;
+  if (blockCount <= firstDataBlock + 1)
+    throw runtime_error("ImageTooSmall");
+  pointersPerBlock = blockSize / sizeof(__u32);
+
+  // -------------------------------------------------- Groups
+  const __u32 MAX_BLOCKS_PER_GROUP = 8 * blockSize; // one bitmap block
+  const __u32 dataBlocks = blockCount - firstDataBlock;
+
+  if (spec.groups == 0) {
+    blocksPerGroup = MAX_BLOCKS_PER_GROUP;
+  } else {
+    blocksPerGroup = ((dataBlocks + spec.groups - 1) / spec.groups + 7) & ~7u;
+    if (blocksPerGroup > MAX_BLOCKS_PER_GROUP)
+      throw runtime_error("TooFewGroupsForImageSize");
+  }
+  groupCount = (dataBlocks + blocksPerGroup - 1) / blocksPerGroup;
+
+  // -------------------------------------------------- Inodes
+  const __u32 INODES_PER_BLOCK = blockSize / inodeSize;
+  const __u32 ALIGN = std::max<__u32>(8, INODES_PER_BLOCK);
+
+  if (spec.inodesPerGroup) {
+    inodesPerGroup = spec.inodesPerGroup;
+  } else {
+    const size_t needed = spec.files + FIRST_INO + 1;
+    inodesPerGroup = (needed + groupCount - 1) / groupCount + 16;
+  }
+  inodesPerGroup = std::max<__u32>(inodesPerGroup, 2 * ALIGN);
+  inodesPerGroup = (inodesPerGroup + ALIGN - 1) / ALIGN * ALIGN;
+  if (inodesPerGroup > 8 * blockSize)
+    throw runtime_error("TooManyInodesPerGroup");
+
+  inodeTableBlocks = (inodesPerGroup * inodeSize + blockSize - 1) / blockSize;
+
+  // -------------------------------------------------- Group Metadata
+  // A final group too small for its own metadata is dropped, as mkfs does
+  for (;;) {
+    gdtBlocks = (groupCount * sizeof(ext2_group_desc) + blockSize - 1) / blockSize;
+
+    const __u32 lastStart = firstDataBlock + (groupCount - 1) * blocksPerGroup;
+    const __u32 overhead = (groupHasSuperBlock(groupCount - 1) ? 1 + gdtBlocks : 0) + 2 + inodeTableBlocks;
+    if (blockCount - lastStart > overhead)
+      break;
+    if (groupCount == 1)
+      throw runtime_error("ImageTooSmall");
+
+    blockCount = lastStart;
+    groupCount--;
+  }
+
+  blockUsed.assign((blockCount + 63) / 64, 0);
+  inodeUsed.assign(((size_t)groupCount * inodesPerGroup + 63) / 64, 0);
+  groupDescs.assign(groupCount, ext2_group_desc());
+  memset(groupDescs.data(), 0, groupCount * sizeof(ext2_group_desc));
+
+  for (__u32 b = 0; b < firstDataBlock; b++)
+    set(blockUsed, b);
+
+  for (__u32 group = 0; group < groupCount; group++) {
+    __u32 block = firstDataBlock + group * blocksPerGroup;
+
+    if (groupHasSuperBlock(group))
+      block += 1 + gdtBlocks;
+
+    groupDescs[group].bg_block_bitmap = block;
+    groupDescs[group].bg_inode_bitmap = block + 1;
+    groupDescs[group].bg_inode_table = block + 2;
+
+    for (__u32 b = firstDataBlock + group * blocksPerGroup; b < block + 2 + inodeTableBlocks; b++)
+      set(blockUsed, b);
+  }
+
+  freeBlocks = 0;
+  for (__u32 b = 0; b < blockCount; b++)
+    freeBlocks += !test(blockUsed, b);
+
+  cursor = firstDataBlock;
+  nextInode = FIRST_INO;
+  inodesUsed = 0;
+  deepestLevel = 0;
+  largeFiles = false;
+}
+
+bool ImageGenerator::groupHasSuperBlock(__u32 group) const
+{
+  if (spec.rev == 0 || group <= 1)
+    return true;
+
+  for (__u32 base : {3, 5, 7}) {
+    __u32 n = group;
+    while (n % base == 0)
+      n /= base;
+    if (n == 1)
+      return true;
+  }
+  return false;
+}
+
+// -------------------------------------------------- Allocation
+__u32 ImageGenerator::allocBlock()
+{
+  if (freeBlocks == 0)
+    throw runtime_error("ImageFull");
+
+  // Fragmentation moves the cursor somewhere random before the next block
+  if (spec.fragmentation > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < spec.fragmentation)
+    cursor = firstDataBlock + rng() % (blockCount - firstDataBlock);
+
+  // Next fit, skipping full words at a time
+  __u32 block = cursor;
+  for (size_t scanned = 0; scanned <= blockCount; ) {
+    if (block >= blockCount)
+      block = 0;
+
+    if (block % 64 == 0 && blockUsed[block / 64] == ~(uint64_t)0) {
+      block += 64;
+      scanned += 64;
+      continue;
+    }
+    if (!test(blockUsed, block))
+      break;
+    block++;
+    scanned++;
+  }
+
+  set(blockUsed, block);
+  freeBlocks--;
+  cursor = block + 1;
+  return block;
+}
+
+__u32 ImageGenerator::allocInode(bool directory)
+{
+  const __u32 ino = ++nextInode;
+  if (ino > groupCount * inodesPerGroup)
+    throw runtime_error("OutOfInodes");
+
+  set(inodeUsed, ino - 1);
+  inodesUsed++;
+  if (directory)
+    groupDescs[(ino - 1) / inodesPerGroup].bg_used_dirs_count++;
+  return ino;
+}
+
+__u32 ImageGenerator::mapBlocks(__u32 *iBlock, size_t count, vector<__u32> *data)
+{
+  __u32 used = 0;
+
+  for (__u32 i = 0; i < EXT2_NDIR_BLOCKS && count > 0; i++, count--, used++) {
+    iBlock[i] = allocBlock();
+    if (data)
+      data->push_back(iBlock[i]);
+  }
+
+  for (__u32 level = 1; level <= 3 && count > 0; level++) {
+    iBlock[EXT2_NDIR_BLOCKS + level - 1] = mapIndirect(level, count, data, used);
+    deepestLevel = std::max(deepestLevel, level);
+  }
+
+  if (count > 0)
+    throw runtime_error("FileTooLargeForBlockMap");
+  return used;
+}
+
+__u32 ImageGenerator::mapIndirect(__u32 level, size_t &remaining, vector<__u32> *data, __u32 &used)
+{
+  // The indirect block comes before the blocks it maps, as in ext2
+  const __u32 block = allocBlock();
+  vector<__u32> pointers(pointersPerBlock, 0);
+  used++;
+
+  for (__u32 i = 0; i < pointersPerBlock && remaining > 0; i++) {
+    if (level == 1) {
+      pointers[i] = allocBlock();
+      if (data)
+        data->push_back(pointers[i]);
+      used++;
+      remaining--;
+    } else {
+      pointers[i] = mapIndirect(level - 1, remaining, data, used);
+    }
+  }
+
+  pwriteAll(pointers.data(), blockSize, (uint64_t)block * blockSize);
+  return block;
+}
+
+// -------------------------------------------------- Inodes and Directories
+void ImageGenerator::writeInode(__u32 ino, const ext2_inode &inode)
+{
+  const __u32 group = (ino - 1) / inodesPerGroup;
+  const uint64_t offset = (uint64_t)groupDescs[group].bg_inode_table * blockSize +
+                          (uint64_t)((ino - 1) % inodesPerGroup) * spec.inodeSize;
+  pwriteAll(&inode, sizeof(inode), offset);
+}
+
+void ImageGenerator::writeFile(__u32 ino, size_t blocks)
+{
+  ext2_inode inode;
+  memset(&inode, 0, sizeof(inode));
+
+  const uint64_t size = (uint64_t)blocks * blockSize;
+  inode.i_mode = S_IFREG | 0644;
+  inode.i_size = (__u32)size;
+  if (size >> 32) {
+    inode.i_dir_acl = size >> 32; // i_size_high
+    largeFiles = true;
+  }
+  inode.i_atime = inode.i_ctime = inode.i_mtime = TIMESTAMP;
+  inode.i_links_count = 1;
+  inode.i_blocks = mapBlocks(inode.i_block, blocks, nullptr) * (blockSize / 512);
+
+  writeInode(ino, inode);
+}
+
+void ImageGenerator::writeDirectory(__u32 ino, __u32 parent, const vector<std::pair<__u32, string>> &entries,
+                                    const vector<bool> &isDir)
+{
+  // -------------------------------------------------- Pack Entries
+  vector<char> content;
+  size_t blockStart = 0, used = 0, lastEntry = 0;
+  __u16 links = 2;
+
+  auto append = [&](__u32 child, const string &name, bool dir) {
+    const size_t recLen = (8 + name.size() + 3) & ~(size_t)3;
+
+    // An entry may not cross a block: the last one in a block absorbs the rest
+    if (content.empty() || used + recLen > blockStart + blockSize) {
+      if (!content.empty()) {
+        reinterpret_cast<ext2_dir_entry*>(&content[lastEntry])->rec_len = blockStart + blockSize - lastEntry;
+        blockStart += blockSize;
+      }
+      content.resize(blockStart + blockSize, 0);
+      used = blockStart;
+    }
+
+    ext2_dir_entry *entry = reinterpret_cast<ext2_dir_entry*>(&content[used]);
+    entry->inode = child;
+    entry->rec_len = recLen;
+    entry->name_len = name.size();
+    entry->file_type = (spec.rev == 0) ? 0 : (dir ? 2 : 1);
+    memcpy(entry->name, name.data(), name.size());
+
+    lastEntry = used;
+    used += recLen;
+  };
+
+  append(ino, ".", true);
+  append(parent, "..", true);
+  for (size_t i = 0; i < entries.size(); i++) {
+    append(entries[i].first, entries[i].second, isDir[i]);
+    links += isDir[i];
+  }
+  reinterpret_cast<ext2_dir_entry*>(&content[lastEntry])->rec_len = blockStart + blockSize - lastEntry;
+
+  // -------------------------------------------------- Write Blocks and Inode
+  ext2_inode inode;
+  memset(&inode, 0, sizeof(inode));
+
+  const size_t blocks = content.size() / blockSize;
+  vector<__u32> data;
+  inode.i_blocks = mapBlocks(inode.i_block, blocks, &data) * (blockSize / 512);
+
+  for (size_t i = 0; i < blocks; i++)
+    pwriteAll(&content[i * blockSize], blockSize, (uint64_t)data[i] * blockSize);
+
+  inode.i_mode = S_IFDIR | 0755;
+  inode.i_size = blocks * blockSize;
+  inode.i_atime = inode.i_ctime = inode.i_mtime = TIMESTAMP;
+  inode.i_links_count = links;
+  writeInode(ino, inode);
+}
+
+// -------------------------------------------------- Super Block, Descriptors and Bitmaps
+void ImageGenerator::writeMetadata()
+{
+  const __u32 inodesCount = groupCount * inodesPerGroup;
+  __u32 totalFreeBlocks = 0, totalFreeInodes = 0;
+  vector<char> bitmap(blockSize);
+
+  for (__u32 group = 0; group < groupCount; group++) {
+    ext2_group_desc &gd = groupDescs[group];
+    const __u32 first = firstDataBlock + group * blocksPerGroup;
+    const __u32 count = std::min(blocksPerGroup, blockCount - first);
+
+    // Bits past the end of the group are set, as mkfs does
+    memset(bitmap.data(), 0xFF, blockSize);
+    for (__u32 bit = 0; bit < count; bit++)
+      if (!test(blockUsed, first + bit)) {
+        bitmap[bit / 8] &= ~(1 << (bit % 8));
+        gd.bg_free_blocks_count++;
+      }
+    pwriteAll(bitmap.data(), blockSize, (uint64_t)gd.bg_block_bitmap * blockSize);
+
+    memset(bitmap.data(), 0xFF, blockSize);
+    for (__u32 bit = 0; bit < inodesPerGroup; bit++)
+      if (!test(inodeUsed, (size_t)group * inodesPerGroup + bit)) {
+        bitmap[bit / 8] &= ~(1 << (bit % 8));
+        gd.bg_free_inodes_count++;
+      }
+    pwriteAll(bitmap.data(), blockSize, (uint64_t)gd.bg_inode_bitmap * blockSize);
+
+    totalFreeBlocks += gd.bg_free_blocks_count;
+    totalFreeInodes += gd.bg_free_inodes_count;
+  }
+
+  ext2_super_block sb;
+  memset(&sb, 0, sizeof(sb));
+  sb.s_inodes_count = inodesCount;
+  sb.s_blocks_count = blockCount;
+  sb.s_r_blocks_count = blockCount / 20;
+  sb.s_free_blocks_count = totalFreeBlocks;
+  sb.s_free_inodes_count = totalFreeInodes;
+  sb.s_first_data_block = firstDataBlock;
+  sb.s_log_block_size = __builtin_ctz(blockSize / KiB);
+  sb.s_log_frag_size = sb.s_log_block_size;
+  sb.s_blocks_per_group = blocksPerGroup;
+  sb.s_frags_per_group = blocksPerGroup;
+  sb.s_inodes_per_group = inodesPerGroup;
+  sb.s_wtime = TIMESTAMP;
+  sb.s_max_mnt_count = -1;
+  sb.s_magic = EXT2_SUPER_MAGIC;
+  sb.s_state = EXT2_VALID_FS;
+  sb.s_errors = 1;
+  sb.s_lastcheck = TIMESTAMP;
+  sb.s_rev_level = spec.rev;
+  sb.s_first_ino = FIRST_INO;
+  sb.s_inode_size = spec.inodeSize;
+  if (spec.rev == 1) {
+    sb.s_feature_incompat = FEATURE_INCOMPAT_FILETYPE;
+    sb.s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER |
+                             (largeFiles ? FEATURE_RO_COMPAT_LARGE_FILE : 0);
+  }
+
+  // The primary copy lives at byte 1024; backups at the start of their group
+  for (__u32 group = 0; group < groupCount; group++) {
+    if (!groupHasSuperBlock(group))
+      continue;
+
+    const __u32 first = firstDataBlock + group * blocksPerGroup;
+    sb.s_block_group_nr = group;
+    pwriteAll(&sb, sizeof(sb), (group == 0) ? KiB : (uint64_t)first * blockSize);
+    pwriteAll(groupDescs.data(), groupCount * sizeof(ext2_group_desc), (uint64_t)(first + 1) * blockSize);
+  }
+}
+
+// -------------------------------------------------- Image
+void ImageGenerator::pwriteAll(const void *buf, size_t len, uint64_t offset)
+{
+  const char *p = static_cast<const char*>(buf);
+  while (len > 0) {
+    ssize_t n = pwrite(fd, p, len, offset);
+    if (n <= 0)
+      throw runtime_error("ImageWriteError");
+    p += n;
+    offset += n;
+    len -= n;
+  }
+}
+
+void ImageGenerator::write(const string &path)
+{
+  rng.seed(spec.seed);
+  layout();
+
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    throw runtime_error("ImageOpenError");
+
+  try {
+    if (ftruncate(fd, (off_t)blockCount * blockSize) != 0)
+      throw runtime_error("ImageTruncateError");
+
+    // Inodes 1..10 are reserved, 2 is the root and 11 is lost+found
+    for (__u32 ino = 1; ino <= FIRST_INO; ino++)
+      set(inodeUsed, ino - 1);
+    inodesUsed = 2;
+    groupDescs[0].bg_used_dirs_count = 2;
+
+    writeDirectory(LOST_FOUND_INO, EXT2_ROOT_INO, {}, {});
+
+    // -------------------------------------------------- File Sizes
+    // One file per indirection level reaches just past its start, the others
+    // share what is left of the fill budget.
+    const size_t dirsTotal = std::max<size_t>(1, (spec.files + spec.fanOut - 1) / spec.fanOut);
+    const size_t filesTotal = spec.files - std::min(spec.files, dirsTotal - 1);
+    const size_t dirBlocks = ((size_t)(spec.fanOut + 2) * (8 + DIRENT_NAME_MAX) + blockSize - 1) / blockSize;
+    const size_t dirReserve = dirsTotal * (dirBlocks + (dirBlocks > EXT2_NDIR_BLOCKS ? 3 : 0));
+
+    vector<size_t> sizes;
+    size_t maxBlocks = EXT2_NDIR_BLOCKS, span = 1;
+    for (__u32 level = 1; level <= spec.indirectDepth; level++) {
+      if (sizes.size() < filesTotal)
+        sizes.push_back(maxBlocks + 1);
+      span *= pointersPerBlock;
+      maxBlocks += span;
+    }
+
+    size_t budget = (freeBlocks > dirReserve) ? (freeBlocks - dirReserve) * spec.fill : 0;
+    for (size_t s : sizes)
+      budget -= std::min(budget, s);
+
+    const size_t mean = (filesTotal > sizes.size()) ? budget / (filesTotal - sizes.size()) : 0;
+    std::uniform_int_distribution<size_t> randomSize(0, std::min(2 * mean, maxBlocks));
+    while (sizes.size() < filesTotal)
+      sizes.push_back(randomSize(rng));
+
+    // An upper bound on the indirect blocks needed to map 'blocks'
+    auto mapOverhead = [this](size_t blocks) -> size_t {
+      return (blocks <= EXT2_NDIR_BLOCKS) ? 0 : blocks / (pointersPerBlock - 1) + 3;
+    };
+
+    // -------------------------------------------------- Tree
+    struct Pending { __u32 ino, parent; };
+    std::deque<Pending> queue = {{EXT2_ROOT_INO, EXT2_ROOT_INO}};
+    size_t dirsCreated = 1, filesCreated = 0, dirsWritten = 0;
+
+    while (!queue.empty()) {
+      const Pending dir = queue.front();
+      queue.pop_front();
+
+      vector<std::pair<__u32, string>> entries;
+      vector<bool> isDir;
+      if (dir.ino == EXT2_ROOT_INO) {
+        entries.emplace_back(LOST_FOUND_INO, "lost+found");
+        isDir.push_back(true);
+      }
+
+      for (__u32 n = 0; n < spec.fanOut && dirsCreated < dirsTotal; n++, dirsCreated++) {
+        const __u32 child = allocInode(true);
+        queue.push_back({child, dir.ino});
+        entries.emplace_back(child, "d" + std::to_string(child));
+        isDir.push_back(true);
+      }
+
+      for (__u32 n = entries.size() - (dir.ino == EXT2_ROOT_INO); n < spec.fanOut && filesCreated < filesTotal; n++) {
+        const __u32 child = allocInode(false);
+
+        // Never take the blocks still needed by the directories
+        const size_t reserve = (dirsTotal - dirsWritten) * (dirBlocks + 3);
+        const size_t available = (freeBlocks > reserve) ? freeBlocks - reserve : 0;
+        size_t blocks = sizes[filesCreated++];
+        if (blocks + mapOverhead(blocks) > available)
+          blocks = (available > mapOverhead(available)) ? available - mapOverhead(available) : 0;
+        writeFile(child, blocks);
+
+        entries.emplace_back(child, "f" + std::to_string(child));
+        isDir.push_back(false);
+      }
+
+      writeDirectory(dir.ino, dir.parent, entries, isDir);
+      dirsWritten++;
+    }
+
+    writeMetadata();
+  } catch (...) {
+    close(fd);
+    fd = -1;
+    throw;
+  }
+
+  close(fd);
+  fd = -1;
+}
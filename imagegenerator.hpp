@@ -0,0 +1,97 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Image Generator
+//
+// Writes synthetic (but consistent) ext2 images, without mkfs.ext2 or root
+// privileges. Used by mkimage and the benchmarks.
+//
+// Only metadata is written: the image is created as a sparse file, and the
+// data blocks of regular files are allocated and referenced but left as holes.
+// Directories are laid out breadth first, each holding up to 'fanOut' entries.
+//
+// Every image it writes should pass 'lab3a --audit' with no findings.
+//
+struct ImageSpec {
+  uint64_t size = 64 << 20;     // bytes (rounded down to whole blocks)
+  __u32 blockSize = 1024;       // 1024, 2048 or 4096
+  __u32 inodeSize = 128;        // rev 1 only; rev 0 is always 128
+  __u32 groups = 0;             // 0 = as few as possible
+  __u32 inodesPerGroup = 0;     // 0 = enough for 'files'
+  __u32 rev = 1;
+  size_t files = 1000;          // number of directory entries (files and directories)
+  __u32 fanOut = 32;            // entries per directory
+  __u32 indirectDepth = 2;      // deepest block map used by some file (0-3)
+  double fill = 0.5;            // fraction of the free blocks given to files
+  double fragmentation = 0.0;   // chance that the next block is not contiguous
+  unsigned seed = 1;
+};
+
+class ImageGenerator {
+ public:
+  ImageGenerator(const ImageSpec &spec);
+
+  /*Writes the image to 'path'. Throws runtime_error on failure*/
+  void write(const string &path);
+
+  // Statistics of the last image written
+  __u32 getBlockCount() const { return blockCount; }
+  __u32 getGroupCount() const { return groupCount; }
+  size_t getInodesUsed() const { return inodesUsed; }
+  __u32 getDeepestLevel() const { return deepestLevel; } // deepest block map written
+
+ private:
+  ImageSpec spec;
+  std::mt19937 rng;
+  int fd = -1;
+
+  __u32 blockSize;
+  __u32 blockCount;
+  __u32 firstDataBlock;
+  __u32 blocksPerGroup;
+  __u32 groupCount;
+  __u32 inodesPerGroup;
+  __u32 inodeTableBlocks;
+  __u32 gdtBlocks;
+  __u32 pointersPerBlock;
+
+  vector<uint64_t> blockUsed; // bit n = block n
+  vector<uint64_t> inodeUsed; // bit n-1 = inode n
+  vector<ext2_group_desc> groupDescs;
+  __u32 cursor;                // next-fit allocation cursor
+  __u32 freeBlocks;
+  __u32 nextInode;
+  size_t inodesUsed;
+  __u32 deepestLevel;
+  bool largeFiles;
+
+  void layout();
+  bool groupHasSuperBlock(__u32 group) const;
+  __u32 groupOf(__u32 block) const { return (block - firstDataBlock) / blocksPerGroup; }
+
+  static bool test(const vector<uint64_t> &set, size_t bit) { return (set[bit / 64] >> (bit % 64)) & 1; }
+  static void set(vector<uint64_t> &set, size_t bit) { set[bit / 64] |= (uint64_t)1 << (bit % 64); }
+
+  __u32 allocBlock();
+  __u32 allocInode(bool directory);
+
+  /*Allocates the block map for 'count' data blocks into i_block. Data block
+    numbers are appended to 'data' if it is given. Returns the blocks used*/
+  __u32 mapBlocks(__u32 *iBlock, size_t count, vector<__u32> *data);
+  __u32 mapIndirect(__u32 level, size_t &remaining, vector<__u32> *data, __u32 &used);
+
+  void writeInode(__u32 ino, const ext2_inode &inode);
+  void writeFile(__u32 ino, size_t blocks);
+  void writeDirectory(__u32 ino, __u32 parent, const vector<std::pair<__u32, string>> &entries,
+                      const vector<bool> &isDir);
+  void writeMetadata();
+  void pwriteAll(const void *buf, size_t len, uint64_t offset);
+};
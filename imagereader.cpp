@@ -1,5 +1,8 @@
 #include "imagereader.hpp"
 
+// Shared by every part of the library; set to non-zero for verbose tracing
+int debug = 0;
+
 ImageReader::ImageReader(MetaFile *metafile) 
 {
   this->meta = metafile;
@@ -9,3 +12,19 @@ struct ext2_super_block *ImageReader::getSuperBlock()
 {
   return &this->superBlock;
 }
+
+void ImageReader::useBackup(const ext2_super_block &copy, size_t descriptorBlock)
+{
+  this->superBlock = copy;
+  this->descriptorTableBlock = descriptorBlock;
+  this->meta->rev = copy.s_rev_level;
+}
+
+size_t ImageReader::getDescriptorTableBlock() const
+{
+  // The primary table follows the Super Block: block 2 with 1KiB blocks (the
+  // Super Block is block 1), block 1 otherwise
+  if (descriptorTableBlock)
+    return descriptorTableBlock;
+  return (meta->blockSize == KiB) ? 2 : 1;
+}
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include "ext2_fs.h"
 #include "metafile.hpp"
@@ -28,18 +29,50 @@ class ImageReader {
   };
 
   ImageReader(MetaFile*);
+  virtual ~ImageReader() {}
 
   virtual void init() = 0;
 
   struct ext2_super_block *getSuperBlock();
 
+  /*Replaces the Super Block read from the image (e.g. with a backup copy) and
+    reads the Group Descriptor Table from 'descriptorBlock' instead of the
+    primary location. Must be called before init()*/
+  void useBackup(const ext2_super_block &copy, size_t descriptorBlock);
+
   /*Returns a buffer containing the raw data from the specified blockIdx*/
   virtual shared_ptr<char[]> getBlock(size_t blockIdx, BlockPersistenceType t = BlockPersistenceType::TEMPORARY) = 0;
 
   /*Returns a buffer containing the raw data from numBlocks contiguous blocks, starting at blockIdx*/
   virtual shared_ptr<char[]> getBlocks(size_t blockIdx, size_t numBlocks) = 0;
 
-  virtual shared_ptr<char[]> getGroupDescriptor() = 0;
+  /*How many of 'wanted' blocks a single getBlocks() call may return within the
+    memory budget (at least 1)*/
+  virtual size_t affordableBlocks(size_t wanted) = 0;
+
+  /*Block holding the first descriptor of the Group Descriptor Table in use*/
+  size_t getDescriptorTableBlock() const;
+
+  /*Reads numBlocks contiguous blocks, starting at blockIdx, into a caller-owned buffer.
+    Unlike getBlock()/getBlocks(), this is safe to call from several threads at once*/
+  virtual void readBlocks(size_t blockIdx, size_t numBlocks, char *buffer) = 0;
+
+  /*Reads 'length' bytes at byte 'offset' into a caller-owned buffer, before the
+    block size is known. Bytes past the end of the image read as 0. Returns the
+    number of bytes read from the image. Thread-safe, like readBlocks()*/
+  virtual size_t readBytes(size_t offset, size_t length, char *buffer) = 0;
+
+  /*Hints that the given blocks (in any order; 0 and out of range entries
+    are ignored) will be read soon, so the device can start on them while
+    the caller does other work. Does not block. Thread-safe*/
+  virtual void prefetch(const std::vector<__u32> &blocks) = 0;
+
+  /*Copies 'length' bytes at byte 'offset' of the image to byte 'outOffset' of
+    the file 'outFd', without passing them through a user space buffer where
+    the kernel allows it. Returns the number of bytes copied, which is short
+    only at the end of the image. Thread-safe, as long as no other thread
+    writes to 'outFd'. Throws runtime_error if 'outFd' cannot be written*/
+  virtual size_t copyBytes(size_t offset, size_t length, int outFd, size_t outOffset) = 0;
 
   static const size_t KiB=1024;
 
@@ -50,5 +83,8 @@ protected:
 
   MetaFile *meta = nullptr;
 
+  // Block holding the Group Descriptor Table in use (0 = the primary one)
+  size_t descriptorTableBlock = 0;
+
   virtual int readSuperBlock() = 0;
 };
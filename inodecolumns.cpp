@@ -0,0 +1,62 @@
+#include "inodecolumns.hpp"
+#include <string.h>
+
+InodeColumns::InodeColumns(__u32 group, size_t capacity)
+    : group(group), storage(new char[bytesFor(capacity)]), slots(capacity) {
+  // The 32-bit columns come first, so that every column stays aligned
+  char *next = storage.get();
+  auto column = [&](size_t width) {
+    char *start = next;
+    next += width * capacity;
+    return start;
+  };
+
+  ino = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  size = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  blocks = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  atime = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  mtime = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  ctime = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  fileAcl = reinterpret_cast<__u32*>(column(sizeof(__u32)));
+  block = reinterpret_cast<__u32*>(column(EXT2_N_BLOCKS * sizeof(__u32)));
+  mode = reinterpret_cast<__u16*>(column(sizeof(__u16)));
+  uid = reinterpret_cast<__u16*>(column(sizeof(__u16)));
+  gid = reinterpret_cast<__u16*>(column(sizeof(__u16)));
+  links = reinterpret_cast<__u16*>(column(sizeof(__u16)));
+}
+
+void InodeColumns::append(__u32 inodeNumber, const ext2_inode &inode) {
+  const size_t i = used++;
+
+  ino[i] = inodeNumber;
+  size[i] = inode.i_size;
+  blocks[i] = inode.i_blocks;
+  atime[i] = inode.i_atime;
+  mtime[i] = inode.i_mtime;
+  ctime[i] = inode.i_ctime;
+  fileAcl[i] = inode.i_file_acl;
+  memcpy(block + i * EXT2_N_BLOCKS, inode.i_block, sizeof(inode.i_block));
+  mode[i] = inode.i_mode;
+  uid[i] = inode.i_uid;
+  gid[i] = inode.i_gid;
+  links[i] = inode.i_links_count;
+}
+
+unique_ptr<InodeColumns> InodeColumns::compact() const {
+  unique_ptr<InodeColumns> copy(new InodeColumns(group, used));
+  copy->used = used;
+
+  memcpy(copy->ino, ino, used * sizeof(__u32));
+  memcpy(copy->size, size, used * sizeof(__u32));
+  memcpy(copy->blocks, blocks, used * sizeof(__u32));
+  memcpy(copy->atime, atime, used * sizeof(__u32));
+  memcpy(copy->mtime, mtime, used * sizeof(__u32));
+  memcpy(copy->ctime, ctime, used * sizeof(__u32));
+  memcpy(copy->fileAcl, fileAcl, used * sizeof(__u32));
+  memcpy(copy->block, block, used * EXT2_N_BLOCKS * sizeof(__u32));
+  memcpy(copy->mode, mode, used * sizeof(__u16));
+  memcpy(copy->uid, uid, used * sizeof(__u16));
+  memcpy(copy->gid, gid, used * sizeof(__u16));
+  memcpy(copy->links, links, used * sizeof(__u16));
+  return copy;
+}
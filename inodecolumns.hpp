@@ -0,0 +1,66 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include "ext2_fs.h"
+
+using std::unique_ptr;
+
+// -------------------------------------------------- Inode Columns
+//
+// The allocated inodes of one block group, decoded into structure-of-arrays
+// form: entry i of every column belongs to inode ino[i], in inode order.
+//
+// Passes that only look at a few fields (the audit, filters, statistics)
+// iterate these dense columns instead of casting ext2_inode at inode-size
+// strides through the raw table, which keeps their loops simple enough for the
+// compiler to vectorize. Columns keep their on-disk widths, and all of them
+// share one allocation.
+//
+class InodeColumns {
+ public:
+  InodeColumns(__u32 group, size_t capacity);
+
+  InodeColumns(const InodeColumns&) = delete;
+  InodeColumns &operator=(const InodeColumns&) = delete;
+
+  __u32 group;
+
+  __u32 *ino;
+  __u32 *size;
+  __u32 *blocks; // i_blocks, in 512-byte sectors
+  __u32 *atime;
+  __u32 *mtime;
+  __u32 *ctime;
+  __u32 *fileAcl; // i_file_acl, the extended attribute block
+  __u32 *block;  // EXT2_N_BLOCKS entries per inode
+  __u16 *mode;
+  __u16 *uid;
+  __u16 *gid;
+  __u16 *links;
+
+  size_t count() const { return used; }
+  size_t capacity() const { return slots; }
+
+  /*i_block of inode ino[i]*/
+  const __u32 *blocksOf(size_t i) const { return block + i * EXT2_N_BLOCKS; }
+
+  /*Empties the columns, to be reused for another group*/
+  void clear(__u32 group) { this->group = group; used = 0; }
+
+  /*Decodes 'inode' into the next entry. Requires count() < capacity()*/
+  void append(__u32 inodeNumber, const ext2_inode &inode);
+
+  /*A copy whose capacity is its count()*/
+  unique_ptr<InodeColumns> compact() const;
+
+  /*Bytes held by the columns of 'inodes' inodes*/
+  static size_t bytesFor(size_t inodes) { return inodes * BYTES_PER_INODE; }
+
+  static const size_t BYTES_PER_INODE = (7 + EXT2_N_BLOCKS) * sizeof(__u32) + 4 * sizeof(__u16);
+
+ private:
+  unique_ptr<char[]> storage;
+  size_t used = 0;
+  size_t slots;
+};
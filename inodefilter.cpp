@@ -0,0 +1,241 @@
+#include "inodefilter.hpp"
+#include "csvvisitor.hpp"
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using std::runtime_error;
+
+// Characters that end a field name or value
+static const char *DELIMITERS = " \t&|()!<>=";
+
+InodeFilter::InodeFilter(const string &expression) : expression(expression) {
+  skipSpaces();
+  if (pos == expression.size())
+    fail("EmptyFilter");
+
+  parseOr();
+  if (pos != expression.size())
+    fail("FilterSyntaxError");
+}
+
+// -------------------------------------------------- Evaluation
+bool InodeFilter::matches(__u32 inodeNumber, const ext2_inode &inode) const {
+  bool stack[MAX_DEPTH];
+  size_t top = 0;
+
+  for (const Instruction &in : program) {
+    switch (in.kind) {
+      case Instruction::COMPARE: {
+        const uint64_t value = fieldValue(in.field, inodeNumber, inode);
+        bool result = false;
+        switch (in.comparison) {
+          case EQ: result = value == in.value; break;
+          case NE: result = value != in.value; break;
+          case LT: result = value < in.value; break;
+          case LE: result = value <= in.value; break;
+          case GT: result = value > in.value; break;
+          case GE: result = value >= in.value; break;
+        }
+        stack[top++] = result;
+        break;
+      }
+      case Instruction::AND:
+        top--;
+        stack[top - 1] = stack[top - 1] && stack[top];
+        break;
+      case Instruction::OR:
+        top--;
+        stack[top - 1] = stack[top - 1] || stack[top];
+        break;
+      case Instruction::NOT:
+        stack[top - 1] = !stack[top - 1];
+        break;
+    }
+  }
+  return stack[0];
+}
+
+uint64_t InodeFilter::fieldValue(Field field, __u32 inodeNumber, const ext2_inode &inode) {
+  switch (field) {
+    case INO:    return inodeNumber;
+    case TYPE:   return CsvVisitor::fileType(inode);
+    case MODE:   return inode.i_mode & 0x0FFF;
+    case UID:    return inode.i_uid;
+    case GID:    return inode.i_gid;
+    case LINKS:  return inode.i_links_count;
+    case SIZE:   return CsvVisitor::fileSize(inode);
+    case BLOCKS: return inode.i_blocks;
+    case ATIME:  return inode.i_atime;
+    case CTIME:  return inode.i_ctime;
+    case MTIME:  return inode.i_mtime;
+  }
+  return 0;
+}
+
+// -------------------------------------------------- Parser
+void InodeFilter::parseOr() {
+  parseAnd();
+  while (accept("||")) {
+    parseAnd();
+    emit(Instruction::OR, -1);
+  }
+}
+
+void InodeFilter::parseAnd() {
+  parseUnary();
+  while (accept("&&")) {
+    parseUnary();
+    emit(Instruction::AND, -1);
+  }
+}
+
+void InodeFilter::parseUnary() {
+  if (++nesting > MAX_DEPTH)
+    fail("FilterTooComplex");
+
+  if (accept("!")) {
+    parseUnary();
+    emit(Instruction::NOT, 0);
+  } else if (accept("(")) {
+    parseOr();
+    if (!accept(")"))
+      fail("UnbalancedFilterParentheses");
+  } else {
+    parseComparison();
+  }
+  nesting--;
+}
+
+void InodeFilter::parseComparison() {
+  static const struct { const char *name; Field field; } FIELDS[] = {
+    {"ino", INO},     {"type", TYPE},   {"mode", MODE},     {"uid", UID},
+    {"gid", GID},     {"links", LINKS}, {"size", SIZE},     {"blocks", BLOCKS},
+    {"atime", ATIME}, {"ctime", CTIME}, {"mtime", MTIME},
+  };
+  // Longer tokens first, so that "<=" is not read as "<"
+  static const struct { const char *token; Comparison comparison; } COMPARISONS[] = {
+    {"==", EQ}, {"!=", NE}, {"<=", LE}, {">=", GE}, {"<", LT}, {">", GT},
+  };
+
+  const size_t start = pos;
+  const string name = nextWord();
+
+  Instruction in = {Instruction::COMPARE, INO, EQ, 0};
+  bool known = false;
+  for (auto &entry : FIELDS)
+    if (name == entry.name) {
+      in.field = entry.field;
+      known = true;
+    }
+  if (!known) {
+    pos = start;
+    fail(name.empty() ? "ExpectedFilterField" : "UnknownFilterField");
+  }
+
+  known = false;
+  for (auto &entry : COMPARISONS)
+    if (!known && accept(entry.token)) {
+      in.comparison = entry.comparison;
+      known = true;
+    }
+  if (!known)
+    fail("ExpectedFilterComparison");
+  if (in.field == TYPE && in.comparison != EQ && in.comparison != NE)
+    fail("InvalidFilterComparison");
+
+  // Errors in the value are reported from its start
+  skipSpaces();
+  const size_t valueStart = pos;
+  const string word = nextWord();
+  const size_t valueEnd = pos;
+  pos = valueStart;
+  in.value = parseValue(in.field, word);
+  pos = valueEnd;
+
+  program.push_back(in);
+  if (++depth > MAX_DEPTH)
+    fail("FilterTooComplex");
+}
+
+void InodeFilter::emit(Instruction::Kind kind, int stackChange) {
+  program.push_back({kind, INO, EQ, 0});
+  depth += stackChange;
+}
+
+/*Integers (with an optional K, M, G or T suffix), dates for the time fields
+  and a type character for 'type'*/
+uint64_t InodeFilter::parseValue(Field field, const string &word) {
+  if (word.empty())
+    fail("ExpectedFilterValue");
+
+  if (field == TYPE) {
+    if (word.size() != 1 || !strchr("fds?", word[0]))
+      fail("InvalidFilterValue");
+    return word[0];
+  }
+
+  if (field == ATIME || field == CTIME || field == MTIME) {
+    struct tm tm = {};
+    int dateLen = 0, timeLen = 0;
+    if (sscanf(word.c_str(), "%4d-%2d-%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &dateLen) == 3) {
+      const char *rest = word.c_str() + dateLen;
+      if (*rest && !(sscanf(rest, "T%2d:%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &timeLen) == 3 &&
+                     rest[timeLen] == '\0'))
+        fail("InvalidFilterValue");
+      if (tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 ||
+          tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60)
+        fail("InvalidFilterValue");
+      tm.tm_year -= 1900;
+      tm.tm_mon -= 1;
+      return timegm(&tm);
+    }
+  }
+
+  char *end;
+  errno = 0;
+  uint64_t value = strtoull(word.c_str(), &end, 0);
+  if (end == word.c_str() || errno != 0 || word[0] == '-')
+    fail("InvalidFilterValue");
+
+  static const char *SUFFIXES = "KMGT";
+  if (*end != '\0') {
+    const char *suffix = strchr(SUFFIXES, *end);
+    if (!suffix || end[1] != '\0')
+      fail("InvalidFilterValue");
+    value <<= 10 * (suffix - SUFFIXES + 1);
+  }
+  return value;
+}
+
+void InodeFilter::skipSpaces() {
+  while (pos < expression.size() && isspace((unsigned char)expression[pos]))
+    pos++;
+}
+
+/*Consumes 'token' (after any spaces) if it comes next*/
+bool InodeFilter::accept(const char *token) {
+  skipSpaces();
+  if (expression.compare(pos, strlen(token), token) != 0)
+    return false;
+  pos += strlen(token);
+  return true;
+}
+
+/*Consumes the field name or value that comes next (possibly empty)*/
+string InodeFilter::nextWord() {
+  skipSpaces();
+  const size_t start = pos;
+  while (pos < expression.size() && !strchr(DELIMITERS, expression[pos]))
+    pos++;
+  return expression.substr(start, pos - start);
+}
+
+void InodeFilter::fail(const char *error) {
+  throw runtime_error(string(error) + " near '" + expression.substr(std::min(pos, expression.size())) + "'");
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "ext2_fs.h"
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Inode Filter
+//
+// A predicate over inodes, e.g. "size>1G && uid==1000" or
+// "type==d || (type==f && mtime>=2024-01-01)". Used by 'lab3a --where'.
+//
+//   fields      ino, type (f, d, s or ?), mode (permission bits), uid, gid,
+//               links, size, blocks, atime, ctime, mtime
+//   comparisons ==  !=  <  <=  >  >=
+//   logic       &&  ||  !  ( )
+//   values      integers (0x.. and 0.. for hex and octal), sizes with a K, M,
+//               G or T suffix, and times as YYYY-MM-DD[THH:MM:SS] (UTC)
+//
+// The expression is compiled once into a postfix program whose comparisons
+// read the raw on-disk inode directly, so evaluating it costs a few loads and
+// compares per inode, and takes no lock.
+//
+class InodeFilter {
+ public:
+  /*Compiles 'expression'. Throws runtime_error if it is malformed*/
+  explicit InodeFilter(const string &expression);
+
+  bool matches(__u32 inodeNumber, const ext2_inode &inode) const;
+
+  const string &getExpression() const { return expression; }
+
+  // Deepest nesting a program may need on its evaluation stack
+  static const size_t MAX_DEPTH = 64;
+
+ private:
+  enum Field : __u8 { INO, TYPE, MODE, UID, GID, LINKS, SIZE, BLOCKS, ATIME, CTIME, MTIME };
+  enum Comparison : __u8 { EQ, NE, LT, LE, GT, GE };
+
+  struct Instruction {
+    enum Kind : __u8 { COMPARE, AND, OR, NOT } kind;
+    Field field;
+    Comparison comparison;
+    uint64_t value;
+  };
+
+  string expression;
+  vector<Instruction> program;
+
+  // -------------------------------------------------- Parser
+  // expr   := and ('||' and)*
+  // and    := unary ('&&' unary)*
+  // unary  := '!' unary | '(' expr ')' | FIELD COMPARISON VALUE
+  size_t pos = 0;
+  size_t nesting = 0; // of '(' and '!'
+  size_t depth = 0;   // of the evaluation stack
+
+  void parseOr();
+  void parseAnd();
+  void parseUnary();
+  void parseComparison();
+  void emit(Instruction::Kind, int stackChange);
+
+  void skipSpaces();
+  bool accept(const char *token);
+  string nextWord();
+  [[noreturn]] void fail(const char *error);
+
+  uint64_t parseValue(Field, const string &);
+  static uint64_t fieldValue(Field, __u32 inodeNumber, const ext2_inode &);
+};
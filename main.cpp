@@ -1,60 +1,573 @@
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <string>
+#include <sstream>
 #include "ext2.hpp"
+#include "batch.hpp"
+#include "compressedoutput.hpp"
+#include "memorybudget.hpp"
+#include "streamscan.hpp"
+#include "trace.hpp"
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <random>
 
-#define LAB3B_USAGE "Usage: lab3a FILE"
+#define LAB3B_USAGE "Usage: lab3a [--audit] [--check-backups] [--sections=LIST] [--where=EXPR] [--owner=BLOCKS] [--estimate[=FRACTION] [--estimate-seed=N]] [--memory-limit=SIZE] [--trace=FILE] [--zstd[=LEVEL] [--zstd-workers=N]] [--stream] [--shard=K/N] FILE|-\n       lab3a --extract=PATH|INODE --out=FILE FILE\n       lab3a [--audit] [--check-backups] [--sections=LIST] [--where=EXPR] [--estimate[=FRACTION]] [--memory-limit=SIZE] [--trace=FILE] [--zstd[=LEVEL]] [--out-dir DIR] --batch LIST|DIR"
 #define ERR_INIT "lab3a: Exception occurred during initialization -- "
 #define ERR_RUNTIME "lab3a: Exception occurred during run time -- "
 #define EXSUCCESS 0
 #define EXBADARG 1
 #define EXCORRUPT 2
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_BUFFER_MIN 4096
+#define ESTIMATE_FRACTION 0.01
 
-int debug = 0;
+// -------------------------------------------------- Run Options
+struct RunOptions {
+  bool audit = false;
+  bool checkBackups = false; // every backup copy, instead of a sample
+  unsigned sections = SECTION_ALL;
+  std::shared_ptr<const InodeFilter> filter; // compiled once, shared by every image
+  vector<BlockOwners::Range> owners; // blocks whose owners are queried, instead of the report
+  const char *extract = nullptr; // file or directory copied out, instead of the report
+  const char *extractTo = nullptr;
+  double estimate = 0; // share of the inode tables sampled, instead of the report (0 = off)
+  uint64_t estimateSeed = 0;
+  __u32 shard = 0; // 1 to shards, this run's share of the image (0 = all of it)
+  __u32 shards = 0;
+};
 
-int main(int argc, char **argv) {
-  if (argc != 2) {
-    std::cerr << LAB3B_USAGE << std::endl;
-    std::cerr << "lab3a: expected 1 argument, received %d. See usage example.\n";
-    std::cerr.flush();
-    exit(EXBADARG); // TODO proper exit code
+/*Parses a comma separated list of section names into a ReportSection mask.
+  Returns 0 if any name is unknown*/
+static unsigned parseSections(const char *list) {
+  static const struct { const char *name; unsigned mask; } NAMES[] = {
+    {"super", SECTION_SUPER},   {"groups", SECTION_GROUPS},
+    {"bfree", SECTION_BFREE},   {"ifree", SECTION_IFREE},
+    {"inodes", SECTION_INODES}, {"dirent", SECTION_DIRENT},
+    {"indirect", SECTION_INDIRECT}, {"frag", SECTION_FRAG},
+    {"hash", SECTION_HASH}, {"path", SECTION_PATH},
+    {"dirent-path", SECTION_DIRENT | SECTION_DIRENT_PATH}, {"xattr", SECTION_XATTR},
+    {"all", SECTION_ALL},
+  };
+
+  unsigned sections = 0;
+  std::stringstream ss(list);
+  string name;
+
+  while (std::getline(ss, name, ',')) {
+    unsigned mask = 0;
+    for (auto &entry : NAMES)
+      if (name == entry.name)
+        mask = entry.mask;
+    if (mask == 0)
+      return 0;
+    sections |= mask;
   }
+  return sections;
+}
+
+/*Parses a comma separated list of block numbers and ranges (e.g. "5,100-120")
+  into sorted, disjoint 'ranges'. Returns false if the list is malformed*/
+static bool parseBlockList(const char *list, vector<BlockOwners::Range> &ranges) {
+  std::stringstream ss(list);
+  string item;
 
+  while (std::getline(ss, item, ',')) {
+    char *end;
+    unsigned long first = strtoul(item.c_str(), &end, 0), last = first;
+    if (end == item.c_str())
+      return false;
+    if (*end == '-') {
+      const char *start = end + 1;
+      last = strtoul(start, &end, 0);
+      if (end == start)
+        return false;
+    }
+    if (*end != '\0' || last < first || last > UINT32_MAX)
+      return false;
+
+    ranges.emplace_back(first, last);
+  }
+  if (ranges.empty())
+    return false;
+
+  // Overlapping and adjacent ranges are merged
+  std::sort(ranges.begin(), ranges.end());
+  size_t merged = 0;
+  for (size_t i = 1; i < ranges.size(); i++) {
+    if ((uint64_t)ranges[merged].second + 1 >= ranges[i].first)
+      ranges[merged].second = std::max(ranges[merged].second, ranges[i].second);
+    else
+      ranges[++merged] = ranges[i];
+  }
+  ranges.resize(merged + 1);
+  return true;
+}
+
+// -------------------------------------------------- Validate One Image
+// Returns the exit code for the image. Reports go to 'out', errors to 'err'.
+static int validateImage(const char *filename, FILE *out, FILE *err, const RunOptions &options) {
+  TRACE_SCOPE("validateImage", "image");
 
   // -------------------------------------------------- Check/Read FS
   std::unique_ptr<EXT2> ext2 = nullptr;
 
   try {
-    ext2 = std::make_unique<EXT2>(argv[1]);
+    ext2 = std::make_unique<EXT2>(const_cast<char*>(filename));
   } catch (EXT2_error &e) {
     // All errors that may occur during initialization will be treated
     // as "corruption" errors
-    std::cerr << LAB3B_USAGE << endl;
-    std::cerr << ERR_INIT  << e.what();
-    std::cerr.flush();
-    exit(EXCORRUPT);
+    fprintf(err, "%s\n%s%s\n", LAB3B_USAGE, ERR_INIT, e.what());
+    return EXCORRUPT;
   } catch (...) {
-    std::cerr << LAB3B_USAGE << endl;
-    std::cerr << "lab3a: encountered invalid or unsupported file" << endl;
-    std::cerr.flush();
-    exit(EXCORRUPT);
+    fprintf(err, "%s\nlab3a: encountered invalid or unsupported file\n", LAB3B_USAGE);
+    return EXCORRUPT;
+  }
+
+  ext2->setOutput(out);
+  ext2->setFilter(options.filter.get());
+  if (options.shards)
+    ext2->setShard(options.shard - 1, options.shards);
+
+  // -------------------------------------------------- Extraction
+  if (options.extract) {
+    try {
+      vector<string> failures = ext2->extract(options.extract, options.extractTo);
+      for (auto &failure : failures)
+        fprintf(err, "lab3a: cannot extract %s\n", failure.c_str());
+      return failures.empty() ? EXSUCCESS : EXCORRUPT;
+    } catch (runtime_error &e) {
+      fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+      return EXCORRUPT;
+    }
   }
 
+  // -------------------------------------------------- Block Owners
+  if (!options.owners.empty()) {
+    try {
+      BlockOwners index;
+      index.restrict(options.owners);
+      ext2->indexBlockOwners(index);
 
+      // Ranges are clipped to the image, so that "1-4000000000" costs no more
+      // than listing every block
+      vector<BlockOwners::Owner> owners;
+      for (auto &range : options.owners) {
+        const uint64_t last = std::min<uint64_t>(range.second, (uint64_t)index.getBlockCount() - 1);
+        for (uint64_t block = range.first; block <= last; block++) {
+          owners.clear();
+          if (index.lookup(block, owners) == 0)
+            fprintf(out, "OWNER,%u,NONE,0,0\n", (__u32)block);
+          for (auto &owner : owners)
+            fprintf(out, "OWNER,%u,%s,%u,%u\n", (__u32)block, BlockOwners::roleName(owner.role),
+                    owner.inode, owner.logical);
+        }
+      }
+    } catch (runtime_error &e) {
+      fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+      return EXCORRUPT;
+    }
+    return EXSUCCESS;
+  }
+
+  // -------------------------------------------------- Audit
+  if (options.audit || options.checkBackups) {
+    try {
+      // A shard's findings are made by lab3a-merge
+      if (options.shards) {
+        ext2->printShardAudit(options.audit, options.checkBackups);
+        return EXSUCCESS;
+      }
+
+      size_t findings = ext2->checkBackups(options.checkBackups);
+      if (options.audit) {
+        findings += ext2->auditBlocks();
+        findings += ext2->verifyXattrBlocks();
+        findings += ext2->verifyDirectoryGraph();
+      }
+      if (findings > 0)
+        return EXCORRUPT;
+    } catch (runtime_error &e) {
+      fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+      return EXCORRUPT;
+    }
+    return EXSUCCESS;
+  }
+
+  // -------------------------------------------------- Estimate
+  if (options.estimate > 0) {
+    try {
+      ext2->printEstimate(options.estimate, options.estimateSeed);
+    } catch (runtime_error &e) {
+      fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+      return EXCORRUPT;
+    }
+    return EXSUCCESS;
+  }
+
+  if (ext2->getSuperBlockGroup() != 0)
+    fprintf(err, "lab3a: the primary superblock is damaged, using the backup in group %u\n",
+            ext2->getSuperBlockGroup());
 
   // -------------------------------------------------- Generate Reports
   try {
-    ext2->printSuperBlock();
-    ext2->printGroupSummary();
-    ext2->printFreeBlockEntries();
-    ext2->printFreeInodeEntries();
-    ext2->printInodeSummary();
+    if (options.shards)
+      ext2->printShardReport(options.sections);
+    else
+      ext2->printReport(options.sections);
   } catch (runtime_error &e) {
-    std::cerr << ERR_RUNTIME << e.what() << endl;
-    std::cerr.flush();
-    exit(EXCORRUPT);
+    fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+    return EXCORRUPT;
   }
   return EXSUCCESS;
 }
+
+// -------------------------------------------------- Stream One Image
+// The report of an image read once from 'fd' (see StreamScan). Returns the
+// exit code for the image.
+static int streamImage(int fd, FILE *out, FILE *err, const RunOptions &options) {
+  TRACE_SCOPE("streamImage", "image");
+
+  try {
+    CsvVisitor visitor(out);
+    StreamScan scan(fd);
+    scan.run(visitor, options.sections, options.filter.get());
+
+    if (scan.getMissedBlocks() > 0) {
+      fprintf(err, "lab3a: %zu blocks were needed after they had left the stream buffer, "
+                   "so the report is incomplete (a larger --memory-limit keeps more of them)\n",
+              scan.getMissedBlocks());
+      return EXCORRUPT;
+    }
+  } catch (runtime_error &e) {
+    fprintf(err, "%s%s\n", ERR_RUNTIME, e.what());
+    return EXCORRUPT;
+  }
+  return EXSUCCESS;
+}
+
+/*Writes the trace, if one was requested. Failing to is not fatal*/
+static void writeTrace(const char *path) {
+  if (path && !Trace::write(path))
+    std::cerr << "lab3a: cannot write trace to '" << path << "'" << std::endl;
+}
+
+int main(int argc, char **argv) {
+  // -------------------------------------------------- Options
+  // --audit        : check block allocation and the directory graph in-process
+  //                  instead of printing the report
+  // --check-backups: compare every backup Super Block and Group Descriptor
+  //                  Table with the primary (--audit only samples a few), and
+  //                  report the differences
+  // --batch SOURCE : validate every image listed in SOURCE (or inside it, if it
+  //                  is a directory) on a thread pool
+  // --out-dir DIR  : with --batch, write one report file per image into DIR
+  // --sections=LIST: only produce (and only compute) the listed report
+  //                  sections: super,groups,bfree,ifree,inodes,dirent,indirect,
+  //                  and, only when asked for, frag (fragmentation statistics),
+  //                  hash (a CRC-32C of every regular file), path (the full
+  //                  path of every directory entry), dirent-path (dirent,
+  //                  with the entry's full path at the end of each line) and
+  //                  xattr (the extended attributes of every inode)
+  // --memory-limit=SIZE: keep the scan's large allocations under SIZE bytes
+  //                  (K, M and G suffixes are accepted) by working in smaller
+  //                  chunks
+  // --trace=FILE   : write a Chrome/Perfetto trace of the run's phases to FILE
+  // --where=EXPR   : only report the inodes matching EXPR (and their directory
+  //                  entries and indirect blocks), e.g. "size>1G && uid==1000".
+  //                  See inodefilter.hpp for the syntax
+  // --owner=BLOCKS : instead of the report, print what owns each of BLOCKS (a
+  //                  comma separated list of numbers and ranges, e.g. 5,90-99):
+  //                  OWNER,block,role,inode,logical block (or group)
+  // --extract=SOURCE --out=PATH: instead of the report, copy the file,
+  //                  symbolic link or directory tree SOURCE (a path in the
+  //                  image, or an inode number) to PATH
+  // --estimate[=FRACTION]: instead of the report, estimate the distributions
+  //                  of free space, file types, sizes and extents, with 95%
+  //                  confidence intervals, from a random stratified sample of
+  //                  FRACTION (0.01 by default) of the inode tables
+  // --estimate-seed=N: draw the sample from seed N, to repeat a run (the seed
+  //                  of every run is in its SAMPLE line)
+  // --stream       : read FILE once, front to back, instead of seeking in it.
+  //                  Implied when FILE is '-' (stdin), a pipe or a character
+  //                  device. Only the report (without frag, hash, paths and
+  //                  xattrs) is available this way
+  // --zstd[=LEVEL] : write the report to stdout as a zstd stream (level 3 by
+  //                  default), compressed on its own thread while the scan
+  //                  carries on
+  // --zstd-workers=N: also have zstd compress the stream on N threads of its
+  //                  own (multithreaded frames)
+  // --shard=K/N    : only read the K-th of N equal ranges of groups, and write
+  //                  a shard of the report or of --audit/--check-backups, for
+  //                  lab3a-merge to put back together (see shard.hpp)
+  int audit = 0;
+  int checkBackups = 0;
+  int stream = 0;
+  const char *batch = nullptr;
+  const char *outDir = nullptr;
+  const char *tracePath = nullptr;
+  int zstdLevel = 0; // 0 = uncompressed
+  int zstdWorkers = 0;
+  bool estimateSeed = false;
+  RunOptions options;
+
+  enum { OPT_BATCH = 'b', OPT_OUT_DIR = 'o', OPT_SECTIONS = 's', OPT_MEMORY_LIMIT = 'm', OPT_TRACE = 't',
+         OPT_WHERE = 'w', OPT_OWNER = 'O', OPT_EXTRACT = 'x', OPT_OUT = 'X', OPT_ZSTD = 'z',
+         OPT_ZSTD_WORKERS = 'Z', OPT_ESTIMATE = 'e', OPT_ESTIMATE_SEED = 'E', OPT_SHARD = 'k' };
+  static struct option longOptions[] = {
+    {"audit", no_argument, &audit, 1},
+    {"check-backups", no_argument, &checkBackups, 1},
+    {"stream", no_argument, &stream, 1},
+    {"batch", required_argument, nullptr, OPT_BATCH},
+    {"out-dir", required_argument, nullptr, OPT_OUT_DIR},
+    {"sections", required_argument, nullptr, OPT_SECTIONS},
+    {"memory-limit", required_argument, nullptr, OPT_MEMORY_LIMIT},
+    {"trace", required_argument, nullptr, OPT_TRACE},
+    {"where", required_argument, nullptr, OPT_WHERE},
+    {"owner", required_argument, nullptr, OPT_OWNER},
+    {"extract", required_argument, nullptr, OPT_EXTRACT},
+    {"out", required_argument, nullptr, OPT_OUT},
+    {"zstd", optional_argument, nullptr, OPT_ZSTD},
+    {"zstd-workers", required_argument, nullptr, OPT_ZSTD_WORKERS},
+    {"estimate", optional_argument, nullptr, OPT_ESTIMATE},
+    {"estimate-seed", required_argument, nullptr, OPT_ESTIMATE_SEED},
+    {"shard", required_argument, nullptr, OPT_SHARD},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case 0:
+        break;
+      case OPT_BATCH:
+        batch = optarg;
+        break;
+      case OPT_OUT_DIR:
+        outDir = optarg;
+        break;
+      case OPT_SECTIONS:
+        options.sections = parseSections(optarg);
+        if (options.sections == 0) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: unknown report section in '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        break;
+      case OPT_TRACE:
+        tracePath = optarg;
+        Trace::start();
+        break;
+      case OPT_WHERE:
+        try {
+          options.filter = std::make_shared<InodeFilter>(optarg);
+        } catch (runtime_error &e) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid filter: " << e.what() << std::endl;
+          exit(EXBADARG);
+        }
+        break;
+      case OPT_EXTRACT:
+        options.extract = optarg;
+        break;
+      case OPT_OUT:
+        options.extractTo = optarg;
+        break;
+      case OPT_OWNER:
+        if (!parseBlockList(optarg, options.owners)) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid block list '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        break;
+      case OPT_ZSTD:
+      case OPT_ZSTD_WORKERS: {
+        // Levels 1 to 22, and at most 200 workers, as zstd allows
+        const bool level = (opt == OPT_ZSTD);
+        char *end = nullptr;
+        long value = optarg ? strtol(optarg, &end, 10) : CompressedOutput::DEFAULT_LEVEL;
+        if ((optarg && (end == optarg || *end != '\0')) || value < (level ? 1 : 0) || value > (level ? 22 : 200)) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid zstd " << (level ? "level" : "worker count") << " '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        (level ? zstdLevel : zstdWorkers) = value;
+        break;
+      }
+      case OPT_ESTIMATE: {
+        char *end = nullptr;
+        options.estimate = optarg ? strtod(optarg, &end) : ESTIMATE_FRACTION;
+        if ((optarg && (end == optarg || *end != '\0')) || !(options.estimate > 0 && options.estimate <= 1)) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid estimate fraction '" << optarg << "' (0 to 1)" << std::endl;
+          exit(EXBADARG);
+        }
+        break;
+      }
+      case OPT_ESTIMATE_SEED: {
+        char *end = nullptr;
+        options.estimateSeed = strtoull(optarg, &end, 0);
+        if (end == optarg || *end != '\0') {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid estimate seed '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        estimateSeed = true;
+        break;
+      }
+      case OPT_SHARD: {
+        unsigned shard, shards;
+        int length = 0;
+        if (sscanf(optarg, "%u/%u%n", &shard, &shards, &length) != 2 || optarg[length] != '\0' ||
+            shard < 1 || shard > shards) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid shard '" << optarg << "' (K/N, with 1 <= K <= N)" << std::endl;
+          exit(EXBADARG);
+        }
+        options.shard = shard;
+        options.shards = shards;
+        break;
+      }
+      case OPT_MEMORY_LIMIT: {
+        size_t limit = MemoryBudget::parseSize(optarg);
+        if (limit == 0) {
+          std::cerr << LAB3B_USAGE << std::endl;
+          std::cerr << "lab3a: invalid memory limit '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        MemoryBudget::global().setLimit(limit);
+        break;
+      }
+      default:
+        std::cerr << LAB3B_USAGE << std::endl;
+        std::cerr.flush();
+        exit(EXBADARG);
+    }
+  }
+
+  options.audit = audit;
+  options.checkBackups = checkBackups;
+
+  // Extraction writes to a single destination, so it takes a single image
+  if (!options.extract != !options.extractTo || (options.extract && batch)) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: --extract needs --out, and cannot be used with --batch" << std::endl;
+    exit(EXBADARG);
+  }
+
+  // A batch is a list of files to seek in
+  if (stream && batch) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: --stream cannot be used with --batch" << std::endl;
+    exit(EXBADARG);
+  }
+
+  // Only stdout is compressed
+  if ((zstdWorkers && !zstdLevel) || (zstdLevel && outDir)) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: --zstd-workers needs --zstd, which cannot be used with --out-dir" << std::endl;
+    exit(EXBADARG);
+  }
+
+  // Everything else reads or reports across groups
+  if (options.shards && (batch || stream || !options.owners.empty() || options.extract || options.estimate ||
+                         (options.sections & (SECTION_FRAG | SECTION_PATH | SECTION_DIRENT_PATH)))) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: --shard only covers the report (without frag and paths), --audit and --check-backups "
+                 "of a single image" << std::endl;
+    exit(EXBADARG);
+  }
+
+  if (estimateSeed && !options.estimate) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: --estimate-seed needs --estimate" << std::endl;
+    exit(EXBADARG);
+  }
+  if (!estimateSeed)
+    options.estimateSeed = std::random_device()();
+
+  // The stdout buffer is the first thing charged to the budget
+  MemoryGrant outputGrant(OUTPUT_BUFFER_SIZE, OUTPUT_BUFFER_MIN);
+  setvbuf(stdout, nullptr, _IOFBF, outputGrant.size());
+
+  // The report goes to stdout, or through a compressor thread to it. Opened
+  // once every argument has been checked, and closed before the exit code is
+  // returned
+  std::unique_ptr<CompressedOutput> compressed;
+  auto openReport = [&]() -> FILE* {
+    if (!zstdLevel)
+      return stdout;
+    try {
+      compressed = std::make_unique<CompressedOutput>(STDOUT_FILENO, zstdLevel, zstdWorkers);
+    } catch (runtime_error &e) {
+      std::cerr << ERR_INIT << e.what() << std::endl;
+      exit(EXBADARG);
+    }
+    return compressed->stream();
+  };
+  auto closeReport = [&](int code) -> int {
+    fflush(stdout);
+    if (compressed && !compressed->close()) {
+      std::cerr << "lab3a: cannot write the compressed report -- " << compressed->getError() << std::endl;
+      code = std::max(code, EXBADARG);
+    }
+    writeTrace(tracePath);
+    return code;
+  };
+
+  if (batch) {
+    if (argc != optind) {
+      std::cerr << LAB3B_USAGE << std::endl;
+      exit(EXBADARG);
+    }
+
+    try {
+      int code = runBatch(batch, outDir, openReport(), [&options](const char *image, FILE *out, FILE *err) {
+        return validateImage(image, out, err, options);
+      });
+      return closeReport(code);
+    } catch (runtime_error &e) {
+      std::cerr << ERR_INIT << e.what() << endl;
+      exit(EXBADARG);
+    }
+  }
+
+  if (argc - optind != 1) {
+    std::cerr << LAB3B_USAGE << std::endl;
+    std::cerr << "lab3a: expected 1 argument, received " << argc - optind << ". See usage example.\n";
+    std::cerr.flush();
+    exit(EXBADARG); // TODO proper exit code
+  }
+
+  // Images that cannot be seeked in are streamed
+  const char *image = argv[optind];
+  struct stat st;
+  if (strcmp(image, "-") == 0 || (stat(image, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode))))
+    stream = 1;
+
+  if (stream) {
+    if (options.audit || options.checkBackups || !options.owners.empty() || options.extract || options.estimate ||
+        options.shards || (options.sections & (SECTION_FRAG | SECTION_HASH | SECTION_PATH | SECTION_DIRENT_PATH | SECTION_XATTR))) {
+      std::cerr << LAB3B_USAGE << std::endl;
+      std::cerr << "lab3a: a streamed image only has the report, without frag, hash, paths, xattrs and shards" << std::endl;
+      exit(EXBADARG);
+    }
+
+    const int fd = (strcmp(image, "-") == 0) ? STDIN_FILENO : open(image, O_RDONLY);
+    if (fd < 0) {
+      std::cerr << ERR_INIT << "cannot open '" << image << "'" << std::endl;
+      exit(EXBADARG);
+    }
+
+    int code = streamImage(fd, openReport(), stderr, options);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    return closeReport(code);
+  }
+
+  return closeReport(validateImage(image, openReport(), stderr, options));
+}
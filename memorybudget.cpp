@@ -0,0 +1,69 @@
+#include "memorybudget.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+MemoryBudget &MemoryBudget::global()
+{
+  static MemoryBudget budget;
+  return budget;
+}
+
+void MemoryBudget::setLimit(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  limit = bytes;
+}
+
+size_t MemoryBudget::affordable(size_t wanted, size_t minimum) const
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (limit == 0)
+    return wanted;
+
+  const size_t available = (limit > used) ? limit - used : 0;
+  return std::max(minimum, std::min(wanted, available));
+}
+
+size_t MemoryBudget::acquire(size_t wanted, size_t minimum)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  size_t granted = wanted;
+
+  if (limit != 0) {
+    const size_t available = (limit > used) ? limit - used : 0;
+    granted = std::max(minimum, std::min(wanted, available));
+  }
+
+  used += granted;
+  return granted;
+}
+
+void MemoryBudget::release(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  used = (bytes > used) ? 0 : used - bytes;
+}
+
+size_t MemoryBudget::parseSize(const char *text)
+{
+  char *end = nullptr;
+  errno = 0;
+  const unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || *text == '-' || errno == ERANGE)
+    return 0;
+
+  unsigned shift;
+  switch (*end) {
+    case '\0':           shift = 0; break;
+    case 'k': case 'K':  shift = 10; break;
+    case 'm': case 'M':  shift = 20; break;
+    case 'g': case 'G':  shift = 30; break;
+    default:             return 0;
+  }
+  // A size that does not fit is refused, as 0 is, rather than wrapped
+  if ((shift && end[1]) || value > (SIZE_MAX >> shift))
+    return 0;
+  return value << shift;
+}
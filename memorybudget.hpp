@@ -0,0 +1,70 @@
+#pragma once
+#include <stddef.h>
+#include <mutex>
+
+// -------------------------------------------------- Memory Budget
+//
+// A process-wide limit shared by every large allocation made during a scan
+// (reader buffers, the block cache, inode table chunks, output buffers and
+// audit structures). A limit of 0 means unlimited.
+//
+// Allocations that can be made smaller ask for what they would like and a
+// minimum they cannot do without, and adapt to what they are granted: under
+// pressure the scan degrades to smaller chunks (and more reads) instead of
+// failing. Minimums are always granted, even when they push usage past the
+// limit, since they are a handful of blocks at most.
+//
+class MemoryBudget {
+ public:
+  static MemoryBudget &global();
+
+  void setLimit(size_t bytes);
+  size_t getLimit() const { return limit; }
+  size_t getUsed() const { return used; }
+
+  /*How much of 'wanted' could be granted right now (at least 'minimum'),
+    without reserving anything*/
+  size_t affordable(size_t wanted, size_t minimum) const;
+
+  /*Reserves and returns affordable(wanted, minimum) bytes*/
+  size_t acquire(size_t wanted, size_t minimum);
+
+  void release(size_t bytes);
+
+  /*Parses sizes such as "512M", "2G" or "65536". Returns 0 on error, or if
+    the size does not fit in a size_t*/
+  static size_t parseSize(const char *text);
+
+ private:
+  mutable std::mutex lock;
+  size_t limit = 0;
+  size_t used = 0;
+};
+
+// -------------------------------------------------- Memory Grant
+// RAII holder for bytes acquired from a MemoryBudget
+class MemoryGrant {
+ public:
+  MemoryGrant() {}
+  MemoryGrant(size_t wanted, size_t minimum, MemoryBudget &budget = MemoryBudget::global())
+      : budget(&budget), bytes(budget.acquire(wanted, minimum)) {}
+  ~MemoryGrant() { reset(); }
+
+  MemoryGrant(const MemoryGrant&) = delete;
+  MemoryGrant &operator=(const MemoryGrant&) = delete;
+  MemoryGrant(MemoryGrant &&other) : budget(other.budget), bytes(other.bytes) { other.bytes = 0; }
+  MemoryGrant &operator=(MemoryGrant &&other) {
+    reset();
+    budget = other.budget;
+    bytes = other.bytes;
+    other.bytes = 0;
+    return *this;
+  }
+
+  size_t size() const { return bytes; }
+  void reset() { if (bytes) budget->release(bytes); bytes = 0; }
+
+ private:
+  MemoryBudget *budget = nullptr;
+  size_t bytes = 0;
+};
@@ -0,0 +1,63 @@
+#include <iostream>
+#include <getopt.h>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "memorybudget.hpp"
+#include "shard.hpp"
+
+#define MERGE_USAGE "Usage: lab3a-merge [--memory-limit=SIZE] SHARD..."
+#define EXSUCCESS 0
+#define EXBADARG 1
+#define EXCORRUPT 2
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// Puts the outputs of lab3a --shard=1/N to N/N back together, and writes what
+// a single run would have (see ShardMerge). Exits with 2 if an audit found
+// inconsistencies, as lab3a does
+int main(int argc, char **argv) {
+  enum { OPT_MEMORY_LIMIT = 'm' };
+  static struct option longOptions[] = {
+    {"memory-limit", required_argument, nullptr, OPT_MEMORY_LIMIT},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case OPT_MEMORY_LIMIT: {
+        size_t limit = MemoryBudget::parseSize(optarg);
+        if (limit == 0) {
+          std::cerr << MERGE_USAGE << std::endl;
+          std::cerr << "lab3a-merge: invalid memory limit '" << optarg << "'" << std::endl;
+          exit(EXBADARG);
+        }
+        MemoryBudget::global().setLimit(limit);
+        break;
+      }
+      default:
+        std::cerr << MERGE_USAGE << std::endl;
+        exit(EXBADARG);
+    }
+  }
+
+  if (optind == argc) {
+    std::cerr << MERGE_USAGE << std::endl;
+    exit(EXBADARG);
+  }
+
+  MemoryGrant outputGrant(OUTPUT_BUFFER_SIZE, 0);
+  setvbuf(stdout, nullptr, _IOFBF, std::max<size_t>(outputGrant.size(), BUFSIZ));
+
+  try {
+    ShardMerge merge(std::vector<std::string>(argv + optind, argv + argc));
+    const size_t findings = merge.merge(stdout);
+    fflush(stdout);
+    return findings > 0 ? EXCORRUPT : EXSUCCESS;
+  } catch (std::runtime_error &e) {
+    fflush(stdout);
+    std::cerr << "lab3a-merge: " << e.what() << std::endl;
+    return EXBADARG;
+  }
+}
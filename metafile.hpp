@@ -1,21 +1,25 @@
 #pragma once
+#include <stdint.h>
 #include <sys/types.h>
-#include "imagereader.hpp"
+#include <sys/stat.h>
+#include <string>
+#include "ext2_fs.h"
 
 // -------------------------------------------------- Meta File Info
 struct MetaFileLimits {
   // Limits enforced by block size
   // Based on Table 2.1 at
   // https://www.nongnu.org/ext2-doc/ext2.html#behaviour-flags
-  unsigned int fileSystemBlocks;
-  unsigned int blocksPerBlockGroup;
-  unsigned int inodesPerBlockGroup;
-  unsigned int bytesPerBlockGroup;
-  unsigned long fileSystemSizeReal;
-  unsigned long fileSystemSizeLinux;
-  unsigned long blocksPerFile;
-  unsigned long long fileSizeReal;
-  unsigned long long fileSizeLinux;
+  // Sizes in bytes are 64 bits: a group of 64KiB blocks alone is 32GiB
+  uint32_t fileSystemBlocks;
+  uint32_t blocksPerBlockGroup;
+  uint32_t inodesPerBlockGroup;
+  uint64_t bytesPerBlockGroup;
+  uint64_t fileSystemSizeReal;
+  uint64_t fileSystemSizeLinux;
+  uint64_t blocksPerFile;
+  uint64_t fileSizeReal;
+  uint64_t fileSizeLinux;
 };
 
 /**
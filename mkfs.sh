@@ -156,3 +156,467 @@ rm -f test.img
 # printf "Exit code: %d\n" $ec8
 # printf "Expected code: %d\n\n" 0
 # rm -f test.img
+
+
+
+# -------------------------------------------------- Generated Images
+# These need no mkfs.ext2: mkimage writes the images itself (make mkimage).
+# Each image is checked both by the report and by --audit.
+T=100
+while read -r desc opts; do
+  T=$((T + 1))
+  echo "--------------------------------------------------Beginning test $T [mkimage: $desc]"
+  ./mkimage $opts ./test.img &>> $log
+  ./lab3a test.img &>> $log
+  ec=$?
+  ./lab3a --audit test.img &>> $log
+  eca=$?
+
+  printf "Exit codes: %d %d\n" $ec $eca
+  printf "Expected codes: %d %d\n\n" 0 0
+  rm -f test.img
+done <<EOF2
+multiple-block-groups --size=64M --groups=8 --files=4000 --fan-out=16
+inode.size==256 --size=32M --inode-size=256 --files=2000
+block.size==2K,rev-0 --size=32M --block-size=2048 --rev=0 --groups=3
+block.size==4K,fragmented --size=256M --block-size=4096 --files=10000 --frag=0.3
+triple-indirect --size=96M --groups=12 --files=1000 --depth=3
+EOF2
+
+
+
+# -------------------------------------------------- Large Sparse Images
+# Images past 4GiB and 2TiB, as sparse files (only the metadata takes space).
+# BFREE is left out, since nearly every block of these images is free.
+# Each image is checked by the report and by --audit.
+T=200
+while read -r desc opts; do
+  T=$((T + 1))
+  echo "--------------------------------------------------Beginning test $T [mkimage: $desc]"
+  ./mkimage $opts ./test.img &>> $log
+  ./lab3a --sections=super,groups,ifree,inodes,dirent,indirect test.img &>> $log
+  ec=$?
+  ./lab3a --audit test.img &>> $log
+  eca=$?
+
+  printf "Exit codes: %d %d\n" $ec $eca
+  printf "Expected codes: %d %d\n\n" 0 0
+  rm -f test.img
+done <<EOF2
+above-4GiB --size=5200M --block-size=4096 --files=200
+above-2TiB --size=2560G --block-size=4096 --files=200
+EOF2
+
+# A file past 4GiB: its INODE line must carry the full 64 bit size
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [sparse 4.5GiB file]"
+truncate -s 5200M ./test.img
+mkfs.ext2 -F -q -b 4096 -N 65536 ./test.img &>> $log
+truncate -s 4608M ./big.bin
+debugfs -w -R "write ./big.bin big" ./test.img &>> $log
+./lab3a --sections=inodes test.img 2>> $log | grep -q ',4831838208,'
+ec=$?
+
+printf "Exit code: %d\n" $ec
+printf "Expected code: %d\n\n" 0
+rm -f test.img big.bin
+
+# INDIRECT offsets on 4K blocks: the second block under the double indirect
+# one maps logical blocks from 12 + 1024 + 1024 on
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [4K INDIRECT offsets]"
+truncate -s 64M ./test.img
+mkfs.ext2 -F -q -b 4096 ./test.img &>> $log
+head -c 12M /dev/urandom > ./big.bin
+debugfs -w -R "write ./big.bin big" ./test.img &>> $log
+n=$(./lab3a --sections=indirect test.img 2>> $log | grep -c -E '^INDIRECT,12,(2,2060|1,2061),')
+[ "$n" -eq 2 ]
+ec=$?
+
+printf "Exit code: %d\n" $ec
+printf "Expected code: %d\n\n" 0
+rm -f test.img big.bin
+
+# Extraction of a directory holding a symbolic link to ./outside and a
+# directory with the same name: nothing may be written through the link
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [extract: duplicate entry names]"
+rm -rf ./outside ./extracted && mkdir ./outside
+mkfs.ext2 -F -q -b 1024 ./test.img 4M &>> $log
+echo data > ./f.txt
+printf 'symlink x %s/outside\nmkdir z\nwrite ./f.txt z/f\n' "$PWD" | debugfs -w ./test.img &>> $log
+# rename z to x in the root directory block (name_len 1, file_type 2)
+b=$(debugfs -R "blocks /" ./test.img 2>> $log)
+off=$(dd if=./test.img bs=1024 skip=$b count=1 2>> $log | LC_ALL=C grep -obUaP '\x01\x02z' | cut -d: -f1)
+printf x | dd of=./test.img bs=1 seek=$((b * 1024 + off + 2)) conv=notrunc 2>> $log
+./lab3a --extract=/ --out=./extracted test.img &>> $log
+ec=$?
+[ -z "$(ls -A ./outside)" ]
+eco=$?
+
+printf "Exit codes: %d %d\n" $ec $eco
+printf "Expected codes: %d %d\n\n" 2 0
+rm -rf test.img f.txt outside extracted
+
+
+
+# -------------------------------------------------- Modes
+# One generated image, checked by each mode against the plain report, and a
+# small one written by debugfs with files of known contents.
+./mkimage --size=64M --groups=8 --files=4000 ./gen.img &>> $log
+./lab3a gen.img > ./gen.csv 2>> $log
+mkfs.ext2 -F -q -b 1024 -I 128 ./files.img 8M &>> $log
+printf 123456789 > ./nine.txt
+head -c 300K /dev/urandom > ./random.bin
+head -c 200K /dev/zero > ./zero.bin
+truncate -s 200K ./hole.bin
+debugfs -w ./files.img &>> $log <<EOF2
+mkdir a
+mkdir a/b
+write nine.txt a/b/nine
+write random.bin a/random
+write zero.bin zero
+write hole.bin hole
+symlink a/link random
+EOF2
+
+# --batch: one BEGIN/END block per image, and with --out-dir one file per image
+# holding its report. Two images with the same basename are refused up front
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [batch]"
+rm -rf ./batch ./out && mkdir -p ./batch/1 ./batch/2 ./out
+cp gen.img ./batch/one.img && cp gen.img ./batch/two.img
+./lab3a --batch ./batch > ./batch.out 2>> $log
+ec=$?
+[ "$(grep -c '^END,.*,0$' ./batch.out)" -eq 2 ]
+ecb=$?
+./lab3a --out-dir ./out --batch ./batch &>> $log && cmp -s ./out/one.img.csv gen.csv &&
+  cmp -s ./out/two.img.csv gen.csv
+eco=$?
+cp gen.img ./batch/1/same.img && cp gen.img ./batch/2/same.img
+printf '%s\n' ./batch/1/same.img ./batch/2/same.img > ./batch.list
+rm -f ./out/*
+./lab3a --out-dir ./out --batch ./batch.list &>> $log
+ecc=$?
+
+printf "Exit codes: %d %d %d %d\n" $ec $ecb $eco $ecc
+printf "Expected codes: %d %d %d %d\n\n" 0 0 0 1
+rm -rf ./batch ./out batch.out batch.list
+
+# --memory-limit: a budget far too small for the whole image gives the same
+# report, and the same findings (in their own order) on a damaged copy
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [memory limit]"
+./lab3a --memory-limit=16K gen.img 2>> $log | cmp -s - gen.csv
+ec=$?
+cp gen.img ./bad.img
+# an inode with a wrong link count, a second owner for its first block, and a
+# block in use marked free
+set -- $(grep '^INODE,[0-9]*,f,' gen.csv | sed -n '50p;3000p' | cut -d, -f2,13 | tr ',' ' ')
+printf 'sif <%s> links_count 7\nsif <%s> block[1] %s\nfreeb %s\n' $1 $3 $2 $4 | debugfs -w ./bad.img &>> $log
+./lab3a --audit bad.img > ./audit.1 2>> $log
+eca=$?
+./lab3a --audit --memory-limit=16K bad.img > ./audit.2 2>> $log
+ecl=$?
+[ -s ./audit.1 ] && cmp -s <(sort ./audit.1) <(sort ./audit.2)
+ecs=$?
+
+printf "Exit codes: %d %d %d %d\n" $ec $eca $ecl $ecs
+printf "Expected codes: %d %d %d %d\n\n" 0 2 2 0
+rm -f bad.img audit.1 audit.2
+
+# --trace: the report is unchanged, and the trace is a complete JSON object
+# with an event for each report section
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [trace]"
+./lab3a --trace=./trace.json gen.img 2>> $log | cmp -s - gen.csv
+ec=$?
+[ "$(head -n 1 ./trace.json)" = '{"displayTimeUnit":"ms","traceEvents":[' ] &&
+  [ "$(tail -n 1 ./trace.json)" = "]}" ] && grep -q '"cat":"section"' ./trace.json
+ect=$?
+
+printf "Exit codes: %d %d\n" $ec $ect
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f trace.json
+
+# --where: exactly the INODE lines of the matching inodes (with the DIRENT
+# lines of matching directories), and every other section as it was
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [where]"
+./lab3a --where="type==f && size>=8K" gen.img 2>> $log | grep '^INODE,' > ./where.out
+awk -F, '$1 == "INODE" && $3 == "f" && $11 >= 8192' gen.csv | cmp -s - ./where.out && [ -s ./where.out ]
+ec=$?
+./lab3a --where="type==d" gen.img 2>> $log | grep -v '^INODE,[0-9]*,d,' > ./where.out
+grep -v '^INODE,' gen.csv | grep -v '^INDIRECT,' | cmp -s - ./where.out
+ecd=$?
+
+printf "Exit codes: %d %d\n" $ec $ecd
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f where.out
+
+# --owner: a file's first block, a free block and the super block, given out of
+# order; a range past the end of the image stops at its last block
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [owner]"
+set -- $(grep '^INODE,[0-9]*,f,' gen.csv | sed -n '100p' | cut -d, -f2,13 | tr ',' ' ')
+free=$(grep -m 1 '^BFREE,' gen.csv | cut -d, -f2)
+./lab3a --owner=$free,$2,1 gen.img 2>> $log > ./owner.out
+printf 'OWNER,1,SUPERBLOCK,0,0\nOWNER,%s,DATA,%s,0\nOWNER,%s,NONE,0,0\n' $2 $1 $free |
+  sort -t, -k2,2n | cmp -s - ./owner.out
+ec=$?
+blocks=$(grep '^SUPERBLOCK,' gen.csv | cut -d, -f2)
+[ "$(./lab3a --owner=0-4294967295 gen.img 2>> $log | cut -d, -f2 | uniq | wc -l)" -eq $blocks ]
+ecr=$?
+
+printf "Exit codes: %d %d\n" $ec $ecr
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f owner.out
+
+# Extraction of everything: the same tree as debugfs's rdump, holes included
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [extract vs rdump]"
+ec=0
+for img in gen.img files.img; do
+  rm -rf ./extracted ./rdump && mkdir ./rdump
+  debugfs -R "rdump / ./rdump" ./$img &>> $log
+  ./lab3a --extract=/ --out=./extracted ./$img &>> $log || ec=1
+  diff -r --no-dereference ./rdump ./extracted &>> $log || ec=1
+done
+[ "$(du -k ./extracted/hole | cut -f1)" -eq 0 ]
+ech=$?
+
+printf "Exit codes: %d %d\n" $ec $ech
+printf "Expected codes: %d %d\n\n" 0 0
+rm -rf rdump extracted
+
+# FILEHASH: "123456789" has the CRC-32C check value e3069283, a hole hashes as
+# the zeros it reads as, and every regular file gets a line with its size
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [file hashes]"
+./lab3a --sections=path,hash files.img > ./hash.out 2>> $log
+ino() { grep ",$1\$" ./hash.out | grep '^PATH,' | cut -d, -f2; }
+grep -q "^FILEHASH,$(ino /a/b/nine),9,e3069283\$" ./hash.out
+ec=$?
+[ "$(grep "^FILEHASH,$(ino /hole)," ./hash.out | cut -d, -f3,4)" = \
+  "$(grep "^FILEHASH,$(ino /zero)," ./hash.out | cut -d, -f3,4)" ]
+ecz=$?
+./lab3a --sections=hash gen.img 2>> $log | cut -d, -f2,3 > ./hash.out
+grep '^INODE,[0-9]*,f,' gen.csv | cut -d, -f2,11 | cmp -s - ./hash.out
+ecg=$?
+
+printf "Exit codes: %d %d %d\n" $ec $ecz $ecg
+printf "Expected codes: %d %d %d\n\n" 0 0 0
+rm -f hash.out
+
+# --stream and stdin: the lines of the report, in disk order
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [stream]"
+cat gen.img | ./lab3a - 2>> $log | sort | cmp -s - <(sort gen.csv)
+ec=$?
+./lab3a --stream files.img 2>> $log | sort | cmp -s - <(./lab3a files.img 2>> $log | sort)
+ecf=$?
+
+printf "Exit codes: %d %d\n" $ec $ecf
+printf "Expected codes: %d %d\n\n" 0 0
+
+# --zstd: the stream decompresses to the plain report, with and without workers
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [zstd]"
+./lab3a --zstd gen.img 2>> $log | zstd -dc 2>> $log | cmp -s - gen.csv
+ec=$?
+./lab3a --zstd=19 --zstd-workers=2 gen.img 2>> $log | zstd -dc 2>> $log | cmp -s - gen.csv
+ecw=$?
+
+printf "Exit codes: %d %d\n" $ec $ecw
+printf "Expected codes: %d %d\n\n" 0 0
+
+# PATH and dirent-path: the full path of every inode, and of every entry
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [paths]"
+./lab3a --sections=path files.img 2>> $log | cut -d, -f3 | LC_ALL=C sort > ./path.out
+printf '%s\n' / /a /a/b /a/b/nine /a/link /a/random /hole /lost+found /zero | cmp -s - ./path.out
+ec=$?
+./lab3a --sections=dirent-path files.img 2>> $log | grep -q "^DIRENT,[0-9]*,[0-9]*,[0-9]*,[0-9]*,4,'nine',/a/b/nine\$"
+ecd=$?
+[ "$(./lab3a --sections=path gen.img 2>> $log | wc -l)" -eq "$(grep -c '^INODE,' gen.csv)" ]
+ecg=$?
+
+printf "Exit codes: %d %d %d\n" $ec $ecd $ecg
+printf "Expected codes: %d %d %d\n\n" 0 0 0
+rm -f path.out
+
+# --estimate: reading everything gives the exact file counts and byte total
+# with empty intervals, and a seed repeats a sample
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [estimate]"
+./lab3a --estimate=1 gen.img > ./estimate.out 2>> $log
+ec=0
+for type in f d s; do
+  n=$(grep -c "^INODE,[0-9]*,$type," gen.csv)
+  grep -q "^ESTIMATE,files,$type,$n,$n,$n\$" ./estimate.out || ec=1
+done
+n=$(awk -F, '$1 == "INODE" && $3 == "f" { total += $11 } END { print total }' gen.csv)
+grep -q "^ESTIMATE,bytes,all,$n,$n,$n\$" ./estimate.out || ec=1
+./lab3a --estimate=0.1 --estimate-seed=7 gen.img 2>> $log | cmp -s - \
+  <(./lab3a --estimate=0.1 --estimate-seed=7 gen.img 2>> $log)
+ecs=$?
+
+printf "Exit codes: %d %d\n" $ec $ecs
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f estimate.out
+
+# XATTR: a text value quoted, a binary one in hex, both in the inode's
+# attribute block, which --audit accepts
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [xattr]"
+cp files.img ./xattr.img
+printf '\001\002\377' > ./value.bin
+debugfs -w ./xattr.img &>> $log <<EOF2
+ea_set a/b/nine user.text bar
+ea_set -f value.bin a/b/nine user.binary
+EOF2
+./lab3a --sections=xattr xattr.img 2>> $log | cut -d, -f1,4- | LC_ALL=C sort > ./xattr.out
+printf "XATTR,'user.binary',3,0102ff\nXATTR,'user.text',3,'bar'\n" | cmp -s - ./xattr.out
+ec=$?
+./lab3a --audit xattr.img &>> $log
+eca=$?
+
+printf "Exit codes: %d %d\n" $ec $eca
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f xattr.img value.bin xattr.out
+
+# --shard and lab3a-merge: three shards merge into the single run's report and
+# audit (with its exit code), and shards of different runs are refused
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [shards]"
+for k in 1 2 3; do ./lab3a --shard=$k/3 gen.img > ./shard.$k 2>> $log; done
+./lab3a-merge ./shard.1 ./shard.2 ./shard.3 2>> $log | cmp -s - gen.csv
+ec=$?
+cp gen.img ./bad.img
+set -- $(grep '^INODE,[0-9]*,f,' gen.csv | sed -n '50p;3000p' | cut -d, -f2,13 | tr ',' ' ')
+printf 'sif <%s> links_count 7\nsif <%s> block[1] %s\n' $1 $3 $2 | debugfs -w ./bad.img &>> $log
+./lab3a --audit bad.img > ./audit.1 2>> $log
+for k in 1 2 3; do ./lab3a --audit --shard=$k/3 bad.img > ./shard.$k 2>> $log; done
+./lab3a-merge ./shard.1 ./shard.2 ./shard.3 > ./audit.2 2>> $log
+eca=$?
+[ -s ./audit.1 ] && cmp -s ./audit.1 ./audit.2
+ecm=$?
+for k in 1 2; do ./lab3a --shard=$k/3 gen.img > ./shard.$k 2>> $log; done
+./lab3a --where="type==f" --shard=3/3 gen.img > ./shard.3 2>> $log
+./lab3a-merge ./shard.1 ./shard.2 ./shard.3 &>> $log
+ecw=$?
+
+printf "Exit codes: %d %d %d %d\n" $ec $eca $ecm $ecw
+printf "Expected codes: %d %d %d %d\n\n" 0 2 0 1
+rm -f bad.img shard.1 shard.2 shard.3 audit.1 audit.2
+
+# --audit of the blocks: a block given to a second inode is a duplicate (and
+# that inode's own block becomes unreferenced), and a block in use marked free
+# is on the freelist
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [block audit]"
+cp gen.img ./bad.img
+set -- $(grep '^INODE,[0-9]*,f,' gen.csv | sed -n '50p;3000p' | cut -d, -f2,13,14 | tr ',' ' ')
+printf 'sif <%s> block[1] %s\nfreeb %s\n' $4 $2 $5 | debugfs -w ./bad.img &>> $log
+./lab3a --audit bad.img > ./audit.out 2>> $log
+ec=$?
+printf 'ALLOCATED BLOCK %s ON FREELIST\nDUPLICATE BLOCK %s IN INODE %s AT OFFSET 0\n' $5 $2 $1 > ./audit.exp
+printf 'DUPLICATE BLOCK %s IN INODE %s AT OFFSET 1\nUNREFERENCED BLOCK %s\n' $2 $4 $6 >> ./audit.exp
+sort ./audit.out | cmp -s - <(sort ./audit.exp)
+ecf=$?
+
+printf "Exit codes: %d %d\n" $ec $ecf
+printf "Expected codes: %d %d\n\n" 2 0
+rm -f bad.img audit.out audit.exp
+
+# --audit of the directory graph: a directory whose '..' names another
+# directory, which shifts the link counts of both
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [directory graph audit]"
+cp gen.img ./bad.img
+set -- $(grep '^INODE,[0-9]*,d,' gen.csv | sed -n '5p;6p' | cut -d, -f2,13 | tr ',' ' ')
+parent=$(grep "^DIRENT,$1,12," gen.csv | cut -d, -f4)
+# the '..' entry is the second of the directory's first block
+printf "$(printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(($3 & 255)) $(($3 >> 8 & 255)) $(($3 >> 16 & 255)) $(($3 >> 24)))" |
+  dd of=./bad.img bs=1 seek=$(($2 * 1024 + 12)) conv=notrunc &>> $log
+./lab3a --audit bad.img > ./audit.out 2>> $log
+ec=$?
+grep -q "^DIRECTORY INODE $1 NAME '..' LINK TO INODE $3 SHOULD BE $parent\$" ./audit.out &&
+  [ "$(grep -c -E "^INODE ($parent|$3) HAS [0-9]+ LINKS BUT LINKCOUNT IS [0-9]+\$" ./audit.out)" -eq 2 ]
+ecf=$?
+
+printf "Exit codes: %d %d\n" $ec $ecf
+printf "Expected codes: %d %d\n\n" 2 0
+rm -f bad.img audit.out
+
+# --sections: a subset is the matching lines of the full report, in the same
+# order, and an unknown section name is refused
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [sections]"
+./lab3a --sections=groups,inodes,dirent gen.img 2>> $log | cmp -s - <(grep -E '^(GROUP|INODE|DIRENT),' gen.csv)
+ec=$?
+./lab3a --sections=inodes,bogus gen.img &>> $log
+ecb=$?
+
+printf "Exit codes: %d %d\n" $ec $ecb
+printf "Expected codes: %d %d\n\n" 0 1
+
+# --check-backups: every backup copy is compared with the primary ones, here a
+# super block backup with another blocks per group and a descriptor backup
+# with another block bitmap
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [check backups]"
+cp gen.img ./bad.img
+per=$(grep '^SUPERBLOCK,' gen.csv | cut -d, -f6)
+printf '\000\020\000\000' | dd of=./bad.img bs=1 seek=$(((3 * per + 1) * 1024 + 32)) conv=notrunc &>> $log
+printf '\007\000\000\000' | dd of=./bad.img bs=1 seek=$(((5 * per + 2) * 1024)) conv=notrunc &>> $log
+./lab3a --check-backups bad.img > ./backups.out 2>> $log
+ec=$?
+printf 'SUPERBLOCK BACKUP IN GROUP 3 DIFFERS FROM PRIMARY\nGROUP DESCRIPTOR 0 BACKUP IN GROUP 5 DIFFERS FROM PRIMARY\n' |
+  cmp -s - ./backups.out
+ecf=$?
+
+printf "Exit codes: %d %d\n" $ec $ecf
+printf "Expected codes: %d %d\n\n" 2 0
+rm -f bad.img backups.out
+
+# frag: on a fragmented image, the FRAG 'all' line counts every file and
+# directory with blocks, and its fragmented files are the FILEFRAG lines
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [fragmentation]"
+./mkimage --size=64M --groups=8 --files=4000 --frag=0.3 ./frag.img &>> $log
+./lab3a --sections=inodes,frag frag.img > ./frag.out 2>> $log
+ec=$?
+files=$(awk -F, '$1 == "INODE" && ($3 == "f" || $3 == "d") && $12 > 0' ./frag.out | wc -l)
+fragmented=$(grep -c '^FILEFRAG,' ./frag.out)
+[ "$fragmented" -gt 0 ] && grep -q "^FRAG,all,$files,[0-9]*,[0-9]*,$fragmented," ./frag.out
+ecf=$?
+
+printf "Exit codes: %d %d\n" $ec $ecf
+printf "Expected codes: %d %d\n\n" 0 0
+rm -f frag.img frag.out
+
+# Extraction keeps modes whatever the umask, and times, those of a read-only
+# directory included
+T=$((T + 1))
+echo "--------------------------------------------------Beginning test $T [extract: modes and times]"
+cp files.img ./modes.img
+debugfs -w ./modes.img &>> $log <<EOF2
+sif a mode 040555
+sif a mtime 200001010000
+sif a/random mode 0100640
+sif a/random mtime 200202020000
+EOF2
+rm -rf ./extracted
+(umask 077; ./lab3a --extract=/a --out=./extracted ./modes.img &>> $log)
+ec=$?
+[ "$(find ./extracted ./extracted/random -maxdepth 0 -printf '%m %TY-%Tm-%Td\n' | tr '\n' ' ')" = \
+  "555 2000-01-01 640 2002-02-02 " ]
+ecm=$?
+
+printf "Exit codes: %d %d\n" $ec $ecm
+printf "Expected codes: %d %d\n\n" 0 0
+chmod -R u+w ./extracted
+rm -rf modes.img extracted
+
+rm -f gen.img gen.csv files.img nine.txt random.bin zero.bin hole.bin
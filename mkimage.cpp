@@ -0,0 +1,76 @@
+#include <iostream>
+#include <getopt.h>
+#include <stdlib.h>
+#include "imagegenerator.hpp"
+#include "memorybudget.hpp"
+
+#define MKIMAGE_USAGE "Usage: mkimage [--size=SIZE] [--block-size=N] [--inode-size=N] [--groups=N]\n" \
+                      "               [--inodes-per-group=N] [--rev=0|1] [--files=N] [--fan-out=N]\n" \
+                      "               [--depth=0-3] [--fill=F] [--frag=F] [--seed=N] FILE"
+#define EXSUCCESS 0
+#define EXBADARG 1
+#define EXFAIL 2
+
+// Writes a synthetic ext2 image (see ImageGenerator)
+int main(int argc, char **argv) {
+  ImageSpec spec;
+
+  enum { OPT_SIZE = 1, OPT_BLOCK_SIZE, OPT_INODE_SIZE, OPT_GROUPS, OPT_INODES_PER_GROUP, OPT_REV,
+         OPT_FILES, OPT_FAN_OUT, OPT_DEPTH, OPT_FILL, OPT_FRAG, OPT_SEED };
+  static struct option longOptions[] = {
+    {"size", required_argument, nullptr, OPT_SIZE},
+    {"block-size", required_argument, nullptr, OPT_BLOCK_SIZE},
+    {"inode-size", required_argument, nullptr, OPT_INODE_SIZE},
+    {"groups", required_argument, nullptr, OPT_GROUPS},
+    {"inodes-per-group", required_argument, nullptr, OPT_INODES_PER_GROUP},
+    {"rev", required_argument, nullptr, OPT_REV},
+    {"files", required_argument, nullptr, OPT_FILES},
+    {"fan-out", required_argument, nullptr, OPT_FAN_OUT},
+    {"depth", required_argument, nullptr, OPT_DEPTH},
+    {"fill", required_argument, nullptr, OPT_FILL},
+    {"frag", required_argument, nullptr, OPT_FRAG},
+    {"seed", required_argument, nullptr, OPT_SEED},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", longOptions, nullptr)) != -1) {
+    switch (opt) {
+      case OPT_SIZE:             spec.size = MemoryBudget::parseSize(optarg); break;
+      case OPT_BLOCK_SIZE:       spec.blockSize = strtoul(optarg, nullptr, 10); break;
+      case OPT_INODE_SIZE:       spec.inodeSize = strtoul(optarg, nullptr, 10); break;
+      case OPT_GROUPS:           spec.groups = strtoul(optarg, nullptr, 10); break;
+      case OPT_INODES_PER_GROUP: spec.inodesPerGroup = strtoul(optarg, nullptr, 10); break;
+      case OPT_REV:              spec.rev = strtoul(optarg, nullptr, 10); break;
+      case OPT_FILES:            spec.files = strtoull(optarg, nullptr, 10); break;
+      case OPT_FAN_OUT:          spec.fanOut = strtoul(optarg, nullptr, 10); break;
+      case OPT_DEPTH:            spec.indirectDepth = strtoul(optarg, nullptr, 10); break;
+      case OPT_FILL:             spec.fill = strtod(optarg, nullptr); break;
+      case OPT_FRAG:             spec.fragmentation = strtod(optarg, nullptr); break;
+      case OPT_SEED:             spec.seed = strtoul(optarg, nullptr, 10); break;
+      default:
+        std::cerr << MKIMAGE_USAGE << std::endl;
+        exit(EXBADARG);
+    }
+  }
+
+  if (argc - optind != 1 || spec.size == 0) {
+    std::cerr << MKIMAGE_USAGE << std::endl;
+    exit(EXBADARG);
+  }
+
+  ImageGenerator generator(spec);
+  try {
+    generator.write(argv[optind]);
+  } catch (std::runtime_error &e) {
+    std::cerr << "mkimage: " << e.what() << std::endl;
+    exit(EXFAIL);
+  }
+
+  fprintf(stderr, "mkimage: %s: %u blocks of %u bytes, %u groups, %zu inodes, indirect depth %u\n",
+          argv[optind], generator.getBlockCount(), spec.blockSize, generator.getGroupCount(),
+          generator.getInodesUsed(), generator.getDeepestLevel());
+  if (generator.getDeepestLevel() < spec.indirectDepth)
+    fprintf(stderr, "mkimage: warning: image too small for indirect depth %u\n", spec.indirectDepth);
+  return EXSUCCESS;
+}
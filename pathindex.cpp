@@ -0,0 +1,120 @@
+#include "pathindex.hpp"
+#include <algorithm>
+#include <string.h>
+
+const size_t PathIndex::ARENA_CHUNK;
+const size_t PathIndex::MIN_TABLE_SLOTS;
+const size_t PathIndex::NONE;
+const PathIndex::NameRef PathIndex::NO_NAME;
+
+PathIndex::PathIndex(vector<__u32> directories) : inodes(std::move(directories))
+{
+  const size_t bytes = inodes.size() * (sizeof(__u32) + sizeof(Link));
+  directoryGrant = MemoryGrant(bytes, bytes);
+  links.assign(inodes.size(), Link{NO_NAME, 0});
+
+  table.assign(MIN_TABLE_SLOTS, 0);
+  tableGrant = MemoryGrant(table.size() * sizeof(NameRef), table.size() * sizeof(NameRef));
+}
+
+void PathIndex::link(__u32 child, __u32 parent, const char *name, size_t length)
+{
+  const size_t i = find(child);
+  if (i == NONE || child == EXT2_ROOT_INO || links[i].parent != 0)
+    return;
+
+  links[i].parent = parent;
+  links[i].name = intern(name, std::min<size_t>(length, EXT2_NAME_LEN));
+}
+
+bool PathIndex::path(__u32 inode, string &path) const
+{
+  path.clear();
+
+  // The names from the directory up; a walk longer than there are directories
+  // has gone round a loop
+  vector<NameRef> up;
+  while (inode != EXT2_ROOT_INO) {
+    const size_t i = find(inode);
+    if (i == NONE || links[i].parent == 0 || up.size() == inodes.size())
+      return false;
+    up.push_back(links[i].name);
+    inode = links[i].parent;
+  }
+
+  if (up.empty())
+    path = "/";
+  for (auto ref = up.rbegin(); ref != up.rend(); ++ref) {
+    const char *stored = name(*ref);
+    path += '/';
+    path.append(stored + 1, (__u8)stored[0]);
+  }
+  return true;
+}
+
+/*PRIVATE*/
+size_t PathIndex::find(__u32 inode) const
+{
+  auto it = std::lower_bound(inodes.begin(), inodes.end(), inode);
+  return (it != inodes.end() && *it == inode) ? it - inodes.begin() : NONE;
+}
+
+/*PRIVATE -- the reference of 'name', stored now if it is new*/
+PathIndex::NameRef PathIndex::intern(const char *text, size_t length)
+{
+  const size_t mask = table.size() - 1;
+  size_t slot = hash(text, length) & mask;
+  for (; table[slot] != 0; slot = (slot + 1) & mask) {
+    const char *stored = name(table[slot] - 1);
+    if ((__u8)stored[0] == length && memcmp(stored + 1, text, length) == 0)
+      return table[slot] - 1;
+  }
+
+  // A name never straddles two chunks
+  if (chunkUsed + 1 + length > ARENA_CHUNK) {
+    chunkGrants.emplace_back(ARENA_CHUNK, ARENA_CHUNK);
+    chunks.emplace_back(new char[ARENA_CHUNK]);
+    chunkUsed = 0;
+  }
+  const NameRef ref = (NameRef)(chunks.size() - 1) * ARENA_CHUNK + chunkUsed;
+  char *stored = chunks.back().get() + chunkUsed;
+  stored[0] = length;
+  memcpy(stored + 1, text, length);
+  chunkUsed += 1 + length;
+  arenaUsed += 1 + length;
+
+  table[slot] = ref + 1;
+  if (++names * 2 > table.size())
+    growTable();
+  return ref;
+}
+
+/*PRIVATE -- doubles the table, keeping it at most half full*/
+void PathIndex::growTable()
+{
+  vector<NameRef> old;
+  old.swap(table);
+  table.assign(old.size() * 2, 0);
+  const size_t bytes = table.size() * sizeof(NameRef);
+  tableGrant = MemoryGrant(bytes, bytes);
+
+  const size_t mask = table.size() - 1;
+  for (NameRef entry : old) {
+    if (entry == 0)
+      continue;
+    const char *stored = name(entry - 1);
+    size_t slot = hash(stored + 1, (__u8)stored[0]) & mask;
+    while (table[slot] != 0)
+      slot = (slot + 1) & mask;
+    table[slot] = entry;
+  }
+}
+
+/*PRIVATE -- FNV-1a*/
+uint32_t PathIndex::hash(const char *name, size_t length)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    h = (h ^ (__u8)name[i]) * 16777619u;
+  return h;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include "ext2_fs.h"
+#include "memorybudget.hpp"
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Path Index
+//
+// The full path of every directory, for the PATH section and the path column
+// of DIRENT lines, kept as a tree rather than as strings: each directory only
+// records its parent and a reference to its own name. A path is assembled on
+// demand by walking up to the root.
+//
+// Names are interned into an arena of fixed-size chunks, so a name shared by
+// many directories ("src", "lib", "2019", ...) is stored once, and the chunks
+// are never moved or copied as the arena grows. An open-addressing table of
+// arena references finds a name already stored.
+//
+// Only directories are indexed: the path of any other entry is its
+// directory's path plus the entry's name, which the scan already has in hand.
+// The index therefore grows with the number of directories and of distinct
+// directory names, not with the number of entries, and images with tens of
+// millions of files are indexed in a few megabytes. Everything it holds is
+// charged to the MemoryBudget.
+//
+class PathIndex {
+ public:
+  /*'directories' are the inode numbers of every directory, in increasing
+    order*/
+  explicit PathIndex(vector<__u32> directories);
+
+  PathIndex(const PathIndex&) = delete;
+  PathIndex &operator=(const PathIndex&) = delete;
+
+  bool isDirectory(__u32 inode) const { return find(inode) != NONE; }
+
+  /*Records that directory 'child' is called 'name' in directory 'parent'.
+    Only the first link to a directory counts: any other (which only a damaged
+    image has) is ignored, as are links to the root*/
+  void link(__u32 child, __u32 parent, const char *name, size_t length);
+
+  /*Replaces 'path' with the path of directory 'inode' ("/" for the root).
+    Returns false if the directory cannot be reached from the root: it is not
+    linked from any directory, or one of its ancestors is not, or they form a
+    loop*/
+  bool path(__u32 inode, string &path) const;
+
+  /*True for the '.' and '..' entries, which are not names of their own*/
+  static bool isDot(const char *name, size_t length) {
+    return (length == 1 || length == 2) && name[0] == '.' && name[length - 1] == '.';
+  }
+
+  size_t getDirectoryCount() const { return inodes.size(); }
+  size_t getNameCount() const { return names; }
+  size_t getArenaBytes() const { return arenaUsed; }
+
+  static const size_t ARENA_CHUNK = 1 << 20;
+  static const size_t MIN_TABLE_SLOTS = 1 << 10;
+
+ private:
+  static const size_t NONE = ~(size_t)0;
+
+  // 64 bits, as the arena of an image with hundreds of millions of distinct
+  // directory names outgrows 4GiB
+  typedef uint64_t NameRef;
+  static const NameRef NO_NAME = ~(NameRef)0;
+
+  struct Link {
+    NameRef name; // arena reference
+    __u32 parent; // 0 until linked
+  };
+
+  vector<__u32> inodes; // sorted
+  vector<Link> links;   // links[i] is the link of inodes[i]
+  MemoryGrant directoryGrant;
+
+  // A name is stored as its length byte followed by its bytes, and referred to
+  // by its offset in the arena: chunk * ARENA_CHUNK + offset in the chunk
+  vector<std::unique_ptr<char[]>> chunks;
+  vector<MemoryGrant> chunkGrants;
+  size_t chunkUsed = ARENA_CHUNK;
+  size_t arenaUsed = 0;
+
+  vector<NameRef> table; // arena references + 1, 0 = empty slot
+  MemoryGrant tableGrant;
+  size_t names = 0;
+
+  size_t find(__u32 inode) const;
+  const char *name(NameRef ref) const { return chunks[ref / ARENA_CHUNK].get() + ref % ARENA_CHUNK; }
+  NameRef intern(const char *name, size_t length);
+  void growTable();
+  static uint32_t hash(const char *name, size_t length);
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "ext2_fs.h"
+#include "metafile.hpp"
+
+// -------------------------------------------------- Scan Visitor
+//
+// Receives the decoded structures of an image as EXT2 walks it. This is the
+// embedding interface of the ext2scan library: lab3a itself is just the
+// CsvVisitor on top of it.
+//
+// All references passed to a callback are zero-copy views into the reader's
+// buffers. They are only valid for the duration of the callback; copy anything
+// that must outlive it.
+//
+// Every callback has an empty default, so a visitor only overrides what it
+// needs.
+//
+class ScanVisitor {
+ public:
+  virtual ~ScanVisitor() {}
+
+  virtual void onSuperBlock(const ext2_super_block &, const MetaFile &) {}
+
+  /*One call per block group, in order*/
+  virtual void onGroup(__u32 /*group*/, const ext2_group_desc &,
+                       __u32 /*blocksInGroup*/, __u32 /*inodesInGroup*/) {}
+
+  /*A run of 'count' free blocks starting at block 'first'*/
+  virtual void onFreeBlockRange(__u32 /*first*/, __u32 /*count*/) {}
+
+  /*A run of 'count' free inodes starting at inode 'first'*/
+  virtual void onFreeInodeRange(__u32 /*first*/, __u32 /*count*/) {}
+
+  /*One call per allocated inode, followed by its extended attributes, then the
+    entries (directories) and indirect references (regular files and
+    directories) belonging to it*/
+  virtual void onInode(__u32 /*inodeNumber*/, const ext2_inode &) {}
+
+  virtual void onDirEntry(__u32 /*dirInode*/, size_t /*logicalOffset*/, const ext2_dir_entry &) {}
+
+  /*One extended attribute of the inode, kept in the (possibly shared)
+    attribute block 'block'. The value is raw bytes*/
+  virtual void onXattr(__u32 /*inodeNumber*/, __u32 /*block*/, const char * /*name*/, size_t /*nameLength*/,
+                       const char * /*value*/, size_t /*valueSize*/) {}
+
+  /*'refBlock' is the entry found in indirect block 'indBlock' (of the given
+    level) and maps the file's logical block 'logicalBlock'*/
+  virtual void onIndirect(__u32 /*inodeNumber*/, __u32 /*level*/, size_t /*logicalBlock*/,
+                          __u32 /*indBlock*/, __u32 /*refBlock*/) {}
+
+  /*The CRC-32C of a regular file's contents (holes read as zeros), in inode
+    order*/
+  virtual void onFileHash(__u32 /*inodeNumber*/, uint64_t /*size*/, __u32 /*crc*/) {}
+
+  /*A full path (not NUL-terminated) naming 'inodeNumber': one call per
+    directory entry other than '.' and '..', by directory in inode order, then
+    in entry order. An inode with several links has several paths*/
+  virtual void onPath(__u32 /*inodeNumber*/, const char * /*path*/, size_t /*length*/) {}
+};
@@ -0,0 +1,502 @@
+#include "shard.hpp"
+#include "ext2.hpp"
+#include "memorybudget.hpp"
+#include "xattrcache.hpp"
+#include <algorithm>
+#include <ctype.h>
+#include <stdexcept>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+using std::runtime_error;
+
+namespace {
+
+// The sections of each kind of shard, by tag, in the order they are written
+const struct { const char *tag; int section; } REPORT_SECTIONS[] = {
+  {"SUPERBLOCK", 0}, {"GROUP", 1}, {"BFREE", 2}, {"IFREE", 3},
+  {"INODE", 4}, {"XATTR", 4}, {"DIRENT", 4}, {"INDIRECT", 4}, {"FILEHASH", 5},
+};
+enum : unsigned { BACKUP, RESERVED, REF, XREF, XBLOCK, BITMAP, ISTATE, EDGE, AUDIT_SECTIONS };
+const struct { const char *tag; int section; } AUDIT_SECTIONS_BY_TAG[] = {
+  {"BACKUP", BACKUP}, {"RESERVED", RESERVED}, {"REF", REF}, {"XREF", XREF}, {"XBLOCK", XBLOCK},
+  {"BITMAP", BITMAP}, {"FREE", BITMAP}, {"ISTATE", ISTATE}, {"EDGE", EDGE},
+};
+const unsigned REPORT_SECTION_COUNT = 6;
+
+/*Parses the first 'count' numbers after the tag of a line. Returns where the
+  last one ends*/
+const char *parseFields(const string &line, uint64_t *values, size_t count) {
+  const char *p = strchr(line.c_str(), ',');
+  for (size_t i = 0; i < count; i++) {
+    if (p == nullptr || *p != ',')
+      throw runtime_error("MalformedShardLine");
+    // Plain decimal digits, as the writers print them
+    const char *digits = ++p;
+    uint64_t value = 0;
+    for (; *p >= '0' && *p <= '9'; p++)
+      value = value * 10 + (*p - '0');
+    if (p == digits)
+      throw runtime_error("MalformedShardLine");
+    values[i] = value;
+  }
+  return p;
+}
+
+/*Reads one line, without its newline. Returns false at the end of the file*/
+bool readRawLine(FILE *file, string &line, char *&buffer, size_t &bufferSize) {
+  ssize_t length = getline(&buffer, &bufferSize, file);
+  if (length < 0)
+    return false;
+  if (length > 0 && buffer[length - 1] == '\n')
+    length--;
+  line.assign(buffer, length);
+  return true;
+}
+
+/*Clears bits [first, first + count) of an on-disk style bitmap*/
+void clearBits(vector<char> &bitmap, uint64_t first, uint64_t count) {
+  uint64_t bit = first;
+  const uint64_t end = std::min<uint64_t>(first + count, (uint64_t)bitmap.size() * 8);
+  for (; bit < end && bit % 8; bit++)
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+  if (end - bit >= 8) {
+    memset(bitmap.data() + bit / 8, 0, (end - bit) / 8);
+    bit += (end - bit) / 8 * 8;
+  }
+  for (; bit < end; bit++)
+    bitmap[bit / 8] &= ~(1 << (bit % 8));
+}
+
+}
+
+// -------------------------------------------------- Shard Header
+void ShardHeader::write(FILE *out) const {
+  fprintf(out, "SHARD,%u,%u,%u,%u,%s,%u,%s,%u,%u,%u,%u,%u,%u,%u,", index, count, firstGroup, endGroup,
+          kind.c_str(), sections, uuid.c_str(), writeTime, blockCount, firstDataBlock, blocksPerGroup,
+          groupCount, inodesCount, firstInode);
+  for (unsigned char c : where)
+    fprintf(out, "%02x", c);
+  fputc('\n', out);
+}
+
+bool ShardHeader::read(const string &line) {
+  char kindText[32], uuidText[64];
+  int length = 0;
+  if (sscanf(line.c_str(), "SHARD,%u,%u,%u,%u,%31[^,],%u,%63[^,],%u,%u,%u,%u,%u,%u,%u%n", &index, &count,
+             &firstGroup, &endGroup, kindText, &sections, uuidText, &writeTime, &blockCount, &firstDataBlock,
+             &blocksPerGroup, &groupCount, &inodesCount, &firstInode, &length) != 14 ||
+      line[length] != ',' || (line.size() - length - 1) % 2 != 0)
+    return false;
+  kind = kindText;
+  uuid = uuidText;
+
+  where.clear();
+  for (size_t i = length + 1; i < line.size(); i += 2) {
+    unsigned byte;
+    if (!isxdigit((unsigned char)line[i]) || !isxdigit((unsigned char)line[i + 1]) ||
+        sscanf(line.c_str() + i, "%2x", &byte) != 1)
+      return false;
+    where += (char)byte;
+  }
+  return true;
+}
+
+bool ShardHeader::sameRun(const ShardHeader &other) const {
+  return count == other.count && kind == other.kind && sections == other.sections && where == other.where &&
+         uuid == other.uuid &&
+         writeTime == other.writeTime && blockCount == other.blockCount &&
+         firstDataBlock == other.firstDataBlock && blocksPerGroup == other.blocksPerGroup &&
+         groupCount == other.groupCount && inodesCount == other.inodesCount && firstInode == other.firstInode;
+}
+
+void ShardHeader::groupRange(__u32 groupCount, __u32 index, __u32 count, __u32 &first, __u32 &end) {
+  first = (uint64_t)groupCount * index / count;
+  end = (uint64_t)groupCount * (index + 1) / count;
+}
+
+// -------------------------------------------------- Shard Writer
+void ShardWriter::backup(const char *finding, size_t length) {
+  flush();
+  fprintf(out, "BACKUP,%.*s\n", (int)length, finding);
+}
+
+void ShardWriter::reserved(__u32 block, __u32 count) {
+  flush();
+  fprintf(out, "RESERVED,%u,%u\n", block, count);
+}
+
+void ShardWriter::reference(__u32 block, const BlockAudit::BlockRef &next) {
+  if (refCount > 0 && next.level == 0 && ref.level == 0 && next.inode == ref.inode &&
+      (uint64_t)refBlock + refCount == block && (uint64_t)ref.offset + refCount == next.offset) {
+    refCount++;
+    return;
+  }
+  flush();
+  refBlock = block;
+  refCount = 1;
+  ref = next;
+}
+
+void ShardWriter::flush() {
+  if (refCount > 0)
+    fprintf(out, "REF,%u,%llu,%u,%u,%u\n", refBlock, (unsigned long long)refCount, ref.inode, ref.offset,
+            ref.level);
+  refCount = 0;
+}
+
+void ShardWriter::xattrBlock(__u32 block, bool valid, __u32 refcount) {
+  flush();
+  fprintf(out, "XBLOCK,%u,%d,%u\n", block, valid ? 1 : 0, refcount);
+}
+
+void ShardWriter::inode(__u32 inode, __u16 mode, __u16 links, bool inBitmap) {
+  flush();
+  fprintf(out, "ISTATE,%u,%u,%u,%d\n", inode, mode, links, inBitmap ? 1 : 0);
+}
+
+void ShardWriter::edge(__u32 parent, __u32 child, const char *name, size_t length, size_t offset) {
+  flush();
+  fprintf(out, "EDGE,%u,%u,%zu,%zu,", parent, child, offset, length);
+  fwrite(name, 1, length, out);
+  fputc('\n', out);
+}
+
+// -------------------------------------------------- Shard Block Log
+ShardBlockLog::ShardBlockLog(ShardWriter &writer, __u32 blockCount, __u32 firstDataBlock, __u32 blocksPerGroup,
+                             __u32 groupCount, __u32 blockSize, bool logReserved)
+    : BlockAudit(blockCount, firstDataBlock, blocksPerGroup, groupCount, 0),
+      writer(writer), blockSize(blockSize), logReserved(logReserved) {}
+
+void ShardBlockLog::reserve(__u32 block, __u32 count) {
+  if (logReserved)
+    writer.reserved(block, count);
+  BlockAudit::reserve(block, count);
+}
+
+bool ShardBlockLog::reference(__u32 block, const BlockRef &ref) {
+  writer.reference(block, ref);
+  return BlockAudit::reference(block, ref);
+}
+
+void ShardBlockLog::loadBitmap(__u32 group, const char *bitmap, __u32 blocksInGroup) {
+  writer.bitmap(group, blocksInGroup);
+  EXT2::scanBitmapRanges(bitmap, blocksInGroup, blockSize, 0,
+                         [&](__u32 first, __u32 count) { writer.freeRange(first, count); });
+}
+
+// -------------------------------------------------- Shard Merge
+ShardMerge::ShardMerge(const vector<string> &paths) {
+  if (paths.empty())
+    throw runtime_error("NoShards");
+
+  try {
+    for (auto &path : paths) {
+      inputs.emplace_back();
+      inputs.back().path = path;
+      inputs.back().file = fopen(path.c_str(), "r");
+      if (!inputs.back().file)
+        throw runtime_error(path + ": CannotOpenShard");
+    }
+    for (auto &input : inputs)
+      index(input);
+  } catch (...) {
+    for (auto &input : inputs)
+      if (input.file)
+        fclose(input.file);
+    free(buffer);
+    throw;
+  }
+
+  std::sort(inputs.begin(), inputs.end(),
+            [](const Input &a, const Input &b) { return a.header.index < b.header.index; });
+
+  // Exactly shards 1 to N of one run, whose groups follow each other
+  const ShardHeader &first = inputs.front().header;
+  string error;
+  for (size_t i = 0; i <= inputs.size() && error.empty(); i++) {
+    if (i == inputs.size()) {
+      if (i < first.count)
+        error = "ShardMissing: " + std::to_string(i + 1) + "/" + std::to_string(first.count);
+      break;
+    }
+    const ShardHeader &header = inputs[i].header;
+    if (!header.sameRun(first))
+      error = inputs[i].path + ": ShardOfAnotherRun";
+    else if (i > 0 && header.index == inputs[i - 1].header.index)
+      error = inputs[i].path + ": DuplicateShard";
+    else if (header.index != i + 1)
+      error = "ShardMissing: " + std::to_string(i + 1) + "/" + std::to_string(first.count);
+    else if (header.firstGroup != (i ? inputs[i - 1].header.endGroup : 0) ||
+             (i + 1 == header.count && header.endGroup != header.groupCount))
+      error = inputs[i].path + ": ShardGroupsDoNotFollow";
+  }
+  if (!error.empty()) {
+    for (auto &input : inputs)
+      fclose(input.file);
+    inputs.clear();
+    free(buffer);
+    throw runtime_error(error);
+  }
+  audit = first.kind != "report";
+}
+
+ShardMerge::~ShardMerge() {
+  for (auto &input : inputs)
+    fclose(input.file);
+  free(buffer);
+}
+
+size_t ShardMerge::merge(FILE *out) {
+  if (!audit) {
+    mergeReport(out);
+    return 0;
+  }
+  return mergeAudit(out);
+}
+
+/*PRIVATE -- reads the header, and checks the order of the sections and the
+  END line*/
+void ShardMerge::index(Input &input) {
+  if (!readRawLine(input.file, line, buffer, bufferSize) || !input.header.read(line))
+    throw runtime_error(input.path + ": NotAShard");
+  audit = input.header.kind != "report";
+  std::fill(input.start, input.start + MAX_SECTIONS, -1);
+
+  int current = -1;
+  bool ended = false;
+  for (long offset = ftell(input.file); readLine(input); offset = ftell(input.file)) {
+    if (ended)
+      throw runtime_error(input.path + ": LinesAfterEnd");
+    if (line == "END") {
+      ended = true;
+      continue;
+    }
+
+    const int section = sectionOf(line);
+    if (section < 0 && (audit || current < 0))
+      throw runtime_error(input.path + ": UnknownShardLine");
+    if (section < 0)
+      continue; // the rest of a name with a newline in it
+    if (section < current)
+      throw runtime_error(input.path + ": ShardSectionsOutOfOrder");
+    if (section > current)
+      input.start[section] = offset;
+    current = section;
+  }
+  if (!ended)
+    throw runtime_error(input.path + ": ShardCutShort");
+}
+
+/*PRIVATE -- the section of a line, by its tag, or -1*/
+int ShardMerge::sectionOf(const string &line) const {
+  const size_t length = std::min(line.find(','), line.size());
+  auto matches = [&](const char *tag) { return strlen(tag) == length && memcmp(tag, line.data(), length) == 0; };
+  if (audit) {
+    for (auto &entry : AUDIT_SECTIONS_BY_TAG)
+      if (matches(entry.tag))
+        return entry.section;
+  } else {
+    for (auto &entry : REPORT_SECTIONS)
+      if (matches(entry.tag))
+        return entry.section;
+  }
+  return -1;
+}
+
+/*PRIVATE -- reads the next line of 'input' into 'line'. An EDGE line goes on
+  until its name is whole, whatever the name holds*/
+bool ShardMerge::readLine(Input &input) {
+  if (!readRawLine(input.file, line, buffer, bufferSize))
+    return false;
+  if (!audit || line.compare(0, 5, "EDGE,") != 0)
+    return true;
+
+  uint64_t fields[4];
+  const size_t nameStart = parseFields(line, fields, 4) + 1 - line.c_str();
+  string more;
+  while (line.size() < nameStart + fields[3] && readRawLine(input.file, more, buffer, bufferSize)) {
+    line += '\n';
+    line += more;
+  }
+  return true;
+}
+
+template <typename Fn>
+void ShardMerge::forEachLine(unsigned section, Fn fn) {
+  for (auto &input : inputs) {
+    if (input.start[section] < 0)
+      continue;
+    fseek(input.file, input.start[section], SEEK_SET);
+    while (readLine(input) && line != "END") {
+      const int lineSection = sectionOf(line);
+      if (lineSection >= 0 && (unsigned)lineSection != section)
+        break;
+      fn(line);
+    }
+  }
+}
+
+/*PRIVATE*/
+void ShardMerge::mergeReport(FILE *out) {
+  for (unsigned section = 0; section < REPORT_SECTION_COUNT; section++)
+    forEachLine(section, [&](const string &line) {
+      fwrite(line.data(), 1, line.size(), out);
+      fputc('\n', out);
+    });
+}
+
+/*PRIVATE -- the checks of EXT2's audits, in the order main() makes them*/
+size_t ShardMerge::mergeAudit(FILE *out) {
+  size_t findings = 0;
+  forEachLine(BACKUP, [&](const string &line) {
+    fwrite(line.data() + 7, 1, line.size() - 7, out);
+    fputc('\n', out);
+    findings++;
+  });
+  if (getHeader().kind == "backups")
+    return findings;
+
+  vector<std::pair<__u32, __u32>> xattrRefs; // (block, inode)
+  forEachLine(XREF, [&](const string &line) {
+    uint64_t fields[2];
+    parseFields(line, fields, 2);
+    xattrRefs.emplace_back(fields[0], fields[1]);
+  });
+  std::sort(xattrRefs.begin(), xattrRefs.end());
+
+  findings += mergeBlockAudit(out, xattrRefs);
+  findings += mergeXattrBlocks(out, xattrRefs);
+  findings += mergeDirectoryGraph(out);
+  return findings;
+}
+
+/*PRIVATE -- as EXT2::auditBlocks()*/
+size_t ShardMerge::mergeBlockAudit(FILE *out, const vector<std::pair<__u32, __u32>> &xattrRefs) {
+  const ShardHeader &image = getHeader();
+  const size_t GROUP_BYTES = BlockAudit::bytesPerGroup(image.blocksPerGroup);
+  MemoryGrant grant((size_t)image.groupCount * GROUP_BYTES, GROUP_BYTES);
+  const __u32 WINDOW_GROUPS = std::max<size_t>(1, grant.size() / GROUP_BYTES);
+  size_t findings = 0;
+
+  for (__u32 first = 0; first < image.groupCount; first += WINDOW_GROUPS) {
+    const __u32 groups = std::min(WINDOW_GROUPS, image.groupCount - first);
+    BlockAudit audit(image.blockCount, image.firstDataBlock, image.blocksPerGroup, first, groups);
+
+    forEachLine(RESERVED, [&](const string &line) {
+      uint64_t fields[2];
+      parseFields(line, fields, 2);
+      audit.reserve(fields[0], fields[1]);
+    });
+
+    auto replay = [&]() {
+      forEachLine(REF, [&](const string &line) {
+        uint64_t fields[5];
+        parseFields(line, fields, 5);
+        for (uint64_t i = 0; i < fields[1]; i++)
+          audit.reference(fields[0] + i, {(__u32)fields[2], (__u32)(fields[3] + i), (__u8)fields[4]});
+      });
+      for (size_t i = 0; i < xattrRefs.size(); i++)
+        if (i == 0 || xattrRefs[i].first != xattrRefs[i - 1].first)
+          audit.reference(xattrRefs[i].first, {xattrRefs[i].second, 0, BlockAudit::XATTR_LEVEL});
+    };
+    replay();
+    if (audit.hasDuplicates()) {
+      audit.beginDuplicatePass();
+      replay();
+    }
+
+    // Each bitmap is rebuilt from the free runs of its group
+    vector<char> bitmap;
+    uint64_t group = ~0ull, blocks = 0;
+    auto load = [&]() {
+      if (group >= first && group < first + groups)
+        audit.loadBitmap(group, bitmap.data(), blocks);
+    };
+    forEachLine(BITMAP, [&](const string &line) {
+      uint64_t fields[2];
+      parseFields(line, fields, 2);
+      if (line[0] == 'B') {
+        load();
+        group = fields[0];
+        blocks = fields[1];
+        bitmap.assign((blocks + 7) / 8, (char)0xFF);
+      } else {
+        clearBits(bitmap, fields[0], fields[1]);
+      }
+    });
+    load();
+
+    findings += audit.report(out);
+  }
+  return findings;
+}
+
+/*PRIVATE -- as EXT2::verifyXattrBlocks()*/
+size_t ShardMerge::mergeXattrBlocks(FILE *out, const vector<std::pair<__u32, __u32>> &xattrRefs) {
+  std::unordered_map<__u32, std::pair<bool, __u32>> headers; // block -> (valid, refcount)
+  forEachLine(XBLOCK, [&](const string &line) {
+    uint64_t fields[3];
+    parseFields(line, fields, 3);
+    headers[fields[0]] = {fields[1] != 0, (__u32)fields[2]};
+  });
+
+  size_t findings = 0;
+  for (size_t first = 0, next; first < xattrRefs.size(); first = next) {
+    const __u32 block = xattrRefs[first].first;
+    for (next = first + 1; next < xattrRefs.size() && xattrRefs[next].first == block; next++)
+      ;
+    if (block >= getHeader().blockCount)
+      continue;
+
+    auto header = headers.find(block);
+    if (header == headers.end())
+      throw runtime_error("ShardXattrBlockMissing");
+    findings += XattrCache::audit(out, block, xattrRefs[first].second, next - first, header->second.first,
+                                  header->second.second);
+  }
+  return findings;
+}
+
+/*PRIVATE -- as EXT2::verifyDirectoryGraph(), with a single worker*/
+size_t ShardMerge::mergeDirectoryGraph(FILE *out) {
+  const ShardHeader &image = getHeader();
+  const size_t wanted = (size_t)image.inodesCount * sizeof(__u16);
+  MemoryGrant countsGrant(std::min<size_t>(wanted, DIRGRAPH_MEMORY_BUDGET),
+                          std::min<size_t>(wanted, DIRGRAPH_MIN_BUDGET));
+  DirGraph graph(image.inodesCount, image.firstInode, countsGrant.size(), 1);
+
+  // Only the mode and link count of an inode are looked at
+  ext2_inode inode = {};
+  auto readInode = [&](const string &line, uint64_t *fields) {
+    parseFields(line, fields, 4);
+    inode.i_mode = fields[1];
+    inode.i_links_count = fields[2];
+  };
+
+  forEachLine(ISTATE, [&](const string &line) {
+    uint64_t fields[4];
+    readInode(line, fields);
+    graph.addInode(fields[0], &inode, fields[3] != 0);
+  });
+
+  for (__u64 first = 1; first <= image.inodesCount; first += graph.getWindowSize()) {
+    graph.beginWindow(first);
+    forEachLine(EDGE, [&](const string &line) {
+      uint64_t fields[4];
+      const char *name = parseFields(line, fields, 4) + 1;
+      const size_t length = std::min<size_t>(fields[3], line.c_str() + line.size() - name);
+      graph.addEdge(0, fields[0], fields[1], name, length, fields[2], first == 1);
+    });
+    graph.endWindow();
+
+    forEachLine(ISTATE, [&](const string &line) {
+      uint64_t fields[4];
+      readInode(line, fields);
+      if (inode.i_mode != 0 && fields[0] >= first && fields[0] - first < graph.getWindowSize())
+        graph.checkLinkCount(fields[0], &inode);
+    });
+  }
+  return graph.report(out);
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "blockaudit.hpp"
+#include "dirgraph.hpp"
+#include "ext2_fs.h"
+
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Shards
+//
+// A large image can be scanned by several processes at once, on one machine or
+// on several sharing its storage. Each takes a shard: a contiguous range of
+// groups (lab3a --shard=K/N). lab3a-merge then puts the shards' outputs back
+// together into the output of a single run.
+//
+// The report needs no more than that. Every line but SUPERBLOCK belongs to a
+// group (GROUP, BFREE, IFREE) or to an inode (INODE, XATTR, DIRENT, INDIRECT,
+// FILEHASH), and each shard writes the lines of its own groups and inodes,
+// section by section, in the order of a single run. The merge takes each
+// section from every shard in turn.
+//
+// The audits cannot be split that way: a block claimed by inodes of two shards
+// is a duplicate, and the links to an inode may come from directories in any
+// shard. So a shard only does the reading (inode tables, indirect, directory
+// and attribute blocks, bitmaps) and writes down every call it would have made
+// to the checks. The merge makes those calls, in the same order, on the same
+// BlockAudit and DirGraph as a single run, which then find and word
+// everything as usual. The lines of an audit shard, in this order:
+//
+//   SHARD,index,count,first group,end group,kind,sections,uuid,write time,
+//         blocks,first data block,blocks per group,groups,inodes,first inode,
+//         where
+//   BACKUP,finding                      checkBackups(), by the first shard
+//   RESERVED,block,count                BlockAudit::reserve(), by the first shard
+//   REF,block,count,inode,offset,level  BlockAudit::reference() of 'count'
+//                                       consecutive blocks, at consecutive offsets
+//   XREF,block,inode                    an extended attribute block and its inode
+//   XBLOCK,block,valid,refcount         the header of each attribute block
+//   BITMAP,group,blocks                 BlockAudit::loadBitmap(), then the
+//   FREE,first,count                    group's free runs (first from 0)
+//   ISTATE,inode,mode,links,in bitmap   DirGraph::addInode() of each inode in
+//                                       use or in the bitmap
+//   EDGE,parent,child,offset,length,name  DirGraph::addEdge(); the name is
+//                                       'length' raw bytes, newlines and all
+//   END
+//
+// A report shard has the SHARD line, the report lines, and END. The kind is
+// report, audit, audit+backups (--audit --check-backups) or backups
+// (--check-backups alone). 'where' is the --where expression, hex encoded (it
+// may hold commas), and empty without one: shards of the same image taken
+// with other sections, kind or filter are not of the same run, and are not
+// merged. The END line tells a finished shard from one that was cut short.
+//
+struct ShardHeader {
+  __u32 index = 0; // 1 to count
+  __u32 count = 0;
+  __u32 firstGroup = 0; // the shard's groups are [firstGroup, endGroup)
+  __u32 endGroup = 0;
+  string kind;
+  unsigned sections = 0; // of a report
+  string where;          // the --where expression, "" for none
+  string uuid;
+  __u32 writeTime = 0;
+
+  // The image, as the audits need it
+  __u32 blockCount = 0;
+  __u32 firstDataBlock = 0;
+  __u32 blocksPerGroup = 0;
+  __u32 groupCount = 0;
+  __u32 inodesCount = 0;
+  __u32 firstInode = 0;
+
+  void write(FILE *out) const;
+  /*Parses a SHARD line. Returns false if it is not one*/
+  bool read(const string &line);
+
+  /*True if both shards come from the same run (all but the shard itself agree)*/
+  bool sameRun(const ShardHeader &other) const;
+
+  /*The groups [first, end) of shard 'index' (0 to count - 1) of 'count'*/
+  static void groupRange(__u32 groupCount, __u32 index, __u32 count, __u32 &first, __u32 &end);
+};
+
+// -------------------------------------------------- Shard Writer
+// Writes the lines of an audit shard. Consecutive references to the
+// consecutive data blocks of a file are written as one REF line.
+class ShardWriter {
+ public:
+  explicit ShardWriter(FILE *out) : out(out) {}
+
+  void header(const ShardHeader &header) { header.write(out); }
+  void backup(const char *finding, size_t length);
+  void reserved(__u32 block, __u32 count);
+  void reference(__u32 block, const BlockAudit::BlockRef &ref);
+  void bitmap(__u32 group, __u32 blocks) { flush(); fprintf(out, "BITMAP,%u,%u\n", group, blocks); }
+  void freeRange(__u32 first, __u32 count) { fprintf(out, "FREE,%u,%u\n", first, count); }
+  void xattrRef(__u32 block, __u32 inode) { flush(); fprintf(out, "XREF,%u,%u\n", block, inode); }
+  void xattrBlock(__u32 block, bool valid, __u32 refcount);
+  void inode(__u32 inode, __u16 mode, __u16 links, bool inBitmap);
+  void edge(__u32 parent, __u32 child, const char *name, size_t length, size_t offset);
+  void end() { flush(); fprintf(out, "END\n"); }
+
+  /*Writes the REF line being extended, if any*/
+  void flush();
+
+ private:
+  FILE *out;
+  __u32 refBlock = 0;
+  uint64_t refCount = 0; // 0 = none pending
+  BlockAudit::BlockRef ref = {};
+};
+
+// -------------------------------------------------- Shard Logs
+/*A BlockAudit that only answers reference() (invalid and reserved blocks
+  are not followed, exactly as in a real audit) and writes every call down.
+  Its window is empty, so it holds no bitsets*/
+class ShardBlockLog : public BlockAudit {
+ public:
+  /*RESERVED lines are only written if 'logReserved' (every shard needs the
+    reserved blocks, but the merge only needs them once)*/
+  ShardBlockLog(ShardWriter &writer, __u32 blockCount, __u32 firstDataBlock, __u32 blocksPerGroup,
+                __u32 groupCount, __u32 blockSize, bool logReserved);
+
+  void reserve(__u32 block, __u32 count = 1) override;
+  bool reference(__u32 block, const BlockRef &ref) override;
+  void loadBitmap(__u32 group, const char *bitmap, __u32 blocksInGroup) override;
+
+ private:
+  ShardWriter &writer;
+  const __u32 blockSize;
+  const bool logReserved;
+};
+
+/*A DirGraph that only writes its edges down. Not thread-safe*/
+class ShardEdgeLog : public DirGraph {
+ public:
+  explicit ShardEdgeLog(ShardWriter &writer) : DirGraph(0, 0, 0, 1), writer(writer) {}
+
+  void addEdge(unsigned, __u32 parent, __u32 child, const char *name, size_t nameLen, size_t offset,
+               bool) override {
+    writer.edge(parent, child, name, nameLen, offset);
+  }
+
+ private:
+  ShardWriter &writer;
+};
+
+// -------------------------------------------------- Shard Merge
+//
+// Puts the outputs of the N shards of one run back together (lab3a-merge).
+// Each input is read through once to check it and to find where each of its
+// sections starts; the sections are then read again from there, as often as
+// the merge needs them (the block audit reads the references once per window,
+// as a single run walks the inodes once per window). Nothing is held in
+// memory but what a single run holds for the same checks, plus the XREF pairs.
+//
+class ShardMerge {
+ public:
+  /*Opens the outputs of the shards, in any order. Throws runtime_error if
+    they are not every shard of a single run, each finished*/
+  explicit ShardMerge(const vector<string> &paths);
+  ~ShardMerge();
+
+  ShardMerge(const ShardMerge&) = delete;
+  ShardMerge &operator=(const ShardMerge&) = delete;
+
+  /*Writes the output of a single run to 'out'. Returns the number of
+    inconsistencies found, for audits*/
+  size_t merge(FILE *out);
+
+  const ShardHeader &getHeader() const { return inputs.front().header; }
+
+ private:
+  static const unsigned MAX_SECTIONS = 8;
+
+  struct Input {
+    string path;
+    FILE *file = nullptr;
+    ShardHeader header;
+    long start[MAX_SECTIONS]; // offset of each section's first line, -1 if empty
+  };
+  vector<Input> inputs; // by shard index
+  bool audit = false;   // the kind of every input
+  string line;
+  char *buffer = nullptr; // of getline()
+  size_t bufferSize = 0;
+
+  void index(Input &);
+  int sectionOf(const string &line) const;
+  bool readLine(Input &);
+
+  /*Calls fn(line) for each line of 'section' of every shard, in shard order*/
+  template <typename Fn> void forEachLine(unsigned section, Fn fn);
+
+  void mergeReport(FILE *out);
+  size_t mergeAudit(FILE *out);
+  size_t mergeBlockAudit(FILE *out, const vector<std::pair<__u32, __u32>> &xattrRefs);
+  size_t mergeXattrBlocks(FILE *out, const vector<std::pair<__u32, __u32>> &xattrRefs);
+  size_t mergeDirectoryGraph(FILE *out);
+};
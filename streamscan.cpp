@@ -0,0 +1,381 @@
+#include "streamscan.hpp"
+#include "ext2.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SUPERBLOCK_OFFSET 1024
+
+const size_t StreamScan::BUFFER_BUDGET;
+const size_t StreamScan::MIN_BUFFER_BLOCKS;
+const size_t StreamScan::READ_CHUNK;
+
+StreamScan::StreamScan(int fd) : fd(fd)
+{
+  memset(&superBlock, 0, sizeof(superBlock));
+}
+
+void StreamScan::run(ScanVisitor &visitor, unsigned sections, const InodeFilter *filter)
+{
+  TRACE_SCOPE("stream", "section");
+  this->visitor = &visitor;
+  this->sections = sections;
+  this->filter = filter;
+
+  readSuperBlock();
+
+  if (sections & SECTION_SUPER)
+    visitor.onSuperBlock(superBlock, meta);
+
+  // The descriptors follow the Super Block's block
+  const __u32 perBlock = meta.blockSize / sizeof(ext2_group_desc);
+  const __u32 descriptorBlocks = (meta.blockGroupsCount + perBlock - 1) / perBlock;
+  if (sections & (SECTION_GROUPS | SECTION_BFREE | SECTION_IFREE | SECTION_INODE_WALK))
+    for (__u32 i = 0; i < descriptorBlocks; i++)
+      schedule(firstDataBlock + 1 + i, {Task::DESCRIPTORS, 0, false, 0, i, 0, 0});
+
+  const size_t ringBytes = ringBlocks * meta.blockSize;
+  const size_t chunk = std::max<size_t>(std::min(READ_CHUNK, ringBytes / 8) / meta.blockSize, 1) * meta.blockSize;
+
+  // Every task runs once the stream has passed its block; the tasks it
+  // schedules behind the stream run straight away, from the ring
+  while (true) {
+    while (!pending.empty() && ((uint64_t)pending.begin()->first + 1) * meta.blockSize <= streamed) {
+      const __u32 number = pending.begin()->first;
+      const Task task = pending.begin()->second;
+      pending.erase(pending.begin());
+
+      const char *data = block(number);
+      if (data) {
+        runTask(number, task, data);
+      } else {
+        missed++;
+        if (task.kind == Task::INODE_TABLE)
+          releaseBitmap(task.owner);
+      }
+    }
+
+    if (pending.empty())
+      break;
+    if (!fill(chunk))
+      throw std::runtime_error("StreamEndedBeforeImage");
+  }
+
+  // The writer of a pipe should not see it closed early
+  {
+    TRACE_SCOPE("stream.drain", "reader");
+    while (fill(ringBytes)) {}
+  }
+}
+
+/*PRIVATE -- reads and validates the Super Block (the same checks as
+  EXT2::validateSuperBlock(), short of the image size, which is unknown), then
+  sets up the ring*/
+void StreamScan::readSuperBlock()
+{
+  char head[SUPERBLOCK_OFFSET + sizeof(ext2_super_block)];
+  size_t got = 0;
+  while (got < sizeof(head)) {
+    ssize_t n = read(fd, head + got, sizeof(head) - got);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error(string("StreamReadFailed: ") + strerror(errno));
+    if (n == 0)
+      throw std::runtime_error("StreamEndedBeforeSuperBlock");
+    got += n;
+  }
+  memcpy(&superBlock, head + SUPERBLOCK_OFFSET, sizeof(superBlock));
+
+  if (superBlock.s_magic != EXT2_SUPER_MAGIC)
+    throw std::runtime_error("InvalidSuperBlockMagicNumber");
+  if (superBlock.s_log_block_size > 6) // 64KiB
+    throw std::runtime_error("FileSystemMalformedBlockSizeError");
+
+  meta.blockSize = KiB << superBlock.s_log_block_size;
+  meta.blockCount = superBlock.s_blocks_count;
+  meta.blocksPerGroup = superBlock.s_blocks_per_group;
+  meta.inodesPerGroup = superBlock.s_inodes_per_group;
+  meta.blockGroupSize = (unsigned long long)meta.blockSize * meta.blocksPerGroup;
+  meta.rev = superBlock.s_rev_level;
+  meta.revMinor = superBlock.s_minor_rev_level;
+  meta.inodeSize = (meta.rev == EXT2_OLD_REV) ? EXT2_OLD_INODE_SIZE : superBlock.s_inode_size;
+  memset(&meta.stat, 0, sizeof(meta.stat));
+  meta.filename = "-";
+  firstDataBlock = superBlock.s_first_data_block;
+
+  const __u32 BITS_PER_BLOCK = meta.blockSize * 8;
+  bool valid = true;
+  if (meta.rev == EXT2_OLD_REV)
+    valid = superBlock.s_first_ino == 0 || superBlock.s_first_ino == EXT2_GOOD_OLD_FIRST_INO;
+  else if (meta.rev == EXT2_DYNAMIC_REV)
+    valid = superBlock.s_first_ino >= EXT2_GOOD_OLD_FIRST_INO && meta.inodeSize >= EXT2_OLD_INODE_SIZE &&
+            meta.inodeSize <= meta.blockSize && (meta.inodeSize & (meta.inodeSize - 1)) == 0;
+  else
+    valid = false;
+
+  valid = valid && meta.blocksPerGroup != 0 && meta.blocksPerGroup <= BITS_PER_BLOCK &&
+          meta.inodesPerGroup != 0 && meta.inodesPerGroup <= BITS_PER_BLOCK &&
+          firstDataBlock == ((meta.blockSize == KiB) ? 1u : 0u) && firstDataBlock < meta.blockCount;
+  if (!valid)
+    throw std::runtime_error("SuperBlockValidationError");
+
+  // The last group holds the rest of s_blocks_count (see EXT2::setBlocksInLastGroup())
+  meta.blockGroupsCount = (meta.blockCount - firstDataBlock + meta.blocksPerGroup - 1) / meta.blocksPerGroup;
+  meta.blocksInLastGroup = meta.blockCount - (uint64_t)(meta.blockGroupsCount - 1) * meta.blocksPerGroup;
+  if ((uint64_t)meta.blockGroupsCount * meta.inodesPerGroup != superBlock.s_inodes_count)
+    throw std::runtime_error("SuperBlockValidationError");
+
+  ptrsPerBlock = meta.blockSize / sizeof(__u32);
+  tableBlocks = ((uint64_t)meta.inodesPerGroup * meta.inodeSize + meta.blockSize - 1) / meta.blockSize;
+
+  // The head already read is the start of the ring
+  ringGrant = MemoryGrant(BUFFER_BUDGET, MIN_BUFFER_BLOCKS * meta.blockSize);
+  ringBlocks = std::max<size_t>(ringGrant.size() / meta.blockSize, MIN_BUFFER_BLOCKS);
+  ring.reset(new char[ringBlocks * meta.blockSize]);
+  memcpy(ring.get(), head, sizeof(head));
+  streamed = sizeof(head);
+}
+
+/*PRIVATE*/
+bool StreamScan::fill(size_t bytes)
+{
+  TRACE_SCOPE("stream.read", "reader", streamed / meta.blockSize);
+  const size_t ringBytes = ringBlocks * meta.blockSize;
+  size_t got = 0;
+
+  while (got < bytes) {
+    // Reads never wrap around the end of the ring
+    const size_t at = streamed % ringBytes;
+    ssize_t n = read(fd, ring.get() + at, std::min(bytes - got, ringBytes - at));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      throw std::runtime_error(string("StreamReadFailed: ") + strerror(errno));
+    if (n == 0)
+      break;
+    got += n;
+    streamed += n;
+  }
+  return got > 0;
+}
+
+/*PRIVATE -- block b sits in slot b % ringBlocks from when it is complete until
+  block b + ringBlocks starts to overwrite it*/
+const char *StreamScan::block(__u32 number) const
+{
+  const uint64_t start = (uint64_t)number * meta.blockSize;
+  if (start + meta.blockSize > streamed || streamed > start + (uint64_t)ringBlocks * meta.blockSize)
+    return nullptr;
+  return ring.get() + (number % ringBlocks) * meta.blockSize;
+}
+
+/*PRIVATE*/
+void StreamScan::releaseBitmap(__u32 group)
+{
+  if (--tableBlocksLeft[group] == 0) {
+    tableBlocksLeft.erase(group);
+    inodeBitmaps.erase(group);
+  }
+}
+
+/*PRIVATE*/
+void StreamScan::schedule(__u32 block, const Task &task)
+{
+  // A pointer past the end of the file system reads as a hole
+  if (block >= meta.blockCount) {
+    if (task.kind == Task::INODE_TABLE)
+      releaseBitmap(task.owner);
+    return;
+  }
+  pending.emplace(block, task);
+}
+
+/*PRIVATE*/
+void StreamScan::runTask(__u32 block, const Task &task, const char *data)
+{
+  switch (task.kind) {
+    case Task::DESCRIPTORS:
+      onDescriptors(task, data);
+      break;
+
+    case Task::BLOCK_BITMAP: {
+      // Only the blocks below s_blocks_count have a bit
+      const __u32 group = task.owner;
+      const __u32 groupStart = firstDataBlock + group * meta.blocksPerGroup;
+      const __u32 bits = (group == meta.blockGroupsCount - 1) ? meta.blockCount - groupStart : meta.blocksPerGroup;
+      EXT2::scanBitmapRanges(data, bits, meta.blockSize, groupStart,
+                             [&](__u32 first, __u32 count) { visitor->onFreeBlockRange(first, count); });
+      break;
+    }
+
+    case Task::INODE_BITMAP:
+      onInodeBitmap(task, data);
+      break;
+
+    case Task::INODE_TABLE:
+      onInodeTable(task, data);
+      break;
+
+    case Task::INDIRECT:
+      onIndirect(block, task, data);
+      break;
+
+    case Task::DIR_BLOCK:
+      onDirBlock(task, data);
+      break;
+  }
+}
+
+/*PRIVATE -- reports the groups described by one block of the table, and
+  schedules their bitmaps*/
+void StreamScan::onDescriptors(const Task &task, const char *data)
+{
+  const __u32 perBlock = meta.blockSize / sizeof(ext2_group_desc);
+  const __u32 first = task.index * perBlock;
+  const __u32 last = std::min(first + perBlock, meta.blockGroupsCount);
+
+  for (__u32 group = first; group < last; group++) {
+    const ext2_group_desc &desc = reinterpret_cast<const ext2_group_desc*>(data)[group - first];
+
+    if (sections & SECTION_GROUPS) {
+      const __u32 blocksInGroup =
+          (group == meta.blockGroupsCount - 1) ? meta.blocksInLastGroup : meta.blocksPerGroup;
+      visitor->onGroup(group, desc, blocksInGroup, meta.inodesPerGroup);
+    }
+
+    if (sections & SECTION_BFREE)
+      schedule(desc.bg_block_bitmap, {Task::BLOCK_BITMAP, 0, false, group, 0, 0, 0});
+    if (sections & (SECTION_IFREE | SECTION_INODE_WALK))
+      schedule(desc.bg_inode_bitmap, {Task::INODE_BITMAP, 0, false, group, desc.bg_inode_table, 0, 0});
+  }
+}
+
+/*PRIVATE -- reports the group's free inodes, and schedules the blocks of its
+  inode table that hold allocated inodes. The bitmap is kept until they have
+  all run*/
+void StreamScan::onInodeBitmap(const Task &task, const char *data)
+{
+  const __u32 group = task.owner;
+
+  if (sections & SECTION_IFREE)
+    EXT2::scanBitmapRanges(data, meta.inodesPerGroup, meta.blockSize, group * meta.inodesPerGroup + 1,
+                           [&](__u32 first, __u32 count) { visitor->onFreeInodeRange(first, count); });
+
+  if (!(sections & SECTION_INODE_WALK))
+    return;
+
+  const __u32 INODES_PER_BLOCK = meta.blockSize / meta.inodeSize;
+  vector<__u32> used;
+  for (__u32 i = 0; i < tableBlocks; i++) {
+    const __u32 firstIdx = i * INODES_PER_BLOCK;
+    const __u32 lastIdx = std::min(firstIdx + INODES_PER_BLOCK, meta.inodesPerGroup);
+    for (__u32 idx = firstIdx; idx < lastIdx; idx++)
+      if ((data[idx / 8] >> (idx % 8)) & 0x01) {
+        used.push_back(i);
+        break;
+      }
+  }
+  if (used.empty())
+    return;
+
+  inodeBitmaps[group].reset(new char[meta.blockSize]);
+  memcpy(inodeBitmaps[group].get(), data, meta.blockSize);
+  tableBlocksLeft[group] = used.size();
+
+  for (__u32 i : used)
+    schedule(task.index + i, {Task::INODE_TABLE, 0, false, group, i, 0, 0});
+}
+
+/*PRIVATE -- the allocated, in-use inodes of one block of an inode table*/
+void StreamScan::onInodeTable(const Task &task, const char *data)
+{
+  const __u32 group = task.owner;
+  const __u32 INODES_PER_BLOCK = meta.blockSize / meta.inodeSize;
+  const __u32 firstIdx = task.index * INODES_PER_BLOCK;
+  const __u32 lastIdx = std::min(firstIdx + INODES_PER_BLOCK, meta.inodesPerGroup);
+  const char *bitmap = inodeBitmaps[group].get();
+
+  for (__u32 idx = firstIdx; idx < lastIdx; idx++) {
+    if (!((bitmap[idx / 8] >> (idx % 8)) & 0x01))
+      continue;
+
+    const ext2_inode &inode = *reinterpret_cast<const ext2_inode*>(data + (size_t)meta.inodeSize * (idx - firstIdx));
+    if (inode.i_mode == 0 || inode.i_links_count == 0)
+      continue;
+
+    onInode(group * meta.inodesPerGroup + idx + 1, inode);
+  }
+
+  releaseBitmap(group);
+}
+
+/*PRIVATE -- reports an inode, and schedules its directory and indirect blocks*/
+void StreamScan::onInode(__u32 inodeNumber, const ext2_inode &inode)
+{
+  // Filtered out inodes are never formatted, nor are their blocks read
+  if (filter && !filter->matches(inodeNumber, inode))
+    return;
+
+  if (sections & SECTION_INODES)
+    visitor->onInode(inodeNumber, inode);
+
+  if (!S_ISDIR(inode.i_mode) && !S_ISREG(inode.i_mode))
+    return;
+
+  // Only the blocks that hold a directory's i_size bytes are scanned
+  const uint64_t dirBlocks = ((sections & SECTION_DIRENT) && S_ISDIR(inode.i_mode))
+      ? (inode.i_size + meta.blockSize - 1) / meta.blockSize : 0;
+
+  for (__u32 i = 0; i < EXT2_NDIR_BLOCKS && i < dirBlocks; i++)
+    if (inode.i_block[i] != 0)
+      schedule(inode.i_block[i], {Task::DIR_BLOCK, 0, false, inodeNumber, 0, i, 0});
+
+  const bool emit = sections & SECTION_INDIRECT;
+  for (__u8 level = 1; level <= 3; level++) {
+    const __u32 indBlockNum = inode.i_block[EXT2_NDIR_BLOCKS + level - 1];
+    const uint64_t logical = EXT2::indirectFirstBlock(meta.blockSize, level);
+    if (indBlockNum != 0 && (emit || logical < dirBlocks))
+      schedule(indBlockNum, {Task::INDIRECT, level, emit, inodeNumber, 0, logical, dirBlocks});
+  }
+}
+
+/*PRIVATE -- reports the references held by an indirect block, and schedules
+  the blocks beneath it that are needed*/
+void StreamScan::onIndirect(__u32 block, const Task &task, const char *data)
+{
+  const __u32 *entries = reinterpret_cast<const __u32*>(data);
+
+  uint64_t span = 1; // logical blocks mapped by each entry
+  for (__u8 l = 1; l < task.level; l++)
+    span *= ptrsPerBlock;
+
+  for (__u32 i = 0; i < ptrsPerBlock; i++) {
+    if (entries[i] == 0)
+      continue;
+
+    const uint64_t logical = task.logical + i * span;
+    if (task.emit)
+      visitor->onIndirect(task.owner, task.level, logical, block, entries[i]);
+
+    if (task.level > 1) {
+      if (task.emit || logical < task.limit)
+        schedule(entries[i], {Task::INDIRECT, (__u8)(task.level - 1), task.emit, task.owner, 0,
+                              logical, task.limit});
+    } else if (logical < task.limit) {
+      schedule(entries[i], {Task::DIR_BLOCK, 0, false, task.owner, 0, logical, 0});
+    }
+  }
+}
+
+/*PRIVATE -- the same entries as EXT2::forEachDirectoryEntry()*/
+void StreamScan::onDirBlock(const Task &task, const char *data)
+{
+  EXT2::forEachBlockEntry(data, meta.blockSize, [&](size_t off, const ext2_dir_entry &entry) {
+    visitor->onDirEntry(task.owner, task.logical * meta.blockSize + off, entry);
+  });
+}
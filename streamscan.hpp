@@ -0,0 +1,102 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <vector>
+#include "ext2_fs.h"
+#include "inodefilter.hpp"
+#include "memorybudget.hpp"
+#include "metafile.hpp"
+#include "scanvisitor.hpp"
+
+using std::vector;
+
+// -------------------------------------------------- Stream Scan
+//
+// Produces the report from an image that can only be read once, front to back
+// (a pipe, e.g. 'zstd -dc disk.img.zst | lab3a -'), instead of seeking through
+// a file with an ImageReader.
+//
+// The Super Block is parsed as soon as it arrives. Every other read is a task
+// keyed by the block it needs, and runs when the stream reaches that block:
+// the descriptor blocks schedule the bitmaps, an inode bitmap schedules the
+// inode table blocks that hold allocated inodes, and an inode schedules its
+// directory and indirect blocks, which in turn schedule the blocks they point
+// to. The visitor is therefore called in the order the blocks sit on disk,
+// not in report order; the lines themselves are the same.
+//
+// The blocks most recently streamed past are kept in a ring buffer (sized by
+// the memory budget), so a task for a block behind the stream (a file whose
+// data precedes its inode, say) is still served as long as the block is in the
+// ring. Older blocks are gone: they are counted by getMissedBlocks(), and what
+// they would have led to is missing from the report. Pointers past the end of
+// the file system are ignored, like holes.
+//
+class StreamScan {
+ public:
+  /*Reads the image from 'fd', which is not closed*/
+  explicit StreamScan(int fd);
+
+  /*Streams the whole image once, reporting the selected ReportSections (other
+    than FRAG and HASH) to 'visitor'. Throws runtime_error if the Super Block is
+    invalid or the stream is unreadable*/
+  void run(ScanVisitor &visitor, unsigned sections, const InodeFilter *filter = nullptr);
+
+  /*Blocks that were needed after they had left the ring buffer*/
+  size_t getMissedBlocks() const { return missed; }
+
+  // Ring buffer wanted from the budget, and the least it can do with (in blocks)
+  static const size_t BUFFER_BUDGET = 64 << 20;
+  static const size_t MIN_BUFFER_BLOCKS = 64;
+  static const size_t READ_CHUNK = 1 << 20; // bytes read at a time, at most an eighth of the ring
+
+ private:
+  struct Task {
+    enum Kind : __u8 { DESCRIPTORS, BLOCK_BITMAP, INODE_BITMAP, INODE_TABLE, INDIRECT, DIR_BLOCK } kind;
+    __u8 level;       // INDIRECT: 1 to 3
+    bool emit;        // INDIRECT: report the references (else only followed for a directory)
+    __u32 owner;      // the group (bitmaps, INODE_TABLE) or the inode (INDIRECT, DIR_BLOCK)
+    __u32 index;      // DESCRIPTORS: block of the table; INODE_BITMAP: the group's inode table;
+                      // INODE_TABLE: block of the group's table
+    uint64_t logical; // INDIRECT, DIR_BLOCK: first logical block mapped
+    uint64_t limit;   // INDIRECT: the directory's block count, or 0 for any other file
+  };
+
+  const int fd;
+  ScanVisitor *visitor = nullptr;
+  const InodeFilter *filter = nullptr;
+  unsigned sections = 0;
+
+  ext2_super_block superBlock;
+  MetaFile meta;
+  __u32 firstDataBlock = 0;
+  __u32 ptrsPerBlock = 0;
+  __u32 tableBlocks = 0; // per group
+
+  // The ring holds the last ringBlocks blocks streamed, block b at slot b % ringBlocks
+  MemoryGrant ringGrant;
+  std::unique_ptr<char[]> ring;
+  size_t ringBlocks = 0;
+  uint64_t streamed = 0; // bytes
+
+  std::multimap<__u32, Task> pending; // by block, in the order scheduled
+  std::map<__u32, std::unique_ptr<char[]>> inodeBitmaps; // until the group's table is done
+  std::map<__u32, __u32> tableBlocksLeft;
+  size_t missed = 0;
+
+  void readSuperBlock();
+  bool fill(size_t bytes); // streams up to 'bytes' more into the ring; false at the end
+  const char *block(__u32 number) const; // null if not in the ring
+  void releaseBitmap(__u32 group); // once per INODE_TABLE task
+
+  void schedule(__u32 block, const Task &task);
+  void runTask(__u32 block, const Task &task, const char *data);
+
+  void onDescriptors(const Task &, const char *data);
+  void onInodeBitmap(const Task &, const char *data);
+  void onInodeTable(const Task &, const char *data);
+  void onInode(__u32 inodeNumber, const ext2_inode &);
+  void onIndirect(__u32 block, const Task &, const char *data);
+  void onDirBlock(const Task &, const char *data);
+};
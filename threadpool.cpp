@@ -0,0 +1,112 @@
+#include "threadpool.hpp"
+
+// The pool, and index in it, of the worker running on this thread. A task of
+// one pool may submit to another, so the index only applies to its own pool
+static thread_local const ThreadPool *currentPool = nullptr;
+static thread_local unsigned currentWorker = 0;
+
+ThreadPool::ThreadPool(unsigned workerCount)
+{
+  if (workerCount == 0)
+    workerCount = 1;
+
+  for (unsigned i = 0; i < workerCount; i++)
+    queues.push_back(std::make_unique<Queue>());
+
+  for (unsigned i = 0; i < workerCount; i++)
+    workers.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    stopping = true;
+  }
+  workAvailable.notify_all();
+
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+  const unsigned target = (currentPool == this) ? currentWorker : nextQueue++ % queues.size();
+
+  pending++;
+  {
+    std::lock_guard<std::mutex> guard(queues[target]->lock);
+    queues[target]->tasks.push_back(std::move(task));
+  }
+
+  std::lock_guard<std::mutex> guard(idleLock);
+  workAvailable.notify_one();
+}
+
+void ThreadPool::wait()
+{
+  std::unique_lock<std::mutex> guard(idleLock);
+  allDone.wait(guard, [this]() { return pending == 0; });
+}
+
+bool ThreadPool::popOrSteal(unsigned self, std::function<void()> &task)
+{
+  {
+    Queue &own = *queues[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  for (unsigned i = 1; i < queues.size(); i++) {
+    Queue &victim = *queues[(self + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void ThreadPool::run(unsigned self)
+{
+  currentPool = this;
+  currentWorker = self;
+  std::function<void()> task;
+
+  while (true) {
+    if (popOrSteal(self, task)) {
+      task();
+      task = nullptr;
+
+      if (--pending == 0) {
+        std::lock_guard<std::mutex> guard(idleLock);
+        allDone.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(idleLock);
+    if (stopping)
+      return;
+
+    // Re-check under the lock: a task may have been submitted after the
+    // failed steal but before we got here.
+    workAvailable.wait(guard, [&]() {
+      if (stopping)
+        return true;
+      for (auto &q : queues) {
+        std::lock_guard<std::mutex> qGuard(q->lock);
+        if (!q->tasks.empty())
+          return true;
+      }
+      return false;
+    });
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// -------------------------------------------------- Work-Stealing Thread Pool
+//
+// Every worker owns a deque of tasks. A worker pops new work from the back of
+// its own deque (most recently submitted, still warm in cache) and, once that
+// runs dry, steals from the front of another worker's deque. Submissions from
+// outside the pool are dealt round-robin; submissions from inside a task go to
+// the submitting worker's own deque.
+//
+// Tasks must not throw; wrap the body in a try/catch if it can.
+//
+class ThreadPool {
+ public:
+  explicit ThreadPool(unsigned workerCount = std::thread::hardware_concurrency());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool &operator=(const ThreadPool&) = delete;
+
+  void submit(std::function<void()> task);
+
+  /*Blocks until every submitted task (including those submitted by tasks) has finished*/
+  void wait();
+
+  unsigned size() const { return queues.size(); }
+
+ private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex idleLock;
+  std::condition_variable workAvailable;
+  std::condition_variable allDone;
+
+  std::atomic<size_t> pending{0}; // submitted but not yet finished
+  std::atomic<size_t> nextQueue{0};
+  bool stopping = false;
+
+  bool popOrSteal(unsigned self, std::function<void()> &task);
+  void run(unsigned self);
+};
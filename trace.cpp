@@ -0,0 +1,99 @@
+#include "trace.hpp"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+std::atomic<bool> Trace::enabled(false);
+
+namespace {
+
+struct TraceEvent {
+  const char *name;
+  const char *category;
+  uint64_t start;
+  uint64_t duration;
+  int64_t arg;
+};
+
+struct ThreadBuffer {
+  long tid;
+  std::vector<TraceEvent> events;
+  size_t dropped = 0;
+};
+
+std::chrono::steady_clock::time_point origin;
+std::mutex buffersLock;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers; // outlive their threads
+thread_local ThreadBuffer *localBuffer = nullptr;
+
+ThreadBuffer *threadBuffer()
+{
+  if (!localBuffer) {
+    std::lock_guard<std::mutex> guard(buffersLock);
+    buffers.push_back(std::make_unique<ThreadBuffer>());
+    localBuffer = buffers.back().get();
+    localBuffer->tid = syscall(SYS_gettid);
+  }
+  return localBuffer;
+}
+
+}
+
+void Trace::start()
+{
+  origin = std::chrono::steady_clock::now();
+  enabled.store(true, std::memory_order_relaxed);
+}
+
+uint64_t Trace::now()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - origin).count();
+}
+
+void Trace::record(const char *name, const char *category, uint64_t start, uint64_t end, int64_t arg)
+{
+  ThreadBuffer *buffer = threadBuffer();
+
+  if (buffer->events.size() >= MAX_EVENTS_PER_THREAD)
+    buffer->dropped++;
+  else
+    buffer->events.push_back({name, category, start, end - start, arg});
+}
+
+bool Trace::write(const char *path)
+{
+  enabled.store(false, std::memory_order_relaxed);
+
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return false;
+
+  const long pid = getpid();
+  const char *separator = "";
+  std::lock_guard<std::mutex> guard(buffersLock);
+
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  for (auto &buffer : buffers) {
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,"
+                 "\"args\":{\"name\":\"%s\",\"dropped_events\":%zu}}",
+            separator, pid, buffer->tid, (buffer->tid == pid) ? "main" : "worker", buffer->dropped);
+    separator = ",\n";
+
+    for (auto &e : buffer->events) {
+      fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%ld,\"tid\":%ld",
+              e.name, e.category, (unsigned long long)e.start, (unsigned long long)e.duration, pid, buffer->tid);
+      if (e.arg >= 0)
+        fprintf(out, ",\"args\":{\"n\":%lld}", (long long)e.arg);
+      fprintf(out, "}");
+    }
+  }
+
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
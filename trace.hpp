@@ -0,0 +1,72 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+// -------------------------------------------------- Trace
+//
+// Scoped timers that are written out as Chrome/Perfetto trace-event JSON
+// (chrome://tracing, ui.perfetto.dev). Enabled with 'lab3a --trace=FILE'.
+//
+// Each thread records complete ("X") events into its own buffer, so recording
+// takes no lock. While tracing is disabled, a TRACE_SCOPE costs one relaxed
+// atomic load and an untaken branch.
+//
+// Names and categories must be string literals (or otherwise outlive the
+// trace), since only the pointers are kept.
+//
+class Trace {
+ public:
+  /*Starts recording. Events recorded before this are not kept*/
+  static void start();
+
+  /*Stops recording and writes every event to 'path'. Returns false if the
+    file cannot be written*/
+  static bool write(const char *path);
+
+  static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+  /*Microseconds since start()*/
+  static uint64_t now();
+
+  static void record(const char *name, const char *category, uint64_t start, uint64_t end, int64_t arg);
+
+  // Events past this many per thread are dropped (and counted)
+  static const size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+ private:
+  static std::atomic<bool> enabled;
+};
+
+class TraceScope {
+ public:
+  /*'arg' (e.g. a group or block number) is shown with the event unless < 0*/
+  TraceScope(const char *name, const char *category, int64_t arg = -1) {
+    if (Trace::isEnabled()) {
+      this->name = name;
+      this->category = category;
+      this->arg = arg;
+      this->start = Trace::now();
+    }
+  }
+
+  ~TraceScope() {
+    if (name)
+      Trace::record(name, category, start, Trace::now(), arg);
+  }
+
+  TraceScope(const TraceScope&) = delete;
+  TraceScope &operator=(const TraceScope&) = delete;
+
+ private:
+  const char *name = nullptr;
+  const char *category;
+  int64_t arg;
+  uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/*Times the rest of the enclosing scope: TRACE_SCOPE("name", "category"[, arg])*/
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
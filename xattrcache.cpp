@@ -0,0 +1,105 @@
+#include "xattrcache.hpp"
+#include "trace.hpp"
+#include <string.h>
+
+XattrCache::XattrCache(ImageReader &reader, __u32 blockSize, size_t budget)
+    : reader(reader), blockSize(blockSize), grant(budget, blockSize) {}
+
+shared_ptr<const XattrCache::Block> XattrCache::get(__u32 block) {
+  auto found = entries.find(block);
+  if (found != entries.end()) {
+    hits++;
+    ages.splice(ages.begin(), ages, found->second.age);
+    return found->second.block;
+  }
+
+  TRACE_SCOPE("xattr.decode", "block", block);
+  reads++;
+  auto decoded = std::make_shared<Block>();
+  decode(reader.getBlock(block).get(), blockSize, *decoded);
+
+  // The least recently used blocks make room, but the new one is always kept
+  ages.push_front(block);
+  const size_t size = bytesOf(*decoded);
+  entries[block] = {decoded, size, ages.begin()};
+  bytes += size;
+  while (bytes > grant.size() && ages.size() > 1) {
+    auto oldest = entries.find(ages.back());
+    bytes -= oldest->second.bytes;
+    entries.erase(oldest);
+    ages.pop_back();
+  }
+  return decoded;
+}
+
+bool XattrCache::decode(const char *data, __u32 blockSize, Block &out) {
+  const size_t HEADER = sizeof(ext2_ext_attr_header);
+  const size_t ENTRY = sizeof(ext2_ext_attr_entry);
+  const ext2_ext_attr_header *header = reinterpret_cast<const ext2_ext_attr_header*>(data);
+
+  out.valid = false;
+  out.refcount = header->h_refcount;
+  out.attributes.clear();
+  if (header->h_magic != EXT2_EXT_ATTR_MAGIC || header->h_blocks != 1)
+    return false;
+
+  for (size_t off = HEADER; off + sizeof(__u32) <= blockSize;) {
+    // Four zero bytes end the list
+    __u32 next;
+    memcpy(&next, data + off, sizeof(next));
+    if (next == 0) {
+      out.valid = true;
+      break;
+    }
+
+    if (off + ENTRY > blockSize)
+      break;
+    const ext2_ext_attr_entry *entry = reinterpret_cast<const ext2_ext_attr_entry*>(data + off);
+    const size_t length = (ENTRY + entry->e_name_len + EXT2_EXT_ATTR_PAD - 1) & ~(size_t)(EXT2_EXT_ATTR_PAD - 1);
+    if (off + length > blockSize || entry->e_value_block != 0 ||
+        (size_t)entry->e_value_offs + entry->e_value_size > blockSize)
+      break;
+
+    out.attributes.push_back({string(prefix(entry->e_name_index)) + string(entry->e_name, entry->e_name_len),
+                              string(data + entry->e_value_offs, entry->e_value_size)});
+    off += length;
+  }
+
+  if (!out.valid)
+    out.attributes.clear();
+  return out.valid;
+}
+
+const char *XattrCache::prefix(__u8 nameIndex) {
+  switch (nameIndex) {
+    case 1: return "user.";
+    case 2: return "system.posix_acl_access";
+    case 3: return "system.posix_acl_default";
+    case 4: return "trusted.";
+    case 6: return "security.";
+    case 7: return "system.";
+    case 8: return "system.richacl";
+  }
+  return "";
+}
+
+size_t XattrCache::audit(FILE *out, __u32 block, __u32 firstInode, size_t references, bool valid,
+                         __u32 refcount) {
+  if (!valid) {
+    fprintf(out, "XATTR BLOCK %u IN INODE %u IS DAMAGED\n", block, firstInode);
+    return 1;
+  }
+  if (refcount != references) {
+    fprintf(out, "XATTR BLOCK %u HAS %zu REFERENCES BUT REFCOUNT IS %u\n", block, references, refcount);
+    return 1;
+  }
+  return 0;
+}
+
+/*PRIVATE -- roughly what a decoded block holds on the heap*/
+size_t XattrCache::bytesOf(const Block &block) {
+  size_t size = sizeof(Block) + sizeof(Entry) + 2 * sizeof(void*);
+  for (auto &attribute : block.attributes)
+    size += sizeof(Attribute) + attribute.name.capacity() + attribute.value.capacity();
+  return size;
+}
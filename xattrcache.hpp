@@ -0,0 +1,108 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ext2_fs.h"
+#include "imagereader.hpp"
+#include "memorybudget.hpp"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+// -------------------------------------------------- Extended Attributes
+// On-disk layout of an extended attribute block (ext2_ext_attr.h): a header,
+// then entries growing down from it and values growing up from the end of
+// the block. The list of entries ends with four zero bytes.
+#define EXT2_EXT_ATTR_MAGIC 0xEA020000
+#define EXT2_EXT_ATTR_PAD 4
+
+struct ext2_ext_attr_header {
+  __u32 h_magic;
+  __u32 h_refcount; // inodes sharing the block
+  __u32 h_blocks;   // always 1
+  __u32 h_hash;
+  __u32 h_reserved[4];
+};
+
+struct ext2_ext_attr_entry {
+  __u8 e_name_len;
+  __u8 e_name_index; // prefix of the name, see XattrCache::prefix()
+  __u16 e_value_offs; // in the block
+  __u32 e_value_block; // always 0
+  __u32 e_value_size;
+  __u32 e_hash;
+  char e_name[0];
+};
+
+// -------------------------------------------------- Xattr Cache
+//
+// Decoded extended attribute blocks, keyed by block number. Identical
+// attribute sets are shared by many inodes through a single block (with a
+// reference count in its header), so the block is read and decoded the first
+// time an inode points to it, and every later inode is served from here.
+//
+// Decoded blocks are kept in least recently used order, up to what the
+// MemoryBudget grants: a block that was evicted is simply decoded again.
+// Not thread-safe.
+//
+class XattrCache {
+ public:
+  struct Attribute {
+    string name;  // with its prefix, e.g. "user.mime_type"
+    string value; // raw bytes
+  };
+
+  struct Block {
+    bool valid;       // the magic is right and every entry and value lies inside the block
+    __u32 refcount;
+    vector<Attribute> attributes;
+  };
+
+  XattrCache(ImageReader &reader, __u32 blockSize, size_t budget);
+
+  /*The decoded attribute block 'block', read now unless it is cached. The
+    result stays valid after it has been evicted*/
+  shared_ptr<const Block> get(__u32 block);
+
+  bool contains(__u32 block) const { return entries.count(block) != 0; }
+
+  /*Decodes one block into 'out'. Returns out.valid*/
+  static bool decode(const char *data, __u32 blockSize, Block &out);
+
+  /*The name prefix of an e_name_index ("" for unknown ones)*/
+  static const char *prefix(__u8 nameIndex);
+
+  /*Prints what is wrong with a block that 'references' inodes point to, the
+    first of them 'firstInode', given its decoded header. Returns the number
+    of findings (0 or 1)*/
+  static size_t audit(FILE *out, __u32 block, __u32 firstInode, size_t references, bool valid,
+                      __u32 refcount);
+
+  size_t getReads() const { return reads; }
+  size_t getHits() const { return hits; }
+
+ private:
+  struct Entry {
+    shared_ptr<const Block> block;
+    size_t bytes;
+    std::list<__u32>::iterator age;
+  };
+
+  ImageReader &reader;
+  const __u32 blockSize;
+  MemoryGrant grant;
+
+  std::unordered_map<__u32, Entry> entries;
+  std::list<__u32> ages; // most recently used first
+  size_t bytes = 0;
+  size_t reads = 0;
+  size_t hits = 0;
+
+  static size_t bytesOf(const Block &);
+};